@@ -7,15 +7,21 @@
 //
 // Optional config macros:
 // FPNG_NO_SSE - Set to 1 to completely disable SSE usage, even on x86/x64. By default, on x86/x64 it's enabled.
-// FPNG_DISABLE_DECODE_CRC32_CHECKS - Set to 1 to disable PNG chunk CRC-32 tests, for improved fuzzing. Defaults to 0.
-// FPNG_USE_UNALIGNED_LOADS - Set to 1 to indicate it's OK to read/write unaligned 32-bit/64-bit values. Defaults to 0, unless x86/x64.
+// FPNG_NO_AVX2 - Set to 1 to disable the runtime dispatched AVX2/VPCLMULQDQ kernels (they're never used if FPNG_NO_SSE is 1). Defaults to 0.
+// FPNG_NO_NEON - Set to 1 to disable the NEON and ARMv8 CRC32 kernels on 64-bit ARM. Defaults to 0.
+// FPNG_DISABLE_DECODE_CRC32_CHECKS - Set to 1 to disable PNG chunk CRC-32 tests (except IHDR's), for improved fuzzing. Defaults to 0. See fpng_decode_params::m_flags for per call control.
+// FPNG_USE_UNALIGNED_LOADS - Set to 1 to indicate it's OK to read/write unaligned 32-bit/64-bit values. Defaults to 0, unless x86/x64 or 64-bit ARM.
+// FPNG_NO_THREADING - Set to 1 to never create any threads. Parallel work is then only run on the caller's thread (or the user's dispatch function). Defaults to 0.
 //
 // With gcc/clang on x86, compile with -msse4.1 -mpclmul -fno-strict-aliasing
+// On 64-bit ARM no extra flags are needed. The CRC32 instructions are detected at runtime (on Linux), unless the compiler targets them already (e.g. -march=armv8.1-a, or Apple Silicon).
+// Don't compile with -mavx2: the AVX2 kernels are compiled using function target attributes, and are only called if the CPU supports them.
 // Only tested with -fno-strict-aliasing (which the Linux kernel uses, and MSVC's default).
 //
 #include "fpng.h"
 #include <assert.h>
 #include <string.h>
+#include <math.h>
 
 #ifdef _MSC_VER
 	#pragma warning (disable:4127) // conditional expression is constant
@@ -26,6 +32,14 @@
 	#define FPNG_NO_SSE (0)
 #endif
 
+#ifndef FPNG_NO_AVX2
+	#define FPNG_NO_AVX2 (0)
+#endif
+
+#ifndef FPNG_NO_NEON
+	#define FPNG_NO_NEON (0)
+#endif
+
 // Detect if we're compiling on x86/x64
 #if defined(_M_IX86) || defined(_M_X64) || defined(__i386__) || defined(__i386) || defined(__i486__) || defined(__i486) || defined(i386) || defined(__ia64__) || defined(__x86_64__)
 	#define FPNG_X86_OR_X64_CPU (1)
@@ -43,8 +57,118 @@
 	#include <wmmintrin.h>		// pclmul
 #endif
 
+#if FPNG_X86_OR_X64_CPU && !FPNG_NO_SSE && !FPNG_NO_AVX2
+	#define FPNG_AVX2_SUPPORTED (1)
+	#include <immintrin.h>		// AVX2, VPCLMULQDQ
+
+	// The AVX2 kernels are compiled for AVX2 without requiring the whole file to be, and they're only called after checking cpu_info.
+	#ifdef _MSC_VER
+		#define FPNG_AVX2_FUNC
+		#define FPNG_VPCLMUL_FUNC
+	#else
+		#define FPNG_AVX2_FUNC __attribute__((target("avx2")))
+		#define FPNG_VPCLMUL_FUNC __attribute__((target("avx2,pclmul,vpclmulqdq")))
+	#endif
+#else
+	#define FPNG_AVX2_SUPPORTED (0)
+#endif
+
+// Detect if we're compiling for 64-bit little endian ARM, where NEON is always available.
+#if (defined(__aarch64__) || defined(_M_ARM64)) && !defined(__ARM_BIG_ENDIAN)
+	#define FPNG_ARM64_CPU (1)
+#else
+	#define FPNG_ARM64_CPU (0)
+#endif
+
+#if FPNG_ARM64_CPU && !FPNG_NO_NEON
+	#define FPNG_NEON_SUPPORTED (1)
+	#include <arm_neon.h>
+
+	// The ARMv8 CRC32 instructions are optional before ARMv8.1, so the CRC-32 kernel is compiled for them using a target attribute and only called after checking cpu_info.
+	#ifdef _MSC_VER
+		#include <intrin.h>
+		#define FPNG_CRC32_FUNC
+	#else
+		#include <arm_acle.h>
+		#if defined(__ARM_FEATURE_CRC32)
+			#define FPNG_CRC32_FUNC
+		#elif defined(__clang__)
+			#define FPNG_CRC32_FUNC __attribute__((target("crc")))
+		#else
+			#define FPNG_CRC32_FUNC __attribute__((target("+crc")))
+		#endif
+
+		#if defined(__linux__) && !defined(__ARM_FEATURE_CRC32)
+			#include <sys/auxv.h>
+			#ifndef HWCAP_CRC32
+				#define HWCAP_CRC32 (1 << 7)
+			#endif
+		#endif
+	#endif
+#else
+	#define FPNG_NEON_SUPPORTED (0)
+#endif
+
 #ifndef FPNG_NO_STDIO
 	#include <stdio.h>
+	#include <chrono>
+	#ifdef _WIN32
+		// For MoveFileExA() and the file mapping functions.
+		#ifndef WIN32_LEAN_AND_MEAN
+			#define WIN32_LEAN_AND_MEAN
+		#endif
+		#ifndef NOMINMAX
+			#define NOMINMAX
+		#endif
+		#include <windows.h>
+	#else
+		// For lstat(), chmod() and chown().
+		#include <sys/stat.h>
+		#include <unistd.h>
+	#endif
+#endif
+
+// Set to 1 to always read and write files with stdio, instead of mapping them into memory.
+#ifndef FPNG_NO_MMAP
+	#define FPNG_NO_MMAP (0)
+#endif
+
+#if defined(FPNG_NO_STDIO) || FPNG_NO_MMAP
+	#define FPNG_MMAP_READ (0)
+	#define FPNG_MMAP_WRITE (0)
+#elif defined(_WIN32)
+	#define FPNG_MMAP_READ (1)
+	#define FPNG_MMAP_WRITE (1)
+#elif defined(__unix__) || defined(__APPLE__)
+	#include <sys/mman.h>
+	#include <sys/stat.h>
+	#include <fcntl.h>
+	#include <unistd.h>
+	#define FPNG_MMAP_READ (1)
+	// Writing needs fallocate(), so running out of disk space fails up front instead of faulting on a store to the mapping.
+	#if defined(__linux__)
+		#define FPNG_MMAP_WRITE (1)
+	#else
+		#define FPNG_MMAP_WRITE (0)
+	#endif
+#else
+	#define FPNG_MMAP_READ (0)
+	#define FPNG_MMAP_WRITE (0)
+#endif
+
+#ifndef FPNG_NO_THREADING
+	#define FPNG_NO_THREADING (0)
+#endif
+
+#if !FPNG_NO_THREADING
+	#include <thread>
+	#include <atomic>
+	#include <mutex>
+	#include <condition_variable>
+#endif
+
+#if FPNG_STATS
+	#include <chrono>
 #endif
 
 // Allow the disabling of the chunk data CRC32 checks, for fuzz testing of the decoder
@@ -62,8 +186,8 @@
 
 // Set to 0 if your platform doesn't support unaligned 32-bit/64-bit reads/writes. 
 #ifndef FPNG_USE_UNALIGNED_LOADS
-	#if FPNG_X86_OR_X64_CPU
-		// On x86/x64 we default to enabled, for a noticeable perf gain.
+	#if FPNG_X86_OR_X64_CPU || FPNG_ARM64_CPU
+		// On x86/x64 and 64-bit ARM we default to enabled, for a noticeable perf gain.
 		#define FPNG_USE_UNALIGNED_LOADS (1)
 	#else
 		#define FPNG_USE_UNALIGNED_LOADS (0)
@@ -103,7 +227,14 @@
 namespace fpng
 {
 	static const int FPNG_FALSE = 0;
-	static const uint8_t FPNG_FDEC_VERSION = 0;
+	// fdEC chunk versions. Version 0 means the IDAT is a single Deflate block. Version 1 adds an index of independently decodable strips (see create_fdec_strip_chunk()).
+	// Single block files are still written as version 0, so older decoders can continue to decode them.
+	static const uint8_t FPNG_FDEC_VERSION_SINGLE_BLOCK = 0;
+	static const uint8_t FPNG_FDEC_VERSION = 1;
+	const uint32_t FPNG_FDEC_STRIP_ENTRY_SIZE = 9;
+	// Strip Huffman table ID's: the strip begins with its own dynamic Huffman block header, or is made of raw (stored) blocks of rows using filter 0.
+	const uint8_t FPNG_FDEC_STRIP_TABLE_DYNAMIC = 0;
+	const uint8_t FPNG_FDEC_STRIP_TABLE_STORED = 1;
 	static const uint32_t FPNG_MAX_SUPPORTED_DIM = 1 << 24;
 
 	template <typename S> static inline S maximum(S a, S b) { return (a > b) ? a : b; }
@@ -252,43 +383,125 @@ namespace fpng
 	// See Fast CRC Computation for Generic Polynomials Using PCLMULQDQ Instruction":
 	// https://www.intel.com/content/dam/www/public/us/en/documents/white-papers/fast-crc-computation-generic-polynomials-pclmulqdq-paper.pdf
 	// Requires PCLMUL and SSE 4.1. This function skips Step 1 (fold by 4) for simplicity/less code.
-	static uint32_t crc32_pclmul(const uint8_t* p, size_t size, uint32_t crc)
-	{
-		assert(size >= 16);
-
-		// See page 22 (bit reflected constants for gzip)
+	
+	// See page 22 (bit reflected constants for gzip)
 #ifdef _MSC_VER
-		static const uint64_t __declspec(align(16)) 
+	static const uint64_t __declspec(align(16)) 
 #else
-		static const uint64_t __attribute__((aligned(16)))
+	static const uint64_t __attribute__((aligned(16)))
 #endif
-			s_u[2] = { 0x1DB710641, 0x1F7011641 }, s_k5k0[2] = { 0x163CD6124, 0 }, s_k3k4[2] = { 0x1751997D0, 0xCCAA009E };
-
-		// Load first 16 bytes, apply initial CRC32
-		__m128i b = _mm_xor_si128(_mm_cvtsi32_si128(~crc), _mm_loadu_si128(reinterpret_cast<const __m128i*>(p)));
+		s_crc32_u[2] = { 0x1DB710641, 0x1F7011641 }, s_crc32_k5k0[2] = { 0x163CD6124, 0 }, s_crc32_k3k4[2] = { 0x1751997D0, 0xCCAA009E };
 
+	// Folds the remaining whole 16 byte blocks into b, then reduces b to the final CRC-32.
+	static uint32_t crc32_pclmul_finish(__m128i b, const uint8_t* p, size_t size)
+	{
 		// We're skipping directly to Step 2 page 12 - iteratively folding by 1 (by 4 is overkill for our needs)
-		const __m128i k3k4 = _mm_load_si128(reinterpret_cast<const __m128i*>(s_k3k4));
+		const __m128i k3k4 = _mm_load_si128(reinterpret_cast<const __m128i*>(s_crc32_k3k4));
 
-		for (size -= 16, p += 16; size >= 16; size -= 16, p += 16)
+		for (; size >= 16; size -= 16, p += 16)
 			b = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(b, k3k4, 17), _mm_loadu_si128(reinterpret_cast<const __m128i*>(p))), _mm_clmulepi64_si128(b, k3k4, 0));
 
 		// Final stages: fold to 64-bits, 32-bit Barrett reduction
-		const __m128i z = _mm_set_epi32(0, ~0, 0, ~0), u = _mm_load_si128(reinterpret_cast<const __m128i*>(s_u));
+		const __m128i z = _mm_set_epi32(0, ~0, 0, ~0), u = _mm_load_si128(reinterpret_cast<const __m128i*>(s_crc32_u));
 		b = _mm_xor_si128(_mm_srli_si128(b, 8), _mm_clmulepi64_si128(b, k3k4, 16));
-		b = _mm_xor_si128(_mm_clmulepi64_si128(_mm_and_si128(b, z), _mm_loadl_epi64(reinterpret_cast<const __m128i*>(s_k5k0)), 0), _mm_srli_si128(b, 4));
+		b = _mm_xor_si128(_mm_clmulepi64_si128(_mm_and_si128(b, z), _mm_loadl_epi64(reinterpret_cast<const __m128i*>(s_crc32_k5k0)), 0), _mm_srli_si128(b, 4));
 		return ~_mm_extract_epi32(_mm_xor_si128(b, _mm_clmulepi64_si128(_mm_and_si128(_mm_clmulepi64_si128(_mm_and_si128(b, z), u, 16), z), u, 0)), 1);
 	}
 
+	static uint32_t crc32_pclmul(const uint8_t* p, size_t size, uint32_t crc)
+	{
+		assert(size >= 16);
+
+		// Load first 16 bytes, apply initial CRC32
+		__m128i b = _mm_xor_si128(_mm_cvtsi32_si128(~crc), _mm_loadu_si128(reinterpret_cast<const __m128i*>(p)));
+
+		return crc32_pclmul_finish(b, p + 16, size - 16);
+	}
+
+#if FPNG_AVX2_SUPPORTED
+	// VPCLMULQDQ version: folds 4 independent 16 byte lanes (in two 256-bit registers) forward by 64 bytes per iteration (Step 1, page 12), then folds the lanes together.
+	static FPNG_VPCLMUL_FUNC uint32_t crc32_vpclmul(const uint8_t* p, size_t size, uint32_t crc)
+	{
+		assert(size >= 64);
+		
+		// Fold by 4 constants (x^(512+64) and x^512 mod P, bit reflected)
+		const __m256i k1k2 = _mm256_setr_epi64x(0x154442BD4, 0x1C6E41596, 0x154442BD4, 0x1C6E41596);
+
+		__m256i x0 = _mm256_xor_si256(_mm256_inserti128_si256(_mm256_setzero_si256(), _mm_cvtsi32_si128(~crc), 0), _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p)));
+		__m256i x1 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p + 32));
+
+		for (size -= 64, p += 64; size >= 64; size -= 64, p += 64)
+		{
+			x0 = _mm256_xor_si256(_mm256_xor_si256(_mm256_clmulepi64_epi128(x0, k1k2, 0x11), _mm256_clmulepi64_epi128(x0, k1k2, 0x00)), _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p)));
+			x1 = _mm256_xor_si256(_mm256_xor_si256(_mm256_clmulepi64_epi128(x1, k1k2, 0x11), _mm256_clmulepi64_epi128(x1, k1k2, 0x00)), _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p + 32)));
+		}
+
+		// Fold the 4 lanes into 1, 16 bytes at a time.
+		const __m128i k3k4 = _mm_load_si128(reinterpret_cast<const __m128i*>(s_crc32_k3k4));
+		
+		__m128i b = _mm256_castsi256_si128(x0);
+		b = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(b, k3k4, 17), _mm256_extracti128_si256(x0, 1)), _mm_clmulepi64_si128(b, k3k4, 0));
+		b = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(b, k3k4, 17), _mm256_castsi256_si128(x1)), _mm_clmulepi64_si128(b, k3k4, 0));
+		b = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(b, k3k4, 17), _mm256_extracti128_si256(x1, 1)), _mm_clmulepi64_si128(b, k3k4, 0));
+
+		return crc32_pclmul_finish(b, p, size);
+	}
+#endif
+
 	static uint32_t crc32_sse41_simd(const unsigned char* buf, size_t len, uint32_t prev_crc32)
 	{
 		if (len < 16)
 			return crc32_slice_by_4(buf, len, prev_crc32);
 
-		uint32_t simd_len = len & ~15;
+		size_t simd_len = len & ~15;
 		uint32_t c = crc32_pclmul(buf, simd_len, prev_crc32);
 		return crc32_slice_by_4(buf + simd_len, len - simd_len, c);
 	}
+
+#if FPNG_AVX2_SUPPORTED
+	static uint32_t crc32_vpclmul_simd(const unsigned char* buf, size_t len, uint32_t prev_crc32)
+	{
+		if (len < 64)
+			return crc32_sse41_simd(buf, len, prev_crc32);
+
+		size_t simd_len = len & ~15;
+		uint32_t c = crc32_vpclmul(buf, simd_len, prev_crc32);
+		return crc32_slice_by_4(buf + simd_len, len - simd_len, c);
+	}
+#endif
+#endif
+
+#if FPNG_NEON_SUPPORTED
+	// ARMv8 CRC32 instructions, which use the same (bit reflected) polynomial as PNG. 8 bytes per instruction.
+	static FPNG_CRC32_FUNC uint32_t crc32_armv8(const uint8_t* p, size_t size, uint32_t crc)
+	{
+		crc = ~crc;
+
+		for (; (size) && ((uintptr_t)p & 7); size--)
+			crc = __crc32b(crc, *p++);
+
+		for (; size >= 32; size -= 32, p += 32)
+		{
+			uint64_t v[4];
+			memcpy(v, p, sizeof(v));
+			crc = __crc32d(crc, v[0]);
+			crc = __crc32d(crc, v[1]);
+			crc = __crc32d(crc, v[2]);
+			crc = __crc32d(crc, v[3]);
+		}
+
+		for (; size >= 8; size -= 8, p += 8)
+		{
+			uint64_t v;
+			memcpy(&v, p, sizeof(v));
+			crc = __crc32d(crc, v);
+		}
+
+		for (; size; size--)
+			crc = __crc32b(crc, *p++);
+
+		return ~crc;
+	}
 #endif
 
 #if FPNG_X86_OR_X64_CPU && !FPNG_NO_SSE 
@@ -315,7 +528,7 @@ namespace fpng
 	{
 		cpu_info() { memset(this, 0, sizeof(*this)); }
 
-		bool m_initialized, m_has_fpu, m_has_mmx, m_has_sse, m_has_sse2, m_has_sse3, m_has_ssse3, m_has_sse41, m_has_sse42, m_has_avx, m_has_avx2, m_has_pclmulqdq;
+		bool m_initialized, m_has_fpu, m_has_mmx, m_has_sse, m_has_sse2, m_has_sse3, m_has_ssse3, m_has_sse41, m_has_sse42, m_has_avx, m_has_avx2, m_has_pclmulqdq, m_has_vpclmulqdq, m_has_osxsave, m_has_os_ymm_support;
 				
 		void init()
 		{
@@ -339,6 +552,10 @@ namespace fpng
 				do_cpuid(1, 0, (uint32_t*)regs);
 #endif
 				extract_x86_flags(regs[2], regs[3]);
+
+				// The OS must save the YMM registers on context switches, or AVX can't be used.
+				if (m_has_osxsave)
+					m_has_os_ymm_support = (get_xcr0() & 6) == 6;
 			}
 
 			if (max_eax >= 7U)
@@ -348,7 +565,7 @@ namespace fpng
 #else
 				do_cpuid(7, 0, (uint32_t*)regs);
 #endif
-				extract_x86_extended_flags(regs[1]);
+				extract_x86_extended_flags(regs[1], regs[2]);
 			}
 
 			m_initialized = true;
@@ -356,20 +573,64 @@ namespace fpng
 
 		bool can_use_sse41() const { return m_has_sse && m_has_sse2 && m_has_sse3 && m_has_ssse3 && m_has_sse41; }
 		bool can_use_pclmul() const	{ return m_has_pclmulqdq && can_use_sse41(); }
+		bool can_use_avx2() const { return m_has_avx && m_has_avx2 && m_has_os_ymm_support && can_use_sse41(); }
+		bool can_use_vpclmul() const { return m_has_vpclmulqdq && can_use_pclmul() && can_use_avx2(); }
 
 	private:
 		void extract_x86_flags(uint32_t ecx, uint32_t edx)
 		{
 			m_has_fpu = (edx & (1 << 0)) != 0;	m_has_mmx = (edx & (1 << 23)) != 0;	m_has_sse = (edx & (1 << 25)) != 0; m_has_sse2 = (edx & (1 << 26)) != 0;
 			m_has_sse3 = (ecx & (1 << 0)) != 0; m_has_ssse3 = (ecx & (1 << 9)) != 0; m_has_sse41 = (ecx & (1 << 19)) != 0; m_has_sse42 = (ecx & (1 << 20)) != 0;
-			m_has_pclmulqdq = (ecx & (1 << 1)) != 0; m_has_avx = (ecx & (1 << 28)) != 0;
+			m_has_pclmulqdq = (ecx & (1 << 1)) != 0; m_has_avx = (ecx & (1 << 28)) != 0; m_has_osxsave = (ecx & (1 << 27)) != 0;
 		}
 
-		void extract_x86_extended_flags(uint32_t ebx) { m_has_avx2 = (ebx & (1 << 5)) != 0; }
+		void extract_x86_extended_flags(uint32_t ebx, uint32_t ecx) { m_has_avx2 = (ebx & (1 << 5)) != 0; m_has_vpclmulqdq = (ecx & (1 << 10)) != 0; }
+
+		static uint64_t get_xcr0()
+		{
+#ifdef _MSC_VER
+			return _xgetbv(0);
+#else
+			uint32_t eax, edx;
+			__asm__("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+			return eax | ((uint64_t)edx << 32);
+#endif
+		}
 	};
 
 	cpu_info g_cpu_info;
 		
+	void fpng_init()
+	{
+		g_cpu_info.init();
+	}
+#elif FPNG_NEON_SUPPORTED
+	struct cpu_info
+	{
+		cpu_info() { memset(this, 0, sizeof(*this)); }
+
+		bool m_initialized, m_has_crc32;
+
+		void init()
+		{
+			if (m_initialized)
+				return;
+
+#if defined(__ARM_FEATURE_CRC32)
+			m_has_crc32 = true;
+#elif defined(__linux__) && !defined(_MSC_VER)
+			m_has_crc32 = (getauxval(AT_HWCAP) & HWCAP_CRC32) != 0;
+#endif
+			// Otherwise, assume the CRC32 instructions aren't available.
+
+			m_initialized = true;
+		}
+
+		bool can_use_crc32() const { return m_has_crc32; }
+	};
+
+	cpu_info g_cpu_info;
+
 	void fpng_init()
 	{
 		g_cpu_info.init();
@@ -390,13 +651,33 @@ namespace fpng
 #endif
 	}
 
+	bool fpng_cpu_supports_avx2()
+	{
+#if FPNG_AVX2_SUPPORTED
+		assert(g_cpu_info.m_initialized);
+		return g_cpu_info.can_use_avx2();
+#else
+		return false;
+#endif
+	}
+
 	uint32_t fpng_crc32(const void* pData, size_t size, uint32_t prev_crc32)
 	{
+#if FPNG_AVX2_SUPPORTED
+		if (g_cpu_info.can_use_vpclmul())
+			return crc32_vpclmul_simd(static_cast<const uint8_t*>(pData), size, prev_crc32);
+#endif
+
 #if FPNG_X86_OR_X64_CPU && !FPNG_NO_SSE 
 		if (g_cpu_info.can_use_pclmul())
 			return crc32_sse41_simd(static_cast<const uint8_t *>(pData), size, prev_crc32);
 #endif
 
+#if FPNG_NEON_SUPPORTED
+		if (g_cpu_info.can_use_crc32())
+			return crc32_armv8(static_cast<const uint8_t*>(pData), size, prev_crc32);
+#endif
+
 		return crc32_slice_by_4(pData, size, prev_crc32);
 	}
 
@@ -462,6 +743,107 @@ namespace fpng
 	}
 #endif
 
+#if FPNG_AVX2_SUPPORTED
+	// AVX2, 32 bytes per iteration. Per block of bytes, s1 gains the byte sum (vpsadbw) and s2 gains 32*s1 plus the bytes weighted 32..1 (vpmaddubsw).
+	static FPNG_AVX2_FUNC uint32_t adler32_avx2(const uint8_t* p, size_t len, uint32_t initial)
+	{
+		uint32_t s1 = initial & 0xFFFF, s2 = initial >> 16;
+		const uint32_t K = 65521;
+
+		const __m256i weights = _mm256_setr_epi8(32, 31, 30, 29, 28, 27, 26, 25, 24, 23, 22, 21, 20, 19, 18, 17, 16, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1);
+		const __m256i ones = _mm256_set1_epi16(1), zero = _mm256_setzero_si256();
+
+		while (len >= 32)
+		{
+			// 5552 is the most bytes that can be summed before s2 could overflow 32-bits
+			const size_t n = minimum<size_t>(len >> 5, 5552 / 32);
+
+			__m256i vs1 = _mm256_setr_epi32(s1, 0, 0, 0, 0, 0, 0, 0), vs2 = _mm256_setr_epi32(s2, 0, 0, 0, 0, 0, 0, 0), vs1_sum = zero;
+
+			for (size_t i = 0; i < n; i++)
+			{
+				const __m256i v = _mm256_loadu_si256((const __m256i*)(p + i * 32));
+				vs1_sum = _mm256_add_epi32(vs1_sum, vs1);
+				vs1 = _mm256_add_epi32(vs1, _mm256_sad_epu8(v, zero));
+				vs2 = _mm256_add_epi32(vs2, _mm256_madd_epi16(_mm256_maddubs_epi16(v, weights), ones));
+			}
+
+			vs2 = _mm256_add_epi32(vs2, _mm256_slli_epi32(vs1_sum, 5));
+			
+			uint32_t sa[8], sb[8];
+			_mm256_storeu_si256((__m256i*)sa, vs1);
+			_mm256_storeu_si256((__m256i*)sb, vs2);
+
+			uint64_t vs1_total = 0, vs2_total = 0;
+			for (uint32_t i = 0; i < 8; i++)
+			{
+				vs1_total += sa[i];
+				vs2_total += sb[i];
+			}
+			
+			s1 = (uint32_t)(vs1_total % K);
+			s2 = (uint32_t)(vs2_total % K);
+
+			p += n * 32;
+			len -= n * 32;
+		}
+
+		for (; len; len--)
+		{
+			s1 += *p++;
+			s2 += s1;
+		}
+
+		return (s1 % K) | ((s2 % K) << 16);
+	}
+#endif
+
+#if FPNG_NEON_SUPPORTED
+	// NEON, 16 bytes per iteration. The same approach as adler32_avx2(): s2 gains 16*s1 plus the bytes weighted 16..1 per block.
+	static uint32_t adler32_neon(const uint8_t* p, size_t len, uint32_t initial)
+	{
+		uint32_t s1 = initial & 0xFFFF, s2 = initial >> 16;
+		const uint32_t K = 65521;
+
+		static const uint8_t s_weights[16] = { 16, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1 };
+		const uint8x8_t weights_lo = vld1_u8(s_weights), weights_hi = vld1_u8(s_weights + 8);
+
+		while (len >= 16)
+		{
+			// 5552 is the most bytes that can be summed before s2 could overflow 32-bits
+			const size_t n = minimum<size_t>(len >> 4, 5552 / 16);
+
+			uint32x4_t vs1 = vsetq_lane_u32(s1, vdupq_n_u32(0), 0), vs2 = vsetq_lane_u32(s2, vdupq_n_u32(0), 0), vs1_sum = vdupq_n_u32(0);
+
+			for (size_t i = 0; i < n; i++)
+			{
+				const uint8x16_t v = vld1q_u8(p + i * 16);
+				vs1_sum = vaddq_u32(vs1_sum, vs1);
+				vs1 = vpadalq_u16(vs1, vpaddlq_u8(v));
+
+				vs2 = vpadalq_u16(vs2, vmull_u8(vget_low_u8(v), weights_lo));
+				vs2 = vpadalq_u16(vs2, vmull_u8(vget_high_u8(v), weights_hi));
+			}
+
+			vs2 = vaddq_u32(vs2, vshlq_n_u32(vs1_sum, 4));
+
+			s1 = (uint32_t)(vaddvq_u32(vs1) % K);
+			s2 = (uint32_t)(vaddvq_u32(vs2) % K);
+
+			p += n * 16;
+			len -= n * 16;
+		}
+
+		for (; len; len--)
+		{
+			s1 += *p++;
+			s2 += s1;
+		}
+
+		return (s1 % K) | ((s2 % K) << 16);
+	}
+#endif
+
 	static uint32_t fpng_adler32_scalar(const uint8_t* ptr, size_t buf_len, uint32_t adler)
 	{
 		uint32_t i, s1 = (uint32_t)(adler & 0xffff), s2 = (uint32_t)(adler >> 16); uint32_t block_len = (uint32_t)(buf_len % 5552);
@@ -479,13 +861,177 @@ namespace fpng
 
 	uint32_t fpng_adler32(const void* pData, size_t size, uint32_t adler)
 	{
+#if FPNG_AVX2_SUPPORTED
+		if (g_cpu_info.can_use_avx2())
+			return adler32_avx2((const uint8_t*)pData, size, adler);
+#endif
+
 #if FPNG_X86_OR_X64_CPU && !FPNG_NO_SSE 
 		if (g_cpu_info.can_use_sse41())
 			return adler32_sse_16((const uint8_t*)pData, size, adler);
 #endif
+
+#if FPNG_NEON_SUPPORTED
+		return adler32_neon((const uint8_t*)pData, size, adler);
+#endif
 		return fpng_adler32_scalar((const uint8_t*)pData, size, adler);
 	}
 
+	// GF(2) polynomial multiply modulo the CRC-32 polynomial, bit reflected (x^0 is the MSB). See zlib's crc32_combine().
+	static uint32_t crc32_multmodp(uint32_t a, uint32_t b)
+	{
+		uint32_t m = 1U << 31, p = 0;
+		for (; ; )
+		{
+			if (a & m)
+			{
+				p ^= b;
+				if ((a & (m - 1)) == 0)
+					break;
+			}
+			m >>= 1;
+			b = (b & 1) ? ((b >> 1) ^ 0xEDB88320) : (b >> 1);
+		}
+		return p;
+	}
+
+	uint32_t fpng_crc32_combine(uint32_t crc32_a, uint32_t crc32_b, uint64_t len_b)
+	{
+		// Compute x^(8*len_b) mod p(x) by repeated squaring, then multiply it into crc32_a.
+		uint32_t p = 1U << 31, sq = 1U << 23;
+		for (; len_b; len_b >>= 1)
+		{
+			if (len_b & 1)
+				p = crc32_multmodp(sq, p);
+			sq = crc32_multmodp(sq, sq);
+		}
+		return crc32_multmodp(p, crc32_a) ^ crc32_b;
+	}
+
+	uint32_t fpng_adler32_combine(uint32_t adler32_a, uint32_t adler32_b, uint64_t len_b)
+	{
+		const uint32_t K = 65521;
+		const uint32_t rem = (uint32_t)(len_b % K);
+		uint32_t s1 = adler32_a & 0xFFFF;
+		uint32_t s2 = (rem * s1) % K;
+		s1 += (adler32_b & 0xFFFF) + K - 1;
+		s2 += (adler32_a >> 16) + (adler32_b >> 16) + K - rem;
+		if (s1 >= K) s1 -= K;
+		if (s1 >= K) s1 -= K;
+		if (s2 >= (K << 1)) s2 -= (K << 1);
+		if (s2 >= K) s2 -= K;
+		return s1 | (s2 << 16);
+	}
+
+	void fpng_encode_stats::clear()
+	{
+		memset(this, 0, sizeof(*this));
+	}
+
+	void fpng_decode_stats::clear()
+	{
+		memset(this, 0, sizeof(*this));
+	}
+
+#if FPNG_STATS
+	// FPNG_STATS_ONLY() keeps the instrumentation in the hot loops out of the code entirely unless FPNG_STATS is 1.
+	#define FPNG_STATS_ONLY(...) __VA_ARGS__
+
+	static inline uint64_t get_stats_ns()
+	{
+		return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+	}
+
+	// Splits the time between successive calls to lap() among the fields of a fpng_encode_stats or fpng_decode_stats, so back to back stages are timed without any gaps.
+	// If pEnd_field isn't nullptr, the time from the last lap until the timer goes out of scope is added to it. Does nothing if pStats is nullptr.
+	template<typename T>
+	struct stats_timer
+	{
+		T* m_pStats;
+		uint64_t T::* m_pEnd_field;
+		uint64_t m_last_ns;
+
+		stats_timer(T* pStats, uint64_t T::* pEnd_field = nullptr) : m_pStats(pStats), m_pEnd_field(pEnd_field), m_last_ns(pStats ? get_stats_ns() : 0) { }
+		~stats_timer() { if (m_pEnd_field) lap(m_pEnd_field); }
+
+		// Skips the time since the last lap, which was already counted elsewhere.
+		inline void reset() { if (m_pStats) m_last_ns = get_stats_ns(); }
+
+		inline void lap(uint64_t T::* pField)
+		{
+			if (!m_pStats)
+				return;
+			const uint64_t t = get_stats_ns();
+			m_pStats->*pField += t - m_last_ns;
+			m_last_ns = t;
+		}
+	};
+
+	typedef stats_timer<fpng_encode_stats> encode_stats_timer;
+	typedef stats_timer<fpng_decode_stats> decode_stats_timer;
+
+	// The compressors count their codes in locals, which are added to the stats once at the end.
+	struct code_counts
+	{
+		uint64_t m_lits, m_matches, m_match_bytes;
+
+		code_counts() : m_lits(0), m_matches(0), m_match_bytes(0) { }
+
+		inline void add_match(uint32_t len) { m_matches++; m_match_bytes += len; }
+
+		void flush(fpng_encode_stats* pStats) const
+		{
+			if (!pStats)
+				return;
+			pStats->m_num_literals += m_lits;
+			pStats->m_num_matches += m_matches;
+			pStats->m_match_bytes += m_match_bytes;
+		}
+	};
+
+	static inline void record_stats_table(fpng_encode_stats* pStats, uint32_t table)
+	{
+		if (pStats)
+			pStats->m_table_blocks[table]++;
+	}
+
+	// The image (or strip) didn't compress, and was written as raw blocks instead.
+	static inline void record_raw_fallback(fpng_encode_stats* pStats)
+	{
+		if (pStats)
+		{
+			pStats->m_raw_fallback = true;
+			pStats->m_table_blocks[FPNG_STATS_TABLE_RAW]++;
+		}
+	}
+
+	static void add_encode_stats(fpng_encode_stats& dst, const fpng_encode_stats& src)
+	{
+		dst.m_analysis_ns += src.m_analysis_ns;
+		dst.m_filter_ns += src.m_filter_ns;
+		dst.m_adler32_ns += src.m_adler32_ns;
+		dst.m_entropy_ns += src.m_entropy_ns;
+		dst.m_crc32_ns += src.m_crc32_ns;
+		dst.m_num_literals += src.m_num_literals;
+		dst.m_num_matches += src.m_num_matches;
+		dst.m_match_bytes += src.m_match_bytes;
+		dst.m_raw_fallback = dst.m_raw_fallback || src.m_raw_fallback;
+		for (uint32_t i = 0; i < FPNG_STATS_MAX_TABLES; i++)
+			dst.m_table_blocks[i] += src.m_table_blocks[i];
+	}
+
+	static void add_decode_stats(fpng_decode_stats& dst, const fpng_decode_stats& src)
+	{
+		dst.m_table_build_ns += src.m_table_build_ns;
+		dst.m_decode_ns += src.m_decode_ns;
+		dst.m_checksum_ns += src.m_checksum_ns;
+		dst.m_num_tables_built += src.m_num_tables_built;
+		dst.m_num_tables_reused += src.m_num_tables_reused;
+	}
+#else
+	#define FPNG_STATS_ONLY(...)
+#endif
+
 	// Ensure we've been configured for endianness correctly.
 	static inline bool endian_check()
 	{
@@ -527,13 +1073,15 @@ namespace fpng
 		
 	static const uint32_t g_bitmasks[17] = { 0x0000, 0x0001, 0x0003, 0x0007, 0x000F, 0x001F, 0x003F, 0x007F, 0x00FF, 0x01FF, 0x03FF, 0x07FF, 0x0FFF, 0x1FFF, 0x3FFF, 0x7FFF, 0xFFFF };
 
+	struct defl_huff_code { uint8_t m_code_size; uint16_t m_code; };
+
 	// Huffman tables generated by fpng_test -t @filelist.txt. Total alpha files : 1440, Total opaque files : 5627.
 	// Feel free to retrain the encoder on your opaque/alpha PNG files by setting FPNG_TRAIN_HUFFMAN_TABLES and running fpng_test with the -t option.
 	static const uint8_t g_dyn_huff_3[] = {
 	120, 1, 237, 195, 3, 176, 110, 89, 122, 128, 225, 247, 251, 214, 218, 248, 113, 124, 173, 190, 109, 12, 50, 201, 196, 182, 109, 219, 182, 109, 219, 182,
 	109, 219, 201, 36, 147, 153, 105, 235, 246, 53, 142, 207, 143, 141, 181, 214, 151, 93, 117, 170, 78, 117, 117, 58, 206, 77, 210, 217, 169, 122 };
 	const uint32_t DYN_HUFF_3_BITBUF = 30, DYN_HUFF_3_BITBUF_SIZE = 7;
-	static const struct { uint8_t m_code_size; uint16_t m_code; } g_dyn_huff_3_codes[288] = {
+	static const defl_huff_code g_dyn_huff_3_codes[288] = {
 	{2,0},{4,2},{4,10},{5,14},{5,30},{6,25},{6,57},{6,5},{6,37},{7,3},{7,67},{7,35},{7,99},{8,11},{8,139},{8,75},{8,203},{8,43},{8,171},{8,107},{9,135},{9,391},{9,71},{9,327},{9,199},{9,455},{9,39},{9,295},{9,167},{9,423},{9,103},{10,183},
 	{9,359},{10,695},{10,439},{10,951},{10,119},{10,631},{10,375},{10,887},{10,247},{10,759},{10,503},{11,975},{11,1999},{11,47},{11,1071},{12,1199},{11,559},{12,3247},{12,687},{11,1583},{12,2735},{12,1711},{12,3759},{12,431},{12,2479},{12,1455},{12,3503},{12,943},{12,2991},{12,1967},{12,4015},{12,111},
 	{12,2159},{12,1135},{12,3183},{12,623},{12,2671},{12,1647},{12,3695},{12,367},{12,2415},{12,1391},{12,3439},{12,879},{12,2927},{12,1903},{12,3951},{12,239},{12,2287},{12,1263},{12,3311},{12,751},{12,2799},{12,1775},{12,3823},{12,495},{12,2543},{12,1519},{12,3567},{12,1007},{12,3055},{12,2031},{12,4079},{12,31},
@@ -549,7 +1097,7 @@ namespace fpng
 	120, 1, 229, 196, 99, 180, 37, 103, 218, 128, 225, 251, 121, 171, 106, 243, 216, 231, 180, 109, 196, 182, 51, 51, 73, 6, 201, 216, 182, 109, 219, 182,
 	17, 140, 98, 219, 102, 219, 60, 125, 172, 205, 170, 122, 159, 111, 213, 143, 179, 214, 94, 189, 58, 153, 104, 166, 103, 190, 247, 199, 117 };
 	const uint32_t DYN_HUFF_4_BITBUF = 1, DYN_HUFF_4_BITBUF_SIZE = 2;
-	static const struct { uint8_t m_code_size; uint16_t m_code; } g_dyn_huff_4_codes[288] = {
+	static const defl_huff_code g_dyn_huff_4_codes[288] = {
 	{2,0},{4,2},{5,6},{6,30},{6,62},{6,1},{7,41},{7,105},{7,25},{7,89},{7,57},{7,121},{8,117},{8,245},{8,13},{8,141},{8,77},{8,205},{8,45},{8,173},{8,109},{8,237},{8,29},{8,157},{8,93},{8,221},{8,61},{9,83},{9,339},{9,211},{9,467},{9,51},
 	{9,307},{9,179},{9,435},{9,115},{9,371},{9,243},{9,499},{9,11},{9,267},{9,139},{9,395},{9,75},{9,331},{9,203},{9,459},{9,43},{9,299},{10,7},{10,519},{10,263},{10,775},{10,135},{10,647},{10,391},{10,903},{10,71},{10,583},{10,327},{10,839},{10,199},{10,711},{10,455},
 	{10,967},{10,39},{10,551},{10,295},{10,807},{10,167},{10,679},{10,423},{10,935},{10,103},{10,615},{11,463},{11,1487},{11,975},{10,359},{10,871},{10,231},{11,1999},{11,47},{11,1071},{11,559},{10,743},{10,487},{11,1583},{11,303},{11,1327},{11,815},{11,1839},{11,175},{11,1199},{11,687},{11,1711},
@@ -561,6 +1109,116 @@ namespace fpng
 	{12,2047},{0,0},{6,9},{0,0},{0,0},{0,0},{8,147},{0,0},{0,0},{7,53},{0,0},{9,379},{0,0},{9,251},{10,911},{10,79},{11,767},{10,591},{10,335},{10,847},{10,207},{10,719},{11,1791},{11,511},{9,507},{11,1535},{11,1023},{12,4095},{5,14},{0,0},{0,0},{0,0}
 	};
 
+	// Presets for screenshots/UI (ui), photos (photo), tangent space normal maps (normalmap) and alpha-masked sprites (sprite), generated by fpng_test -t.
+	// They were trained on synthetic images of each kind (40 per kind), so retraining them on real images of your own workloads should help: see training_mode() in fpng_test.cpp.
+
+	static const uint8_t g_dyn_huff_3_ui[] = {
+	120, 1, 237, 195, 9, 80, 148, 101, 192, 192, 241, 127, 175, 71, 158, 149, 90, 166, 25, 166, 168, 121, 223, 183, 139, 133, 235, 65, 81, 153, 87, 34,
+	174, 176, 43, 11, 168, 160, 226, 149, 213, 215, 245, 117, 151, 121, 161, 162, 136, 44, 238, 130, 43, 98, 94, 89, 81, 120, 172, 148, 172, 247, 125, 165,
+	169, 104, 154, 105, 150, 87, 222, 146, 60, 223, 51, 243, 206, 236, 236, 44, 72, 118, 88, 228, 243, 205, 252, 126 };
+	const uint32_t DYN_HUFF_3_UI_BITBUF = 0, DYN_HUFF_3_UI_BITBUF_SIZE = 0;
+	static const defl_huff_code g_dyn_huff_3_ui_codes[288] = {
+	{2,0},{10,247},{6,26},{9,37},{9,293},{9,165},{9,421},{10,759},{9,101},{9,357},{9,229},{9,485},{9,21},{9,277},{10,503},{10,1015},{10,15},{9,149},{9,405},{9,85},{10,527},{10,271},{9,341},{10,783},{9,213},{9,469},{10,143},{9,53},{10,655},{8,126},{9,309},{10,399},
+	{9,181},{9,437},{8,254},{9,117},{9,373},{9,245},{10,911},{9,501},{9,13},{9,269},{9,141},{9,397},{9,77},{9,333},{9,205},{9,461},{9,45},{9,301},{9,173},{9,429},{9,109},{9,365},{9,237},{9,493},{9,29},{9,285},{9,157},{7,6},{8,1},{9,413},{10,79},{10,591},
+	{8,129},{9,93},{7,70},{9,349},{9,221},{9,477},{9,61},{8,65},{10,335},{10,847},{8,193},{10,207},{10,719},{10,463},{9,317},{10,975},{9,189},{9,445},{9,125},{9,381},{9,253},{10,47},{9,509},{8,33},{9,3},{8,161},{9,259},{7,38},{9,131},{8,97},{8,225},{7,102},
+	{7,22},{9,387},{8,17},{7,86},{8,145},{8,81},{8,209},{9,67},{9,323},{9,195},{8,49},{8,177},{9,451},{9,35},{9,291},{8,113},{9,163},{9,419},{9,99},{9,355},{9,227},{10,559},{9,483},{10,303},{10,815},{10,175},{12,1023},{10,687},{10,431},{10,943},{10,111},{10,623},
+	{12,3071},{10,367},{10,879},{10,239},{10,751},{10,495},{10,1007},{10,31},{10,543},{10,287},{9,19},{10,799},{9,275},{9,147},{9,403},{9,83},{9,339},{8,241},{9,211},{9,467},{9,51},{8,9},{9,307},{9,179},{8,137},{9,435},{8,73},{9,115},{8,201},{7,54},{8,41},{9,371},
+	{7,118},{7,14},{8,169},{8,105},{9,243},{7,78},{9,499},{8,233},{9,11},{8,25},{9,267},{10,159},{9,139},{9,395},{9,75},{9,331},{9,203},{10,671},{9,459},{10,415},{10,927},{10,95},{8,153},{10,607},{10,351},{8,89},{9,43},{9,299},{9,171},{9,427},{7,46},{9,107},
+	{8,217},{10,863},{10,223},{9,363},{8,57},{7,110},{9,235},{9,491},{9,27},{9,283},{9,155},{9,411},{9,91},{9,347},{9,219},{9,475},{9,59},{9,315},{9,187},{9,443},{9,123},{9,379},{9,251},{10,735},{9,507},{9,7},{10,479},{9,263},{9,135},{9,391},{8,185},{9,71},
+	{9,327},{10,991},{9,199},{9,455},{10,63},{9,39},{10,575},{9,295},{9,167},{10,319},{9,423},{10,831},{10,191},{9,103},{9,359},{9,231},{9,487},{9,23},{10,703},{9,279},{9,151},{9,407},{9,87},{9,343},{9,215},{9,471},{9,55},{8,121},{10,447},{9,311},{8,249},{5,2},
+	{12,2047},{5,18},{0,0},{0,0},{6,58},{0,0},{0,0},{7,30},{0,0},{7,94},{0,0},{7,62},{8,5},{8,133},{9,183},{8,69},{10,959},{9,439},{10,127},{10,639},{10,383},{10,895},{9,119},{10,255},{10,767},{8,197},{10,511},{9,375},{5,10},{12,4095},{0,0},{0,0}
+	};
+
+	static const uint8_t g_dyn_huff_3_photo[] = {
+	120, 1, 237, 195, 3, 204, 54, 75, 144, 5, 224, 83, 232, 238, 153, 239, 174, 109, 219, 182, 109, 219, 182, 109, 219, 182, 109, 219, 182, 109, 219, 184,
+	255, 59, 51, 221, 85, 117, 118, 147, 77, 54, 155, 181, 157, 60 };
+	const uint32_t DYN_HUFF_3_PHOTO_BITBUF = 15, DYN_HUFF_3_PHOTO_BITBUF_SIZE = 6;
+	static const defl_huff_code g_dyn_huff_3_photo_codes[288] = {
+	{3,0},{4,2},{4,10},{4,6},{4,14},{5,13},{5,29},{5,3},{6,27},{6,59},{8,119},{10,503},{12,15},{12,2063},{12,1039},{12,3087},{12,527},{12,2575},{12,1551},{12,3599},{12,271},{12,2319},{12,1295},{12,3343},{12,783},{12,2831},{12,1807},{12,3855},{12,143},{12,2191},{12,1167},{12,3215},
+	{12,655},{12,2703},{12,1679},{12,3727},{12,399},{12,2447},{12,1423},{12,3471},{12,911},{12,2959},{12,1935},{12,3983},{12,79},{12,2127},{12,1103},{12,3151},{12,591},{12,2639},{12,1615},{12,3663},{12,335},{12,2383},{12,1359},{12,3407},{12,847},{12,2895},{12,1871},{12,3919},{12,207},{12,2255},{12,1231},{12,3279},
+	{12,719},{12,2767},{12,1743},{12,3791},{12,463},{12,2511},{12,1487},{12,3535},{12,975},{12,3023},{12,1999},{12,4047},{12,47},{12,2095},{12,1071},{12,3119},{12,559},{12,2607},{12,1583},{12,3631},{12,303},{12,2351},{12,1327},{12,3375},{12,815},{12,2863},{12,1839},{12,3887},{12,175},{12,2223},{12,1199},{12,3247},
+	{12,687},{12,2735},{12,1711},{12,3759},{12,431},{12,2479},{12,1455},{12,3503},{12,943},{12,2991},{12,1967},{12,4015},{12,111},{12,2159},{12,1135},{12,3183},{12,623},{12,2671},{12,1647},{12,3695},{12,367},{12,2415},{12,1391},{12,3439},{12,879},{12,2927},{12,1903},{12,3951},{12,239},{12,2287},{12,1263},{12,3311},
+	{12,751},{12,2799},{12,1775},{12,3823},{12,495},{12,2543},{12,1519},{12,3567},{12,1007},{12,3055},{12,2031},{12,4079},{12,31},{12,2079},{12,1055},{12,3103},{12,543},{12,2591},{12,1567},{12,3615},{12,287},{12,2335},{12,1311},{12,3359},{12,799},{12,2847},{12,1823},{12,3871},{12,159},{12,2207},{12,1183},{12,3231},
+	{12,671},{12,2719},{12,1695},{12,3743},{12,415},{12,2463},{12,1439},{12,3487},{12,927},{12,2975},{12,1951},{12,3999},{12,95},{12,2143},{12,1119},{12,3167},{12,607},{12,2655},{12,1631},{12,3679},{12,351},{12,2399},{12,1375},{12,3423},{12,863},{12,2911},{12,1887},{12,3935},{12,223},{12,2271},{12,1247},{12,3295},
+	{12,735},{12,2783},{12,1759},{12,3807},{12,479},{12,2527},{12,1503},{12,3551},{12,991},{12,3039},{12,2015},{12,4063},{12,63},{12,2111},{12,1087},{12,3135},{12,575},{12,2623},{12,1599},{12,3647},{12,319},{12,2367},{12,1343},{12,3391},{12,831},{12,2879},{12,1855},{12,3903},{12,191},{12,2239},{12,1215},{12,3263},
+	{12,703},{12,2751},{12,1727},{12,3775},{12,447},{12,2495},{12,1471},{12,3519},{12,959},{12,3007},{12,1983},{12,4031},{12,127},{12,2175},{12,1151},{12,3199},{12,639},{12,2687},{12,1663},{12,3711},{10,1015},{9,247},{7,55},{6,7},{6,39},{6,23},{5,19},{5,11},{4,1},{4,9},{4,5},{3,4},
+	{12,383},{12,2431},{0,0},{0,0},{12,1407},{0,0},{0,0},{12,3455},{0,0},{12,895},{0,0},{12,2943},{12,1919},{12,3967},{12,255},{12,2303},{12,1279},{12,3327},{12,767},{12,2815},{12,1791},{12,3839},{12,511},{12,2559},{12,1535},{12,3583},{12,1023},{12,3071},{12,2047},{12,4095},{0,0},{0,0}
+	};
+
+	static const uint8_t g_dyn_huff_3_normalmap[] = {
+	120, 1, 237, 195, 3, 140, 101, 221, 154, 6, 224, 247, 91, 123, 31, 150, 171, 109, 255, 211, 182, 109, 151, 173, 182, 109, 219, 182, 221, 101, 179, 109,
+	219, 190, 183, 109, 150, 171, 14, 247, 94, 107, 58, 153, 100, 50, 25, 219, 201, 243 };
+	const uint32_t DYN_HUFF_3_NORMALMAP_BITBUF = 0, DYN_HUFF_3_NORMALMAP_BITBUF_SIZE = 2;
+	static const defl_huff_code g_dyn_huff_3_normalmap_codes[288] = {
+	{3,0},{4,4},{5,12},{6,18},{6,50},{7,26},{7,90},{7,58},{7,122},{7,6},{7,70},{8,14},{8,142},{8,78},{8,206},{8,46},{8,174},{8,110},{8,238},{9,37},{9,293},{9,165},{9,421},{9,101},{9,357},{9,229},{9,485},{9,21},{9,277},{9,149},{9,405},{9,85},
+	{9,341},{9,213},{9,469},{9,53},{9,309},{9,181},{10,127},{12,383},{9,437},{9,117},{9,373},{9,245},{9,501},{9,13},{9,269},{9,141},{9,397},{9,77},{9,333},{9,205},{9,461},{9,45},{9,301},{9,173},{9,429},{9,109},{9,365},{9,237},{9,493},{9,29},{9,285},{9,157},
+	{9,413},{9,93},{9,349},{9,221},{9,477},{9,61},{9,317},{9,189},{9,445},{9,125},{9,381},{9,253},{9,509},{8,30},{8,158},{8,94},{8,222},{8,62},{8,190},{8,126},{8,254},{8,1},{8,129},{8,65},{8,193},{8,33},{8,161},{8,97},{8,225},{8,17},{9,3},{9,259},
+	{9,131},{9,387},{9,67},{9,323},{9,195},{9,451},{9,35},{9,291},{9,163},{9,419},{9,99},{9,355},{9,227},{9,483},{9,19},{9,275},{9,147},{9,403},{9,83},{9,339},{9,211},{9,467},{9,51},{9,307},{9,179},{9,435},{9,115},{9,371},{9,243},{9,499},{9,11},{9,267},
+	{9,139},{9,395},{9,75},{9,331},{9,203},{9,459},{9,43},{9,299},{9,171},{9,427},{9,107},{9,363},{9,235},{9,491},{9,27},{9,283},{9,155},{9,411},{9,91},{9,347},{9,219},{9,475},{9,59},{9,315},{9,187},{9,443},{9,123},{9,379},{9,251},{9,507},{9,7},{9,263},
+	{9,135},{9,391},{8,145},{8,81},{8,209},{8,49},{8,177},{8,113},{8,241},{8,9},{8,137},{8,73},{8,201},{8,41},{8,169},{8,105},{8,233},{8,25},{8,153},{8,89},{9,71},{9,327},{9,199},{9,455},{9,39},{9,295},{9,167},{9,423},{9,103},{9,359},{9,231},{9,487},
+	{9,23},{9,279},{9,151},{9,407},{9,87},{9,343},{9,215},{9,471},{9,55},{9,311},{9,183},{9,439},{9,119},{9,375},{9,247},{9,503},{9,15},{9,271},{9,143},{9,399},{9,79},{9,335},{9,207},{9,463},{9,47},{11,639},{11,1663},{9,303},{9,175},{9,431},{9,111},{9,367},
+	{9,239},{9,495},{9,31},{9,287},{9,159},{9,415},{9,95},{9,351},{9,223},{9,479},{9,63},{9,319},{9,191},{8,217},{8,57},{8,185},{8,121},{8,249},{8,5},{8,133},{8,69},{8,197},{7,38},{7,102},{7,22},{7,86},{7,54},{7,118},{6,10},{6,42},{5,28},{5,2},
+	{12,2431},{9,447},{0,0},{0,0},{12,1407},{0,0},{0,0},{12,3455},{0,0},{12,895},{0,0},{12,2943},{12,1919},{12,3967},{12,255},{12,2303},{12,1279},{12,3327},{12,767},{12,2815},{12,1791},{12,3839},{12,511},{12,2559},{12,1535},{12,3583},{12,1023},{12,3071},{12,2047},{12,4095},{0,0},{0,0}
+	};
+
+	static const uint8_t g_dyn_huff_4_ui[] = {
+	120, 1, 229, 196, 123, 188, 215, 243, 253, 0, 240, 231, 190, 198, 92, 54, 140, 148, 123, 238, 148, 194, 190, 56, 147, 13, 135, 92, 106, 150, 159, 153,
+	123, 135, 115, 82, 167, 111, 42, 36, 178, 217, 239, 247, 155, 237, 183, 223, 111, 54, 145, 80, 233, 219, 41, 206, 225, 228, 62, 51, 205, 138, 137, 131,
+	145, 29, 124, 135, 146, 251, 253, 90, 98, 216, 220, 167, 207, 239, 241, 254, 227, 243, 120, 156, 199, 121, 156, 82, 45, 84, 175, 63, 158 };
+	const uint32_t DYN_HUFF_4_UI_BITBUF = 79, DYN_HUFF_4_UI_BITBUF_SIZE = 7;
+	static const defl_huff_code g_dyn_huff_4_ui_codes[288] = {
+	{1,0},{11,863},{7,5},{10,427},{11,1887},{10,939},{10,107},{11,223},{10,619},{10,363},{10,875},{10,235},{11,1247},{11,735},{10,747},{10,491},{10,1003},{11,1759},{10,27},{10,539},{9,157},{10,283},{9,413},{9,93},{10,795},{10,155},{10,667},{10,411},{10,923},{10,91},{10,603},{9,349},
+	{10,347},{10,859},{10,219},{10,731},{10,475},{10,987},{10,59},{10,571},{10,315},{9,221},{9,477},{10,827},{9,61},{9,317},{10,187},{10,699},{10,443},{11,479},{7,69},{10,955},{10,123},{10,635},{8,85},{11,1503},{10,379},{9,189},{10,891},{11,991},{11,2015},{10,251},{10,763},{10,507},
+	{8,213},{10,1019},{10,7},{9,445},{10,519},{10,263},{10,775},{10,135},{9,125},{9,381},{11,63},{10,647},{11,1087},{9,253},{10,391},{12,511},{10,903},{11,575},{10,71},{11,1599},{10,583},{10,327},{10,839},{10,199},{10,711},{10,455},{10,967},{9,509},{8,53},{10,39},{10,551},{8,181},
+	{8,117},{9,3},{10,295},{9,259},{9,131},{8,245},{9,387},{7,37},{9,67},{10,807},{9,323},{9,195},{9,451},{10,167},{10,679},{10,423},{9,35},{10,935},{9,291},{10,103},{10,615},{9,163},{10,359},{11,319},{11,1343},{10,871},{11,831},{12,2559},{12,1535},{12,3583},{11,1855},{10,231},
+	{11,191},{11,1215},{12,1023},{11,703},{12,3071},{12,2047},{11,1727},{10,743},{11,447},{11,1471},{10,487},{9,419},{10,999},{10,23},{9,99},{10,535},{9,355},{10,279},{10,791},{10,151},{9,227},{9,483},{9,19},{10,663},{9,275},{7,101},{9,147},{8,13},{9,403},{9,83},{10,407},{10,919},
+	{8,141},{8,77},{10,87},{10,599},{8,205},{9,339},{10,343},{10,855},{10,215},{10,727},{10,471},{10,983},{10,55},{11,959},{10,567},{11,1983},{10,311},{11,127},{10,823},{9,211},{11,1151},{10,183},{11,639},{9,467},{9,51},{10,695},{10,439},{11,1663},{10,951},{9,307},{10,119},{10,631},
+	{8,45},{10,375},{10,887},{10,247},{11,383},{10,759},{10,503},{9,179},{10,1015},{11,1407},{8,173},{10,15},{10,527},{10,271},{7,21},{11,895},{10,783},{10,143},{10,655},{9,435},{9,115},{10,399},{9,371},{10,911},{10,79},{10,591},{10,335},{10,847},{10,207},{10,719},{10,463},{10,975},
+	{10,47},{10,559},{10,303},{10,815},{10,175},{10,687},{10,431},{10,943},{10,111},{9,243},{9,499},{10,623},{9,11},{10,367},{10,879},{11,1919},{10,239},{10,751},{10,495},{11,255},{11,1279},{10,1007},{10,31},{10,543},{10,287},{10,799},{10,159},{10,671},{11,767},{10,415},{9,267},{6,25},
+	{12,4095},{0,0},{5,9},{0,0},{0,0},{0,0},{6,57},{0,0},{0,0},{8,109},{0,0},{8,237},{0,0},{8,29},{9,139},{9,395},{10,927},{9,75},{9,331},{9,203},{11,1791},{9,459},{10,95},{10,607},{10,351},{9,43},{9,299},{9,171},{4,1},{0,0},{0,0},{0,0}
+	};
+
+	static const uint8_t g_dyn_huff_4_sprite[] = {
+	120, 1, 229, 196, 83, 144, 44, 81, 144, 0, 208, 147, 183, 170, 103, 237, 94, 219, 182, 109, 219, 182, 109, 219, 182, 109, 219, 182, 109, 219, 234, 53,
+	95, 87, 221, 204, 141, 250, 152, 136, 23, 27, 107, 207, 230, 199, 57 };
+	const uint32_t DYN_HUFF_4_SPRITE_BITBUF = 0, DYN_HUFF_4_SPRITE_BITBUF_SIZE = 0;
+	static const defl_huff_code g_dyn_huff_4_sprite_codes[288] = {
+	{1,0},{4,1},{5,3},{6,11},{6,43},{7,39},{8,55},{12,15},{12,2063},{12,1039},{12,3087},{12,527},{12,2575},{12,1551},{12,3599},{12,271},{12,2319},{12,1295},{12,3343},{12,783},{7,103},{12,2831},{12,1807},{12,3855},{12,143},{12,2191},{12,1167},{12,3215},{12,655},{12,2703},{12,1679},{12,3727},
+	{12,399},{12,2447},{12,1423},{12,3471},{12,911},{12,2959},{12,1935},{12,3983},{12,79},{12,2127},{12,1103},{12,3151},{12,591},{12,2639},{12,1615},{12,3663},{12,335},{12,2383},{12,1359},{12,3407},{12,847},{12,2895},{12,1871},{12,3919},{12,207},{12,2255},{12,1231},{12,3279},{12,719},{12,2767},{12,1743},{12,3791},
+	{12,463},{12,2511},{12,1487},{12,3535},{12,975},{12,3023},{12,1999},{12,4047},{12,47},{12,2095},{12,1071},{12,3119},{12,559},{12,2607},{12,1583},{12,3631},{12,303},{12,2351},{12,1327},{12,3375},{12,815},{12,2863},{12,1839},{12,3887},{12,175},{12,2223},{12,1199},{12,3247},{12,687},{12,2735},{12,1711},{12,3759},
+	{12,431},{12,2479},{12,1455},{12,3503},{12,943},{12,2991},{12,1967},{12,4015},{12,111},{12,2159},{12,1135},{12,3183},{12,623},{12,2671},{12,1647},{12,3695},{12,367},{12,2415},{12,1391},{12,3439},{12,879},{12,2927},{12,1903},{12,3951},{12,239},{12,2287},{12,1263},{12,3311},{12,751},{12,2799},{12,1775},{12,3823},
+	{12,495},{12,2543},{12,1519},{12,3567},{12,1007},{12,3055},{12,2031},{12,4079},{12,31},{12,2079},{12,1055},{12,3103},{12,543},{12,2591},{12,1567},{12,3615},{12,287},{12,2335},{12,1311},{12,3359},{12,799},{12,2847},{12,1823},{12,3871},{12,159},{12,2207},{12,1183},{12,3231},{12,671},{12,2719},{12,1695},{12,3743},
+	{12,415},{12,2463},{12,1439},{12,3487},{12,927},{12,2975},{12,1951},{12,3999},{12,95},{12,2143},{12,1119},{12,3167},{12,607},{12,2655},{12,1631},{12,3679},{12,351},{12,2399},{12,1375},{12,3423},{12,863},{12,2911},{12,1887},{12,3935},{12,223},{12,2271},{12,1247},{12,3295},{12,735},{12,2783},{12,1759},{12,3807},
+	{12,479},{12,2527},{12,1503},{12,3551},{12,991},{12,3039},{12,2015},{12,4063},{12,63},{12,2111},{12,1087},{12,3135},{12,575},{12,2623},{12,1599},{12,3647},{12,319},{12,2367},{12,1343},{12,3391},{12,831},{12,2879},{12,1855},{12,3903},{12,191},{12,2239},{12,1215},{12,3263},{12,703},{12,2751},{12,1727},{12,3775},
+	{12,447},{12,2495},{12,1471},{12,3519},{12,959},{12,3007},{12,1983},{12,4031},{12,127},{12,2175},{12,1151},{12,3199},{7,23},{12,639},{12,2687},{12,1663},{12,3711},{12,383},{12,2431},{12,1407},{12,3455},{12,895},{12,2943},{12,1919},{12,3967},{9,247},{7,87},{6,27},{6,59},{5,19},{4,9},{4,5},
+	{12,255},{0,0},{6,7},{0,0},{0,0},{0,0},{8,183},{0,0},{0,0},{9,503},{0,0},{12,2303},{0,0},{12,1279},{12,3327},{12,767},{12,2815},{12,1791},{12,3839},{12,511},{12,2559},{12,1535},{12,3583},{12,1023},{12,3071},{12,2047},{8,119},{12,4095},{4,13},{0,0},{0,0},{0,0}
+	};
+
+	// A precomputed one pass Huffman table: the zlib header and dynamic block header written by create_dynamic_block_prefix(), the bits of it left in the bit buffer, and the literal/length codes.
+	struct defl_huff_preset
+	{
+		const uint8_t* m_pPrefix;
+		uint32_t m_prefix_size;
+		uint32_t m_bit_buf, m_bit_buf_size;
+		const defl_huff_code* m_pCodes;
+	};
+
+	// The one pass compressor picks one of these per image (or strip) with select_huff_preset(). The first of each is the general purpose table above, the others were trained on narrower kinds of images.
+	static const defl_huff_preset g_dyn_huff_3_presets[] = 
+	{
+		{ g_dyn_huff_3, sizeof(g_dyn_huff_3), DYN_HUFF_3_BITBUF, DYN_HUFF_3_BITBUF_SIZE, g_dyn_huff_3_codes },
+		{ g_dyn_huff_3_ui, sizeof(g_dyn_huff_3_ui), DYN_HUFF_3_UI_BITBUF, DYN_HUFF_3_UI_BITBUF_SIZE, g_dyn_huff_3_ui_codes },
+		{ g_dyn_huff_3_photo, sizeof(g_dyn_huff_3_photo), DYN_HUFF_3_PHOTO_BITBUF, DYN_HUFF_3_PHOTO_BITBUF_SIZE, g_dyn_huff_3_photo_codes },
+		{ g_dyn_huff_3_normalmap, sizeof(g_dyn_huff_3_normalmap), DYN_HUFF_3_NORMALMAP_BITBUF, DYN_HUFF_3_NORMALMAP_BITBUF_SIZE, g_dyn_huff_3_normalmap_codes },
+	};
+
+	static const defl_huff_preset g_dyn_huff_4_presets[] = 
+	{
+		{ g_dyn_huff_4, sizeof(g_dyn_huff_4), DYN_HUFF_4_BITBUF, DYN_HUFF_4_BITBUF_SIZE, g_dyn_huff_4_codes },
+		{ g_dyn_huff_4_ui, sizeof(g_dyn_huff_4_ui), DYN_HUFF_4_UI_BITBUF, DYN_HUFF_4_UI_BITBUF_SIZE, g_dyn_huff_4_ui_codes },
+		{ g_dyn_huff_4_sprite, sizeof(g_dyn_huff_4_sprite), DYN_HUFF_4_SPRITE_BITBUF, DYN_HUFF_4_SPRITE_BITBUF_SIZE, g_dyn_huff_4_sprite_codes },
+	};
+
 #define PUT_BITS(bb, ll) do { uint32_t b = bb, l = ll; assert((l) >= 0 && (l) <= 16); assert((b) < (1ULL << (l))); bit_buf |= (((uint64_t)(b)) << bit_buf_size); bit_buf_size += (l); assert(bit_buf_size <= 64); } while(0)
 #define PUT_BITS_CZ(bb, ll) do { uint32_t b = bb, l = ll; assert((l) >= 1 && (l) <= 16); assert((b) < (1ULL << (l))); bit_buf |= (((uint64_t)(b)) << bit_buf_size); bit_buf_size += (l); assert(bit_buf_size <= 64); } while(0)
 
@@ -587,6 +1245,107 @@ namespace fpng
 	} \
 } while(0)
 
+	enum
+	{
+		// Write the 2 byte zlib header before the block.
+		DEFL_ZLIB_HEADER = 1,
+		// Set the BFINAL bit. Non-final blocks are ended with a sync flush (an empty stored block), so the output is byte aligned and can be directly followed by the next block.
+		DEFL_FINAL_BLOCK = 2,
+		// Write the zlib Adler-32 of the block's uncompressed data after it.
+		DEFL_ZLIB_ADLER32 = 4,
+
+		DEFL_ZLIB_STREAM = DEFL_ZLIB_HEADER | DEFL_FINAL_BLOCK | DEFL_ZLIB_ADLER32
+	};
+
+	// How much new compressed output is gathered before it's folded into the running CRC-32. Small enough that it's still in the L1 cache.
+	const uint32_t DEFL_CRC32_FOLD_SIZE = 8192;
+
+	// Told that the output up to ofs is final. ofs going back to 0 means the output is about to be rewritten from the start.
+	typedef void (*defl_output_func)(uint32_t ofs, void* pUser_data);
+
+	// The PNG chunk CRC-32 of a compressed stream, folded in as the output is written instead of in another pass over the whole stream afterwards.
+	// m_crc32 covers pDst[0, m_ofs), where pDst is the start of the output buffer given to the compressor. Bytes before the compressor's dst_ofs are final.
+	// If m_pOutput_func isn't nullptr, it's called after each fold, so the final output can be written out while the rest is compressed.
+	struct defl_output_crc32
+	{
+		uint32_t m_crc32;
+		uint32_t m_ofs;
+		defl_output_func m_pOutput_func;
+		void* m_pOutput_user_data;
+
+		defl_output_crc32(uint32_t crc32 = FPNG_CRC32_INIT, uint32_t ofs = 0, defl_output_func pOutput_func = nullptr, void* pOutput_user_data = nullptr) : 
+			m_crc32(crc32), m_ofs(ofs), m_pOutput_func(pOutput_func), m_pOutput_user_data(pOutput_user_data) { }
+
+		inline void update(const uint8_t* pDst, uint32_t dst_ofs)
+		{
+			assert(dst_ofs >= m_ofs);
+			m_crc32 = fpng_crc32(pDst + m_ofs, dst_ofs - m_ofs, m_crc32);
+			m_ofs = dst_ofs;
+
+			if (m_pOutput_func)
+				m_pOutput_func(m_ofs, m_pOutput_user_data);
+		}
+
+		inline void update_if_full(const uint8_t* pDst, uint32_t dst_ofs)
+		{
+			if ((dst_ofs - m_ofs) >= DEFL_CRC32_FOLD_SIZE)
+				update(pDst, dst_ofs);
+		}
+	};
+
+	// Copies one of the precomputed zlib header+dynamic block prefixes to pDst, honoring block_flags. Returns the number of whole bytes written, or 0 on failure.
+	static uint32_t defl_write_prefix(const uint8_t* pPrefix, uint32_t prefix_size, uint32_t block_flags, uint8_t* pDst, uint32_t dst_buf_size)
+	{
+		assert(prefix_size > 2);
+
+		// The first 2 bytes are the zlib header, and bit 0 of the 3rd byte is BFINAL.
+		const uint32_t skip = (block_flags & DEFL_ZLIB_HEADER) ? 0 : 2;
+		if (dst_buf_size < prefix_size - skip)
+			return 0;
+
+		memcpy(pDst, pPrefix + skip, prefix_size - skip);
+		if ((block_flags & DEFL_FINAL_BLOCK) == 0)
+			pDst[2 - skip] &= ~1;
+
+		return prefix_size - skip;
+	}
+
+	// Flushes the bit buffer after a block's end of block code, then writes a sync flush or the zlib Adler-32 as requested.
+	static bool defl_finish_block(uint8_t* pDst, uint32_t& dst_ofs, uint32_t dst_buf_size, uint64_t bit_buf, int bit_buf_size, uint32_t block_flags, uint32_t src_adler32)
+	{
+		if ((block_flags & DEFL_FINAL_BLOCK) == 0)
+		{
+			// Empty stored block: BFINAL=0, BTYPE=0, pad to a byte, LEN=0, NLEN=0xFFFF
+			PUT_BITS(0, 3);
+			PUT_BITS_FORCE_FLUSH;
+
+			if ((dst_ofs + 4) > dst_buf_size)
+				return false;
+			WRITE_LE32(pDst + dst_ofs, 0xFFFF0000);
+			dst_ofs += 4;
+		}
+		else
+		{
+			PUT_BITS_FORCE_FLUSH;
+		}
+
+		if (block_flags & DEFL_ZLIB_ADLER32)
+		{
+			// Write zlib adler32
+			for (uint32_t i = 0; i < 4; i++)
+			{
+				if ((dst_ofs + 1) > dst_buf_size)
+					return false;
+				*(uint8_t*)(pDst + dst_ofs) = (uint8_t)(src_adler32 >> 24);
+				dst_ofs++;
+
+				src_adler32 <<= 8;
+			}
+		}
+
+		return true;
+	}
+
 	enum
 	{
 		DEFL_MAX_HUFF_TABLES = 3,
@@ -815,24 +1574,326 @@ do { \
 		return true;
 	}
 
-	static uint32_t write_raw_block(const uint8_t* pSrc, uint32_t src_len, uint8_t* pDst, uint32_t dst_buf_size)
+	// Returns a buffer of at least n elements. The vector only ever grows, so a reused scratch buffer stops allocating once it's large enough.
+	template<typename T>
+	static inline T* get_scratch_buf(std::vector<T>& buf, size_t n)
 	{
-		if (dst_buf_size < 2)
-			return 0;
+		if (buf.size() < n)
+			buf.resize(n);
+		return buf.data();
+	}
+
+	// Converts a row of w pixels between the layout of fpng_encode_params::m_src_format or fpng_decode_params::m_dst_format and the file's.
+	typedef void (*pixel_convert_func)(const uint8_t* pSrc, uint8_t* pDst, uint32_t w);
+
+	// Returns (c * a) / 255, rounded.
+	static inline uint32_t mul_div_255(uint32_t c, uint32_t a)
+	{
+		const uint32_t t = c * a + 128;
+		return (t + (t >> 8)) >> 8;
+	}
+
+	// A pixel in memory is mem_bpp bytes, with its R, G and B at r_ofs, g_ofs and b_ofs, and its alpha (or unused byte) at a_ofs. The file's pixels are RGB or RGBA (file_chans).
+	// If to_file is true the row is converted from memory to the file's layout, dividing premultiplied colors by alpha. Otherwise the file's pixels are converted to memory, 
+	// setting unused bytes to 255 and multiplying the colors by alpha if premultiplied is true.
+	template<bool to_file, uint32_t mem_bpp, uint32_t r_ofs, uint32_t g_ofs, uint32_t b_ofs, uint32_t a_ofs, uint32_t file_chans, bool premultiplied>
+	static void convert_pixels(const uint8_t* pSrc, uint8_t* pDst, uint32_t w)
+	{
+		const uint32_t src_bpp = to_file ? mem_bpp : file_chans, dst_bpp = to_file ? file_chans : mem_bpp;
+
+		for (uint32_t x = 0; x < w; x++, pSrc += src_bpp, pDst += dst_bpp)
+		{
+			uint32_t r, g, b, a = 255;
+			if (to_file)
+			{
+				r = pSrc[r_ofs];
+				g = pSrc[g_ofs];
+				b = pSrc[b_ofs];
+				if (file_chans == 4)
+					a = pSrc[a_ofs];
+			}
+			else
+			{
+				r = pSrc[0];
+				g = pSrc[1];
+				b = pSrc[2];
+				if (file_chans == 4)
+					a = pSrc[3];
+			}
+
+			if ((premultiplied) && (a != 255))
+			{
+				if (!to_file)
+				{
+					r = mul_div_255(r, a);
+					g = mul_div_255(g, a);
+					b = mul_div_255(b, a);
+				}
+				else if (!a)
+					r = g = b = 0;
+				else
+				{
+					r = minimum<uint32_t>(255, (r * 255 + (a >> 1)) / a);
+					g = minimum<uint32_t>(255, (g * 255 + (a >> 1)) / a);
+					b = minimum<uint32_t>(255, (b * 255 + (a >> 1)) / a);
+				}
+			}
+
+			if (to_file)
+			{
+				pDst[0] = (uint8_t)r;
+				pDst[1] = (uint8_t)g;
+				pDst[2] = (uint8_t)b;
+				if (file_chans == 4)
+					pDst[3] = (uint8_t)a;
+			}
+			else
+			{
+				pDst[r_ofs] = (uint8_t)r;
+				pDst[g_ofs] = (uint8_t)g;
+				pDst[b_ofs] = (uint8_t)b;
+				if (mem_bpp == 4)
+					pDst[a_ofs] = (uint8_t)a;
+			}
+		}
+	}
+
+	// Looks up a FPNG_PIXEL_FORMAT_* format (default_chans is the caller's num_chans or desired_channels, for FPNG_PIXEL_FORMAT_DEFAULT): its number of channels in the file, 
+	// its bytes per pixel in memory, and the function converting its rows to (to_file) or from the file's layout, which is nullptr if they're the same.
+	// Returns false if the format isn't valid, or is premultiplied without alpha.
+	template<bool to_file>
+	static bool get_pixel_format(uint32_t format, uint32_t default_chans, uint32_t& file_chans, uint32_t& mem_bpp, pixel_convert_func& pConvert)
+	{
+		const bool premultiplied = (format & FPNG_PIXEL_FORMAT_PREMULTIPLIED) != 0;
+		
+		pConvert = nullptr;
+
+#define FPNG_PIXEL_FORMAT_CASE(fmt, bpp, r_ofs, g_ofs, b_ofs, a_ofs, chans) \
+		case fmt: \
+			file_chans = chans; \
+			mem_bpp = bpp; \
+			if (premultiplied) \
+				pConvert = convert_pixels<to_file, bpp, r_ofs, g_ofs, b_ofs, a_ofs, chans, true>; \
+			else \
+				pConvert = convert_pixels<to_file, bpp, r_ofs, g_ofs, b_ofs, a_ofs, chans, false>; \
+			break;
+
+		switch (format & ~FPNG_PIXEL_FORMAT_PREMULTIPLIED)
+		{
+		case FPNG_PIXEL_FORMAT_DEFAULT:
+			if (!premultiplied)
+			{
+				file_chans = default_chans;
+				mem_bpp = default_chans;
+				return true;
+			}
+			if (default_chans != 4)
+				return false;
+			file_chans = 4;
+			mem_bpp = 4;
+			pConvert = convert_pixels<to_file, 4, 0, 1, 2, 3, 4, true>;
+			break;
+		FPNG_PIXEL_FORMAT_CASE(FPNG_PIXEL_FORMAT_BGR, 3, 2, 1, 0, 0, 3)
+		FPNG_PIXEL_FORMAT_CASE(FPNG_PIXEL_FORMAT_BGRA, 4, 2, 1, 0, 3, 4)
+		FPNG_PIXEL_FORMAT_CASE(FPNG_PIXEL_FORMAT_ARGB, 4, 1, 2, 3, 0, 4)
+		FPNG_PIXEL_FORMAT_CASE(FPNG_PIXEL_FORMAT_ABGR, 4, 3, 2, 1, 0, 4)
+		FPNG_PIXEL_FORMAT_CASE(FPNG_PIXEL_FORMAT_RGBX, 4, 0, 1, 2, 3, 3)
+		FPNG_PIXEL_FORMAT_CASE(FPNG_PIXEL_FORMAT_BGRX, 4, 2, 1, 0, 3, 3)
+		FPNG_PIXEL_FORMAT_CASE(FPNG_PIXEL_FORMAT_XRGB, 4, 1, 2, 3, 0, 3)
+		FPNG_PIXEL_FORMAT_CASE(FPNG_PIXEL_FORMAT_XBGR, 4, 3, 2, 1, 0, 3)
+		default:
+			return false;
+		}
+
+#undef FPNG_PIXEL_FORMAT_CASE
+
+		return (!premultiplied) || (file_chans == 4);
+	}
+
+	// Called by encode_row_reader with every row it reads (in the file's layout), including rows read more than once or out of order.
+	typedef void (*encode_row_func)(const uint8_t* pRow, uint32_t y, void* pUser_data);
+
+	// The rows of an image being encoded: m_pitch bytes apart from m_pImg, at m_ppRows[y], or copied into a row buffer by m_pRead_row (as row m_first_row + y, and m_pitch is the size of a row).
+	// If m_pConvert isn't nullptr, they're in the layout of fpng_encode_params::m_src_format and must be converted to the file's.
+	// If m_pRow_func isn't nullptr, it sees each row the compressors read, see encode_row_func.
+	struct encode_source
+	{
+		const uint8_t* m_pImg;
+		size_t m_pitch;
+		uint32_t m_w;
+		pixel_convert_func m_pConvert;
+		encode_row_func m_pRow_func;
+		void* m_pRow_user_data;
+		const uint8_t* const* m_ppRows;
+		fpng_read_row_func m_pRead_row;
+		void* m_pRead_row_user_data;
+		uint32_t m_first_row;
+
+		encode_source(const uint8_t* pImg, size_t pitch, uint32_t w, pixel_convert_func pConvert = nullptr, encode_row_func pRow_func = nullptr, void* pRow_user_data = nullptr) : 
+			m_pImg(pImg), m_pitch(pitch), m_w(w), m_pConvert(pConvert), m_pRow_func(pRow_func), m_pRow_user_data(pRow_user_data), 
+			m_ppRows(nullptr), m_pRead_row(nullptr), m_pRead_row_user_data(nullptr), m_first_row(0) { }
+
+		// The rows from first_row on. They're renumbered, so m_pRow_func isn't kept.
+		encode_source from_row(uint32_t first_row) const 
+		{ 
+			encode_source src(*this);
+			if (m_ppRows)
+				src.m_ppRows += first_row;
+			else if (!m_pRead_row)
+				src.m_pImg += (size_t)first_row * m_pitch;
+			src.m_first_row += first_row;
+			src.m_pRow_func = nullptr;
+			src.m_pRow_user_data = nullptr;
+			return src;
+		}
+
+		// Whether the rows aren't in memory in the file's layout, so they have to be read into row buffers.
+		bool is_buffered() const { return (m_pConvert != nullptr) || (m_pRead_row != nullptr); }
+
+		const uint8_t* get_row(uint32_t y) const { return m_ppRows ? m_ppRows[y] : (m_pImg + (size_t)y * m_pitch); }
+	};
+
+	// Reads the rows of an encode_source for the compressors. Rows which need converting or reading are put into one of two row buffers of bpl bytes, which also keeps the row above 
+	// the last one read for the filters, so no copy of the image is ever made. Reading the rows in order converts each row once.
+	class encode_row_reader
+	{
+	public:
+		encode_row_reader(const encode_source& src, std::vector<uint8_t>& bufs, uint32_t bpl) : m_src(src), m_pRead_buf(nullptr)
+		{
+			m_row_index[0] = UINT32_MAX;
+			m_row_index[1] = UINT32_MAX;
+			m_pBufs[0] = nullptr;
+			m_pBufs[1] = nullptr;
+
+			if (src.is_buffered())
+			{
+				// Rows which are read and then converted are read into a third buffer.
+				const size_t read_buf_size = (src.m_pConvert && src.m_pRead_row) ? src.m_pitch : 0;
+				m_pBufs[0] = get_scratch_buf(bufs, (size_t)bpl * 2 + read_buf_size);
+				m_pBufs[1] = m_pBufs[0] + bpl;
+				if (read_buf_size)
+					m_pRead_buf = m_pBufs[1] + bpl;
+			}
+		}
+
+		// Rows which are already in memory in the file's layout don't need the buffers.
+		explicit encode_row_reader(const encode_source& src) : m_src(src), m_pRead_buf(nullptr)
+		{
+			assert(!src.is_buffered());
+			m_pBufs[0] = nullptr;
+			m_pBufs[1] = nullptr;
+			m_row_index[0] = UINT32_MAX;
+			m_row_index[1] = UINT32_MAX;
+		}
 
-		pDst[0] = 0x78;
-		pDst[1] = 0x01;
+		const uint8_t* row(uint32_t y)
+		{
+			const uint8_t* pRow = read_row(y);
+			if (m_src.m_pRow_func)
+				m_src.m_pRow_func(pRow, y, m_src.m_pRow_user_data);
+			return pRow;
+		}
+
+		// Returns row y, and the row above it in pPrev_row (nullptr for row 0).
+		const uint8_t* row(uint32_t y, const uint8_t*& pPrev_row)
+		{
+			pPrev_row = y ? row(y - 1) : nullptr;
+			return row(y);
+		}
+
+	private:
+		encode_source m_src;
+		uint8_t* m_pBufs[2];
+		uint8_t* m_pRead_buf;
+		uint32_t m_row_index[2];
+
+		const uint8_t* read_row(uint32_t y)
+		{
+			if (!m_src.is_buffered())
+				return m_src.get_row(y);
+
+			if (m_row_index[0] == y)
+				return m_pBufs[0];
+			if (m_row_index[1] == y)
+				return m_pBufs[1];
+
+			// Keep the row above this one.
+			const uint32_t i = (m_row_index[0] == (y - 1)) ? 1 : 0;
+			if (!m_src.m_pRead_row)
+				m_src.m_pConvert(m_src.get_row(y), m_pBufs[i], m_src.m_w);
+			else if (!m_src.m_pConvert)
+				m_src.m_pRead_row(m_src.m_first_row + y, m_pBufs[i], m_src.m_pRead_row_user_data);
+			else
+			{
+				m_src.m_pRead_row(m_src.m_first_row + y, m_pRead_buf, m_src.m_pRead_row_user_data);
+				m_src.m_pConvert(m_pRead_buf, m_pBufs[i], m_src.m_w);
+			}
+			m_row_index[i] = y;
+			return m_pBufs[i];
+		}
+	};
+
+	// Copies n bytes of a row starting at byte ofs (which can split a 16-bit sample, at the end of a raw block). If samples16 is true, the row's native endian 16-bit samples are 
+	// swapped to big endian, like PNG stores them.
+	static inline void write_samples(uint8_t* pDst, const uint8_t* pRow, uint32_t ofs, uint32_t n, bool samples16)
+	{
+#if __BYTE_ORDER == __LITTLE_ENDIAN
+		if (samples16)
+		{
+			for (uint32_t i = 0; i < n; i++)
+				pDst[i] = pRow[(ofs + i) ^ 1];
+			return;
+		}
+#else
+		(void)samples16;
+#endif
+		memcpy(pDst, pRow + ofs, n);
+	}
+
+	// The size of the zlib stream written by write_raw_block().
+	static uint64_t get_raw_zlib_size(uint32_t w, uint32_t h, uint32_t bpp)
+	{
+		const uint64_t raw_len = (uint64_t)(w * bpp + 1) * h;
+		return 6 + raw_len + ((raw_len + 65534) / 65535) * 5;
+	}
+
+	// Writes the image's rows (read from rows) using filter 0 as uncompressed Deflate blocks. The 0 filter bytes are inserted while copying, so no temporary copy of the image is needed.
+	// bpp is the number of bytes per pixel in the file. If samples16 is true, the image's native endian 16-bit samples are written big endian.
+	// block_flags works like it does for the compressors: without DEFL_FINAL_BLOCK (a strip), the last block isn't marked final, and if pAdler32 isn't nullptr 
+	// the Adler-32 of the filtered rows is returned there instead of being written. The output always ends on a byte boundary.
+	// If pOut_crc32 isn't nullptr, each block is folded into it right after it's written.
+	static uint32_t write_raw_block(encode_row_reader& rows, uint32_t w, uint32_t h, uint32_t bpp, uint8_t* pDst, uint32_t dst_buf_size, 
+		uint32_t block_flags = DEFL_ZLIB_STREAM, uint32_t* pAdler32 = nullptr, defl_output_crc32* pOut_crc32 = nullptr, bool samples16 = false, fpng_encode_stats* pStats = nullptr)
+	{
+		(void)pStats;
+		FPNG_STATS_ONLY(encode_stats_timer timer(pStats);)
+
+		uint32_t dst_ofs = 0;
+
+		if (block_flags & DEFL_ZLIB_HEADER)
+		{
+			if (dst_buf_size < 2)
+				return 0;
 
-		uint32_t dst_ofs = 2;
+			pDst[0] = 0x78;
+			pDst[1] = 0x01;
+			dst_ofs = 2;
+		}
+
+		const uint32_t src_bpl = w * bpp, bpl = src_bpl + 1;
+		const uint64_t src_len = (uint64_t)bpl * h;
 
-		uint32_t src_ofs = 0;
+		uint32_t src_adler32 = FPNG_ADLER32_INIT;
+
+		uint64_t src_ofs = 0;
+		uint32_t x = 0, y = 0;
 		while (src_ofs < src_len)
 		{
-			const uint32_t src_remaining = src_len - src_ofs;
-			const uint32_t block_size = minimum<uint32_t>(UINT16_MAX, src_remaining);
-			const bool final_block = (block_size == src_remaining);
+			const uint64_t src_remaining = src_len - src_ofs;
+			const uint32_t block_size = (uint32_t)minimum<uint64_t>(UINT16_MAX, src_remaining);
+			const bool final_block = (block_size == src_remaining) && ((block_flags & DEFL_FINAL_BLOCK) != 0);
 
-			if ((dst_ofs + 5 + block_size) > dst_buf_size)
+			if (((uint64_t)dst_ofs + 5 + block_size) > dst_buf_size)
 				return 0;
 
 			pDst[dst_ofs + 0] = final_block ? 1 : 0;
@@ -843,23 +1904,61 @@ do { \
 			pDst[dst_ofs + 3] = (~block_size) & 0xFF;
 			pDst[dst_ofs + 4] = ((~block_size) >> 8) & 0xFF;
 
-			memcpy(pDst + dst_ofs + 5, pSrc + src_ofs, block_size);
+			uint8_t* pBlock = pDst + dst_ofs + 5;
+			for (uint32_t bytes_left = block_size; bytes_left; )
+			{
+				if (!x)
+				{
+					// filter byte
+					*pBlock++ = 0;
+					x = 1;
+					bytes_left--;
+					continue;
+				}
+
+				const uint32_t n = minimum(bytes_left, bpl - x);
+				write_samples(pBlock, rows.row(y), x - 1, n, samples16);
+				pBlock += n;
+				bytes_left -= n;
+
+				if ((x += n) == bpl)
+				{
+					x = 0;
+					y++;
+				}
+			}
+
+			FPNG_STATS_ONLY(timer.lap(&fpng_encode_stats::m_entropy_ns);)
+
+			src_adler32 = fpng_adler32(pDst + dst_ofs + 5, block_size, src_adler32);
+
+			FPNG_STATS_ONLY(timer.lap(&fpng_encode_stats::m_adler32_ns);)
 
 			src_ofs += block_size;
 			dst_ofs += 5 + block_size;
+
+			if (pOut_crc32)
+				pOut_crc32->update(pDst, dst_ofs);
+
+			FPNG_STATS_ONLY(timer.lap(&fpng_encode_stats::m_crc32_ns);)
 		}
 
-		uint32_t src_adler32 = fpng_adler32(pSrc, src_len, FPNG_ADLER32_INIT);
+		if (pAdler32)
+		{
+			*pAdler32 = src_adler32;
+			return dst_ofs;
+		}
 
-		for (uint32_t i = 0; i < 4; i++)
+		if (block_flags & DEFL_ZLIB_ADLER32)
 		{
-			if (dst_ofs + 1 > dst_buf_size)
+			if (dst_ofs + 4 > dst_buf_size)
 				return 0;
 
-			pDst[dst_ofs] = (uint8_t)(src_adler32 >> 24);
-			dst_ofs++;
+			for (uint32_t i = 0; i < 4; i++, src_adler32 <<= 8)
+				pDst[dst_ofs++] = (uint8_t)(src_adler32 >> 24);
 
-			src_adler32 <<= 8;
+			if (pOut_crc32)
+				pOut_crc32->update(pDst, dst_ofs);
 		}
 
 		return dst_ofs;
@@ -906,6 +2005,23 @@ do { \
 		}
 	}
 
+	// Ensures all valid Deflate literal/EOB/length syms the one pass compressor can emit are non-zero, so anything can be coded.
+	static void defl_add_one_pass_syms(uint32_t* pLit_freq, uint32_t num_chans)
+	{
+		for (uint32_t i = 0; i <= 256; i++)
+		{
+			if (!pLit_freq[i])
+				pLit_freq[i] = 1;
+		}
+
+		for (uint32_t len = num_chans; len <= DEFL_MAX_MATCH_LEN; len += num_chans)
+		{
+			uint32_t sym = g_defl_len_sym[len - 3];
+			if (!pLit_freq[sym])
+				pLit_freq[sym] = 1;
+		}
+	}
+
 #if FPNG_TRAIN_HUFFMAN_TABLES
 	bool create_dynamic_block_prefix(uint64_t* pFreq, uint32_t num_chans, std::vector<uint8_t>& prefix, uint64_t& bit_buf, int &bit_buf_size, uint32_t* pCodes, uint8_t* pCodesizes)
 	{
@@ -939,19 +2055,7 @@ do { \
 			shift_len++;
 		}
 				
-		// Ensure all valid Deflate literal/EOB/length syms are non-zero, so anything can be coded.
-		for (uint32_t i = 0; i <= 256; i++)
-		{
-			if (!lit_freq[i])
-				lit_freq[i] = 1;
-		}
-
-		for (uint32_t len = num_chans; len <= DEFL_MAX_MATCH_LEN; len += num_chans)
-		{
-			uint32_t sym = g_defl_len_sym[len - 3];
-			if (!lit_freq[sym])
-				lit_freq[sym] = 1;
-		}
+		defl_add_one_pass_syms(lit_freq, num_chans);
 
 		adjust_freq32(DEFL_MAX_HUFF_SYMBOLS_0, lit_freq, &dh.m_huff_count[0][0]);
 		
@@ -987,60 +2091,459 @@ do { \
 	}
 #endif
 
-	static uint32_t pixel_deflate_dyn_3_rle(
-		const uint8_t* pImg, uint32_t w, uint32_t h,
-		uint8_t* pDst, uint32_t dst_buf_size)
+#if FPNG_AVX2_SUPPORTED
+	static FPNG_AVX2_FUNC void up_filter_avx2(uint8_t* pDst, const uint8_t* pSrc, const uint8_t* pPrev_src, uint32_t n)
 	{
-		const uint32_t bpl = 1 + w * 3;
-
-		uint64_t bit_buf = 0;
-		int bit_buf_size = 0;
-
-		uint32_t dst_ofs = 0;
+		uint32_t ofs = 0;
+		for (; n >= 64; n -= 64, ofs += 64)
+		{
+			_mm256_storeu_si256((__m256i*)(pDst + ofs), _mm256_sub_epi8(_mm256_loadu_si256((const __m256i*)(pSrc + ofs)), _mm256_loadu_si256((const __m256i*)(pPrev_src + ofs))));
+			_mm256_storeu_si256((__m256i*)(pDst + ofs + 32), _mm256_sub_epi8(_mm256_loadu_si256((const __m256i*)(pSrc + ofs + 32)), _mm256_loadu_si256((const __m256i*)(pPrev_src + ofs + 32))));
+		}
 
-		// zlib header
-		PUT_BITS(0x78, 8);
-		PUT_BITS(0x01, 8);
+		if (n >= 32)
+		{
+			_mm256_storeu_si256((__m256i*)(pDst + ofs), _mm256_sub_epi8(_mm256_loadu_si256((const __m256i*)(pSrc + ofs)), _mm256_loadu_si256((const __m256i*)(pPrev_src + ofs))));
+			n -= 32;
+			ofs += 32;
+		}
 
-		// write BFINAL bit
-		PUT_BITS(1, 1);
+		for (; n; n--, ofs++)
+			pDst[ofs] = (uint8_t)(pSrc[ofs] - pPrev_src[ofs]);
+	}
 
-		std::vector<uint32_t> codes((w + 1) * h);
-		uint32_t* pDst_codes = codes.data();
+	// Returns how many bytes past pRun (up to max_len, rounded down to a multiple of num_chans) continue the run of pixels ending at pRun.
+	// Compares each byte against the byte one pixel earlier, 32 at a time. Never reads past pRun + max_len.
+	static FPNG_AVX2_FUNC uint32_t find_run_len_avx2(const uint8_t* pRun, uint32_t max_len, uint32_t num_chans)
+	{
+		uint32_t len = 0;
+		while ((len + 32) <= max_len)
+		{
+			const uint32_t eq_mask = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(pRun + len)), _mm256_loadu_si256((const __m256i*)(pRun + len - num_chans))));
+			if (eq_mask != 0xFFFFFFFF)
+			{
+#ifdef _MSC_VER
+				unsigned long first_mismatch;
+				_BitScanForward(&first_mismatch, ~eq_mask);
+				len += first_mismatch;
+#else
+				len += (uint32_t)__builtin_ctz(~eq_mask);
+#endif
+				return len - (len % num_chans);
+			}
+			len += 32 - (32 % num_chans);
+		}
 
-		uint32_t lit_freq[DEFL_MAX_HUFF_SYMBOLS_0];
-		memset(lit_freq, 0, sizeof(lit_freq));
-		
-		const uint8_t* pSrc = pImg;
-		uint32_t src_ofs = 0;
+		for (; (len + num_chans) <= max_len; len += num_chans)
+			if (memcmp(pRun + len, pRun + len - num_chans, num_chans) != 0)
+				break;
 
-		uint32_t src_adler32 = fpng_adler32(pImg, bpl * h, FPNG_ADLER32_INIT);
+		return len;
+	}
+#endif
 
-		const uint32_t dist_sym = g_defl_small_dist_sym[3 - 1];
-				
-		for (uint32_t y = 0; y < h; y++)
+#if FPNG_NEON_SUPPORTED
+	// NEON version of find_run_len_avx2(), 16 bytes at a time.
+	static inline uint32_t find_run_len_neon(const uint8_t* pRun, uint32_t max_len, uint32_t num_chans)
+	{
+		uint32_t len = 0;
+		while ((len + 16) <= max_len)
 		{
-			const uint32_t end_src_ofs = src_ofs + bpl;
-
-			const uint32_t filter_lit = pSrc[src_ofs++];
-			*pDst_codes++ = 1 | (filter_lit << 8);
-			lit_freq[filter_lit]++;
-
-			uint32_t prev_lits;
+			const uint8x16_t eq = vceqq_u8(vld1q_u8(pRun + len), vld1q_u8(pRun + len - num_chans));
 
+			// Narrow the byte compare results to 4 bits per byte
+			const uint64_t eq_mask = vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(eq), 4)), 0);
+			if (eq_mask != UINT64_MAX)
 			{
-				uint32_t lits = READ_RGB_PIXEL(pSrc + src_ofs);
+#ifdef _MSC_VER
+				unsigned long first_mismatch;
+				_BitScanForward64(&first_mismatch, ~eq_mask);
+				len += (uint32_t)first_mismatch >> 2;
+#else
+				len += (uint32_t)__builtin_ctzll(~eq_mask) >> 2;
+#endif
+				return len - (len % num_chans);
+			}
+			len += 16 - (16 % num_chans);
+		}
 
-				*pDst_codes++ = lits << 8;
+		for (; (len + num_chans) <= max_len; len += num_chans)
+			if (memcmp(pRun + len, pRun + len - num_chans, num_chans) != 0)
+				break;
 
-				lit_freq[lits & 0xFF]++;
-				lit_freq[(lits >> 8) & 0xFF]++;
-				lit_freq[lits >> 16]++;
+		return len;
+	}
+#endif
 
-				src_ofs += 3;
+	// The PNG Paeth predictor: a is the byte to the left, b the one above, and c the one above and to the left.
+	static inline uint32_t paeth_predictor(uint32_t a, uint32_t b, uint32_t c)
+	{
+		const int p = (int)a + (int)b - (int)c;
+		const int pa = (p > (int)a) ? (p - (int)a) : ((int)a - p);
+		const int pb = (p > (int)b) ? (p - (int)b) : ((int)b - p);
+		const int pc = (p > (int)c) ? (p - (int)c) : ((int)c - p);
+
+		if ((pa <= pb) && (pa <= pc))
+			return a;
+		if (pb <= pc)
+			return b;
+		return c;
+	}
 
-				prev_lits = lits;
-			}
+	// Returns byte i of a row filtered with filter 0-4. num_chans is the distance to the byte to the left. pPrev_src is the row above, which can only be nullptr for None and Sub.
+	static inline uint8_t filter_byte(uint32_t filter, uint32_t num_chans, const uint8_t* pSrc, const uint8_t* pPrev_src, uint32_t i)
+	{
+		const uint32_t a = (i >= num_chans) ? pSrc[i - num_chans] : 0;
+
+		switch (filter)
+		{
+		case 1: return (uint8_t)(pSrc[i] - a);
+		case 2: return (uint8_t)(pSrc[i] - pPrev_src[i]);
+		case 3: return (uint8_t)(pSrc[i] - ((a + pPrev_src[i]) >> 1));
+		case 4: return (uint8_t)(pSrc[i] - paeth_predictor(a, pPrev_src[i], (i >= num_chans) ? pPrev_src[i - num_chans] : 0));
+		default: break;
+		}
+
+		return pSrc[i];
+	}
+
+	static inline uint32_t signed_byte_magnitude(uint8_t v)
+	{
+		const int s = (int8_t)v;
+		return (s < 0) ? -s : s;
+	}
+
+#if FPNG_X86_OR_X64_CPU && !FPNG_NO_SSE
+	static inline uint64_t sum_epi64_sse41(__m128i v)
+	{
+		uint64_t lanes[2];
+		_mm_storeu_si128((__m128i*)lanes, v);
+		return lanes[0] + lanes[1];
+	}
+
+	// The Paeth predictor of 8 16-bit lanes.
+	static inline __m128i paeth_predictor_sse41(__m128i a, __m128i b, __m128i c)
+	{
+		const __m128i b_minus_c = _mm_sub_epi16(b, c), a_minus_c = _mm_sub_epi16(a, c);
+		
+		// pa=|p-a|=|b-c|, pb=|p-b|=|a-c|, pc=|p-c|=|(b-c)+(a-c)|
+		const __m128i pa = _mm_abs_epi16(b_minus_c), pb = _mm_abs_epi16(a_minus_c), pc = _mm_abs_epi16(_mm_add_epi16(b_minus_c, a_minus_c));
+		const __m128i smallest = _mm_min_epi16(pc, _mm_min_epi16(pa, pb));
+
+		// Ties go to a, then b, like the scalar predictor.
+		return _mm_blendv_epi8(_mm_blendv_epi8(c, b, _mm_cmpeq_epi16(smallest, pb)), a, _mm_cmpeq_epi16(smallest, pa));
+	}
+
+	// Filters the 16 bytes at ofs with filter 1, 3 or 4. ofs must be at least num_chans, so the bytes to the left are all in the row.
+	static inline __m128i filter_16_sse41(uint32_t filter, uint32_t num_chans, const uint8_t* pSrc, const uint8_t* pPrev_src, uint32_t ofs)
+	{
+		const __m128i x = _mm_loadu_si128((const __m128i*)(pSrc + ofs)), a = _mm_loadu_si128((const __m128i*)(pSrc + ofs - num_chans));
+		if (filter == 1)
+			return _mm_sub_epi8(x, a);
+
+		const __m128i b = _mm_loadu_si128((const __m128i*)(pPrev_src + ofs));
+		if (filter == 3)
+		{
+			// _mm_avg_epu8() rounds up, PNG's average rounds down.
+			const __m128i avg = _mm_sub_epi8(_mm_avg_epu8(a, b), _mm_and_si128(_mm_xor_si128(a, b), _mm_set1_epi8(1)));
+			return _mm_sub_epi8(x, avg);
+		}
+
+		const __m128i c = _mm_loadu_si128((const __m128i*)(pPrev_src + ofs - num_chans)), z = _mm_setzero_si128();
+		const __m128i pred_lo = paeth_predictor_sse41(_mm_unpacklo_epi8(a, z), _mm_unpacklo_epi8(b, z), _mm_unpacklo_epi8(c, z));
+		const __m128i pred_hi = paeth_predictor_sse41(_mm_unpackhi_epi8(a, z), _mm_unpackhi_epi8(b, z), _mm_unpackhi_epi8(c, z));
+		return _mm_sub_epi8(x, _mm_packus_epi16(pred_lo, pred_hi));
+	}
+#endif
+
+	// Estimates how well a row will compress with a filter, using the usual PNG heuristic: the sum of the filtered bytes' magnitudes as signed values.
+	static uint64_t get_filter_cost(uint32_t filter, uint32_t n, uint32_t num_chans, const uint8_t* pSrc, const uint8_t* pPrev_src)
+	{
+		uint64_t cost = 0;
+		uint32_t ofs = 0;
+
+#if FPNG_X86_OR_X64_CPU && !FPNG_NO_SSE
+		if ((filter != 0) && (filter != 2) && (g_cpu_info.can_use_sse41()))
+		{
+			for (; ofs < num_chans; ofs++)
+				cost += signed_byte_magnitude(filter_byte(filter, num_chans, pSrc, pPrev_src, ofs));
+
+			__m128i sum = _mm_setzero_si128();
+			for (; (ofs + 16) <= n; ofs += 16)
+				sum = _mm_add_epi64(sum, _mm_sad_epu8(_mm_abs_epi8(filter_16_sse41(filter, num_chans, pSrc, pPrev_src, ofs)), _mm_setzero_si128()));
+
+			cost += sum_epi64_sse41(sum);
+		}
+		else if (g_cpu_info.can_use_sse41())
+		{
+			__m128i sum = _mm_setzero_si128();
+			for (; (ofs + 16) <= n; ofs += 16)
+			{
+				__m128i r = _mm_loadu_si128((const __m128i*)(pSrc + ofs));
+				if (filter == 2)
+					r = _mm_sub_epi8(r, _mm_loadu_si128((const __m128i*)(pPrev_src + ofs)));
+				sum = _mm_add_epi64(sum, _mm_sad_epu8(_mm_abs_epi8(r), _mm_setzero_si128()));
+			}
+
+			cost += sum_epi64_sse41(sum);
+		}
+#endif
+
+		for (; ofs < n; ofs++)
+			cost += signed_byte_magnitude(filter_byte(filter, num_chans, pSrc, pPrev_src, ofs));
+
+		return cost;
+	}
+
+	// FPNG_ENCODE_ADAPTIVE_FILTERS: returns the filter with the lowest estimated cost for a row. The first row of the image (or of a strip) can only use None or Sub.
+	// Up is tried first and wins ties, because the decoder undoes it while decoding instead of in a separate pass.
+	static uint32_t choose_filter(uint32_t w, uint32_t num_chans, const uint8_t* pSrc, const uint8_t* pPrev_src)
+	{
+		const uint32_t n = w * num_chans;
+
+		if (!pPrev_src)
+			return (get_filter_cost(1, n, num_chans, pSrc, nullptr) < get_filter_cost(0, n, num_chans, pSrc, nullptr)) ? 1 : 0;
+
+		uint32_t best_filter = 2;
+		uint64_t best_cost = get_filter_cost(2, n, num_chans, pSrc, pPrev_src);
+
+		static const uint8_t s_other_filters[3] = { 1, 4, 3 };
+		for (uint32_t i = 0; (i < 3) && (best_cost); i++)
+		{
+			const uint64_t cost = get_filter_cost(s_other_filters[i], n, num_chans, pSrc, pPrev_src);
+			if (cost < best_cost)
+			{
+				best_cost = cost;
+				best_filter = s_other_filters[i];
+			}
+		}
+
+		return best_filter;
+	}
+
+	static void apply_filter(uint32_t filter, int w, int h, uint32_t num_chans, uint32_t bpl, const uint8_t* pSrc, const uint8_t* pPrev_src, uint8_t* pDst)
+	{
+		(void)h;
+
+		switch (filter)
+		{
+		case 0:
+		{
+			*pDst++ = 0;
+
+			memcpy(pDst, pSrc, bpl);
+			break;
+		}
+		case 2:
+		{
+			assert(pPrev_src);
+
+			// Previous scanline
+			*pDst++ = 2;
+
+#if FPNG_AVX2_SUPPORTED
+			if (g_cpu_info.can_use_avx2())
+				up_filter_avx2(pDst, pSrc, pPrev_src, w * num_chans);
+			else
+#endif
+#if FPNG_X86_OR_X64_CPU && !FPNG_NO_SSE
+			if (g_cpu_info.can_use_sse41())
+			{
+				uint32_t bytes_to_process = w * num_chans, ofs = 0;
+				for (; bytes_to_process >= 16; bytes_to_process -= 16, ofs += 16)
+					_mm_storeu_si128((__m128i*)(pDst + ofs), _mm_sub_epi8(_mm_loadu_si128((const __m128i*)(pSrc + ofs)), _mm_loadu_si128((const __m128i*)(pPrev_src + ofs))));
+
+				for (; bytes_to_process; bytes_to_process--, ofs++)
+					pDst[ofs] = (uint8_t)(pSrc[ofs] - pPrev_src[ofs]);
+			}
+			else
+#endif
+#if FPNG_NEON_SUPPORTED
+			{
+				uint32_t bytes_to_process = w * num_chans, ofs = 0;
+				for (; bytes_to_process >= 32; bytes_to_process -= 32, ofs += 32)
+				{
+					vst1q_u8(pDst + ofs, vsubq_u8(vld1q_u8(pSrc + ofs), vld1q_u8(pPrev_src + ofs)));
+					vst1q_u8(pDst + ofs + 16, vsubq_u8(vld1q_u8(pSrc + ofs + 16), vld1q_u8(pPrev_src + ofs + 16)));
+				}
+
+				for (; bytes_to_process; bytes_to_process--, ofs++)
+					pDst[ofs] = (uint8_t)(pSrc[ofs] - pPrev_src[ofs]);
+			}
+#else
+			{
+				if (num_chans == 3)
+				{
+					for (uint32_t x = 0; x < (uint32_t)w; x++)
+					{
+						pDst[0] = (uint8_t)(pSrc[0] - pPrev_src[0]);
+						pDst[1] = (uint8_t)(pSrc[1] - pPrev_src[1]);
+						pDst[2] = (uint8_t)(pSrc[2] - pPrev_src[2]);
+
+						pSrc += 3;
+						pPrev_src += 3;
+						pDst += 3;
+					}
+				}
+				else if (num_chans == 4)
+				{
+					for (uint32_t x = 0; x < (uint32_t)w; x++)
+					{
+						pDst[0] = (uint8_t)(pSrc[0] - pPrev_src[0]);
+						pDst[1] = (uint8_t)(pSrc[1] - pPrev_src[1]);
+						pDst[2] = (uint8_t)(pSrc[2] - pPrev_src[2]);
+						pDst[3] = (uint8_t)(pSrc[3] - pPrev_src[3]);
+
+						pSrc += 4;
+						pPrev_src += 4;
+						pDst += 4;
+					}
+				}
+				else
+				{
+					// Grayscale, gray+alpha and 16-bit pixels
+					for (uint32_t i = 0; i < w * num_chans; i++)
+						pDst[i] = (uint8_t)(pSrc[i] - pPrev_src[i]);
+				}
+			}
+#endif
+
+			break;
+		}
+		case 1:
+		case 3:
+		case 4:
+		{
+			// Sub, Average or Paeth, only used with FPNG_ENCODE_ADAPTIVE_FILTERS.
+			assert(pPrev_src || (filter == 1));
+
+			*pDst++ = (uint8_t)filter;
+
+			const uint32_t n = w * num_chans;
+			
+			// The first pixel has nothing to its left.
+			uint32_t ofs = 0;
+			for (; ofs < minimum(num_chans, n); ofs++)
+				pDst[ofs] = filter_byte(filter, num_chans, pSrc, pPrev_src, ofs);
+
+#if FPNG_X86_OR_X64_CPU && !FPNG_NO_SSE
+			if (g_cpu_info.can_use_sse41())
+			{
+				for (; (ofs + 16) <= n; ofs += 16)
+					_mm_storeu_si128((__m128i*)(pDst + ofs), filter_16_sse41(filter, num_chans, pSrc, pPrev_src, ofs));
+			}
+#endif
+
+			for (; ofs < n; ofs++)
+				pDst[ofs] = filter_byte(filter, num_chans, pSrc, pPrev_src, ofs);
+
+			break;
+		}
+		default:
+			assert(0);
+			break;
+		}
+	}
+
+	// A symbol parsed by pixel_deflate_dyn_lz().
+	struct lz_code
+	{
+		// If m_len is 0, m_dist (1-4) literal bytes in m_lits, otherwise a match of m_len bytes at distance m_dist bytes.
+		uint32_t m_lits;
+		uint16_t m_len;
+		uint16_t m_dist;
+	};
+
+	// The compressors' temporary buffers, kept by fpng_encode_context between calls.
+	struct encode_scratch
+	{
+		std::vector<uint8_t> m_row_buf, m_swapped_rows, m_src_rows;
+		std::vector<uint32_t> m_codes32;
+		std::vector<uint64_t> m_codes64;
+		std::vector<lz_code> m_lz_codes;
+		std::vector<uint32_t> m_hash_head, m_hash_row, m_hash_prev;
+
+		// Where the compressors add their timings and counts, or nullptr.
+		fpng_encode_stats* m_pStats;
+
+		encode_scratch() : m_pStats(nullptr) { }
+	};
+
+	static uint32_t pixel_deflate_dyn_3_rle(encode_scratch& scratch,
+		const encode_source& src, uint32_t w, uint32_t h,
+		uint8_t* pDst, uint32_t dst_buf_size, uint32_t block_flags = DEFL_ZLIB_STREAM, uint32_t* pAdler32 = nullptr, defl_output_crc32* pOut_crc32 = nullptr, bool adaptive_filters = false)
+	{
+		const uint32_t bpl = 1 + w * 3;
+
+		uint64_t bit_buf = 0;
+		int bit_buf_size = 0;
+
+		uint32_t dst_ofs = 0;
+
+		// zlib header
+		if (block_flags & DEFL_ZLIB_HEADER)
+		{
+			PUT_BITS(0x78, 8);
+			PUT_BITS(0x01, 8);
+		}
+
+		// write BFINAL bit
+		PUT_BITS((block_flags & DEFL_FINAL_BLOCK) ? 1 : 0, 1);
+
+		uint32_t* pCodes = get_scratch_buf(scratch.m_codes32, (size_t)(w + 1) * h);
+		uint32_t* pDst_codes = pCodes;
+
+		uint32_t lit_freq[DEFL_MAX_HUFF_SYMBOLS_0];
+		memset(lit_freq, 0, sizeof(lit_freq));
+		
+		const uint32_t src_bpl = bpl - 1;
+
+		// Each row is Up filtered into this small buffer right before it's compressed (padded because the pixel reads can go a few bytes past the end).
+		uint8_t* pRow_buf = get_scratch_buf(scratch.m_row_buf, bpl + 8);
+		const uint8_t* pSrc = pRow_buf;
+
+		uint32_t src_adler32 = FPNG_ADLER32_INIT;
+
+		const uint32_t dist_sym = g_defl_small_dist_sym[3 - 1];
+
+		FPNG_STATS_ONLY(encode_stats_timer timer(scratch.m_pStats); code_counts counts;)
+
+		encode_row_reader src_rows(src, scratch.m_src_rows, src_bpl);
+
+		for (uint32_t y = 0; y < h; y++)
+		{
+			const uint8_t* pPrev_src_row;
+			const uint8_t* pSrc_row = src_rows.row(y, pPrev_src_row);
+			apply_filter(adaptive_filters ? choose_filter(w, 3, pSrc_row, pPrev_src_row) : (y ? 2 : 0), w, h, 3, src_bpl, pSrc_row, pPrev_src_row, pRow_buf);
+
+			FPNG_STATS_ONLY(timer.lap(&fpng_encode_stats::m_filter_ns);)
+
+			src_adler32 = fpng_adler32(pSrc, bpl, src_adler32);
+
+			FPNG_STATS_ONLY(timer.lap(&fpng_encode_stats::m_adler32_ns);)
+
+			uint32_t src_ofs = 0;
+			const uint32_t end_src_ofs = bpl;
+
+			const uint32_t filter_lit = pSrc[src_ofs++];
+			*pDst_codes++ = 1 | (filter_lit << 8);
+			lit_freq[filter_lit]++;
+
+			uint32_t prev_lits;
+
+			{
+				uint32_t lits = READ_RGB_PIXEL(pSrc + src_ofs);
+
+				*pDst_codes++ = lits << 8;
+
+				lit_freq[lits & 0xFF]++;
+				lit_freq[(lits >> 8) & 0xFF]++;
+				lit_freq[lits >> 16]++;
+
+				src_ofs += 3;
+
+				prev_lits = lits;
+			}
 
 			while (src_ofs < end_src_ofs)
 			{
@@ -1081,11 +2584,12 @@ do { \
 
 			} // while (src_ofs < end_src_ofs)
 
+			FPNG_STATS_ONLY(timer.lap(&fpng_encode_stats::m_entropy_ns);)
+
 		} // y
 
-		assert(src_ofs == h * bpl);
-		const uint32_t total_codes = (uint32_t)(pDst_codes - codes.data());
-		assert(total_codes <= codes.size());
+		const uint32_t total_codes = (uint32_t)(pDst_codes - pCodes);
+		assert(total_codes <= scratch.m_codes32.size());
 								
 		defl_huff dh;
 		
@@ -1105,11 +2609,13 @@ do { \
 				
 		for (uint32_t i = 0; i < total_codes; i++)
 		{
-			uint32_t c = codes[i];
+			uint32_t c = pCodes[i];
 
 			uint32_t c_type = c & 0xFF;
 			if (c_type == 0)
 			{
+				FPNG_STATS_ONLY(counts.m_lits += 3;)
+
 				uint32_t lits = c >> 8;
 
 				PUT_BITS_CZ(dh.m_huff_codes[0][lits & 0xFF], dh.m_huff_code_sizes[0][lits & 0xFF]);
@@ -1122,12 +2628,15 @@ do { \
 			}
 			else if (c_type == 1)
 			{
+				FPNG_STATS_ONLY(counts.m_lits++;)
+
 				uint32_t lit = c >> 8;
 				PUT_BITS_CZ(dh.m_huff_codes[0][lit], dh.m_huff_code_sizes[0][lit]);
 			}
 			else
 			{
 				uint32_t match_len = c_type + 1;
+				FPNG_STATS_ONLY(counts.add_match(match_len);)
 
 				uint32_t adj_match_len = match_len - 3;
 				
@@ -1140,64 +2649,87 @@ do { \
 
 			// up to 55 bits
 			PUT_BITS_FLUSH;
+
+			if ((pOut_crc32) && ((i & 1023) == 1023))
+			{
+				FPNG_STATS_ONLY(timer.lap(&fpng_encode_stats::m_entropy_ns);)
+				pOut_crc32->update_if_full(pDst, dst_ofs);
+				FPNG_STATS_ONLY(timer.lap(&fpng_encode_stats::m_crc32_ns);)
+			}
 		}
 
 		PUT_BITS_CZ(dh.m_huff_codes[0][256], dh.m_huff_code_sizes[0][256]);
 
-		PUT_BITS_FORCE_FLUSH;
+		if (pAdler32)
+			*pAdler32 = src_adler32;
 
-		// Write zlib adler32
-		for (uint32_t i = 0; i < 4; i++)
-		{
-			if ((dst_ofs + 1) > dst_buf_size)
-				return 0;
-			*(uint8_t*)(pDst + dst_ofs) = (uint8_t)(src_adler32 >> 24);
-			dst_ofs++;
+		if (!defl_finish_block(pDst, dst_ofs, dst_buf_size, bit_buf, bit_buf_size, block_flags, src_adler32))
+			return 0;
 
-			src_adler32 <<= 8;
-		}
+		FPNG_STATS_ONLY(timer.lap(&fpng_encode_stats::m_entropy_ns);)
+
+		if (pOut_crc32)
+			pOut_crc32->update(pDst, dst_ofs);
+
+		FPNG_STATS_ONLY(timer.lap(&fpng_encode_stats::m_crc32_ns); counts.flush(scratch.m_pStats); record_stats_table(scratch.m_pStats, FPNG_STATS_TABLE_DYNAMIC);)
 
 		return dst_ofs;
 	}
 
-	static uint32_t pixel_deflate_dyn_3_rle_one_pass(
-		const uint8_t* pImg, uint32_t w, uint32_t h,
-		uint8_t* pDst, uint32_t dst_buf_size)
+	// Codes num_rows source rows (read from src_rows) using the precomputed one pass Huffman table, Up filtering each row into pRow_buf (bpl+8 bytes) first.
+	// pPrev_row is the row above the first row, or nullptr at the top of the image. The output offset, bit buffer and Adler-32 are carried across calls.
+	// If pOut_crc32 isn't nullptr, the output is folded into it every DEFL_CRC32_FOLD_SIZE bytes or so. With FPNG_STATS, the timings and code counts are added to pStats if it isn't nullptr.
+	static bool pixel_deflate_rows_3_one_pass(
+		encode_row_reader& src_rows, uint32_t w, uint32_t num_rows, const uint8_t* pPrev_row, uint8_t* pRow_buf,
+		uint8_t* pDst, uint32_t& cur_dst_ofs, uint32_t dst_buf_size, uint64_t& cur_bit_buf, int& cur_bit_buf_size, uint32_t& src_adler32, const defl_huff_code* pCodes, defl_output_crc32* pOut_crc32, bool adaptive_filters, fpng_encode_stats* pStats = nullptr)
 	{
 		const uint32_t bpl = 1 + w * 3;
+		const uint32_t src_bpl = bpl - 1;
+		const uint8_t* pSrc = pRow_buf;
 
-		if (dst_buf_size < sizeof(g_dyn_huff_3))
-			return false;
-		memcpy(pDst, g_dyn_huff_3, sizeof(g_dyn_huff_3));
-		uint32_t dst_ofs = sizeof(g_dyn_huff_3);
-
-		uint64_t bit_buf = DYN_HUFF_3_BITBUF;
-		int bit_buf_size = DYN_HUFF_3_BITBUF_SIZE;
+		uint32_t dst_ofs = cur_dst_ofs;
+		uint64_t bit_buf = cur_bit_buf;
+		int bit_buf_size = cur_bit_buf_size;
 
-		const uint8_t* pSrc = pImg;
-		uint32_t src_ofs = 0;
+		(void)pStats;
+		FPNG_STATS_ONLY(encode_stats_timer timer(pStats); code_counts counts;)
 
-		uint32_t src_adler32 = fpng_adler32(pImg, bpl * h, FPNG_ADLER32_INIT);
+#if FPNG_AVX2_SUPPORTED
+		const bool use_avx2 = g_cpu_info.can_use_avx2();
+#endif
 
-		for (uint32_t y = 0; y < h; y++)
+		for (uint32_t y = 0; y < num_rows; y++)
 		{
-			const uint32_t end_src_ofs = src_ofs + bpl;
+			const uint8_t* pPrev_src_row = y ? src_rows.row(y - 1) : pPrev_row;
+			const uint8_t* pSrc_row = src_rows.row(y);
+			apply_filter(adaptive_filters ? choose_filter(w, 3, pSrc_row, pPrev_src_row) : (pPrev_src_row ? 2 : 0), w, num_rows, 3, src_bpl, pSrc_row, pPrev_src_row, pRow_buf);
+
+			FPNG_STATS_ONLY(timer.lap(&fpng_encode_stats::m_filter_ns);)
+
+			src_adler32 = fpng_adler32(pSrc, bpl, src_adler32);
+
+			FPNG_STATS_ONLY(timer.lap(&fpng_encode_stats::m_adler32_ns);)
+
+			uint32_t src_ofs = 0;
+			const uint32_t end_src_ofs = bpl;
 
 			const uint32_t filter_lit = pSrc[src_ofs++];
-			PUT_BITS_CZ(g_dyn_huff_3_codes[filter_lit].m_code, g_dyn_huff_3_codes[filter_lit].m_code_size);
+			PUT_BITS_CZ(pCodes[filter_lit].m_code, pCodes[filter_lit].m_code_size);
 
 			uint32_t prev_lits;
 
 			{
 				uint32_t lits = READ_RGB_PIXEL(pSrc + src_ofs);
 
-				PUT_BITS_CZ(g_dyn_huff_3_codes[lits & 0xFF].m_code, g_dyn_huff_3_codes[lits & 0xFF].m_code_size);
-				PUT_BITS_CZ(g_dyn_huff_3_codes[(lits >> 8) & 0xFF].m_code, g_dyn_huff_3_codes[(lits >> 8) & 0xFF].m_code_size);
-				PUT_BITS_CZ(g_dyn_huff_3_codes[(lits >> 16)].m_code, g_dyn_huff_3_codes[(lits >> 16)].m_code_size);
+				PUT_BITS_CZ(pCodes[lits & 0xFF].m_code, pCodes[lits & 0xFF].m_code_size);
+				PUT_BITS_CZ(pCodes[(lits >> 8) & 0xFF].m_code, pCodes[(lits >> 8) & 0xFF].m_code_size);
+				PUT_BITS_CZ(pCodes[(lits >> 16)].m_code, pCodes[(lits >> 16)].m_code_size);
 
 				src_ofs += 3;
-			
+				
 				prev_lits = lits;
+
+				FPNG_STATS_ONLY(counts.m_lits += 1 + 3;)
 			}
 
 			PUT_BITS_FLUSH;
@@ -1216,20 +2748,39 @@ do { \
 						if (READ_RGB_PIXEL(pSrc + src_ofs + match_len) != lits)
 							break;
 						match_len += 3;
+
+#if FPNG_AVX2_SUPPORTED
+						// Most runs are short, so only switch to SIMD once this one is 4 pixels long.
+						if ((match_len == 12) && (use_avx2))
+						{
+							match_len += find_run_len_avx2(pSrc + src_ofs + match_len, max_match_len - match_len, 3);
+							break;
+						}
+#elif FPNG_NEON_SUPPORTED
+						if (match_len == 12)
+						{
+							match_len += find_run_len_neon(pSrc + src_ofs + match_len, max_match_len - match_len, 3);
+							break;
+						}
+#endif
 					}
 										
 					uint32_t adj_match_len = match_len - 3;
 
-					PUT_BITS_CZ(g_dyn_huff_3_codes[g_defl_len_sym[adj_match_len]].m_code, g_dyn_huff_3_codes[g_defl_len_sym[adj_match_len]].m_code_size);
+					FPNG_STATS_ONLY(counts.add_match(match_len);)
+
+					PUT_BITS_CZ(pCodes[g_defl_len_sym[adj_match_len]].m_code, pCodes[g_defl_len_sym[adj_match_len]].m_code_size);
 					PUT_BITS(adj_match_len & g_bitmasks[g_defl_len_extra[adj_match_len]], g_defl_len_extra[adj_match_len] + 1); // up to 6 bits, +1 for the match distance Huff code which is always 0
 
 					src_ofs += match_len;
 				}
 				else
 				{
-					PUT_BITS_CZ(g_dyn_huff_3_codes[lits & 0xFF].m_code, g_dyn_huff_3_codes[lits & 0xFF].m_code_size);
-					PUT_BITS_CZ(g_dyn_huff_3_codes[(lits >> 8) & 0xFF].m_code, g_dyn_huff_3_codes[(lits >> 8) & 0xFF].m_code_size);
-					PUT_BITS_CZ(g_dyn_huff_3_codes[(lits >> 16)].m_code, g_dyn_huff_3_codes[(lits >> 16)].m_code_size);
+					FPNG_STATS_ONLY(counts.m_lits += 3;)
+
+					PUT_BITS_CZ(pCodes[lits & 0xFF].m_code, pCodes[lits & 0xFF].m_code_size);
+					PUT_BITS_CZ(pCodes[(lits >> 8) & 0xFF].m_code, pCodes[(lits >> 8) & 0xFF].m_code_size);
+					PUT_BITS_CZ(pCodes[(lits >> 16)].m_code, pCodes[(lits >> 16)].m_code_size);
 					
 					prev_lits = lits;
 
@@ -1240,33 +2791,69 @@ do { \
 
 			} // while (src_ofs < end_src_ofs)
 
-		} // y
+			FPNG_STATS_ONLY(timer.lap(&fpng_encode_stats::m_entropy_ns);)
 
-		assert(src_ofs == h * bpl);
-		
-		assert(bit_buf_size <= 7);
+			if (pOut_crc32)
+				pOut_crc32->update_if_full(pDst, dst_ofs);
 
-		PUT_BITS_CZ(g_dyn_huff_3_codes[256].m_code, g_dyn_huff_3_codes[256].m_code_size);
+			FPNG_STATS_ONLY(timer.lap(&fpng_encode_stats::m_crc32_ns);)
 
-		PUT_BITS_FORCE_FLUSH;
+		} // y
 
-		// Write zlib adler32
-		for (uint32_t i = 0; i < 4; i++)
-		{
-			if ((dst_ofs + 1) > dst_buf_size)
-				return 0;
-			*(uint8_t*)(pDst + dst_ofs) = (uint8_t)(src_adler32 >> 24);
-			dst_ofs++;
+		FPNG_STATS_ONLY(counts.flush(pStats);)
 
-			src_adler32 <<= 8;
-		}
+		cur_dst_ofs = dst_ofs;
+		cur_bit_buf = bit_buf;
+		cur_bit_buf_size = bit_buf_size;
 
-		return dst_ofs;
+		return true;
 	}
 
-	static uint32_t pixel_deflate_dyn_4_rle(
-		const uint8_t* pImg, uint32_t w, uint32_t h,
-		uint8_t* pDst, uint32_t dst_buf_size)
+	static uint32_t pixel_deflate_dyn_3_rle_one_pass(encode_scratch& scratch,
+		const encode_source& src, uint32_t w, uint32_t h,
+		uint8_t* pDst, uint32_t dst_buf_size, uint32_t block_flags = DEFL_ZLIB_STREAM, uint32_t* pAdler32 = nullptr, defl_output_crc32* pOut_crc32 = nullptr, bool adaptive_filters = false, const defl_huff_preset& preset = g_dyn_huff_3_presets[0])
+	{
+		const uint32_t bpl = 1 + w * 3;
+
+		uint32_t dst_ofs = defl_write_prefix(preset.m_pPrefix, preset.m_prefix_size, block_flags, pDst, dst_buf_size);
+		if (!dst_ofs)
+			return 0;
+
+		uint64_t bit_buf = preset.m_bit_buf;
+		int bit_buf_size = preset.m_bit_buf_size;
+
+		// Each row is Up filtered into this small buffer right before it's compressed (padded because the pixel reads can go a few bytes past the end).
+		uint8_t* pRow_buf = get_scratch_buf(scratch.m_row_buf, bpl + 8);
+
+		uint32_t src_adler32 = FPNG_ADLER32_INIT;
+
+		encode_row_reader src_rows(src, scratch.m_src_rows, bpl - 1);
+		if (!pixel_deflate_rows_3_one_pass(src_rows, w, h, nullptr, pRow_buf, pDst, dst_ofs, dst_buf_size, bit_buf, bit_buf_size, src_adler32, preset.m_pCodes, pOut_crc32, adaptive_filters, scratch.m_pStats))
+			return 0;
+
+		assert(bit_buf_size <= 7);
+
+		PUT_BITS_CZ(preset.m_pCodes[256].m_code, preset.m_pCodes[256].m_code_size);
+
+		if (pAdler32)
+			*pAdler32 = src_adler32;
+
+		if (!defl_finish_block(pDst, dst_ofs, dst_buf_size, bit_buf, bit_buf_size, block_flags, src_adler32))
+			return 0;
+
+		FPNG_STATS_ONLY(encode_stats_timer timer(scratch.m_pStats, &fpng_encode_stats::m_crc32_ns);)
+
+		if (pOut_crc32)
+			pOut_crc32->update(pDst, dst_ofs);
+
+		FPNG_STATS_ONLY(record_stats_table(scratch.m_pStats, FPNG_STATS_TABLE_PRESET + (uint32_t)(&preset - g_dyn_huff_3_presets));)
+
+		return dst_ofs;
+	}
+
+	static uint32_t pixel_deflate_dyn_4_rle(encode_scratch& scratch,
+		const encode_source& src, uint32_t w, uint32_t h,
+		uint8_t* pDst, uint32_t dst_buf_size, uint32_t block_flags = DEFL_ZLIB_STREAM, uint32_t* pAdler32 = nullptr, defl_output_crc32* pOut_crc32 = nullptr, bool adaptive_filters = false)
 	{
 		const uint32_t bpl = 1 + w * 4;
 
@@ -1276,29 +2863,49 @@ do { \
 		uint32_t dst_ofs = 0;
 
 		// zlib header
-		PUT_BITS(0x78, 8);
-		PUT_BITS(0x01, 8);
+		if (block_flags & DEFL_ZLIB_HEADER)
+		{
+			PUT_BITS(0x78, 8);
+			PUT_BITS(0x01, 8);
+		}
 
 		// write BFINAL bit
-		PUT_BITS(1, 1);
+		PUT_BITS((block_flags & DEFL_FINAL_BLOCK) ? 1 : 0, 1);
 
-		std::vector<uint64_t> codes;
-		codes.resize((w + 1) * h);
-		uint64_t* pDst_codes = codes.data();
+		uint64_t* pCodes = get_scratch_buf(scratch.m_codes64, (size_t)(w + 1) * h);
+		uint64_t* pDst_codes = pCodes;
 
 		uint32_t lit_freq[DEFL_MAX_HUFF_SYMBOLS_0];
 		memset(lit_freq, 0, sizeof(lit_freq));
 
-		const uint8_t* pSrc = pImg;
-		uint32_t src_ofs = 0;
+		const uint32_t src_bpl = bpl - 1;
+
+		// Each row is Up filtered into this small buffer right before it's compressed (padded because the pixel reads can go a few bytes past the end).
+		uint8_t* pRow_buf = get_scratch_buf(scratch.m_row_buf, bpl + 8);
+		const uint8_t* pSrc = pRow_buf;
 
-		uint32_t src_adler32 = fpng_adler32(pImg, bpl * h, FPNG_ADLER32_INIT);
+		uint32_t src_adler32 = FPNG_ADLER32_INIT;
 
 		const uint32_t dist_sym = g_defl_small_dist_sym[4 - 1];
 
+		FPNG_STATS_ONLY(encode_stats_timer timer(scratch.m_pStats); code_counts counts;)
+
+		encode_row_reader src_rows(src, scratch.m_src_rows, src_bpl);
+
 		for (uint32_t y = 0; y < h; y++)
 		{
-			const uint32_t end_src_ofs = src_ofs + bpl;
+			const uint8_t* pPrev_src_row;
+			const uint8_t* pSrc_row = src_rows.row(y, pPrev_src_row);
+			apply_filter(adaptive_filters ? choose_filter(w, 4, pSrc_row, pPrev_src_row) : (y ? 2 : 0), w, h, 4, src_bpl, pSrc_row, pPrev_src_row, pRow_buf);
+
+			FPNG_STATS_ONLY(timer.lap(&fpng_encode_stats::m_filter_ns);)
+
+			src_adler32 = fpng_adler32(pSrc, bpl, src_adler32);
+
+			FPNG_STATS_ONLY(timer.lap(&fpng_encode_stats::m_adler32_ns);)
+
+			uint32_t src_ofs = 0;
+			const uint32_t end_src_ofs = bpl;
 
 			const uint32_t filter_lit = pSrc[src_ofs++];
 			*pDst_codes++ = 1 | (filter_lit << 8);
@@ -1360,11 +2967,12 @@ do { \
 
 			} // while (src_ofs < end_src_ofs)
 
+			FPNG_STATS_ONLY(timer.lap(&fpng_encode_stats::m_entropy_ns);)
+
 		} // y
 
-		assert(src_ofs == h * bpl);
-		const uint32_t total_codes = (uint32_t)(pDst_codes - codes.data());
-		assert(total_codes <= codes.size());
+		const uint32_t total_codes = (uint32_t)(pDst_codes - pCodes);
+		assert(total_codes <= scratch.m_codes64.size());
 						
 		defl_huff dh;
 		
@@ -1384,11 +2992,13 @@ do { \
 
 		for (uint32_t i = 0; i < total_codes; i++)
 		{
-			uint64_t c = codes[i];
+			uint64_t c = pCodes[i];
 
 			uint32_t c_type = (uint32_t)(c & 0xFF);
 			if (c_type == 0)
 			{
+				FPNG_STATS_ONLY(counts.m_lits += 4;)
+
 				uint32_t lits = (uint32_t)(c >> 8);
 
 				PUT_BITS_CZ(dh.m_huff_codes[0][lits & 0xFF], dh.m_huff_code_sizes[0][lits & 0xFF]);
@@ -1409,12 +3019,15 @@ do { \
 			}
 			else if (c_type == 1)
 			{
+				FPNG_STATS_ONLY(counts.m_lits++;)
+
 				uint32_t lit = (uint32_t)(c >> 8);
 				PUT_BITS_CZ(dh.m_huff_codes[0][lit], dh.m_huff_code_sizes[0][lit]);
 			}
 			else
 			{
 				uint32_t match_len = c_type + 1;
+				FPNG_STATS_ONLY(counts.add_match(match_len);)
 
 				uint32_t adj_match_len = match_len - 3;
 				
@@ -1426,51 +3039,72 @@ do { \
 
 			// up to 55 bits
 			PUT_BITS_FLUSH;
+
+			if ((pOut_crc32) && ((i & 1023) == 1023))
+			{
+				FPNG_STATS_ONLY(timer.lap(&fpng_encode_stats::m_entropy_ns);)
+				pOut_crc32->update_if_full(pDst, dst_ofs);
+				FPNG_STATS_ONLY(timer.lap(&fpng_encode_stats::m_crc32_ns);)
+			}
 		}
 
 		PUT_BITS_CZ(dh.m_huff_codes[0][256], dh.m_huff_code_sizes[0][256]);
 
-		PUT_BITS_FORCE_FLUSH;
+		if (pAdler32)
+			*pAdler32 = src_adler32;
 
-		// Write zlib adler32
-		for (uint32_t i = 0; i < 4; i++)
-		{
-			if ((dst_ofs + 1) > dst_buf_size)
-				return 0;
-			*(uint8_t*)(pDst + dst_ofs) = (uint8_t)(src_adler32 >> 24);
-			dst_ofs++;
+		if (!defl_finish_block(pDst, dst_ofs, dst_buf_size, bit_buf, bit_buf_size, block_flags, src_adler32))
+			return 0;
 
-			src_adler32 <<= 8;
-		}
+		FPNG_STATS_ONLY(timer.lap(&fpng_encode_stats::m_entropy_ns);)
+
+		if (pOut_crc32)
+			pOut_crc32->update(pDst, dst_ofs);
+
+		FPNG_STATS_ONLY(timer.lap(&fpng_encode_stats::m_crc32_ns); counts.flush(scratch.m_pStats); record_stats_table(scratch.m_pStats, FPNG_STATS_TABLE_DYNAMIC);)
 
 		return dst_ofs;
 	}
 
-	static uint32_t pixel_deflate_dyn_4_rle_one_pass(
-		const uint8_t* pImg, uint32_t w, uint32_t h,
-		uint8_t* pDst, uint32_t dst_buf_size)
+	// Codes num_rows source rows (read from src_rows) using the precomputed one pass Huffman table, Up filtering each row into pRow_buf (bpl+8 bytes) first.
+	// pPrev_row is the row above the first row, or nullptr at the top of the image. The output offset, bit buffer and Adler-32 are carried across calls.
+	// If pOut_crc32 isn't nullptr, the output is folded into it every DEFL_CRC32_FOLD_SIZE bytes or so. With FPNG_STATS, the timings and code counts are added to pStats if it isn't nullptr.
+	static bool pixel_deflate_rows_4_one_pass(
+		encode_row_reader& src_rows, uint32_t w, uint32_t num_rows, const uint8_t* pPrev_row, uint8_t* pRow_buf,
+		uint8_t* pDst, uint32_t& cur_dst_ofs, uint32_t dst_buf_size, uint64_t& cur_bit_buf, int& cur_bit_buf_size, uint32_t& src_adler32, const defl_huff_code* pCodes, defl_output_crc32* pOut_crc32, bool adaptive_filters, fpng_encode_stats* pStats = nullptr)
 	{
 		const uint32_t bpl = 1 + w * 4;
+		const uint32_t src_bpl = bpl - 1;
+		const uint8_t* pSrc = pRow_buf;
 
-		if (dst_buf_size < sizeof(g_dyn_huff_4))
-			return false;
-		memcpy(pDst, g_dyn_huff_4, sizeof(g_dyn_huff_4));
-		uint32_t dst_ofs = sizeof(g_dyn_huff_4);
-
-		uint64_t bit_buf = DYN_HUFF_4_BITBUF;
-		int bit_buf_size = DYN_HUFF_4_BITBUF_SIZE;
+		uint32_t dst_ofs = cur_dst_ofs;
+		uint64_t bit_buf = cur_bit_buf;
+		int bit_buf_size = cur_bit_buf_size;
 
-		const uint8_t* pSrc = pImg;
-		uint32_t src_ofs = 0;
+		(void)pStats;
+		FPNG_STATS_ONLY(encode_stats_timer timer(pStats); code_counts counts;)
 
-		uint32_t src_adler32 = fpng_adler32(pImg, bpl * h, FPNG_ADLER32_INIT);
+#if FPNG_AVX2_SUPPORTED
+		const bool use_avx2 = g_cpu_info.can_use_avx2();
+#endif
 
-		for (uint32_t y = 0; y < h; y++)
+		for (uint32_t y = 0; y < num_rows; y++)
 		{
-			const uint32_t end_src_ofs = src_ofs + bpl;
+			const uint8_t* pPrev_src_row = y ? src_rows.row(y - 1) : pPrev_row;
+			const uint8_t* pSrc_row = src_rows.row(y);
+			apply_filter(adaptive_filters ? choose_filter(w, 4, pSrc_row, pPrev_src_row) : (pPrev_src_row ? 2 : 0), w, num_rows, 4, src_bpl, pSrc_row, pPrev_src_row, pRow_buf);
+
+			FPNG_STATS_ONLY(timer.lap(&fpng_encode_stats::m_filter_ns);)
+
+			src_adler32 = fpng_adler32(pSrc, bpl, src_adler32);
+
+			FPNG_STATS_ONLY(timer.lap(&fpng_encode_stats::m_adler32_ns);)
+
+			uint32_t src_ofs = 0;
+			const uint32_t end_src_ofs = bpl;
 
 			const uint32_t filter_lit = pSrc[src_ofs++];
-			PUT_BITS_CZ(g_dyn_huff_4_codes[filter_lit].m_code, g_dyn_huff_4_codes[filter_lit].m_code_size);
+			PUT_BITS_CZ(pCodes[filter_lit].m_code, pCodes[filter_lit].m_code_size);
 
 			PUT_BITS_FLUSH;
 
@@ -1478,20 +3112,22 @@ do { \
 			{
 				uint32_t lits = READ_LE32(pSrc + src_ofs);
 
-				PUT_BITS_CZ(g_dyn_huff_4_codes[lits & 0xFF].m_code, g_dyn_huff_4_codes[lits & 0xFF].m_code_size);
-				PUT_BITS_CZ(g_dyn_huff_4_codes[(lits >> 8) & 0xFF].m_code, g_dyn_huff_4_codes[(lits >> 8) & 0xFF].m_code_size);
-				PUT_BITS_CZ(g_dyn_huff_4_codes[(lits >> 16) & 0xFF].m_code, g_dyn_huff_4_codes[(lits >> 16) & 0xFF].m_code_size);
+				PUT_BITS_CZ(pCodes[lits & 0xFF].m_code, pCodes[lits & 0xFF].m_code_size);
+				PUT_BITS_CZ(pCodes[(lits >> 8) & 0xFF].m_code, pCodes[(lits >> 8) & 0xFF].m_code_size);
+				PUT_BITS_CZ(pCodes[(lits >> 16) & 0xFF].m_code, pCodes[(lits >> 16) & 0xFF].m_code_size);
 
 				if (bit_buf_size >= 49)
 				{
 					PUT_BITS_FLUSH;
 				}
 				
-				PUT_BITS_CZ(g_dyn_huff_4_codes[(lits >> 24)].m_code, g_dyn_huff_4_codes[(lits >> 24)].m_code_size);
+				PUT_BITS_CZ(pCodes[(lits >> 24)].m_code, pCodes[(lits >> 24)].m_code_size);
 
 				src_ofs += 4;
 				
 				prev_lits = lits;
+
+				FPNG_STATS_ONLY(counts.m_lits += 1 + 4;)
 			}
 
 			PUT_BITS_FLUSH;
@@ -1510,24 +3146,41 @@ do { \
 						if (READ_LE32(pSrc + src_ofs + match_len) != lits)
 							break;
 						match_len += 4;
+
+#if FPNG_AVX2_SUPPORTED
+						// Most runs are short, so only switch to SIMD once this one is 4 pixels long.
+						if ((match_len == 16) && (use_avx2))
+						{
+							match_len += find_run_len_avx2(pSrc + src_ofs + match_len, max_match_len - match_len, 4);
+							break;
+						}
+#elif FPNG_NEON_SUPPORTED
+						if (match_len == 16)
+						{
+							match_len += find_run_len_neon(pSrc + src_ofs + match_len, max_match_len - match_len, 4);
+							break;
+						}
+#endif
 					}
 
 					uint32_t adj_match_len = match_len - 3;
 
-					const uint32_t match_code_bits = g_dyn_huff_4_codes[g_defl_len_sym[adj_match_len]].m_code_size;
+					const uint32_t match_code_bits = pCodes[g_defl_len_sym[adj_match_len]].m_code_size;
 					const uint32_t len_extra_bits = g_defl_len_extra[adj_match_len];
 
 					if (match_len == 4)
 					{
 						// This check is optional - see if just encoding 4 literals would be cheaper than using a short match.
-						uint32_t lit_bits = g_dyn_huff_4_codes[lits & 0xFF].m_code_size + g_dyn_huff_4_codes[(lits >> 8) & 0xFF].m_code_size + 
-							g_dyn_huff_4_codes[(lits >> 16) & 0xFF].m_code_size + g_dyn_huff_4_codes[(lits >> 24)].m_code_size;
+						uint32_t lit_bits = pCodes[lits & 0xFF].m_code_size + pCodes[(lits >> 8) & 0xFF].m_code_size + 
+							pCodes[(lits >> 16) & 0xFF].m_code_size + pCodes[(lits >> 24)].m_code_size;
 						
 						if ((match_code_bits + len_extra_bits + 1) > lit_bits)
 							goto do_literals;
 					}
 
-					PUT_BITS_CZ(g_dyn_huff_4_codes[g_defl_len_sym[adj_match_len]].m_code, match_code_bits);
+					FPNG_STATS_ONLY(counts.add_match(match_len);)
+
+					PUT_BITS_CZ(pCodes[g_defl_len_sym[adj_match_len]].m_code, match_code_bits);
 					PUT_BITS(adj_match_len & g_bitmasks[g_defl_len_extra[adj_match_len]], len_extra_bits + 1); // up to 6 bits, +1 for the match distance Huff code which is always 0
 
 					src_ofs += match_len;
@@ -1535,16 +3188,18 @@ do { \
 				else
 				{
 do_literals:
-					PUT_BITS_CZ(g_dyn_huff_4_codes[lits & 0xFF].m_code, g_dyn_huff_4_codes[lits & 0xFF].m_code_size);
-					PUT_BITS_CZ(g_dyn_huff_4_codes[(lits >> 8) & 0xFF].m_code, g_dyn_huff_4_codes[(lits >> 8) & 0xFF].m_code_size);
-					PUT_BITS_CZ(g_dyn_huff_4_codes[(lits >> 16) & 0xFF].m_code, g_dyn_huff_4_codes[(lits >> 16) & 0xFF].m_code_size);
+					FPNG_STATS_ONLY(counts.m_lits += 4;)
+
+					PUT_BITS_CZ(pCodes[lits & 0xFF].m_code, pCodes[lits & 0xFF].m_code_size);
+					PUT_BITS_CZ(pCodes[(lits >> 8) & 0xFF].m_code, pCodes[(lits >> 8) & 0xFF].m_code_size);
+					PUT_BITS_CZ(pCodes[(lits >> 16) & 0xFF].m_code, pCodes[(lits >> 16) & 0xFF].m_code_size);
 
 					if (bit_buf_size >= 49)
 					{
 						PUT_BITS_FLUSH;
 					}
 
-					PUT_BITS_CZ(g_dyn_huff_4_codes[(lits >> 24)].m_code, g_dyn_huff_4_codes[(lits >> 24)].m_code_size);
+					PUT_BITS_CZ(pCodes[(lits >> 24)].m_code, pCodes[(lits >> 24)].m_code_size);
 
 					src_ofs += 4;
 					
@@ -1555,26 +3210,62 @@ do_literals:
 
 			} // while (src_ofs < end_src_ofs)
 
+			FPNG_STATS_ONLY(timer.lap(&fpng_encode_stats::m_entropy_ns);)
+
+			if (pOut_crc32)
+				pOut_crc32->update_if_full(pDst, dst_ofs);
+
+			FPNG_STATS_ONLY(timer.lap(&fpng_encode_stats::m_crc32_ns);)
+
 		} // y
 
-		assert(src_ofs == h * bpl);
+		FPNG_STATS_ONLY(counts.flush(pStats);)
+
+		cur_dst_ofs = dst_ofs;
+		cur_bit_buf = bit_buf;
+		cur_bit_buf_size = bit_buf_size;
+
+		return true;
+	}
+
+	static uint32_t pixel_deflate_dyn_4_rle_one_pass(encode_scratch& scratch,
+		const encode_source& src, uint32_t w, uint32_t h,
+		uint8_t* pDst, uint32_t dst_buf_size, uint32_t block_flags = DEFL_ZLIB_STREAM, uint32_t* pAdler32 = nullptr, defl_output_crc32* pOut_crc32 = nullptr, bool adaptive_filters = false, const defl_huff_preset& preset = g_dyn_huff_4_presets[0])
+	{
+		const uint32_t bpl = 1 + w * 4;
+
+		uint32_t dst_ofs = defl_write_prefix(preset.m_pPrefix, preset.m_prefix_size, block_flags, pDst, dst_buf_size);
+		if (!dst_ofs)
+			return 0;
+
+		uint64_t bit_buf = preset.m_bit_buf;
+		int bit_buf_size = preset.m_bit_buf_size;
+
+		// Each row is Up filtered into this small buffer right before it's compressed (padded because the pixel reads can go a few bytes past the end).
+		uint8_t* pRow_buf = get_scratch_buf(scratch.m_row_buf, bpl + 8);
+
+		uint32_t src_adler32 = FPNG_ADLER32_INIT;
+
+		encode_row_reader src_rows(src, scratch.m_src_rows, bpl - 1);
+		if (!pixel_deflate_rows_4_one_pass(src_rows, w, h, nullptr, pRow_buf, pDst, dst_ofs, dst_buf_size, bit_buf, bit_buf_size, src_adler32, preset.m_pCodes, pOut_crc32, adaptive_filters, scratch.m_pStats))
+			return 0;
 
 		assert(bit_buf_size <= 7);
 
-		PUT_BITS_CZ(g_dyn_huff_4_codes[256].m_code, g_dyn_huff_4_codes[256].m_code_size);
+		PUT_BITS_CZ(preset.m_pCodes[256].m_code, preset.m_pCodes[256].m_code_size);
 
-		PUT_BITS_FORCE_FLUSH;
+		if (pAdler32)
+			*pAdler32 = src_adler32;
 
-		// Write zlib adler32
-		for (uint32_t i = 0; i < 4; i++)
-		{
-			if ((dst_ofs + 1) > dst_buf_size)
-				return 0;
-			*(uint8_t*)(pDst + dst_ofs) = (uint8_t)(src_adler32 >> 24);
-			dst_ofs++;
+		if (!defl_finish_block(pDst, dst_ofs, dst_buf_size, bit_buf, bit_buf_size, block_flags, src_adler32))
+			return 0;
 
-			src_adler32 <<= 8;
-		}
+		FPNG_STATS_ONLY(encode_stats_timer timer(scratch.m_pStats, &fpng_encode_stats::m_crc32_ns);)
+
+		if (pOut_crc32)
+			pOut_crc32->update(pDst, dst_ofs);
+
+		FPNG_STATS_ONLY(record_stats_table(scratch.m_pStats, FPNG_STATS_TABLE_PRESET + (uint32_t)(&preset - g_dyn_huff_4_presets));)
 
 		return dst_ofs;
 	}
@@ -1589,1558 +3280,5555 @@ do_literals:
 		}
 	}
 		
-	static void apply_filter(uint32_t filter, int w, int h, uint32_t num_chans, uint32_t bpl, const uint8_t* pSrc, const uint8_t* pPrev_src, uint8_t* pDst)
-	{
-		(void)h;
+	const uint32_t PNG_SIG_IHDR_SIZE = 33, PNG_IDAT_HEADER_SIZE = 8;
 
-		switch (filter)
-		{
-		case 0:
-		{
-			*pDst++ = 0;
+	// Our custom private, ancillary, do not copy, fdEC chunk (single block version)
+	static const uint8_t s_fdec_chunk_single_block[17] = { 0, 0, 0, 5, 'f', 'd', 'E', 'C', 82, 36, 147, 227, FPNG_FDEC_VERSION_SINGLE_BLOCK,   0xE5, 0xAB, 0x62, 0x99 };
 
-			memcpy(pDst, pSrc, bpl);
-			break;
-		}
-		case 2:
+	// Writes the PNG signature, the IHDR chunk, the fdEC chunk (if any), and the beginning of the IDAT chunk. Returns the number of bytes written.
+	static uint32_t write_png_header(uint8_t* pDst, uint32_t w, uint32_t h, uint32_t num_chans, uint32_t idat_len, const uint8_t* pFdec_chunk, uint32_t fdec_chunk_size, uint32_t bit_depth = 8)
+	{
+		static const uint8_t s_color_type[] = { 0x00, 0x00, 0x04, 0x02, 0x06 };
+
+		uint8_t pnghdr[41] = {
+			0x89,0x50,0x4e,0x47,0x0d,0x0a,0x1a,0x0a,   // PNG sig
+			0x00,0x00,0x00,0x0d, 'I','H','D','R',  // IHDR chunk len, type
+			(uint8_t)(w >> 24),(uint8_t)(w >> 16),(uint8_t)(w >> 8),(uint8_t)w, // width
+			(uint8_t)(h >> 24),(uint8_t)(h >> 16),(uint8_t)(h >> 8),(uint8_t)h, // height
+			(uint8_t)bit_depth,   //bit_depth
+			s_color_type[num_chans], // color_type
+			0, // compression
+			0, // filter
+			0, // interlace
+			0, 0, 0, 0, // IHDR crc32
+			(uint8_t)(idat_len >> 24),(uint8_t)(idat_len >> 16),(uint8_t)(idat_len >> 8),(uint8_t)idat_len, 'I','D','A','T' // IDATA chunk len, type
+		};
+
+		// Compute IHDR CRC32
+		uint32_t c = (uint32_t)fpng_crc32(pnghdr + 12, 17, FPNG_CRC32_INIT);
+		for (uint32_t i = 0; i < 4; ++i, c <<= 8)
+			((uint8_t*)(pnghdr + 29))[i] = (uint8_t)(c >> 24);
+
+		uint32_t ofs = PNG_SIG_IHDR_SIZE;
+		memcpy(pDst, pnghdr, ofs);
+
+		if (fdec_chunk_size)
 		{
-			assert(pPrev_src);
+			memcpy(pDst + ofs, pFdec_chunk, fdec_chunk_size);
+			ofs += fdec_chunk_size;
+		}
 
-			// Previous scanline
-			*pDst++ = 2;
+		memcpy(pDst + ofs, pnghdr + PNG_SIG_IHDR_SIZE, PNG_IDAT_HEADER_SIZE);
+		ofs += PNG_IDAT_HEADER_SIZE;
 
-#if FPNG_X86_OR_X64_CPU && !FPNG_NO_SSE
-			if (g_cpu_info.can_use_sse41())
-			{
-				uint32_t bytes_to_process = w * num_chans, ofs = 0;
-				for (; bytes_to_process >= 16; bytes_to_process -= 16, ofs += 16)
-					_mm_storeu_si128((__m128i*)(pDst + ofs), _mm_sub_epi8(_mm_loadu_si128((const __m128i*)(pSrc + ofs)), _mm_loadu_si128((const __m128i*)(pPrev_src + ofs))));
+		return ofs;
+	}
 
-				for (; bytes_to_process; bytes_to_process--, ofs++)
-					pDst[ofs] = (uint8_t)(pSrc[ofs] - pPrev_src[ofs]);
-			}
-			else
-#endif
-			{
-				if (num_chans == 3)
-				{
-					for (uint32_t x = 0; x < (uint32_t)w; x++)
-					{
-						pDst[0] = (uint8_t)(pSrc[0] - pPrev_src[0]);
-						pDst[1] = (uint8_t)(pSrc[1] - pPrev_src[1]);
-						pDst[2] = (uint8_t)(pSrc[2] - pPrev_src[2]);
+	// Appends the IDAT chunk's CRC32 (computed by the caller over the chunk's type and data) and the IEND chunk.
+	const uint32_t PNG_TRAILER_SIZE = 16;
 
-						pSrc += 3;
-						pPrev_src += 3;
-						pDst += 3;
-					}
-				}
-				else
-				{
-					for (uint32_t x = 0; x < (uint32_t)w; x++)
-					{
-						pDst[0] = (uint8_t)(pSrc[0] - pPrev_src[0]);
-						pDst[1] = (uint8_t)(pSrc[1] - pPrev_src[1]);
-						pDst[2] = (uint8_t)(pSrc[2] - pPrev_src[2]);
-						pDst[3] = (uint8_t)(pSrc[3] - pPrev_src[3]);
+	// Writes the IDAT CRC32, followed by the IEND chunk. Returns the number of bytes written (PNG_TRAILER_SIZE).
+	static uint32_t write_png_trailer(uint8_t* pDst, uint32_t idat_crc32)
+	{
+		memcpy(pDst, "\0\0\0\0\0\0\0\0\x49\x45\x4e\x44\xae\x42\x60\x82", PNG_TRAILER_SIZE);
 
-						pSrc += 4;
-						pPrev_src += 4;
-						pDst += 4;
-					}
-				}
-			}
+		for (uint32_t i = 0; i < 4; ++i, idat_crc32 <<= 8)
+			pDst[i] = (uint8_t)(idat_crc32 >> 24);
 
-			break;
-		}
-		default:
-			assert(0);
-			break;
-		}
+		return PNG_TRAILER_SIZE;
 	}
 
-	bool fpng_encode_image_to_memory(const void* pImage, uint32_t w, uint32_t h, uint32_t num_chans, std::vector<uint8_t>& out_buf, uint32_t flags)
+	// The in-memory encoders' offsets into their output are 32-bit, so their zlib streams are limited to a bit less than 4GB (leaving room for the "dst_ofs + n > dst_buf_size" checks).
+	const uint32_t MAX_ZLIB_BUF_SIZE = 0xFFFF0000;
+
+	static inline void write_be32(uint8_t* p, uint32_t v)
 	{
-		if (!endian_check())
-		{
-			assert(0);
-			return false;
-		}
+		p[0] = (uint8_t)(v >> 24);
+		p[1] = (uint8_t)(v >> 16);
+		p[2] = (uint8_t)(v >> 8);
+		p[3] = (uint8_t)v;
+	}
+
+	// The number of extra bytes needed to split zlib_len bytes of zlib data into IDAT chunks of at most FPNG_MAX_IDAT_CHUNK_SIZE bytes: a chunk header and CRC32 per extra chunk.
+	static uint64_t get_idat_split_overhead(uint64_t zlib_len)
+	{
+		return zlib_len ? ((zlib_len - 1) / FPNG_MAX_IDAT_CHUNK_SIZE) * (PNG_IDAT_HEADER_SIZE + sizeof(uint32_t)) : 0;
+	}
 
-		if ((w < 1) || (h < 1) || (w * (uint64_t)h > UINT32_MAX) || (w > FPNG_MAX_SUPPORTED_DIM) || (h > FPNG_MAX_SUPPORTED_DIM))
+	// Finishes a file whose zlib data has been written as a single IDAT chunk starting at pDst + idat_ofs, with the CRC32 idat_crc32, by writing the chunk's length, CRC32, and the IEND chunk.
+	// If the zlib data is longer than FPNG_MAX_IDAT_CHUNK_SIZE, it's split into several IDAT chunks in place, and each chunk's CRC32 is recomputed. pDst must have room for get_idat_split_overhead() more bytes.
+	// Returns the size of the file.
+	static size_t write_idat_chunks(uint8_t* pDst, size_t idat_ofs, uint64_t zlib_len, uint32_t idat_crc32)
+	{
+		const uint64_t CHUNK_OVERHEAD = PNG_IDAT_HEADER_SIZE + sizeof(uint32_t);
+		const uint64_t num_chunks = maximum<uint64_t>(1, (zlib_len + FPNG_MAX_IDAT_CHUNK_SIZE - 1) / FPNG_MAX_IDAT_CHUNK_SIZE);
+
+		// Make room for the chunk headers and CRC32's, moving the last chunk's data first so nothing is overwritten before it's moved.
+		for (uint64_t i = num_chunks - 1; i > 0; i--)
 		{
-			assert(0);
-			return false;
+			const uint64_t src_ofs = i * FPNG_MAX_IDAT_CHUNK_SIZE;
+			memmove(pDst + idat_ofs + PNG_IDAT_HEADER_SIZE + src_ofs + i * CHUNK_OVERHEAD, pDst + idat_ofs + PNG_IDAT_HEADER_SIZE + src_ofs, (size_t)minimum<uint64_t>(FPNG_MAX_IDAT_CHUNK_SIZE, zlib_len - src_ofs));
 		}
 
-		if ((num_chans != 3) && (num_chans != 4))
+		uint8_t* pChunk = pDst + idat_ofs;
+		for (uint64_t i = 0; i < num_chunks; i++)
 		{
-			assert(0);
-			return false;
-		}
+			const uint32_t chunk_len = (uint32_t)minimum<uint64_t>(FPNG_MAX_IDAT_CHUNK_SIZE, zlib_len - i * FPNG_MAX_IDAT_CHUNK_SIZE);
+			
+			write_be32(pChunk, chunk_len);
+			memcpy(pChunk + 4, "IDAT", 4);
 
-		int i, bpl = w * num_chans;
-		uint32_t y;
+			// A single chunk's CRC32 was already computed while its data was written.
+			const uint32_t chunk_crc32 = (num_chunks == 1) ? idat_crc32 : fpng_crc32(pChunk + 4, 4 + chunk_len, FPNG_CRC32_INIT);
 
-		std::vector<uint8_t> temp_buf;
-		temp_buf.resize((bpl + 1) * h + 7);
-		uint32_t temp_buf_ofs = 0;
+			pChunk += PNG_IDAT_HEADER_SIZE + chunk_len;
 
-		for (y = 0; y < h; ++y)
-		{
-			const uint8_t* pSrc = (uint8_t*)pImage + y * bpl;
-			const uint8_t* pPrev_src = y ? ((uint8_t*)pImage + (y - 1) * bpl) : nullptr;
+			if (i == (num_chunks - 1))
+				pChunk += write_png_trailer(pChunk, chunk_crc32);
+			else
+			{
+				write_be32(pChunk, chunk_crc32);
+				pChunk += sizeof(uint32_t);
+			}
+		}
 
-			uint8_t* pDst = &temp_buf[temp_buf_ofs];
+		return pChunk - pDst;
+	}
 
-			apply_filter(y ? 2 : 0, w, h, num_chans, bpl, pSrc, pPrev_src, pDst);
+	// Filters row y of the image and parses it the way the one pass compressor would (literals and RLE matches), adding the row's literal/length symbols to pHist.
+	// pRow_buf must be at least w*num_chans+1 bytes.
+	static void sample_row_histogram(encode_row_reader& src_rows, uint32_t w, uint32_t h, uint32_t num_chans, uint32_t y, bool adaptive_filters, uint8_t* pRow_buf, uint32_t* pHist)
+	{
+		const uint32_t src_bpl = w * num_chans;
+		const uint32_t bpl = src_bpl + 1;
+		const uint32_t max_match_len = (num_chans == 3) ? 255 : 252;
 
-			temp_buf_ofs += 1 + bpl;
-		}
+		const uint8_t* pPrev_src_row;
+		const uint8_t* pSrc_row = src_rows.row(y, pPrev_src_row);
+		apply_filter(adaptive_filters ? choose_filter(w, num_chans, pSrc_row, pPrev_src_row) : (y ? 2 : 0), w, h, num_chans, src_bpl, pSrc_row, pPrev_src_row, pRow_buf);
 
-		const uint32_t PNG_HEADER_SIZE = 58;
-				
-		uint32_t out_ofs = PNG_HEADER_SIZE;
-				
-		out_buf.resize((out_ofs + (bpl + 1) * h + 7) & ~7);
+		const uint8_t* pRow = pRow_buf;
 
-		uint32_t defl_size = 0;
-		if ((flags & FPNG_FORCE_UNCOMPRESSED) == 0)
+		pHist[pRow[0]]++;
+
+		for (uint32_t ofs = 1; ofs < bpl; )
 		{
-			if (num_chans == 3)
+			if ((ofs > 1) && (memcmp(pRow + ofs, pRow + ofs - num_chans, num_chans) == 0))
 			{
-				if (flags & FPNG_ENCODE_SLOWER)
-					defl_size = pixel_deflate_dyn_3_rle(temp_buf.data(), w, h, &out_buf[out_ofs], (uint32_t)out_buf.size() - out_ofs);
-				else
-					defl_size = pixel_deflate_dyn_3_rle_one_pass(temp_buf.data(), w, h, &out_buf[out_ofs], (uint32_t)out_buf.size() - out_ofs);
+				const uint32_t max_len = minimum(max_match_len, bpl - ofs);
+
+				uint32_t match_len = num_chans;
+				while ((match_len < max_len) && (memcmp(pRow + ofs + match_len, pRow + ofs, num_chans) == 0))
+					match_len += num_chans;
+
+				pHist[g_defl_len_sym[match_len - 3]]++;
+				ofs += match_len;
 			}
 			else
 			{
-				if (flags & FPNG_ENCODE_SLOWER)
-					defl_size = pixel_deflate_dyn_4_rle(temp_buf.data(), w, h, &out_buf[out_ofs], (uint32_t)out_buf.size() - out_ofs);
-				else
-					defl_size = pixel_deflate_dyn_4_rle_one_pass(temp_buf.data(), w, h, &out_buf[out_ofs], (uint32_t)out_buf.size() - out_ofs);
+				for (uint32_t c = 0; c < num_chans; c++)
+					pHist[pRow[ofs + c]]++;
+				ofs += num_chans;
 			}
 		}
+	}
 
-		uint32_t zlib_size = defl_size;
-		
-		if (!defl_size)
-		{
-			// Dynamic block failed to compress - fall back to uncompressed blocks, filter 0.
+	const uint32_t HUFF_PRESET_SAMPLE_ROWS = 16;
 
-			temp_buf_ofs = 0;
+	// Picks the one pass Huffman table preset that should code the image in the fewest bits. A few evenly spaced rows are filtered and parsed the way the one pass 
+	// compressor would (literals and RLE matches), and the resulting symbol histogram is priced with each preset's code sizes and header size.
+	static uint32_t select_huff_preset(encode_scratch& scratch, const encode_source& src, uint32_t w, uint32_t h, uint32_t num_chans, bool adaptive_filters, const defl_huff_preset* pPresets, uint32_t num_presets)
+	{
+		assert((num_chans == 3) || (num_chans == 4));
 
-			for (y = 0; y < h; ++y)
-			{
-				const uint8_t* pSrc = (uint8_t*)pImage + y * bpl;
+		if (num_presets < 2)
+			return 0;
 
-				uint8_t* pDst = &temp_buf[temp_buf_ofs];
+		FPNG_STATS_ONLY(encode_stats_timer timer(scratch.m_pStats, &fpng_encode_stats::m_analysis_ns);)
 
-				apply_filter(0, w, h, num_chans, bpl, pSrc, nullptr, pDst);
+		uint8_t* pRow_buf = get_scratch_buf(scratch.m_row_buf, w * num_chans + 1 + 8);
 
-				temp_buf_ofs += 1 + bpl;
-			}
+		uint32_t hist[DEFL_MAX_HUFF_SYMBOLS_0];
+		memset(hist, 0, sizeof(hist));
 
-			assert(temp_buf_ofs <= temp_buf.size());
-						
-			out_buf.resize(out_ofs + 6 + temp_buf_ofs + ((temp_buf_ofs + 65534) / 65535) * 5);
+		encode_row_reader src_rows(src, scratch.m_src_rows, w * num_chans);
 
-			uint32_t raw_size = write_raw_block(temp_buf.data(), (uint32_t)temp_buf_ofs, out_buf.data() + out_ofs, (uint32_t)out_buf.size() - out_ofs);
-			if (!raw_size)
+		const uint32_t num_sample_rows = minimum(h, HUFF_PRESET_SAMPLE_ROWS);
+		for (uint32_t i = 0; i < num_sample_rows; i++)
+			sample_row_histogram(src_rows, w, h, num_chans, (uint32_t)(((uint64_t)i * h + h / 2) / num_sample_rows), adaptive_filters, pRow_buf, hist);
+
+		uint32_t best_preset = 0;
+		uint64_t best_bits = UINT64_MAX;
+
+		for (uint32_t p = 0; p < num_presets; p++)
+		{
+			uint64_t bits = 0;
+			for (uint32_t i = 0; i < DEFL_MAX_HUFF_SYMBOLS_0; i++)
 			{
-				// Somehow we miscomputed the size of the output buffer.
-				assert(0);
-				return false;
+				assert(!hist[i] || pPresets[p].m_pCodes[i].m_code_size);
+				bits += (uint64_t)hist[i] * pPresets[p].m_pCodes[i].m_code_size;
 			}
 
-			zlib_size = raw_size;
+			bits = (bits * h) / num_sample_rows + pPresets[p].m_prefix_size * 8;
+			if (bits < best_bits)
+			{
+				best_bits = bits;
+				best_preset = p;
+			}
 		}
-		
-		assert((out_ofs + zlib_size) <= out_buf.size());
 
-		out_buf.resize(out_ofs + zlib_size);
+		return best_preset;
+	}
 
-		const uint32_t idat_len = (uint32_t)out_buf.size() - PNG_HEADER_SIZE;
+	const uint32_t HUFF_SAMPLE_ROW_INTERVAL = 8;
 
-		// Write real PNG header, fdEC chunk, and the beginning of the IDAT chunk
-		{
-			static const uint8_t s_color_type[] = { 0x00, 0x00, 0x04, 0x02, 0x06 };
+	// FPNG_LEVEL_MEDIUM: builds a dynamic Huffman table from the symbols of every HUFF_SAMPLE_ROW_INTERVAL'th row (instead of every row, like FPNG_ENCODE_SLOWER), 
+	// then codes the whole image with it in a single pass, using the one pass compressor.
+	static uint32_t pixel_deflate_dyn_sampled(encode_scratch& scratch,
+		const encode_source& src, uint32_t w, uint32_t h, uint32_t num_chans,
+		uint8_t* pDst, uint32_t dst_buf_size, uint32_t block_flags, uint32_t* pAdler32, defl_output_crc32* pOut_crc32, bool adaptive_filters)
+	{
+		assert((num_chans == 3) || (num_chans == 4));
 
-			uint8_t pnghdr[58] = { 
-				0x89,0x50,0x4e,0x47,0x0d,0x0a,0x1a,0x0a,   // PNG sig
-				0x00,0x00,0x00,0x0d, 'I','H','D','R',  // IHDR chunk len, type
-			    0,0,(uint8_t)(w >> 8),(uint8_t)w, // width
-				0,0,(uint8_t)(h >> 8),(uint8_t)h, // height
-				8,   //bit_depth
-				s_color_type[num_chans], // color_type
-				0, // compression
-				0, // filter
-				0, // interlace
-				0, 0, 0, 0, // IHDR crc32
-				0, 0, 0, 5, 'f', 'd', 'E', 'C', 82, 36, 147, 227, FPNG_FDEC_VERSION,   0xE5, 0xAB, 0x62, 0x99, // our custom private, ancillary, do not copy, fdEC chunk
-			  (uint8_t)(idat_len >> 24),(uint8_t)(idat_len >> 16),(uint8_t)(idat_len >> 8),(uint8_t)idat_len, 'I','D','A','T' // IDATA chunk len, type
-			}; 
+		const uint32_t bpl = 1 + w * num_chans;
 
-			// Compute IHDR CRC32
-			uint32_t c = (uint32_t)fpng_crc32(pnghdr + 12, 17, FPNG_CRC32_INIT);
-			for (i = 0; i < 4; ++i, c <<= 8)
-				((uint8_t*)(pnghdr + 29))[i] = (uint8_t)(c >> 24);
+		// Each row is filtered into this small buffer right before it's compressed (padded because the pixel reads can go a few bytes past the end).
+		uint8_t* pRow_buf = get_scratch_buf(scratch.m_row_buf, bpl + 8);
 
-			memcpy(out_buf.data(), pnghdr, PNG_HEADER_SIZE);
-		}
+		FPNG_STATS_ONLY(encode_stats_timer timer(scratch.m_pStats);)
 
-		// Write IDAT chunk's CRC32 and a 0 length IEND chunk
-		vector_append(out_buf, "\0\0\0\0\0\0\0\0\x49\x45\x4e\x44\xae\x42\x60\x82", 16); // IDAT CRC32, followed by the IEND chunk
+		uint32_t lit_freq[DEFL_MAX_HUFF_SYMBOLS_0];
+		memset(lit_freq, 0, sizeof(lit_freq));
 
-		// Compute IDAT crc32
-		uint32_t c = (uint32_t)fpng_crc32(out_buf.data() + PNG_HEADER_SIZE - 4, idat_len + 4, FPNG_CRC32_INIT);
-		
-		for (i = 0; i < 4; ++i, c <<= 8)
-			(out_buf.data() + out_buf.size() - 16)[i] = (uint8_t)(c >> 24);
-				
-		return true;
-	}
+		encode_row_reader src_rows(src, scratch.m_src_rows, bpl - 1);
 
-#ifndef FPNG_NO_STDIO
-	bool fpng_encode_image_to_file(const char* pFilename, const void* pImage, uint32_t w, uint32_t h, uint32_t num_chans, uint32_t flags)
-	{
-		std::vector<uint8_t> out_buf;
-		if (!fpng_encode_image_to_memory(pImage, w, h, num_chans, out_buf, flags))
-			return false;
+		for (uint32_t y = 0; y < h; y += HUFF_SAMPLE_ROW_INTERVAL)
+			sample_row_histogram(src_rows, w, h, num_chans, y, adaptive_filters, pRow_buf, lit_freq);
 
-		FILE* pFile = nullptr;
-#ifdef _MSC_VER
-		fopen_s(&pFile, pFilename, "wb");
-#else
-		pFile = fopen(pFilename, "wb");
-#endif
-		if (!pFile)
-			return false;
+		FPNG_STATS_ONLY(timer.lap(&fpng_encode_stats::m_analysis_ns);)
 
-		if (fwrite(out_buf.data(), 1, out_buf.size(), pFile) != out_buf.size())
-		{
-			fclose(pFile);
-			return false;
-		}
+		// The rows that weren't sampled can use any symbol.
+		defl_add_one_pass_syms(lit_freq, num_chans);
 
-		return (fclose(pFile) != EOF);
-	}
-#endif
+		defl_huff dh;
+		adjust_freq32(DEFL_MAX_HUFF_SYMBOLS_0, lit_freq, &dh.m_huff_count[0][0]);
 
-	// Decompression
+		const uint32_t dist_sym = g_defl_small_dist_sym[num_chans - 1];
+		memset(&dh.m_huff_count[1][0], 0, sizeof(dh.m_huff_count[1][0]) * DEFL_MAX_HUFF_SYMBOLS_1);
+		dh.m_huff_count[1][dist_sym] = 1;
+		dh.m_huff_count[1][dist_sym + 1] = 1; // to workaround a bug in wuffs decoder
 
-	const uint32_t FPNG_DECODER_TABLE_BITS = 12;
-	const uint32_t FPNG_DECODER_TABLE_SIZE = 1 << FPNG_DECODER_TABLE_BITS;
+		uint64_t bit_buf = 0;
+		int bit_buf_size = 0;
 
-	static bool build_decoder_table(uint32_t num_syms, uint8_t* pCode_sizes, uint32_t* pTable)
-	{
-		uint32_t num_codes[16];
+		uint32_t dst_ofs = 0;
 
-		memset(num_codes, 0, sizeof(num_codes));
-		for (uint32_t i = 0; i < num_syms; i++)
+		// zlib header
+		if (block_flags & DEFL_ZLIB_HEADER)
 		{
-			assert(pCode_sizes[i] <= FPNG_DECODER_TABLE_SIZE);
-			num_codes[pCode_sizes[i]]++;
+			PUT_BITS(0x78, 8);
+			PUT_BITS(0x01, 8);
 		}
 
-		uint32_t next_code[17];
-		next_code[0] = next_code[1] = 0;
-		uint32_t total = 0;
-		for (uint32_t i = 1; i <= 15; i++)
-			next_code[i + 1] = (uint32_t)(total = ((total + ((uint32_t)num_codes[i])) << 1));
+		// write BFINAL bit
+		PUT_BITS((block_flags & DEFL_FINAL_BLOCK) ? 1 : 0, 1);
 
-		if (total != 0x10000)
+		if (!defl_start_dynamic_block(&dh, pDst, dst_ofs, dst_buf_size, bit_buf, bit_buf_size))
+			return 0;
+
+		assert(bit_buf_size <= 7);
+		assert(dh.m_huff_codes[1][dist_sym] == 0 && dh.m_huff_code_sizes[1][dist_sym] == 1);
+
+		defl_huff_code codes[DEFL_MAX_HUFF_SYMBOLS_0];
+		for (uint32_t i = 0; i < DEFL_MAX_HUFF_SYMBOLS_0; i++)
 		{
-			uint32_t j = 0;
+			codes[i].m_code_size = dh.m_huff_code_sizes[0][i];
+			codes[i].m_code = dh.m_huff_codes[0][i];
+		}
 
-			for (uint32_t i = 15; i != 0; i--)
-				if ((j += num_codes[i]) > 1)
-					return false;
-			
-			if (j != 1)
-				return false;
+		uint32_t src_adler32 = FPNG_ADLER32_INIT;
+
+		FPNG_STATS_ONLY(timer.lap(&fpng_encode_stats::m_entropy_ns);)
+
+		if (num_chans == 3)
+		{
+			if (!pixel_deflate_rows_3_one_pass(src_rows, w, h, nullptr, pRow_buf, pDst, dst_ofs, dst_buf_size, bit_buf, bit_buf_size, src_adler32, codes, pOut_crc32, adaptive_filters, scratch.m_pStats))
+				return 0;
 		}
+		else if (!pixel_deflate_rows_4_one_pass(src_rows, w, h, nullptr, pRow_buf, pDst, dst_ofs, dst_buf_size, bit_buf, bit_buf_size, src_adler32, codes, pOut_crc32, adaptive_filters, scratch.m_pStats))
+			return 0;
 
-		uint32_t rev_codes[DEFL_MAX_HUFF_SYMBOLS];
+		assert(bit_buf_size <= 7);
 
-		for (uint32_t i = 0; i < num_syms; i++)
-			rev_codes[i] = next_code[pCode_sizes[i]]++;
+		PUT_BITS_CZ(codes[256].m_code, codes[256].m_code_size);
 
-		memset(pTable, 0, sizeof(uint32_t) * FPNG_DECODER_TABLE_SIZE);
+		if (pAdler32)
+			*pAdler32 = src_adler32;
 
-		for (uint32_t i = 0; i < num_syms; i++)
-		{
-			const uint32_t code_size = pCode_sizes[i];
-			if (!code_size)
-				continue;
+		if (!defl_finish_block(pDst, dst_ofs, dst_buf_size, bit_buf, bit_buf_size, block_flags, src_adler32))
+			return 0;
 
-			uint32_t old_code = rev_codes[i], new_code = 0;
-			for (uint32_t j = code_size; j != 0; j--)
-			{
-				new_code = (new_code << 1) | (old_code & 1);
-				old_code >>= 1;
-			}
+		FPNG_STATS_ONLY(timer.reset();)
 
-			uint32_t j = 1 << code_size;
+		if (pOut_crc32)
+			pOut_crc32->update(pDst, dst_ofs);
 
-			while (new_code < FPNG_DECODER_TABLE_SIZE)
-			{
-				pTable[new_code] = i | (code_size << 9);
-				new_code += j;
-			}
-		}
+		FPNG_STATS_ONLY(timer.lap(&fpng_encode_stats::m_crc32_ns); record_stats_table(scratch.m_pStats, FPNG_STATS_TABLE_SAMPLED);)
 
-		return true;
+		return dst_ofs;
 	}
 
-	static const uint16_t g_run_len3_to_4[259] = 
+	// FPNG_ENCODE_LZ_MATCHES: matches are found with a small hash chain over the pixels of the current row only, so they never reach into the previous row
+	// (repeats from row to row are already cheap thanks to the Up filter). Matches other than the usual 1 pixel distance run must be at least LZ_MIN_MATCH_PIXELS long.
+	// The same compressor also handles the images the other compressors don't (grayscale, gray+alpha and 16-bit), with or without LZ matches.
+	const uint32_t LZ_HASH_BITS = 12;
+	const uint32_t LZ_HASH_SIZE = 1 << LZ_HASH_BITS;
+	const uint32_t LZ_MAX_CANDIDATES = 4;
+	const uint32_t LZ_MIN_MATCH_PIXELS = 2;
+	const uint32_t LZ_MAX_DIST = 8192;
+
+	// Returns the Deflate distance symbol of dist (1-32768) and its extra bits.
+	static inline uint32_t defl_get_dist_sym(uint32_t dist, uint32_t& num_extra_bits, uint32_t& extra_bits)
 	{
-		0,
-		0, 0, 4, 0, 0, 8, 0, 0, 12, 0, 0, 16, 0, 0, 20, 0, 0, 24, 0, 0, 28, 0, 0,
-		32, 0, 0, 36, 0, 0, 40, 0, 0, 44, 0, 0, 48, 0, 0, 52, 0, 0, 56, 0, 0,
-		60, 0, 0, 64, 0, 0, 68, 0, 0, 72, 0, 0, 76, 0, 0, 80, 0, 0, 84, 0, 0,
-		88, 0, 0, 92, 0, 0, 96, 0, 0, 100, 0, 0, 104, 0, 0, 108, 0, 0, 112, 0, 0,
-		116, 0, 0, 120, 0, 0, 124, 0, 0, 128, 0, 0, 132, 0, 0, 136, 0, 0, 140, 0, 0,
-		144, 0, 0, 148, 0, 0, 152, 0, 0, 156, 0, 0, 160, 0, 0, 164, 0, 0, 168, 0, 0,
-		172, 0, 0, 176, 0, 0, 180, 0, 0, 184, 0, 0, 188, 0, 0, 192, 0, 0, 196, 0, 0,
-		200, 0, 0, 204, 0, 0, 208, 0, 0, 212, 0, 0, 216, 0, 0, 220, 0, 0, 224, 0, 0,
-		228, 0, 0, 232, 0, 0, 236, 0, 0, 240, 0, 0, 244, 0, 0, 248, 0, 0, 252, 0, 0,
-		256, 0, 0, 260, 0, 0, 264, 0, 0, 268, 0, 0, 272, 0, 0, 276, 0, 0, 280, 0, 0,
-		284, 0, 0, 288, 0, 0, 292, 0, 0, 296, 0, 0, 300, 0, 0, 304, 0, 0, 308, 0, 0,
-		312, 0, 0, 316, 0, 0, 320, 0, 0, 324, 0, 0, 328, 0, 0, 332, 0, 0, 336, 0, 0,
-		340, 0, 0, 
-		344,
-	};
-
-	static const int s_length_extra[] = { 0,0,0,0, 0,0,0,0, 1,1,1,1, 2,2,2,2, 3,3,3,3, 4,4,4,4, 5,5,5,5, 0,    0,0 };
-	static const int s_length_range[] = { 3,4,5,6, 7,8,9,10, 11,13,15,17, 19,23,27,31, 35,43,51,59, 67,83,99,115, 131,163,195,227, 258,    0,0 };
+		assert((dist >= 1) && (dist <= DEFL_LZ_DICT_SIZE));
 
-#define ENSURE_32BITS() do { \
-	if (bit_buf_size < 32) { \
-		if ((src_ofs + 4) > src_len) return false; \
-		bit_buf |= ((uint64_t)READ_LE32(pSrc + src_ofs)) << bit_buf_size; \
-		src_ofs += 4; bit_buf_size += 32; } \
-	} while(0)
+		const uint32_t d = dist - 1;
+		if (d < 4)
+		{
+			num_extra_bits = 0;
+			extra_bits = 0;
+			return d;
+		}
 
-#define GET_BITS(b, ll) do { \
-	uint32_t l = ll; assert(l && (l <= 32)); \
-	b = (uint32_t)(bit_buf & g_bitmasks[l]); \
-	bit_buf >>= l; \
-	bit_buf_size -= l; \
-	ENSURE_32BITS(); \
-	} while(0)
+		uint32_t nb = 31;
+		while (!(d >> nb))
+			nb--;
 
-#define SKIP_BITS(ll) do { \
-	uint32_t l = ll; assert(l <= 32); \
-	bit_buf >>= l; \
-	bit_buf_size -= l; \
-	ENSURE_32BITS(); \
-	} while(0)
+		num_extra_bits = nb - 1;
+		extra_bits = d & g_bitmasks[num_extra_bits];
+		return 2 * nb + ((d >> (nb - 1)) & 1);
+	}
 
-#define GET_BITS_NE(b, ll) do { \
-	uint32_t l = ll; assert(l && (l <= 32) && (bit_buf_size >= l)); \
-	b = (uint32_t)(bit_buf & g_bitmasks[l]); \
-	bit_buf >>= l; \
-	bit_buf_size -= l; \
-	} while(0)
+	// Reads a pixel of bpp (1-4, 6 or 8) bytes.
+	template<uint32_t bpp>
+	static inline uint64_t lz_read_pixel(const uint8_t* p)
+	{
+		switch (bpp)
+		{
+		case 1: return p[0];
+		case 2: return p[0] | (p[1] << 8);
+		case 3: return READ_RGB_PIXEL(p);
+		case 4: return READ_LE32(p);
+		case 6: return READ_LE32(p) | ((uint64_t)(p[4] | (p[5] << 8)) << 32);
+		default: break;
+		}
+		return READ_LE32(p) | ((uint64_t)READ_LE32(p + 4) << 32);
+	}
 
-#define SKIP_BITS_NE(ll) do { \
-	uint32_t l = ll; assert(l <= 32 && (bit_buf_size >= l)); \
-	bit_buf >>= l; \
-	bit_buf_size -= l; \
-	} while(0)
+	template<uint32_t bpp>
+	static inline uint32_t lz_hash(const uint8_t* p)
+	{
+		return (uint32_t)(((lz_read_pixel<bpp>(p) * 0x9E3779B97F4A7C15ULL) ^ (lz_read_pixel<bpp>(p + bpp) * 0xC2B2AE3D27D4EB4FULL)) >> (64 - LZ_HASH_BITS));
+	}
 
-	static bool prepare_dynamic_block(
-		const uint8_t* pSrc, uint32_t src_len, uint32_t& src_ofs,
-		uint32_t& bit_buf_size, uint64_t& bit_buf,
-		uint32_t* pLit_table, uint32_t num_chans)
+	// Converts a row of native endian 16-bit samples to big endian, like PNG stores them.
+	static inline void swap_row_samples16(uint8_t* pDst, const uint8_t* pSrc, uint32_t n)
 	{
-		static const uint8_t s_bit_length_order[] = { 16, 17, 18, 0, 8,  7,  9, 6, 10,  5, 11, 4, 12,  3, 13, 2, 14,  1, 15 };
+#if __BYTE_ORDER == __LITTLE_ENDIAN
+		for (uint32_t i = 0; i < n; i += 2)
+		{
+			pDst[i] = pSrc[i + 1];
+			pDst[i + 1] = pSrc[i];
+		}
+#else
+		memcpy(pDst, pSrc, n);
+#endif
+	}
 
-		uint32_t num_lit_codes, num_dist_codes, num_clen_codes;
+	// Two passes like FPNG_ENCODE_SLOWER, for pixels of bpp bytes. If lz_matches is true (FPNG_ENCODE_LZ_MATCHES), the first pass also looks for matches at other distances within each row.
+	// If samples16 is true, the image has native endian 16-bit samples, which are swapped to big endian one row at a time before filtering.
+	template<uint32_t bpp>
+	static uint32_t pixel_deflate_dyn_lz(encode_scratch& scratch,
+		const encode_source& src, uint32_t w, uint32_t h,
+		uint8_t* pDst, uint32_t dst_buf_size, uint32_t block_flags, uint32_t* pAdler32, defl_output_crc32* pOut_crc32, bool adaptive_filters, bool lz_matches, bool samples16)
+	{
+		const uint32_t bpl = 1 + w * bpp;
+		const uint32_t src_bpl = bpl - 1;
+		
+		// Matches are whole pixels, and at least 3 bytes long.
+		const uint32_t max_match_pixels = ((bpp == 3) ? 255 : (bpp == 4) ? 252 : DEFL_MAX_MATCH_LEN) / bpp;
+		const uint32_t min_run_pixels = (DEFL_MIN_MATCH_LEN + bpp - 1) / bpp;
+		const uint32_t min_match_pixels = maximum(LZ_MIN_MATCH_PIXELS, min_run_pixels);
+		const uint32_t max_dist_pixels = LZ_MAX_DIST / bpp;
 
-		GET_BITS(num_lit_codes, 5);
-		num_lit_codes += 257;
+		// Pixels wider than 4 bytes are coded as 2 literal codes.
+		lz_code* pCodes = get_scratch_buf(scratch.m_lz_codes, ((bpp > 4) ? (w * 2 + 1) : (w + 1)) * h);
+		lz_code* pDst_codes = pCodes;
 
-		GET_BITS(num_dist_codes, 5);
-		num_dist_codes += 1;
-		
-		uint32_t total_codes = num_lit_codes + num_dist_codes;
-		if (total_codes > (DEFL_MAX_HUFF_SYMBOLS_0 + DEFL_MAX_HUFF_SYMBOLS_1))
-			return false;
+		uint32_t lit_freq[DEFL_MAX_HUFF_SYMBOLS_0];
+		memset(lit_freq, 0, sizeof(lit_freq));
 
-		uint8_t code_sizes[DEFL_MAX_HUFF_SYMBOLS_0 + DEFL_MAX_HUFF_SYMBOLS_1];
-		memset(code_sizes, 0, sizeof(code_sizes));
+		uint32_t dist_freq[DEFL_MAX_HUFF_SYMBOLS_1];
+		memset(dist_freq, 0, sizeof(dist_freq));
 
-		GET_BITS(num_clen_codes, 4);
-		num_clen_codes += 4;
+		// Each row is filtered into this small buffer right before it's parsed (padded because the pixel reads can go a few bytes past the end).
+		uint8_t* pRow_buf = get_scratch_buf(scratch.m_row_buf, bpl + 8);
+		const uint8_t* pPixels = pRow_buf + 1;
 
-		uint8_t clen_codesizes[DEFL_MAX_HUFF_SYMBOLS_2];
-		memset(clen_codesizes, 0, sizeof(clen_codesizes));
+		// The current and previous rows, swapped to big endian.
+		uint8_t* pSwapped_rows = samples16 ? get_scratch_buf(scratch.m_swapped_rows, src_bpl * 2) : nullptr;
 
-		for (uint32_t i = 0; i < num_clen_codes; i++)
+		// The hash heads are tagged with the row they were inserted on, so they don't need to be cleared for each row (only the tags are cleared for each image).
+		uint32_t* pHash_head = nullptr, * pHash_row = nullptr, * pHash_prev = nullptr;
+		if (lz_matches)
 		{
-			uint32_t len = 0;
-			GET_BITS(len, 3);
-			clen_codesizes[s_bit_length_order[i]] = (uint8_t)len;
+			pHash_head = get_scratch_buf(scratch.m_hash_head, LZ_HASH_SIZE);
+			pHash_row = get_scratch_buf(scratch.m_hash_row, LZ_HASH_SIZE);
+			pHash_prev = get_scratch_buf(scratch.m_hash_prev, w);
+			memset(pHash_row, 0, LZ_HASH_SIZE * sizeof(uint32_t));
 		}
 
-		uint32_t clen_table[FPNG_DECODER_TABLE_SIZE];
-		if (!build_decoder_table(DEFL_MAX_HUFF_SYMBOLS_2, clen_codesizes, clen_table))
-			return false;
+		uint32_t src_adler32 = FPNG_ADLER32_INIT;
 
-		uint32_t min_code_size = 15;
+		FPNG_STATS_ONLY(encode_stats_timer timer(scratch.m_pStats); code_counts counts;)
 
-		for (uint32_t cur_code = 0; cur_code < total_codes; )
+		encode_row_reader src_rows(src, scratch.m_src_rows, src_bpl);
+
+		for (uint32_t y = 0; y < h; y++)
 		{
-			uint32_t sym = clen_table[bit_buf & (FPNG_DECODER_TABLE_SIZE - 1)];
-			uint32_t sym_len = sym >> 9;
-			if (!sym_len)
-				return false;
-			SKIP_BITS(sym_len);
-			sym &= 511;
-						
-			if (sym <= 15)
+			const uint8_t* pPrev_src_row;
+			const uint8_t* pSrc_row = src_rows.row(y, pPrev_src_row);
+
+			if (samples16)
 			{
-				// Can't be a fpng Huffman table
-				if (sym > FPNG_DECODER_TABLE_BITS)
-					return false;
+				uint8_t* pSwapped_row = pSwapped_rows + (y & 1) * src_bpl;
+				swap_row_samples16(pSwapped_row, pSrc_row, src_bpl);
+				
+				pSrc_row = pSwapped_row;
+				pPrev_src_row = y ? (pSwapped_rows + ((y - 1) & 1) * src_bpl) : nullptr;
+			}
 
-				if (sym)
-					min_code_size = minimum(min_code_size, sym);
+			apply_filter(adaptive_filters ? choose_filter(w, bpp, pSrc_row, pPrev_src_row) : (y ? 2 : 0), w, h, bpp, src_bpl, pSrc_row, pPrev_src_row, pRow_buf);
 
-				code_sizes[cur_code++] = (uint8_t)sym;
-				continue;
-			}
+			FPNG_STATS_ONLY(timer.lap(&fpng_encode_stats::m_filter_ns);)
 
-			uint32_t rep_len = 0, rep_code_size = 0;
+			src_adler32 = fpng_adler32(pRow_buf, bpl, src_adler32);
 
-			switch (sym)
-			{
-			case 16:
-			{
-				GET_BITS(rep_len, 2);
-				rep_len += 3;
-				if (!cur_code)
-					return false;
-				rep_code_size = code_sizes[cur_code - 1];
-				break;
-			}
-			case 17:
+			FPNG_STATS_ONLY(timer.lap(&fpng_encode_stats::m_adler32_ns);)
+
+			const uint32_t filter_lit = pRow_buf[0];
+			pDst_codes->m_lits = filter_lit;
+			pDst_codes->m_len = 0;
+			pDst_codes->m_dist = 1;
+			pDst_codes++;
+			lit_freq[filter_lit]++;
+
+			auto insert_hash = [&](uint32_t x)
 			{
-				GET_BITS(rep_len, 3);
-				rep_len += 3;
-				rep_code_size = 0;
-				break;
-			}
-			case 18:
+				if ((!lz_matches) || (x + 1 >= w))
+					return;
+				const uint32_t hash = lz_hash<bpp>(pPixels + x * bpp);
+				pHash_prev[x] = (pHash_row[hash] == y + 1) ? pHash_head[hash] : UINT32_MAX;
+				pHash_head[hash] = x;
+				pHash_row[hash] = y + 1;
+			};
+
+			uint32_t x = 0;
+			while (x < w)
 			{
-				GET_BITS(rep_len, 7);
-				rep_len += 11;
-				rep_code_size = 0;
-				break;
-			}
-			}
+				const uint8_t* pCur = pPixels + x * bpp;
+				const uint64_t cur = lz_read_pixel<bpp>(pCur);
+				const uint32_t max_len = minimum(max_match_pixels, w - x);
 
-			if ((cur_code + rep_len) > total_codes)
-				return false;
+				uint32_t best_len = 0, best_dist = 0;
 
-			for (; rep_len; rep_len--)
-				code_sizes[cur_code++] = (uint8_t)rep_code_size;
-		}
+				// The usual fpng run of the previous pixel.
+				if ((x) && (lz_read_pixel<bpp>(pCur - bpp) == cur))
+				{
+					best_len = 1;
+					while ((best_len < max_len) && (lz_read_pixel<bpp>(pCur + best_len * bpp) == cur))
+						best_len++;
+					
+					if (best_len >= min_run_pixels)
+						best_dist = 1;
+					else
+						best_len = 0;
+				}
 
-		uint8_t lit_codesizes[DEFL_MAX_HUFF_SYMBOLS_0];
+				if ((lz_matches) && (best_len < max_len) && (x + 1 < w))
+				{
+					const uint32_t hash = lz_hash<bpp>(pCur);
+					uint32_t cand = (pHash_row[hash] == y + 1) ? pHash_head[hash] : UINT32_MAX;
 
-		memcpy(lit_codesizes, code_sizes, num_lit_codes);
-		memset(lit_codesizes + num_lit_codes, 0, DEFL_MAX_HUFF_SYMBOLS_0 - num_lit_codes);
+					for (uint32_t n = 0; (cand != UINT32_MAX) && (n < LZ_MAX_CANDIDATES); n++, cand = pHash_prev[cand])
+					{
+						const uint32_t dist = x - cand;
+						if (dist > max_dist_pixels)
+							break;
 
-		uint32_t total_valid_distcodes = 0;
-		for (uint32_t i = 0; i < num_dist_codes; i++)
-			total_valid_distcodes += (code_sizes[num_lit_codes + i] == 1);
-		
-		// 1 or 2 because the first version of FPNG only issued 1 valid distance code, but that upset wuffs. So we let 1 or 2 through.
-		if ((total_valid_distcodes < 1) || (total_valid_distcodes > 2))
-			return false;
+						const uint8_t* pCand = pPixels + cand * bpp;
+						if ((dist == 1) || (lz_read_pixel<bpp>(pCand + best_len * bpp) != lz_read_pixel<bpp>(pCur + best_len * bpp)))
+							continue;
 
-		if (code_sizes[num_lit_codes + (num_chans - 1)] != 1)
-			return false;
+						uint32_t len = 0;
+						while ((len < max_len) && (lz_read_pixel<bpp>(pCand + len * bpp) == lz_read_pixel<bpp>(pCur + len * bpp)))
+							len++;
 
-		if (total_valid_distcodes == 2)
-		{
-			// If there are two valid distance codes, make sure the first is 1 bit.
-			if (code_sizes[num_lit_codes + num_chans] != 1)
-				return false;
-		}
-						
-		if (!build_decoder_table(num_lit_codes, lit_codesizes, pLit_table))
-			return false;
+						if (len > best_len)
+						{
+							best_len = len;
+							best_dist = dist;
+							if (len == max_len)
+								break;
+						}
+					}
+				}
 
-		// Add next symbol to decoder table, when it fits
-		for (uint32_t i = 0; i < FPNG_DECODER_TABLE_SIZE; i++)
-		{
-			uint32_t sym = pLit_table[i] & 511;
-			if (sym >= 256)
-				continue;
+				if ((best_dist == 1) || (best_len >= min_match_pixels))
+				{
+					const uint32_t match_len = best_len * bpp, match_dist = best_dist * bpp;
 
-			uint32_t sym_bits = (pLit_table[i] >> 9) & 15;
-			if (!sym_bits)
-				continue;
-			assert(sym_bits <= FPNG_DECODER_TABLE_BITS);
+					pDst_codes->m_lits = 0;
+					pDst_codes->m_len = (uint16_t)match_len;
+					pDst_codes->m_dist = (uint16_t)match_dist;
+					pDst_codes++;
 
-			uint32_t bits_left = FPNG_DECODER_TABLE_BITS - sym_bits;
-			if (bits_left < min_code_size)
-				continue;
+					lit_freq[g_defl_len_sym[match_len - 3]]++;
 
-			uint32_t next_bits = i >> sym_bits;
-			uint32_t next_sym = pLit_table[next_bits] & 511;
-			uint32_t next_sym_bits = (pLit_table[next_bits] >> 9) & 15;
-			if ((!next_sym_bits) || (bits_left < next_sym_bits))
-				continue;
+					uint32_t num_extra_bits, extra_bits;
+					dist_freq[defl_get_dist_sym(match_dist, num_extra_bits, extra_bits)]++;
 
-			pLit_table[i] |= (next_sym << 16) | (next_sym_bits << (16 + 9));
+					for (uint32_t i = 0; i < best_len; i++)
+						insert_hash(x + i);
+
+					x += best_len;
+				}
+				else
+				{
+					pDst_codes->m_lits = (uint32_t)cur;
+					pDst_codes->m_len = 0;
+					pDst_codes->m_dist = minimum<uint16_t>(bpp, 4);
+					pDst_codes++;
+
+					if (bpp > 4)
+					{
+						pDst_codes->m_lits = (uint32_t)(cur >> 32);
+						pDst_codes->m_len = 0;
+						pDst_codes->m_dist = bpp - 4;
+						pDst_codes++;
+					}
+
+					for (uint32_t c = 0; c < bpp; c++)
+						lit_freq[pCur[c]]++;
+
+					insert_hash(x);
+
+					x++;
+				}
+			} // x
+
+			FPNG_STATS_ONLY(timer.lap(&fpng_encode_stats::m_entropy_ns);)
+
+		} // y
+
+		const uint32_t total_codes = (uint32_t)(pDst_codes - pCodes);
+		assert(total_codes <= scratch.m_lz_codes.size());
+
+		defl_huff dh;
+
+		lit_freq[256] = 1;
+
+		adjust_freq32(DEFL_MAX_HUFF_SYMBOLS_0, lit_freq, &dh.m_huff_count[0][0]);
+
+		// Keep at least two distance codes to workaround a bug in wuffs decoder. When nothing but runs were found, this is the same table as pixel_deflate_dyn_3/4_rle()'s.
+		const uint32_t dist_sym = g_defl_small_dist_sym[bpp - 1];
+		uint32_t total_dist_syms = 0;
+		for (uint32_t i = 0; i < DEFL_MAX_HUFF_SYMBOLS_1; i++)
+			total_dist_syms += (dist_freq[i] != 0);
+
+		if (total_dist_syms < 2)
+		{
+			if (!dist_freq[dist_sym])
+				dist_freq[dist_sym] = 1;
+			else
+				dist_freq[dist_sym + 1] = 1;
 		}
 
-		return true;
-	}
-		
-	static bool fpng_pixel_zlib_raw_decompress(
-		const uint8_t* pSrc, uint32_t src_len, uint32_t zlib_len,
-		uint8_t* pDst, uint32_t w, uint32_t h,
-		uint32_t src_chans, uint32_t dst_chans)
-	{
-		assert((src_chans == 3) || (src_chans == 4));
-		assert((dst_chans == 3) || (dst_chans == 4));
-		
-		const uint32_t src_bpl = w * src_chans;
-		const uint32_t dst_bpl = w * dst_chans;
-		const uint32_t dst_len = dst_bpl * h;
+		adjust_freq32(DEFL_MAX_HUFF_SYMBOLS_1, dist_freq, &dh.m_huff_count[1][0]);
+
+		uint64_t bit_buf = 0;
+		int bit_buf_size = 0;
 
-		uint32_t src_ofs = 2;
 		uint32_t dst_ofs = 0;
-		uint32_t raster_ofs = 0;
-		uint32_t comp_ofs = 0;
 
-		for (; ; )
+		// zlib header
+		if (block_flags & DEFL_ZLIB_HEADER)
 		{
-			if ((src_ofs + 1) > src_len)
-				return false;
+			PUT_BITS(0x78, 8);
+			PUT_BITS(0x01, 8);
+		}
 
-			const bool bfinal = (pSrc[src_ofs] & 1) != 0;
-			const uint32_t btype = (pSrc[src_ofs] >> 1) & 3;
-			if (btype != 0)
-				return false;
+		// write BFINAL bit
+		PUT_BITS((block_flags & DEFL_FINAL_BLOCK) ? 1 : 0, 1);
 
-			src_ofs++;
+		if (!defl_start_dynamic_block(&dh, pDst, dst_ofs, dst_buf_size, bit_buf, bit_buf_size))
+			return 0;
 
-			if ((src_ofs + 4) > src_len)
-				return false;
-			uint32_t len = pSrc[src_ofs + 0] | (pSrc[src_ofs + 1] << 8);
-			uint32_t nlen = pSrc[src_ofs + 2] | (pSrc[src_ofs + 3] << 8);
-			src_ofs += 4;
+		assert(bit_buf_size <= 7);
 
-			if (len != (~nlen & 0xFFFF))
-				return false;
+		for (uint32_t i = 0; i < total_codes; i++)
+		{
+			const lz_code& c = pCodes[i];
 
-			if ((src_ofs + len) > src_len)
-				return false;
+			if (c.m_len == 0)
+			{
+				FPNG_STATS_ONLY(counts.m_lits += c.m_dist;)
 
-			// Raw blocks are a relatively uncommon case so this isn't well optimized.
-			// Supports 3->4 and 4->3 byte/pixel conversion.
-			for (uint32_t i = 0; i < len; i++)
+				uint32_t lits = c.m_lits;
+				for (uint32_t j = 0; j < c.m_dist; j++, lits >>= 8)
+					PUT_BITS_CZ(dh.m_huff_codes[0][lits & 0xFF], dh.m_huff_code_sizes[0][lits & 0xFF]);
+			}
+			else
 			{
-				uint32_t c = pSrc[src_ofs + i];
+				FPNG_STATS_ONLY(counts.add_match(c.m_len);)
 
-				if (!raster_ofs)
-				{
-					// Check filter type
-					if (c != 0)
-						return false;
-					
-					assert(!comp_ofs);
-				}
-				else
-				{
-					if (comp_ofs < dst_chans)
-					{
-						if (dst_ofs == dst_len)
-							return false;
+				const uint32_t adj_match_len = c.m_len - 3;
 
-						pDst[dst_ofs++] = (uint8_t)c;
-					}
-					
-					if (++comp_ofs == src_chans)
-					{
-						if (dst_chans > src_chans)
-						{
-							if (dst_ofs == dst_len)
-								return false;
+				PUT_BITS_CZ(dh.m_huff_codes[0][g_defl_len_sym[adj_match_len]], dh.m_huff_code_sizes[0][g_defl_len_sym[adj_match_len]]);
+				PUT_BITS(adj_match_len & g_bitmasks[g_defl_len_extra[adj_match_len]], g_defl_len_extra[adj_match_len]);
 
-							pDst[dst_ofs++] = (uint8_t)0xFF;
-						}
+				uint32_t num_extra_bits, extra_bits;
+				const uint32_t sym = defl_get_dist_sym(c.m_dist, num_extra_bits, extra_bits);
+				PUT_BITS_CZ(dh.m_huff_codes[1][sym], dh.m_huff_code_sizes[1][sym]);
+				PUT_BITS(extra_bits, num_extra_bits);
+			}
 
-						comp_ofs = 0;
-					}
-				}
+			// up to 55 bits
+			PUT_BITS_FLUSH;
 
-				if (++raster_ofs == (src_bpl + 1))
-				{
-					assert(!comp_ofs);
-					raster_ofs = 0;
-				}
+			if ((pOut_crc32) && ((i & 1023) == 1023))
+			{
+				FPNG_STATS_ONLY(timer.lap(&fpng_encode_stats::m_entropy_ns);)
+				pOut_crc32->update_if_full(pDst, dst_ofs);
+				FPNG_STATS_ONLY(timer.lap(&fpng_encode_stats::m_crc32_ns);)
 			}
+		}
 
-			src_ofs += len;
+		PUT_BITS_CZ(dh.m_huff_codes[0][256], dh.m_huff_code_sizes[0][256]);
 
-			if (bfinal)
-				break;
-		}
+		if (pAdler32)
+			*pAdler32 = src_adler32;
 
-		if (comp_ofs != 0)
-			return false;
+		if (!defl_finish_block(pDst, dst_ofs, dst_buf_size, bit_buf, bit_buf_size, block_flags, src_adler32))
+			return 0;
 
-		// Check for zlib adler32
-		if ((src_ofs + 4) != zlib_len)
-			return false;
+		FPNG_STATS_ONLY(timer.lap(&fpng_encode_stats::m_entropy_ns);)
 
-		return (dst_ofs == dst_len);
+		if (pOut_crc32)
+			pOut_crc32->update(pDst, dst_ofs);
+
+		FPNG_STATS_ONLY(timer.lap(&fpng_encode_stats::m_crc32_ns); counts.flush(scratch.m_pStats); record_stats_table(scratch.m_pStats, FPNG_STATS_TABLE_DYNAMIC);)
+
+		return dst_ofs;
 	}
-	
-	template<uint32_t dst_comps>
-	static bool fpng_pixel_zlib_decompress_3(
-		const uint8_t* pSrc, uint32_t src_len, uint32_t zlib_len,
-		uint8_t* pDst, uint32_t w, uint32_t h)
+
+	// Returns the encode flags for fpng_encode_params::m_level, which (unless it's FPNG_LEVEL_FROM_FLAGS) overrides m_flags' compression flags.
+	static uint32_t get_encode_flags(const fpng_encode_params& params)
 	{
-		assert(src_len >= (zlib_len + 4));
+		if (params.m_level < 0)
+			return params.m_flags;
 
-		const uint32_t dst_bpl = w * dst_comps;
-		//const uint32_t dst_len = dst_bpl * h;
+		uint32_t flags = params.m_flags & ~(FPNG_ENCODE_SLOWER | FPNG_FORCE_UNCOMPRESSED | FPNG_ENCODE_ADAPTIVE_FILTERS);
 
-		if (zlib_len < 7)
-			return false;
+		switch (minimum<int>(params.m_level, FPNG_MAX_LEVEL))
+		{
+		case FPNG_LEVEL_UNCOMPRESSED: flags |= FPNG_FORCE_UNCOMPRESSED; break;
+		case FPNG_LEVEL_FASTEST: break;
+		case FPNG_LEVEL_MEDIUM: break;
+		case FPNG_LEVEL_SLOWER: flags |= FPNG_ENCODE_SLOWER; break;
+		default: flags |= FPNG_ENCODE_SLOWER | FPNG_ENCODE_ADAPTIVE_FILTERS; break;
+		}
 
-		// check zlib header
-		if ((pSrc[0] != 0x78) || (pSrc[1] != 0x01))
-			return false;
+		return flags;
+	}
 
-		uint32_t src_ofs = 2;
-		
-		if ((pSrc[src_ofs] & 6) == 0)
-			return fpng_pixel_zlib_raw_decompress(pSrc, src_len, zlib_len, pDst, w, h, 3, dst_comps);
-		
-		if ((src_ofs + 4) > src_len)
-			return false;
-		uint64_t bit_buf = READ_LE32(pSrc + src_ofs);
-		src_ofs += 4;
+	// Returns true for FPNG_LEVEL_MEDIUM, which has no public flag: the single pass compressor codes the image with a table built from a sample of its rows, instead of a preset.
+	static bool get_sampled_tables(const fpng_encode_params& params)
+	{
+		return minimum<int>(params.m_level, FPNG_MAX_LEVEL) == FPNG_LEVEL_MEDIUM;
+	}
 
-		uint32_t bit_buf_size = 32;
+	// Returns the number of bytes per pixel of an image with num_chans channels of 8 or 16 (FPNG_ENCODE_16BIT) bits.
+	static inline uint32_t get_bytes_per_pixel(uint32_t num_chans, uint32_t flags)
+	{
+		return (flags & FPNG_ENCODE_16BIT) ? (num_chans * 2) : num_chans;
+	}
 
-		uint32_t bfinal, btype;
-		GET_BITS(bfinal, 1);
-		GET_BITS(btype, 2);
+	const uint32_t INCOMPRESSIBLE_SAMPLE_ROWS = 16;
 
-		// Must be the final block or it's not valid, and type=2 (dynamic)
-		if ((bfinal != 1) || (btype != 2))
-			return false;
-		
-		uint32_t lit_table[FPNG_DECODER_TABLE_SIZE];
-		if (!prepare_dynamic_block(pSrc, src_len, src_ofs, bit_buf_size, bit_buf, lit_table, 3))
-			return false;
+	// Quickly estimates if an image (or strip) is too noisy to be worth compressing, so the caller can go straight to raw blocks instead of throwing away a full compression.
+	// A few evenly spaced rows are filtered, and the order-0 entropy of their bytes is computed, treating the bytes of pixels which repeat the previous pixel as free (RLE matches).
+	// Without FPNG_ENCODE_LZ_MATCHES, that's a lower bound on the size of the compressed rows, not counting the Huffman tables. It returns true if it's above 63/64 of the raw size.
+	// Matches at other distances aren't modeled, so with FPNG_ENCODE_LZ_MATCHES it's no bound at all (a row repeating a short noisy pattern looks incompressible) and the caller skips it.
+	// 16-bit samples aren't swapped to big endian here: filtering is bytewise, so that only reorders the filtered bytes, which doesn't change their histogram.
+	static bool is_incompressible(encode_scratch& scratch, const encode_source& src, uint32_t w, uint32_t h, uint32_t num_chans, uint32_t flags)
+	{
+		FPNG_STATS_ONLY(encode_stats_timer timer(scratch.m_pStats, &fpng_encode_stats::m_analysis_ns);)
 
-		const uint8_t* pPrev_scanline = nullptr;
-		uint8_t* pCur_scanline = pDst;
+		const bool adaptive_filters = (flags & FPNG_ENCODE_ADAPTIVE_FILTERS) != 0;
+		const uint32_t bpp = get_bytes_per_pixel(num_chans, flags);
+		const uint32_t src_bpl = w * bpp, bpl = src_bpl + 1;
 
-		for (uint32_t y = 0; y < h; y++)
+		uint8_t* pRow_buf = get_scratch_buf(scratch.m_row_buf, bpl + 8);
+
+		encode_row_reader src_rows(src, scratch.m_src_rows, src_bpl);
+
+		uint32_t hist[256];
+		memset(hist, 0, sizeof(hist));
+		
+		const uint32_t num_sample_rows = minimum(h, INCOMPRESSIBLE_SAMPLE_ROWS);
+		for (uint32_t i = 0; i < num_sample_rows; i++)
 		{
-			// At start of PNG scanline, so read the filter literal
-			assert(bit_buf_size >= FPNG_DECODER_TABLE_BITS);
-			uint32_t filter = lit_table[bit_buf & (FPNG_DECODER_TABLE_SIZE - 1)];
-			uint32_t filter_len = (filter >> 9) & 15;
-			if (!filter_len)
-				return false;
-			SKIP_BITS(filter_len);
-			filter &= 511;
+			const uint32_t y = (uint32_t)(((uint64_t)i * h + h / 2) / num_sample_rows);
+			const uint8_t* pPrev_src_row;
+			const uint8_t* pSrc_row = src_rows.row(y, pPrev_src_row);
+			apply_filter(adaptive_filters ? choose_filter(w, bpp, pSrc_row, pPrev_src_row) : (y ? 2 : 0), w, h, bpp, src_bpl, pSrc_row, pPrev_src_row, pRow_buf);
 
-			uint32_t expected_filter = (y ? 2 : 0);
-			if (filter != expected_filter)
-				return false;
+			hist[pRow_buf[0]]++;
 
-			uint32_t x_ofs = 0;
-			uint8_t prev_delta_r = 0, prev_delta_g = 0, prev_delta_b = 0;
-			do
+			const uint8_t* pPixels = pRow_buf + 1;
+			for (uint32_t x = 0; x < w; x++)
 			{
-				assert(bit_buf_size >= FPNG_DECODER_TABLE_BITS);
-				uint32_t lit0_tab = lit_table[bit_buf & (FPNG_DECODER_TABLE_SIZE - 1)];
-				
-				uint32_t lit0 = lit0_tab;
-				uint32_t lit0_len = (lit0_tab >> 9) & 15;
-				if (!lit0_len)
-					return false;
-				SKIP_BITS(lit0_len);
+				const uint8_t* pPixel = pPixels + x * bpp;
+				if ((x) && (memcmp(pPixel, pPixel - bpp, bpp) == 0))
+					continue;
 
-				if (lit0 & 256)
-				{
-					lit0 &= 511;
+				for (uint32_t c = 0; c < bpp; c++)
+					hist[pPixel[c]]++;
+			}
+		}
 
-					// Can't be EOB - we still have more pixels to decompress.
-					if (lit0 == 256)
-						return false;
+		uint32_t total = 0;
+		for (uint32_t i = 0; i < 256; i++)
+			total += hist[i];
 
-					// Must be an RLE match against the previous pixel.
-					uint32_t run_len = s_length_range[lit0 - 257];
-					if (lit0 >= 265)
-					{
-						uint32_t e;
-						GET_BITS_NE(e, s_length_extra[lit0 - 257]);
+		double bits = 0.0;
+		for (uint32_t i = 0; i < 256; i++)
+			if (hist[i])
+				bits += hist[i] * log2((double)total / hist[i]);
 
-						run_len += e;
-					}
-					
-					// Skip match distance - it's always the same (3)
-					SKIP_BITS_NE(1);
+		const uint64_t sampled_bits = (uint64_t)num_sample_rows * bpl * 8;
+		return bits >= (double)(sampled_bits - sampled_bits / 64);
+	}
 
-					// Matches must always be a multiple of 3/4 bytes
-					assert((run_len % 3) == 0);
-																				
-					if (dst_comps == 4)
-					{
-						const uint32_t x_ofs_end = x_ofs + g_run_len3_to_4[run_len];
-						
-						// Check for valid run lengths
-						if (x_ofs == x_ofs_end)
-							return false;
+	// src holds the unfiltered source rows, w*num_chans bytes each in the file (times 2 for 16-bit images). The Adler-32 is computed on each filtered row as it's compressed, and if pOut_crc32 isn't nullptr
+	// the CRC-32 of the output is folded in as it's written, so each byte of the image and of the output is only touched once.
+	// sampled_tables selects FPNG_LEVEL_MEDIUM's sampled tables, see get_sampled_tables().
+	// Returns 0 if the data didn't fit, or looked incompressible.
+	static uint32_t pixel_deflate(encode_scratch& scratch, const encode_source& src, uint32_t w, uint32_t h, uint32_t num_chans, uint32_t flags, bool sampled_tables, uint8_t* pDst, uint32_t dst_buf_size, uint32_t block_flags, uint32_t* pAdler32 = nullptr, defl_output_crc32* pOut_crc32 = nullptr)
+	{
+		// Returning 0 makes the caller fall back to raw blocks.
+		if (((flags & FPNG_ENCODE_LZ_MATCHES) == 0) && (is_incompressible(scratch, src, w, h, num_chans, flags)))
+			return 0;
 
-						// Matches cannot cross scanlines.
-						if (x_ofs_end > dst_bpl)
-							return false;
+		const bool adaptive_filters = (flags & FPNG_ENCODE_ADAPTIVE_FILTERS) != 0;
 
-						if (pPrev_scanline)
-						{
-							if ((prev_delta_r | prev_delta_g | prev_delta_b) == 0)
-							{
-								memcpy(pCur_scanline + x_ofs, pPrev_scanline + x_ofs, x_ofs_end - x_ofs);
-								x_ofs = x_ofs_end;
-							}
-							else
-							{
-								do
-								{
-									pCur_scanline[x_ofs] = (uint8_t)(pPrev_scanline[x_ofs] + prev_delta_r);
-									pCur_scanline[x_ofs + 1] = (uint8_t)(pPrev_scanline[x_ofs + 1] + prev_delta_g);
-									pCur_scanline[x_ofs + 2] = (uint8_t)(pPrev_scanline[x_ofs + 2] + prev_delta_b);
-									pCur_scanline[x_ofs + 3] = 0xFF;
-									x_ofs += 4;
-								} while (x_ofs < x_ofs_end);
-							}
-						}
-						else
-						{
-							do
-							{
-								pCur_scanline[x_ofs] = prev_delta_r;
-								pCur_scanline[x_ofs + 1] = prev_delta_g;
-								pCur_scanline[x_ofs + 2] = prev_delta_b;
-								pCur_scanline[x_ofs + 3] = 0xFF;
-								x_ofs += 4;
-							} while (x_ofs < x_ofs_end);
-						}
-					}
-					else
-					{
-						// Check for valid run lengths
-						if (!g_run_len3_to_4[run_len])
-							return false;
+		const bool lz_matches = (flags & FPNG_ENCODE_LZ_MATCHES) != 0, samples16 = (flags & FPNG_ENCODE_16BIT) != 0;
 
-						const uint32_t x_ofs_end = x_ofs + run_len;
+		// Grayscale, gray+alpha and 16-bit images always use two passes.
+		switch (get_bytes_per_pixel(num_chans, flags))
+		{
+		case 1: return pixel_deflate_dyn_lz<1>(scratch, src, w, h, pDst, dst_buf_size, block_flags, pAdler32, pOut_crc32, adaptive_filters, lz_matches, samples16);
+		case 2: return pixel_deflate_dyn_lz<2>(scratch, src, w, h, pDst, dst_buf_size, block_flags, pAdler32, pOut_crc32, adaptive_filters, lz_matches, samples16);
+		case 6: return pixel_deflate_dyn_lz<6>(scratch, src, w, h, pDst, dst_buf_size, block_flags, pAdler32, pOut_crc32, adaptive_filters, lz_matches, samples16);
+		case 8: return pixel_deflate_dyn_lz<8>(scratch, src, w, h, pDst, dst_buf_size, block_flags, pAdler32, pOut_crc32, adaptive_filters, lz_matches, samples16);
+		default: break;
+		}
 
-						// Matches cannot cross scanlines.
-						if (x_ofs_end > dst_bpl)
-							return false;
+		// 16-bit gray+alpha pixels are also 4 bytes.
+		if ((lz_matches) || (samples16))
+			return (num_chans == 3) ? pixel_deflate_dyn_lz<3>(scratch, src, w, h, pDst, dst_buf_size, block_flags, pAdler32, pOut_crc32, adaptive_filters, lz_matches, false) : pixel_deflate_dyn_lz<4>(scratch, src, w, h, pDst, dst_buf_size, block_flags, pAdler32, pOut_crc32, adaptive_filters, lz_matches, samples16);
 
-						if (pPrev_scanline)
-						{
-							if ((prev_delta_r | prev_delta_g | prev_delta_b) == 0)
-							{
-								memcpy(pCur_scanline + x_ofs, pPrev_scanline + x_ofs, run_len);
-								x_ofs = x_ofs_end;
-							}
-							else
-							{
-								do
-								{
-									pCur_scanline[x_ofs] = (uint8_t)(pPrev_scanline[x_ofs] + prev_delta_r);
-									pCur_scanline[x_ofs + 1] = (uint8_t)(pPrev_scanline[x_ofs + 1] + prev_delta_g);
-									pCur_scanline[x_ofs + 2] = (uint8_t)(pPrev_scanline[x_ofs + 2] + prev_delta_b);
-									x_ofs += 3;
-								} while (x_ofs < x_ofs_end);
-							}
-						}
-						else
-						{
-							do
-							{
-								pCur_scanline[x_ofs] = prev_delta_r;
-								pCur_scanline[x_ofs + 1] = prev_delta_g;
-								pCur_scanline[x_ofs + 2] = prev_delta_b;
-								x_ofs += 3;
-							} while (x_ofs < x_ofs_end);
-						}
-					}
-				}
-				else
-				{
-					uint32_t lit1, lit2;
+		if (sampled_tables)
+			return pixel_deflate_dyn_sampled(scratch, src, w, h, num_chans, pDst, dst_buf_size, block_flags, pAdler32, pOut_crc32, adaptive_filters);
 
-					uint32_t lit1_spec_len = (lit0_tab >> (16 + 9));
-					uint32_t lit2_len;
-					if (lit1_spec_len)
-					{
-						lit1 = (lit0_tab >> 16) & 511;
-						SKIP_BITS_NE(lit1_spec_len);
+		if (num_chans == 3)
+		{
+			if (flags & FPNG_ENCODE_SLOWER)
+				return pixel_deflate_dyn_3_rle(scratch, src, w, h, pDst, dst_buf_size, block_flags, pAdler32, pOut_crc32, adaptive_filters);
+			else
+			{
+				const uint32_t preset = select_huff_preset(scratch, src, w, h, 3, adaptive_filters, g_dyn_huff_3_presets, sizeof(g_dyn_huff_3_presets) / sizeof(g_dyn_huff_3_presets[0]));
+				return pixel_deflate_dyn_3_rle_one_pass(scratch, src, w, h, pDst, dst_buf_size, block_flags, pAdler32, pOut_crc32, adaptive_filters, g_dyn_huff_3_presets[preset]);
+			}
+		}
+		
+		if (flags & FPNG_ENCODE_SLOWER)
+			return pixel_deflate_dyn_4_rle(scratch, src, w, h, pDst, dst_buf_size, block_flags, pAdler32, pOut_crc32, adaptive_filters);
+		
+		const uint32_t preset = select_huff_preset(scratch, src, w, h, 4, adaptive_filters, g_dyn_huff_4_presets, sizeof(g_dyn_huff_4_presets) / sizeof(g_dyn_huff_4_presets[0]));
+		return pixel_deflate_dyn_4_rle_one_pass(scratch, src, w, h, pDst, dst_buf_size, block_flags, pAdler32, pOut_crc32, adaptive_filters, g_dyn_huff_4_presets[preset]);
+	}
 
-						assert(bit_buf_size >= FPNG_DECODER_TABLE_BITS);
-						lit2 = lit_table[bit_buf & (FPNG_DECODER_TABLE_SIZE - 1)];
-						lit2_len = (lit2 >> 9) & 15;
-						if (!lit2_len)
-							return false;
-					}
-					else
-					{
-						assert(bit_buf_size >= FPNG_DECODER_TABLE_BITS);
-						lit1 = lit_table[bit_buf & (FPNG_DECODER_TABLE_SIZE - 1)];
-						uint32_t lit1_len = (lit1 >> 9) & 15;
-						if (!lit1_len)
-							return false;
-						SKIP_BITS_NE(lit1_len);
+	// Runs pTask over [0, num_tasks), either via the user's dispatch function or on up to num_threads threads (including the caller's).
+	static void dispatch_tasks(uint32_t num_tasks, uint32_t num_threads, fpng_task_func pTask, void* pTask_data, fpng_dispatch_func pDispatch, void* pDispatch_user_data)
+	{
+		if (pDispatch)
+		{
+			pDispatch(num_tasks, pTask, pTask_data, pDispatch_user_data);
+			return;
+		}
 
-						lit2_len = (lit1 >> (16 + 9));
-						if (lit2_len)
-							lit2 = lit1 >> 16;
-						else
-						{
-							assert(bit_buf_size >= FPNG_DECODER_TABLE_BITS);
-							lit2 = lit_table[bit_buf & (FPNG_DECODER_TABLE_SIZE - 1)];
-							lit2_len = (lit2 >> 9) & 15;
-							if (!lit2_len)
-								return false;
-						}
-					}
+#if !FPNG_NO_THREADING
+		std::atomic<uint32_t> next_task(0);
 
-					SKIP_BITS(lit2_len);
-					
-					// Check for matches
-					if ((lit1 | lit2) & 256)
-						return false;
+		auto worker_func = [&]()
+		{
+			uint32_t task_index;
+			while ((task_index = next_task.fetch_add(1)) < num_tasks)
+				pTask(task_index, pTask_data);
+		};
 
-					if (dst_comps == 4)
-					{
-						if (pPrev_scanline)
-						{
-							pCur_scanline[x_ofs] = (uint8_t)(pPrev_scanline[x_ofs] + lit0);
-							pCur_scanline[x_ofs + 1] = (uint8_t)(pPrev_scanline[x_ofs + 1] + lit1);
-							pCur_scanline[x_ofs + 2] = (uint8_t)(pPrev_scanline[x_ofs + 2] + lit2);
-							pCur_scanline[x_ofs + 3] = 0xFF;
-						}
-						else
-						{
-							pCur_scanline[x_ofs] = (uint8_t)lit0;
-							pCur_scanline[x_ofs + 1] = (uint8_t)lit1;
-							pCur_scanline[x_ofs + 2] = (uint8_t)lit2;
-							pCur_scanline[x_ofs + 3] = 0xFF;
-						}
-						x_ofs += 4;
-					}
-					else
-					{
-						if (pPrev_scanline)
-						{
-							pCur_scanline[x_ofs] = (uint8_t)(pPrev_scanline[x_ofs] + lit0);
-							pCur_scanline[x_ofs + 1] = (uint8_t)(pPrev_scanline[x_ofs + 1] + lit1);
-							pCur_scanline[x_ofs + 2] = (uint8_t)(pPrev_scanline[x_ofs + 2] + lit2);
-						}
-						else
-						{
-							pCur_scanline[x_ofs] = (uint8_t)lit0;
-							pCur_scanline[x_ofs + 1] = (uint8_t)lit1;
-							pCur_scanline[x_ofs + 2] = (uint8_t)lit2;
-						}
-						x_ofs += 3;
-					}
+		std::vector<std::thread> threads;
+		for (uint32_t i = 1; i < minimum(num_threads, num_tasks); i++)
+			threads.emplace_back(worker_func);
 
-					prev_delta_r = (uint8_t)lit0;
-					prev_delta_g = (uint8_t)lit1;
-					prev_delta_b = (uint8_t)lit2;
-										
-					// See if we can decode one more pixel.
-					uint32_t spec_next_len0_len = lit2 >> (16 + 9);
-					if ((spec_next_len0_len) && (x_ofs < dst_bpl))
-					{
-						lit0 = (lit2 >> 16) & 511;
-						if (lit0 < 256)
-						{
-							SKIP_BITS_NE(spec_next_len0_len);
+		worker_func();
 
-							assert(bit_buf_size >= FPNG_DECODER_TABLE_BITS);
-							lit1 = lit_table[bit_buf & (FPNG_DECODER_TABLE_SIZE - 1)];
-							uint32_t lit1_len = (lit1 >> 9) & 15;
-							if (!lit1_len)
-								return false;
-							SKIP_BITS(lit1_len);
+		for (auto& t : threads)
+			t.join();
+#else
+		(void)num_threads;
 
-							lit2_len = (lit1 >> (16 + 9));
-							if (lit2_len)
-								lit2 = lit1 >> 16;
-							else
-							{
-								assert(bit_buf_size >= FPNG_DECODER_TABLE_BITS);
-								lit2 = lit_table[bit_buf & (FPNG_DECODER_TABLE_SIZE - 1)];
-								lit2_len = (lit2 >> 9) & 15;
-								if (!lit2_len)
-									return false;
-							}
+		for (uint32_t i = 0; i < num_tasks; i++)
+			pTask(i, pTask_data);
+#endif
+	}
 
-							SKIP_BITS_NE(lit2_len);
+	struct encode_strip
+	{
+		uint32_t m_first_row, m_num_rows;
+		std::vector<uint8_t> m_defl;
+		uint32_t m_defl_size, m_adler32, m_crc32;
+		bool m_stored; // true if the strip didn't compress, and was written as raw blocks
+		encode_scratch m_scratch;
+		fpng_encode_stats m_stats; // summed into fpng_encode_params::m_pStats once all the strips are done
+	};
 
-							// Check for matches
-							if ((lit1 | lit2) & 256)
-								return false;
-					
-							if (dst_comps == 4)
-							{
-								if (pPrev_scanline)
-								{
-									pCur_scanline[x_ofs] = (uint8_t)(pPrev_scanline[x_ofs] + lit0);
-									pCur_scanline[x_ofs + 1] = (uint8_t)(pPrev_scanline[x_ofs + 1] + lit1);
-									pCur_scanline[x_ofs + 2] = (uint8_t)(pPrev_scanline[x_ofs + 2] + lit2);
-									pCur_scanline[x_ofs + 3] = 0xFF;
-								}
-								else
-								{
-									pCur_scanline[x_ofs] = (uint8_t)lit0;
-									pCur_scanline[x_ofs + 1] = (uint8_t)lit1;
-									pCur_scanline[x_ofs + 2] = (uint8_t)lit2;
-									pCur_scanline[x_ofs + 3] = 0xFF;
-								}
-								x_ofs += 4;
-							}
-							else
-							{
-								if (pPrev_scanline)
-								{
-									pCur_scanline[x_ofs] = (uint8_t)(pPrev_scanline[x_ofs] + lit0);
-									pCur_scanline[x_ofs + 1] = (uint8_t)(pPrev_scanline[x_ofs + 1] + lit1);
-									pCur_scanline[x_ofs + 2] = (uint8_t)(pPrev_scanline[x_ofs + 2] + lit2);
-								}
-								else
-								{
-									pCur_scanline[x_ofs] = (uint8_t)lit0;
-									pCur_scanline[x_ofs + 1] = (uint8_t)lit1;
-									pCur_scanline[x_ofs + 2] = (uint8_t)lit2;
-								}
-								x_ofs += 3;
-							}
+	struct fpng_encode_context::scratch
+	{
+		encode_scratch m_single;
+		std::vector<encode_strip> m_strips;
+		std::vector<uint8_t> m_fdec_chunk;
+	};
 
-							prev_delta_r = (uint8_t)lit0;
-							prev_delta_g = (uint8_t)lit1;
-							prev_delta_b = (uint8_t)lit2;
-																				
-						} // if (lit0 < 256)
+	fpng_encode_context::fpng_encode_context() : m_pScratch(nullptr)
+	{
+	}
 
-					} // if ((spec_next_len0_len) && (x_ofs < bpl))
-				}
+	fpng_encode_context::~fpng_encode_context()
+	{
+		delete m_pScratch;
+	}
 
-			} while (x_ofs < dst_bpl);
+	void fpng_encode_context::clear()
+	{
+		delete m_pScratch;
+		m_pScratch = nullptr;
+	}
 
-			pPrev_scanline = pCur_scanline;
-			pCur_scanline += dst_bpl;
+	fpng_encode_context::scratch* fpng_encode_context::get_scratch()
+	{
+		if (!m_pScratch)
+			m_pScratch = new scratch;
+		return m_pScratch;
+	}
 
-		} // y
+	struct encode_strips_job
+	{
+		const encode_source* m_pSrc;
+		uint32_t m_w, m_num_chans, m_flags;
+		bool m_sampled_tables;
+		encode_strip* m_pStrips;
+		uint32_t m_num_strips;
+	};
 
-		// The last symbol should be EOB
-		assert(bit_buf_size >= FPNG_DECODER_TABLE_BITS);
-		uint32_t lit0 = lit_table[bit_buf & (FPNG_DECODER_TABLE_SIZE - 1)];
-		uint32_t lit0_len = (lit0 >> 9) & 15;
-		if (!lit0_len)
-			return false;
-		lit0 &= 511;
-		if (lit0 != 256)
-			return false;
+	// Filters and compresses a single strip. Each strip's first row always uses filter 0, and each strip is coded as its own Deflate block which ends on a byte boundary.
+	// Strips which don't compress are written as raw blocks instead.
+	static void encode_strip_task(uint32_t strip_index, void* pData)
+	{
+		const encode_strips_job& job = *static_cast<const encode_strips_job*>(pData);
+		encode_strip& strip = job.m_pStrips[strip_index];
 
-		bit_buf_size -= lit0_len;
-		bit_buf >>= lit0_len;
+		const uint32_t bpp = get_bytes_per_pixel(job.m_num_chans, job.m_flags);
+		const uint32_t bpl = job.m_w * bpp;
 
-		uint32_t align_bits = bit_buf_size & 7;
-		bit_buf_size -= align_bits;
-		bit_buf >>= align_bits;
+		uint32_t block_flags = 0;
+		if (!strip_index)
+			block_flags |= DEFL_ZLIB_HEADER;
+		if (strip_index == (job.m_num_strips - 1))
+			block_flags |= DEFL_FINAL_BLOCK;
 
-		if (src_ofs < (bit_buf_size >> 3))
-			return false;
-		src_ofs -= (bit_buf_size >> 3);
+		// Also large enough for the strip's raw blocks.
+		const uint32_t defl_buf_size = (uint32_t)minimum<uint64_t>(maximum<uint64_t>(((uint64_t)(bpl + 1) * strip.m_num_rows + 64) & ~7ULL, get_raw_zlib_size(job.m_w, strip.m_num_rows, bpp)), MAX_ZLIB_BUF_SIZE);
+		uint8_t* pDefl = get_scratch_buf(strip.m_defl, defl_buf_size);
+		
+		const encode_source strip_src(job.m_pSrc->from_row(strip.m_first_row));
 
-		// We should be at the very end, because the bit buf reads ahead 32-bits (which contains the zlib adler32).
-		if ((src_ofs + 4) != zlib_len)
-			return false;
+		strip.m_adler32 = FPNG_ADLER32_INIT;
+		strip.m_stored = false;
+		strip.m_stats.clear();
+		defl_output_crc32 out_crc32;
+		strip.m_defl_size = pixel_deflate(strip.m_scratch, strip_src, job.m_w, strip.m_num_rows, job.m_num_chans, job.m_flags, job.m_sampled_tables, 
+			pDefl, defl_buf_size, block_flags, &strip.m_adler32, &out_crc32);
 
-		return true;
+		if (!strip.m_defl_size)
+		{
+			// Only this strip falls back to raw blocks, which the fdEC strip index marks so the decoder knows what to expect.
+			out_crc32 = defl_output_crc32();
+			strip.m_stored = true;
+			FPNG_STATS_ONLY(record_raw_fallback(strip.m_scratch.m_pStats);)
+			encode_row_reader strip_rows(strip_src, strip.m_scratch.m_src_rows, bpl);
+			strip.m_defl_size = write_raw_block(strip_rows, job.m_w, strip.m_num_rows, bpp, pDefl, defl_buf_size, block_flags, &strip.m_adler32, &out_crc32, (job.m_flags & FPNG_ENCODE_16BIT) != 0, strip.m_scratch.m_pStats);
+		}
+		
+		strip.m_crc32 = strip.m_defl_size ? out_crc32.m_crc32 : 0;
 	}
 
-	template<uint32_t dst_comps>
-	static bool fpng_pixel_zlib_decompress_4(
-		const uint8_t* pSrc, uint32_t src_len, uint32_t zlib_len,
-		uint8_t* pDst, uint32_t w, uint32_t h)
+	// Creates a version 1 fdEC chunk. Its data is the fdEC sig and version byte, followed by the big endian 32-bit number of strips, then for each strip:
+	// its big endian 32-bit byte offset from the start of the zlib data (strips are byte aligned), its big endian 32-bit first row, and its 8-bit Huffman table ID (FPNG_FDEC_STRIP_TABLE_DYNAMIC, or FPNG_FDEC_STRIP_TABLE_STORED for raw blocks).
+	static void create_fdec_strip_chunk(std::vector<uint8_t>& chunk, const encode_strip* pStrips, uint32_t num_strips)
 	{
-		assert(src_len >= (zlib_len + 4));
-
-		const uint32_t dst_bpl = w * dst_comps;
-		//const uint32_t dst_len = dst_bpl * h;
-
-		if (zlib_len < 7)
-			return false;
+		const uint32_t data_len = 9 + num_strips * FPNG_FDEC_STRIP_ENTRY_SIZE;
+		
+		chunk.resize(0);
+		chunk.reserve(12 + data_len);
 
-		// check zlib header
-		if ((pSrc[0] != 0x78) || (pSrc[1] != 0x01))
-			return false;
+		const uint8_t prefix[] = { (uint8_t)(data_len >> 24), (uint8_t)(data_len >> 16), (uint8_t)(data_len >> 8), (uint8_t)data_len, 'f', 'd', 'E', 'C', 82, 36, 147, 227, FPNG_FDEC_VERSION,
+			(uint8_t)(num_strips >> 24), (uint8_t)(num_strips >> 16), (uint8_t)(num_strips >> 8), (uint8_t)num_strips };
+		vector_append(chunk, prefix, sizeof(prefix));
 
-		uint32_t src_ofs = 2;
+		uint32_t strip_ofs = 2; // skip the zlib header
+		for (uint32_t i = 0; i < num_strips; i++)
+		{
+			const uint32_t first_row = pStrips[i].m_first_row;
+			const uint8_t entry[FPNG_FDEC_STRIP_ENTRY_SIZE] = { (uint8_t)(strip_ofs >> 24), (uint8_t)(strip_ofs >> 16), (uint8_t)(strip_ofs >> 8), (uint8_t)strip_ofs,
+				(uint8_t)(first_row >> 24), (uint8_t)(first_row >> 16), (uint8_t)(first_row >> 8), (uint8_t)first_row, 
+				pStrips[i].m_stored ? FPNG_FDEC_STRIP_TABLE_STORED : FPNG_FDEC_STRIP_TABLE_DYNAMIC };
+			vector_append(chunk, entry, sizeof(entry));
 
-		if ((pSrc[src_ofs] & 6) == 0)
-			return fpng_pixel_zlib_raw_decompress(pSrc, src_len, zlib_len, pDst, w, h, 4, dst_comps);
+			strip_ofs += pStrips[i].m_defl_size - (i ? 0 : 2);
+		}
 
-		if ((src_ofs + 4) > src_len)
-			return false;
-		uint64_t bit_buf = READ_LE32(pSrc + src_ofs);
-		src_ofs += 4;
+		uint32_t c = fpng_crc32(chunk.data() + 4, 4 + data_len, FPNG_CRC32_INIT);
+		const uint8_t crc[4] = { (uint8_t)(c >> 24), (uint8_t)(c >> 16), (uint8_t)(c >> 8), (uint8_t)c };
+		vector_append(chunk, crc, sizeof(crc));
+	}
 
-		uint32_t bit_buf_size = 32;
+	// Strip-parallel encoding. Returns the size of the file written to pDst, or 0 on failure (including if the output doesn't fit or is larger than the raw fallback).
+	static size_t encode_strips(const encode_source& src, uint32_t w, uint32_t h, uint32_t num_chans, uint8_t* pDst, size_t dst_buf_size, const fpng_encode_params& params, uint32_t num_strips)
+	{
+		// The strips (and their compressed data and scratch buffers) are kept by the context, if there is one.
+		std::vector<encode_strip> local_strips;
+		std::vector<uint8_t> local_fdec_chunk;
+		fpng_encode_context::scratch* pContext_scratch = params.m_pContext ? params.m_pContext->get_scratch() : nullptr;
+
+		std::vector<encode_strip>& strips = pContext_scratch ? pContext_scratch->m_strips : local_strips;
+		std::vector<uint8_t>& fdec_chunk = pContext_scratch ? pContext_scratch->m_fdec_chunk : local_fdec_chunk;
+		if (strips.size() < num_strips)
+			strips.resize(num_strips);
+
+		const uint32_t rows_per_strip = h / num_strips;
+		for (uint32_t i = 0; i < num_strips; i++)
+		{
+			strips[i].m_first_row = i * rows_per_strip;
+			strips[i].m_num_rows = (i == (num_strips - 1)) ? (h - strips[i].m_first_row) : rows_per_strip;
+			strips[i].m_scratch.m_pStats = params.m_pStats ? &strips[i].m_stats : nullptr;
+		}
 
-		uint32_t bfinal, btype;
-		GET_BITS(bfinal, 1);
-		GET_BITS(btype, 2);
+		encode_strips_job job;
+		job.m_pSrc = &src;
+		job.m_w = w;
+		job.m_num_chans = num_chans;
+		job.m_flags = get_encode_flags(params);
+		job.m_sampled_tables = get_sampled_tables(params);
+		job.m_pStrips = strips.data();
+		job.m_num_strips = num_strips;
 
-		// Must be the final block or it's not valid, and type=2 (dynamic)
-		if ((bfinal != 1) || (btype != 2))
-			return false;
+		dispatch_tasks(num_strips, params.m_num_threads, encode_strip_task, &job, params.m_pDispatch, params.m_pDispatch_user_data);
 
-		uint32_t lit_table[FPNG_DECODER_TABLE_SIZE];
-		if (!prepare_dynamic_block(pSrc, src_len, src_ofs, bit_buf_size, bit_buf, lit_table, 4))
-			return false;
+#if FPNG_STATS
+		if (params.m_pStats)
+		{
+			for (uint32_t i = 0; i < num_strips; i++)
+				add_encode_stats(*params.m_pStats, strips[i].m_stats);
+		}
+#endif
 
-		const uint8_t* pPrev_scanline = nullptr;
-		uint8_t* pCur_scanline = pDst;
+		const uint32_t bpl = w * get_bytes_per_pixel(num_chans, job.m_flags);
 
-		for (uint32_t y = 0; y < h; y++)
+		uint64_t total_defl_size = 0;
+		for (uint32_t i = 0; i < num_strips; i++)
 		{
-			// At start of PNG scanline, so read the filter literal
-			assert(bit_buf_size >= FPNG_DECODER_TABLE_BITS);
-			uint32_t filter = lit_table[bit_buf & (FPNG_DECODER_TABLE_SIZE - 1)];
-			uint32_t filter_len = (filter >> 9) & 15;
-			if (!filter_len)
-				return false;
-			SKIP_BITS(filter_len);
-			filter &= 511;
+			if (!strips[i].m_defl_size)
+				return 0;
+			total_defl_size += strips[i].m_defl_size;
+		}
 
-			uint32_t expected_filter = (y ? 2 : 0);
-			if (filter != expected_filter)
-				return false;
+		create_fdec_strip_chunk(fdec_chunk, strips.data(), num_strips);
 
-			uint32_t x_ofs = 0;
-			uint8_t prev_delta_r = 0, prev_delta_g = 0, prev_delta_b = 0, prev_delta_a = 0;
-			do
-			{
-				assert(bit_buf_size >= FPNG_DECODER_TABLE_BITS);
-				uint32_t lit0_tab = lit_table[bit_buf & (FPNG_DECODER_TABLE_SIZE - 1)];
+		const uint32_t PNG_HEADER_SIZE = PNG_SIG_IHDR_SIZE + (uint32_t)fdec_chunk.size() + PNG_IDAT_HEADER_SIZE;
 
-				uint32_t lit0 = lit0_tab;
-				uint32_t lit0_len = (lit0_tab >> 9) & 15;
-				if (!lit0_len)
-					return false;
-				SKIP_BITS(lit0_len);
+		// Only accept the output if it's no larger than the raw fallback would be, plus one more raw block header per strip (strips written as raw blocks 
+		// can end with a partial block).
+		if ((total_defl_size + 4) > get_raw_zlib_size(w, h, get_bytes_per_pixel(num_chans, job.m_flags)) + num_strips * 5)
+			return 0;
 
-				if (lit0 & 256)
-				{
-					lit0 &= 511;
+		// The fdEC strip offsets are 32-bit.
+		if ((total_defl_size + 4) > MAX_ZLIB_BUF_SIZE)
+			return 0;
 
-					// Can't be EOB - we still have more pixels to decompress.
-					if (lit0 == 256)
-						return false;
+		const uint32_t idat_len = (uint32_t)total_defl_size + 4;
 
-					// Must be an RLE match against the previous pixel.
-					uint32_t run_len = s_length_range[lit0 - 257];
+		if ((uint64_t)PNG_HEADER_SIZE + idat_len + get_idat_split_overhead(idat_len) + PNG_TRAILER_SIZE > dst_buf_size)
+			return 0;
+		
+		size_t out_ofs = write_png_header(pDst, w, h, num_chans, idat_len, fdec_chunk.data(), (uint32_t)fdec_chunk.size(), (job.m_flags & FPNG_ENCODE_16BIT) ? 16 : 8);
+		assert(out_ofs == PNG_HEADER_SIZE);
+
+		uint32_t adler32 = FPNG_ADLER32_INIT, crc32 = fpng_crc32("IDAT", 4, FPNG_CRC32_INIT);
+		for (uint32_t i = 0; i < num_strips; i++)
+		{
+			const encode_strip& strip = strips[i];
+
+			memcpy(pDst + out_ofs, strip.m_defl.data(), strip.m_defl_size);
+			out_ofs += strip.m_defl_size;
+			
+			adler32 = i ? fpng_adler32_combine(adler32, strip.m_adler32, (uint64_t)(bpl + 1) * strip.m_num_rows) : strip.m_adler32;
+			crc32 = fpng_crc32_combine(crc32, strip.m_crc32, strip.m_defl_size);
+		}
+
+		// Write zlib adler32
+		for (uint32_t i = 0; i < 4; i++, adler32 <<= 8)
+			pDst[out_ofs++] = (uint8_t)(adler32 >> 24);
+
+		crc32 = fpng_crc32(pDst + out_ofs - 4, 4, crc32);
+
+		return write_idat_chunks(pDst, PNG_HEADER_SIZE - PNG_IDAT_HEADER_SIZE, idat_len, crc32);
+	}
+
+	uint64_t fpng_get_max_encoded_size(uint32_t w, uint32_t h, uint32_t num_chans, uint32_t flags)
+	{
+		if ((w < 1) || (h < 1) || (w * (uint64_t)h > UINT32_MAX) || (w > FPNG_MAX_SUPPORTED_DIM) || (h > FPNG_MAX_SUPPORTED_DIM) || (num_chans < 1) || (num_chans > 4))
+			return 0;
+		
+		// The compressed output is never allowed to be larger than the raw fallback. Strip-parallel files also have a larger fdEC chunk, holding at most one entry per FPNG_MIN_STRIP_ROWS rows,
+		// and may have one more raw block header per strip.
+		const uint64_t max_strips = h / FPNG_MIN_STRIP_ROWS;
+		const uint64_t max_fdec_chunk_size = maximum<uint64_t>(sizeof(s_fdec_chunk_single_block), 12 + 9 + max_strips * FPNG_FDEC_STRIP_ENTRY_SIZE);
+
+		const uint64_t max_zlib_size = get_raw_zlib_size(w, h, get_bytes_per_pixel(num_chans, flags)) + max_strips * 5;
+
+		return PNG_SIG_IHDR_SIZE + max_fdec_chunk_size + PNG_IDAT_HEADER_SIZE + max_zlib_size + get_idat_split_overhead(max_zlib_size) + PNG_TRAILER_SIZE;
+	}
+
+	bool fpng_encode_image_to_memory(const void* pImage, uint32_t w, uint32_t h, uint32_t num_chans, std::vector<uint8_t>& out_buf, uint32_t flags)
+	{
+		fpng_encode_params params;
+		params.m_flags = flags;
+
+		return fpng_encode_image_to_memory(pImage, w, h, num_chans, out_buf, params);
+	}
+
+	bool fpng_encode_image_to_memory(const void* pImage, uint32_t w, uint32_t h, uint32_t num_chans, std::vector<uint8_t>& out_buf, const fpng_encode_params& params)
+	{
+		const uint64_t max_size = fpng_get_max_encoded_size(w, h, num_chans, params.m_flags);
+		if ((!max_size) || (max_size > SIZE_MAX))
+		{
+			assert(0);
+			return false;
+		}
+
+		out_buf.resize((size_t)max_size);
+
+		const size_t size = fpng_encode_image_to_memory(pImage, w, h, num_chans, out_buf.data(), out_buf.size(), params);
+		if (!size)
+		{
+			out_buf.resize(0);
+			return false;
+		}
+
+		out_buf.resize(size);
+		return true;
+	}
+
+	// Sets up the rows of an image to encode from fpng_encode_params' pixel format, and its row pitch, row pointers or row callback. Returns false if they're invalid.
+	static bool init_encode_source(encode_source& src, const void* pImage, uint32_t w, uint32_t num_chans, const fpng_encode_params& params)
+	{
+		const uint32_t flags = get_encode_flags(params);
+
+		// Other pixel formats are converted a row at a time as they're compressed. They must have the number of channels written to the file, and 8 bits per channel.
+		uint32_t file_chans, src_bpp;
+		pixel_convert_func pConvert;
+		if ((!get_pixel_format<true>(params.m_src_format, num_chans, file_chans, src_bpp, pConvert)) || (file_chans != num_chans) || ((pConvert) && (flags & FPNG_ENCODE_16BIT)))
+			return false;
+
+		const size_t src_bpl = (size_t)w * (pConvert ? src_bpp : get_bytes_per_pixel(num_chans, flags));
+
+		if (params.m_pRead_row)
+		{
+			src = encode_source(nullptr, src_bpl, w, pConvert);
+			src.m_pRead_row = params.m_pRead_row;
+			src.m_pRead_row_user_data = params.m_pRead_row_user_data;
+		}
+		else if (params.m_ppSrc_rows)
+		{
+			src = encode_source(nullptr, src_bpl, w, pConvert);
+			src.m_ppRows = reinterpret_cast<const uint8_t* const*>(params.m_ppSrc_rows);
+		}
+		else
+		{
+			if ((!pImage) || ((params.m_src_pitch) && (params.m_src_pitch < src_bpl)))
+				return false;
+
+			src = encode_source(static_cast<const uint8_t*>(pImage), params.m_src_pitch ? params.m_src_pitch : src_bpl, w, pConvert);
+		}
+
+		return true;
+	}
+
+	// pOutput_func is told how much of the single block zlib stream (after the PNG header) is final as it's compressed, see defl_output_crc32. Strip-parallel encodes don't call it.
+	// pRow_func sees the rows as they're compressed, see encode_source. Strip-parallel encodes don't call it either.
+	static size_t encode_image_to_memory(const void* pImage, uint32_t w, uint32_t h, uint32_t num_chans, void* pDst_buf, size_t dst_buf_size, const fpng_encode_params& params, 
+		defl_output_func pOutput_func = nullptr, void* pOutput_user_data = nullptr, encode_row_func pRow_func = nullptr, void* pRow_user_data = nullptr)
+	{
+		if (!endian_check())
+		{
+			assert(0);
+			return 0;
+		}
+
+		if ((!pDst_buf) || (w < 1) || (h < 1) || (w * (uint64_t)h > UINT32_MAX) || (w > FPNG_MAX_SUPPORTED_DIM) || (h > FPNG_MAX_SUPPORTED_DIM))
+		{
+			assert(0);
+			return 0;
+		}
+
+		if ((num_chans < 1) || (num_chans > 4))
+		{
+			assert(0);
+			return 0;
+		}
+
+		uint8_t* pDst = static_cast<uint8_t*>(pDst_buf);
+
+		const uint32_t flags = get_encode_flags(params);
+		const bool samples16 = (flags & FPNG_ENCODE_16BIT) != 0;
+		const uint32_t bpp = get_bytes_per_pixel(num_chans, flags);
+
+		int bpl = w * bpp;
+
+		encode_source src(nullptr, 0, w);
+		if (!init_encode_source(src, pImage, w, num_chans, params))
+		{
+			assert(0);
+			return 0;
+		}
+
+		src.m_pRow_func = pRow_func;
+		src.m_pRow_user_data = pRow_user_data;
+
+		if ((params.m_num_threads > 1) && ((flags & FPNG_FORCE_UNCOMPRESSED) == 0))
+		{
+			const uint32_t num_strips = minimum(params.m_num_threads, h / FPNG_MIN_STRIP_ROWS);
+			if (num_strips > 1)
+			{
+				const size_t size = encode_strips(src, w, h, num_chans, pDst, dst_buf_size, params, num_strips);
+				if (size)
+					return size;
+
+				// Fall back to raw blocks.
+				FPNG_STATS_ONLY(if (params.m_pStats) params.m_pStats->m_raw_fallback = true;)
+
+				fpng_encode_params raw_params(params);
+				raw_params.m_flags = flags | FPNG_FORCE_UNCOMPRESSED;
+				raw_params.m_level = FPNG_LEVEL_FROM_FLAGS;
+				return encode_image_to_memory(pImage, w, h, num_chans, pDst_buf, dst_buf_size, raw_params, pOutput_func, pOutput_user_data, pRow_func, pRow_user_data);
+			}
+		}
+
+		const uint32_t PNG_HEADER_SIZE = PNG_SIG_IHDR_SIZE + sizeof(s_fdec_chunk_single_block) + PNG_IDAT_HEADER_SIZE;
+		
+		if (dst_buf_size < (PNG_HEADER_SIZE + PNG_TRAILER_SIZE))
+			return 0;
+
+		// Space left for the zlib stream. If it needs to be split into several IDAT chunks, the space for their headers is checked after it's written.
+		const uint32_t zlib_buf_size = (uint32_t)minimum<uint64_t>(dst_buf_size - (PNG_HEADER_SIZE + PNG_TRAILER_SIZE), MAX_ZLIB_BUF_SIZE);
+				
+		uint32_t out_ofs = PNG_HEADER_SIZE;
+
+		// The IDAT CRC-32 covers the chunk type and the zlib stream, which is folded in as it's written.
+		const uint32_t idat_type_crc32 = fpng_crc32("IDAT", 4, FPNG_CRC32_INIT);
+		defl_output_crc32 idat_crc32(idat_type_crc32, 0, pOutput_func, pOutput_user_data);
+
+		encode_scratch local_scratch;
+		encode_scratch& scratch = params.m_pContext ? params.m_pContext->get_scratch()->m_single : local_scratch;
+		scratch.m_pStats = params.m_pStats;
+
+		uint32_t defl_size = 0;
+		if ((flags & FPNG_FORCE_UNCOMPRESSED) == 0)
+			defl_size = pixel_deflate(scratch, src, w, h, num_chans, flags, get_sampled_tables(params), pDst + out_ofs, (uint32_t)minimum<uint64_t>(zlib_buf_size, ((uint64_t)(bpl + 1) * h + 7) & ~7ULL), DEFL_ZLIB_STREAM, nullptr, &idat_crc32);
+
+		uint32_t zlib_size = defl_size;
+		
+		if (!defl_size)
+		{
+			// Dynamic block failed to compress - fall back to uncompressed blocks, filter 0.
+			if (get_raw_zlib_size(w, h, bpp) > zlib_buf_size)
+				return 0;
+
+			idat_crc32 = defl_output_crc32(idat_type_crc32, 0, pOutput_func, pOutput_user_data);
+			if (pOutput_func)
+				pOutput_func(0, pOutput_user_data);
+
+#if FPNG_STATS
+			if ((flags & FPNG_FORCE_UNCOMPRESSED) == 0)
+				record_raw_fallback(params.m_pStats);
+			else
+				record_stats_table(params.m_pStats, FPNG_STATS_TABLE_RAW);
+#endif
+
+			encode_row_reader src_rows(src, scratch.m_src_rows, bpl);
+			uint32_t raw_size = write_raw_block(src_rows, w, h, bpp, pDst + out_ofs, zlib_buf_size, DEFL_ZLIB_STREAM, nullptr, &idat_crc32, samples16, params.m_pStats);
+			if (!raw_size)
+			{
+				// Somehow we miscomputed the size of the output buffer.
+				assert(0);
+				return 0;
+			}
+
+			zlib_size = raw_size;
+		}
+		
+		const uint32_t idat_len = zlib_size;
+
+		if ((uint64_t)PNG_HEADER_SIZE + idat_len + get_idat_split_overhead(idat_len) + PNG_TRAILER_SIZE > dst_buf_size)
+			return 0;
+
+		// Write real PNG header, fdEC chunk, and the beginning of the IDAT chunk
+		write_png_header(pDst, w, h, num_chans, idat_len, s_fdec_chunk_single_block, sizeof(s_fdec_chunk_single_block), samples16 ? 16 : 8);
+
+		// Write the IDAT crc32 (splitting the IDAT chunk if it's too large) and a 0 length IEND chunk
+		assert(idat_crc32.m_ofs == idat_len);
+
+		// Splitting moves the zlib data, so none of it is final after all.
+		if ((pOutput_func) && (get_idat_split_overhead(idat_len)))
+			pOutput_func(0, pOutput_user_data);
+
+		return write_idat_chunks(pDst, PNG_HEADER_SIZE - PNG_IDAT_HEADER_SIZE, idat_len, idat_crc32.m_crc32);
+	}
+
+	size_t fpng_encode_image_to_memory(const void* pImage, uint32_t w, uint32_t h, uint32_t num_chans, void* pDst_buf, size_t dst_buf_size, const fpng_encode_params& params)
+	{
+		if (params.m_pStats)
+			params.m_pStats->clear();
+
+		FPNG_STATS_ONLY(encode_stats_timer timer(params.m_pStats, &fpng_encode_stats::m_total_ns);)
+
+		return encode_image_to_memory(pImage, w, h, num_chans, pDst_buf, dst_buf_size, params);
+	}
+
+	// Builds the mip levels below an image from its rows, which must be added in order. Each pair of rows is box filtered into a row of the level below as soon as the second one
+	// is added, which cascades down the levels, so the image is only read once, while its rows are still in the cache from being compressed.
+	class mip_chain_builder
+	{
+	public:
+		mip_chain_builder(uint32_t w, uint32_t h, uint32_t num_chans, bool samples16) : 
+			m_num_chans(num_chans), m_bytes_per_sample(samples16 ? 2 : 1), m_next_row(0)
+		{
+			m_levels.push_back(mip_level(w, h));
+			while ((w > 1) || (h > 1))
+			{
+				w = maximum<uint32_t>(w >> 1, 1);
+				h = maximum<uint32_t>(h >> 1, 1);
+				m_levels.push_back(mip_level(w, h));
+				m_levels.back().m_pixels.resize((size_t)w * h * get_bpp());
+			}
+
+			m_levels[0].m_pixels.resize(m_levels[0].m_w * get_bpp());
+		}
+
+		uint32_t get_num_levels() const { return (uint32_t)m_levels.size(); }
+		uint32_t get_width(uint32_t level) const { return m_levels[level].m_w; }
+		uint32_t get_height(uint32_t level) const { return m_levels[level].m_h; }
+		
+		// Valid once all the image's rows have been added. Level 0 is the image itself, which isn't kept.
+		const uint8_t* get_pixels(uint32_t level) const { assert(level && (m_next_row == m_levels[0].m_h)); return m_levels[level].m_pixels.data(); }
+
+		// The next row of the image to add.
+		uint32_t get_next_row() const { return m_next_row; }
+
+		// An encode_row_func, which adds the rows the compressors read in order and ignores the others.
+		static void row_func(const uint8_t* pRow, uint32_t y, void* pUser_data)
+		{
+			mip_chain_builder& builder = *static_cast<mip_chain_builder*>(pUser_data);
+			if (y != builder.m_next_row)
+				return;
+
+			builder.add_row(0, pRow, y);
+			builder.m_next_row++;
+		}
+
+	private:
+		struct mip_level
+		{
+			uint32_t m_w, m_h;
+
+			// The level's pixels. For level 0, just a copy of the last even row, which the image's next row is averaged with.
+			std::vector<uint8_t> m_pixels;
+			const uint8_t* m_pPrev_row;
+
+			mip_level(uint32_t w, uint32_t h) : m_w(w), m_h(h), m_pPrev_row(nullptr) { }
+		};
+
+		std::vector<mip_level> m_levels;
+		uint32_t m_num_chans, m_bytes_per_sample, m_next_row;
+
+		uint32_t get_bpp() const { return m_num_chans * m_bytes_per_sample; }
+
+		// Each pixel of the row below is the rounded average of a 2x2 block of pixels. An odd last row or column is dropped, and a dimension which is 1 is averaged with itself.
+		void add_row(uint32_t level, const uint8_t* pRow, uint32_t y)
+		{
+			if ((level + 1) == m_levels.size())
+				return;
+
+			mip_level& src = m_levels[level];
+			const uint8_t* pPrev_row = pRow;
+			if ((src.m_h > 1) && ((y & 1) == 0))
+			{
+				if (level)
+					src.m_pPrev_row = pRow;
+				else
+				{
+					memcpy(src.m_pixels.data(), pRow, src.m_w * get_bpp());
+					src.m_pPrev_row = src.m_pixels.data();
+				}
+				return;
+			}
+			else if (src.m_h > 1)
+				pPrev_row = src.m_pPrev_row;
+
+			mip_level& dst = m_levels[level + 1];
+			const uint32_t dst_y = y >> 1;
+			if (dst_y >= dst.m_h)
+				return;
+
+			uint8_t* pDst_row = dst.m_pixels.data() + (size_t)dst_y * dst.m_w * get_bpp();
+
+			if (m_bytes_per_sample == 2)
+				downsample_row<uint16_t>(pPrev_row, pRow, pDst_row, src.m_w, dst.m_w);
+			else
+				downsample_row<uint8_t>(pPrev_row, pRow, pDst_row, src.m_w, dst.m_w);
+
+			add_row(level + 1, pDst_row, dst_y);
+		}
+
+		template<typename T, uint32_t num_chans>
+		static void downsample_row(const uint8_t* pRow0, const uint8_t* pRow1, uint8_t* pDst_row, uint32_t src_w, uint32_t dst_w)
+		{
+			const T* pSrc0 = reinterpret_cast<const T*>(pRow0);
+			const T* pSrc1 = reinterpret_cast<const T*>(pRow1);
+			T* pDst = reinterpret_cast<T*>(pDst_row);
+			const uint32_t next = (src_w > 1) ? num_chans : 0;
+
+			for (uint32_t x = 0; x < dst_w; x++, pSrc0 += num_chans * 2, pSrc1 += num_chans * 2, pDst += num_chans)
+				for (uint32_t c = 0; c < num_chans; c++)
+					pDst[c] = (T)(((uint32_t)pSrc0[c] + pSrc0[c + next] + pSrc1[c] + pSrc1[c + next] + 2) >> 2);
+		}
+
+		template<typename T>
+		void downsample_row(const uint8_t* pRow0, const uint8_t* pRow1, uint8_t* pDst_row, uint32_t src_w, uint32_t dst_w) const
+		{
+			switch (m_num_chans)
+			{
+			case 1: downsample_row<T, 1>(pRow0, pRow1, pDst_row, src_w, dst_w); break;
+			case 2: downsample_row<T, 2>(pRow0, pRow1, pDst_row, src_w, dst_w); break;
+			case 3: downsample_row<T, 3>(pRow0, pRow1, pDst_row, src_w, dst_w); break;
+			default: downsample_row<T, 4>(pRow0, pRow1, pDst_row, src_w, dst_w); break;
+			}
+		}
+	};
+
+	bool fpng_encode_mip_chain(const void* pImage, uint32_t w, uint32_t h, uint32_t num_chans, std::vector<std::vector<uint8_t>>& out_files, const fpng_encode_params& params)
+	{
+		out_files.resize(0);
+
+		if (params.m_pStats)
+			params.m_pStats->clear();
+
+		FPNG_STATS_ONLY(encode_stats_timer timer(params.m_pStats, &fpng_encode_stats::m_total_ns);)
+
+		encode_source src(nullptr, 0, w);
+		const uint64_t max_size = fpng_get_max_encoded_size(w, h, num_chans, params.m_flags);
+		if ((!max_size) || (max_size > SIZE_MAX) || (!init_encode_source(src, pImage, w, num_chans, params)))
+		{
+			assert(0);
+			return false;
+		}
+
+		const bool samples16 = (get_encode_flags(params) & FPNG_ENCODE_16BIT) != 0;
+		const uint32_t bpl = w * get_bytes_per_pixel(num_chans, params.m_flags);
+
+		// All the levels share the scratch memory.
+		fpng_encode_context local_context;
+		fpng_encode_params level_params(params);
+		if (!level_params.m_pContext)
+			level_params.m_pContext = &local_context;
+
+		mip_chain_builder mips(w, h, num_chans, samples16);
+		out_files.resize(mips.get_num_levels());
+
+		// The levels are built as level 0 is compressed.
+		out_files[0].resize((size_t)max_size);
+		size_t size = encode_image_to_memory(pImage, w, h, num_chans, out_files[0].data(), out_files[0].size(), level_params, nullptr, nullptr, mip_chain_builder::row_func, &mips);
+		if (!size)
+		{
+			out_files.resize(0);
+			return false;
+		}
+		out_files[0].resize(size);
+
+		// Strip-parallel encodes don't report their rows, and a compressor which gives up early (before falling back to raw blocks) may not have read them all.
+		if (mips.get_next_row() < h)
+		{
+			src.m_pRow_func = mip_chain_builder::row_func;
+			src.m_pRow_user_data = &mips;
+			std::vector<uint8_t> row_bufs;
+			encode_row_reader src_rows(src, row_bufs, bpl);
+			while (mips.get_next_row() < h)
+				src_rows.row(mips.get_next_row());
+		}
+
+		level_params.m_src_format = FPNG_PIXEL_FORMAT_DEFAULT;
+		level_params.m_src_pitch = 0;
+		level_params.m_ppSrc_rows = nullptr;
+		level_params.m_pRead_row = nullptr;
+
+		for (uint32_t level = 1; level < mips.get_num_levels(); level++)
+		{
+			const uint32_t level_w = mips.get_width(level), level_h = mips.get_height(level);
+
+			std::vector<uint8_t>& file = out_files[level];
+			file.resize((size_t)fpng_get_max_encoded_size(level_w, level_h, num_chans, params.m_flags));
+
+			size = encode_image_to_memory(mips.get_pixels(level), level_w, level_h, num_chans, file.data(), file.size(), level_params);
+			if (!size)
+			{
+				out_files.resize(0);
+				return false;
+			}
+			file.resize(size);
+		}
+
+		return true;
+	}
+
+#if FPNG_MMAP_READ || FPNG_MMAP_WRITE
+	// A whole file mapped into memory, so fpng_decode_file() can decode straight from the page cache and fpng_encode_image_to_file() can encode straight into it.
+	// Every failure leaves the object closed, and the caller falls back to stdio (which also reports the error, if there really is one).
+	class mapped_file
+	{
+	public:
+		mapped_file() : m_pData(nullptr), m_size(0), m_writable(false)
+		{
+#ifdef _WIN32
+			m_hFile = INVALID_HANDLE_VALUE;
+			m_hMapping = nullptr;
+#else
+			m_fd = -1;
+#endif
+		}
+
+		~mapped_file() { close(0); }
+
+		// Sizes which can be mapped in one view, and that fpng_decode_memory() or fpng_encode_image_to_memory() can handle.
+		static bool is_mappable_size(uint64_t size)
+		{
+			if (!size)
+				return false;
+			return (sizeof(size_t) > sizeof(uint32_t)) || (size <= 0x70000000);
+		}
+
+		// Maps an existing, non-empty, regular file read-only.
+		bool open_for_reading(const char* pFilename)
+		{
+			assert(!m_pData);
+#ifdef _WIN32
+			m_hFile = CreateFileA(pFilename, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+			if (m_hFile == INVALID_HANDLE_VALUE)
+				return false;
+
+			LARGE_INTEGER file_size;
+			if ((!GetFileSizeEx(m_hFile, &file_size)) || (file_size.QuadPart < 0) || (!is_mappable_size((uint64_t)file_size.QuadPart)))
+				return fail();
+			m_size = (uint64_t)file_size.QuadPart;
+
+			m_hMapping = CreateFileMappingA(m_hFile, nullptr, PAGE_READONLY, 0, 0, nullptr);
+			if (!m_hMapping)
+				return fail();
+
+			m_pData = MapViewOfFile(m_hMapping, FILE_MAP_READ, 0, 0, (SIZE_T)m_size);
+#else
+			m_fd = ::open(pFilename, O_RDONLY);
+			if (m_fd < 0)
+				return false;
+
+			struct stat st;
+			if ((fstat(m_fd, &st) != 0) || (!S_ISREG(st.st_mode)) || (st.st_size < 0) || (!is_mappable_size((uint64_t)st.st_size)))
+				return fail();
+			m_size = (uint64_t)st.st_size;
+
+			void* p = mmap(nullptr, (size_t)m_size, PROT_READ, MAP_PRIVATE, m_fd, 0);
+			m_pData = (p != MAP_FAILED) ? p : nullptr;
+
+#ifdef MADV_WILLNEED
+			// The whole file is about to be read, possibly by several threads at once: start reading it in now.
+			if (m_pData)
+				madvise(m_pData, (size_t)m_size, MADV_WILLNEED);
+#endif
+#endif
+			if (!m_pData)
+				return fail();
+
+			return true;
+		}
+
+#if FPNG_MMAP_WRITE
+		// Creates (or truncates) a file of the given size with its disk space reserved, and maps it for writing.
+		bool create_for_writing(const char* pFilename, uint64_t size)
+		{
+			assert(!m_pData);
+			if (!is_mappable_size(size))
+				return false;
+
+			m_writable = true;
+			m_size = size;
+
+#ifdef _WIN32
+			m_hFile = CreateFileA(pFilename, GENERIC_READ | GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+			if (m_hFile == INVALID_HANDLE_VALUE)
+				return fail();
+
+			// Growing the file to the mapping's size allocates its clusters, so this fails if the disk is full.
+			m_hMapping = CreateFileMappingA(m_hFile, nullptr, PAGE_READWRITE, (DWORD)(size >> 32), (DWORD)size, nullptr);
+			if (!m_hMapping)
+				return fail();
+
+			m_pData = MapViewOfFile(m_hMapping, FILE_MAP_WRITE, 0, 0, (SIZE_T)size);
+#else
+			m_fd = ::open(pFilename, O_RDWR | O_CREAT | O_TRUNC, 0666);
+			if (m_fd < 0)
+				return fail();
+
+			if (fallocate(m_fd, 0, 0, (off_t)size) != 0)
+				return fail();
+
+			void* p = mmap(nullptr, (size_t)size, PROT_READ | PROT_WRITE, MAP_SHARED, m_fd, 0);
+			m_pData = (p != MAP_FAILED) ? p : nullptr;
+#endif
+			if (!m_pData)
+				return fail();
+
+			return true;
+		}
+#endif
+
+		// Unmaps and closes the file. A file created for writing is first truncated to final_size. Returns false if any of that fails.
+		bool close(uint64_t final_size)
+		{
+			bool status = true;
+
+#ifdef _WIN32
+			if (m_pData)
+				status = UnmapViewOfFile(m_pData) && status;
+			if (m_hMapping)
+				status = CloseHandle(m_hMapping) && status;
+
+			if (m_hFile != INVALID_HANDLE_VALUE)
+			{
+				if (m_writable)
+				{
+					LARGE_INTEGER ofs;
+					ofs.QuadPart = (LONGLONG)final_size;
+					status = SetFilePointerEx(m_hFile, ofs, nullptr, FILE_BEGIN) && SetEndOfFile(m_hFile) && status;
+				}
+				status = CloseHandle(m_hFile) && status;
+			}
+
+			m_hFile = INVALID_HANDLE_VALUE;
+			m_hMapping = nullptr;
+#else
+			if (m_pData)
+				status = (munmap(m_pData, (size_t)m_size) == 0) && status;
+
+			if (m_fd >= 0)
+			{
+				if (m_writable)
+					status = (ftruncate(m_fd, (off_t)final_size) == 0) && status;
+				status = (::close(m_fd) == 0) && status;
+			}
+
+			m_fd = -1;
+#endif
+			m_pData = nullptr;
+			m_size = 0;
+			m_writable = false;
+
+			return status;
+		}
+
+		uint8_t* get_ptr() const { return (uint8_t*)m_pData; }
+		uint64_t get_size() const { return m_size; }
+
+	private:
+		void* m_pData;
+		uint64_t m_size;
+		bool m_writable;
+
+#ifdef _WIN32
+		HANDLE m_hFile;
+		HANDLE m_hMapping;
+#else
+		int m_fd;
+#endif
+
+		bool fail()
+		{
+			close(0);
+			return false;
+		}
+
+		mapped_file(const mapped_file&);
+		mapped_file& operator=(const mapped_file&);
+	};
+#endif
+
+#ifndef FPNG_NO_STDIO
+	// The file fpng_encode_image_to_file() writes. By default that's the destination itself, written in place. With FPNG_ENCODE_REPLACE_FILE it's a temporary file in the destination's
+	// directory, which is renamed over the destination once it's completely written and closed. If anything fails before that, the temporary file is removed and an existing file at 
+	// the destination is left untouched. Destinations that can't be replaced without changing what they are (symlinks, files with more than one hard link, and special files like 
+	// /dev/stdout or a pipe) are still written in place, and a replaced file keeps its permissions (and owner, if the process is allowed to set it).
+	class temp_output_file
+	{
+	public:
+		temp_output_file(const char* pFilename, bool replace) : m_pFilename(pFilename), m_direct(!replace), m_committed(false), m_keep_mode(false)
+		{
+			if (m_direct)
+				return;
+
+#ifndef _WIN32
+			if (lstat(pFilename, &m_stat) == 0)
+			{
+				m_direct = (!S_ISREG(m_stat.st_mode)) || (m_stat.st_nlink > 1);
+				if (m_direct)
+					return;
+				m_keep_mode = true;
+			}
+#endif
+
+			// The name only has to differ between writers of the same destination at the same time: the object's address tells threads apart, and the clock processes.
+			const uint64_t ticks = (uint64_t)std::chrono::high_resolution_clock::now().time_since_epoch().count();
+			const size_t size = strlen(pFilename) + 32;
+			m_temp_filename.resize(size);
+			snprintf(m_temp_filename.data(), size, "%s.%08x%08x.tmp", pFilename, (uint32_t)(uintptr_t)this, (uint32_t)(ticks ^ (ticks >> 32)));
+		}
+
+		~temp_output_file()
+		{
+			if ((!m_direct) && (!m_committed))
+				remove(get_filename());
+		}
+
+		// The file to write to.
+		const char* get_filename() const { return m_direct ? m_pFilename : m_temp_filename.data(); }
+
+		// True if the destination is written in place.
+		bool is_direct() const { return m_direct; }
+
+		// Replaces the destination with the temporary file, which must be closed. Returns false if the rename fails.
+		bool commit()
+		{
+			if (m_direct)
+				return true;
+
+#ifdef _WIN32
+			m_committed = MoveFileExA(get_filename(), m_pFilename, MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+			if (m_keep_mode)
+			{
+				// Only root can give a file away, so a failed chown() is ignored: the file then belongs to the caller, as if it had been written in place by them.
+				if (chown(get_filename(), m_stat.st_uid, m_stat.st_gid) != 0) { }
+				if (chmod(get_filename(), m_stat.st_mode & 07777) != 0)
+					return false;
+			}
+
+			m_committed = rename(get_filename(), m_pFilename) == 0;
+#endif
+			return m_committed;
+		}
+
+	private:
+		const char* m_pFilename;
+		std::vector<char> m_temp_filename;
+		bool m_direct, m_committed, m_keep_mode;
+#ifndef _WIN32
+		struct stat m_stat;
+#endif
+
+		temp_output_file(const temp_output_file&);
+		temp_output_file& operator=(const temp_output_file&);
+	};
+#endif
+
+#if !defined(FPNG_NO_STDIO) && !FPNG_NO_THREADING
+	// How much of the zlib stream is gathered before the background thread writes it.
+	const uint32_t PIPELINED_WRITE_SIZE = 1024 * 1024;
+
+	// Writes a PNG file from a background thread while its zlib stream is compressed into memory (FPNG_ENCODE_PIPELINED_WRITE). The file's bytes are written at their offsets in pBuf.
+	// The compressor reports how much of its output is final (see defl_output_crc32), and the thread writes it a large piece at a time, starting at data_ofs, where the caller
+	// has already seeked the file to. finish() writes whatever is left, then seeks back to write the header, which has the IDAT length.
+	class pipelined_file_writer
+	{
+	public:
+		pipelined_file_writer(FILE* pFile, const uint8_t* pBuf, uint32_t data_ofs) :
+			m_pFile(pFile), m_pBuf(pBuf), m_data_ofs(data_ofs),
+			m_avail(0), m_written(0), m_writing(false), m_done(false), m_failed(false), m_next_notify(PIPELINED_WRITE_SIZE)
+		{
+			m_thread = std::thread(thread_func, this);
+		}
+
+		~pipelined_file_writer() 
+		{
+			stop();
+		}
+
+		static void output_func(uint32_t ofs, void* pUser_data)
+		{
+			static_cast<pipelined_file_writer*>(pUser_data)->output(ofs);
+		}
+
+		// Waits for the thread to finish writing, then writes the rest of the file pBuf[0, size). Returns false if any write failed, or if size is 0 (encoding failed).
+		bool finish(size_t size)
+		{
+			stop();
+
+			if ((m_failed) || (!size))
+				return false;
+
+			// The file is positioned right after the part of the zlib stream the thread wrote.
+			const size_t end_ofs = m_data_ofs + (size_t)m_written;
+			assert(size >= end_ofs);
+
+			if (fwrite(m_pBuf + end_ofs, 1, size - end_ofs, m_pFile) != (size - end_ofs))
+				return false;
+
+			return (fseek(m_pFile, 0, SEEK_SET) == 0) && (fwrite(m_pBuf, 1, m_data_ofs, m_pFile) == m_data_ofs);
+		}
+
+	private:
+		FILE* m_pFile;
+		const uint8_t* m_pBuf;
+		uint32_t m_data_ofs;
+
+		std::thread m_thread;
+		std::mutex m_mutex;
+		std::condition_variable m_cond;
+
+		// The final and written bytes of the zlib stream, and whether the thread is writing (without holding the mutex). Guarded by m_mutex.
+		uint32_t m_avail, m_written;
+		bool m_writing, m_done, m_failed;
+
+		// Only used by the compressing thread, so most reports don't need the mutex.
+		uint32_t m_next_notify;
+
+		void output(uint32_t ofs)
+		{
+			if ((ofs) && (ofs < m_next_notify))
+				return;
+
+			std::unique_lock<std::mutex> lock(m_mutex);
+
+			if (!ofs)
+			{
+				// The compressor is starting over (with raw blocks), so rewind once the thread is idle.
+				while (m_writing)
+					m_cond.wait(lock);
+
+				if ((m_written) && (fseek(m_pFile, m_data_ofs, SEEK_SET) != 0))
+					m_failed = true;
+
+				m_avail = 0;
+				m_written = 0;
+				m_next_notify = PIPELINED_WRITE_SIZE;
+				return;
+			}
+
+			m_avail = ofs;
+			m_next_notify = ofs + PIPELINED_WRITE_SIZE;
+
+			lock.unlock();
+			m_cond.notify_all();
+		}
+
+		static void thread_func(pipelined_file_writer* pWriter)
+		{
+			pWriter->run();
+		}
+
+		void run()
+		{
+			std::unique_lock<std::mutex> lock(m_mutex);
+
+			while (!m_failed)
+			{
+				while ((!m_done) && (m_avail == m_written))
+					m_cond.wait(lock);
+
+				if (m_avail == m_written)
+					break;
+
+				const uint32_t ofs = m_written, len = m_avail - m_written;
+				m_writing = true;
+
+				lock.unlock();
+				const bool status = fwrite(m_pBuf + m_data_ofs + ofs, 1, len, m_pFile) == len;
+				lock.lock();
+
+				m_writing = false;
+				m_written = ofs + len;
+				if (!status)
+					m_failed = true;
+
+				m_cond.notify_all();
+			}
+		}
+
+		void stop()
+		{
+			if (!m_thread.joinable())
+				return;
+
+			{
+				std::lock_guard<std::mutex> lock(m_mutex);
+				m_done = true;
+			}
+			m_cond.notify_all();
+
+			m_thread.join();
+		}
+
+		pipelined_file_writer(const pipelined_file_writer&);
+		pipelined_file_writer& operator=(const pipelined_file_writer&);
+	};
+
+	static bool encode_image_to_file_pipelined(const char* pFilename, const void* pImage, uint32_t w, uint32_t h, uint32_t num_chans, const fpng_encode_params& params)
+	{
+		const uint64_t max_size = fpng_get_max_encoded_size(w, h, num_chans, params.m_flags);
+		if ((!max_size) || (max_size > SIZE_MAX))
+		{
+			assert(0);
+			return false;
+		}
+
+		std::vector<uint8_t> out_buf((size_t)max_size);
+
+		temp_output_file temp_file(pFilename, (params.m_flags & FPNG_ENCODE_REPLACE_FILE) != 0);
+
+		FILE* pFile = nullptr;
+#ifdef _MSC_VER
+		fopen_s(&pFile, temp_file.get_filename(), "wb");
+#else
+		pFile = fopen(temp_file.get_filename(), "wb");
+#endif
+		if (!pFile)
+			return false;
+
+		// A single block file's zlib stream starts right after its header, which is written last.
+		const uint32_t data_ofs = PNG_SIG_IHDR_SIZE + sizeof(s_fdec_chunk_single_block) + PNG_IDAT_HEADER_SIZE;
+
+		bool status = (fseek(pFile, data_ofs, SEEK_SET) == 0);
+		if (status)
+		{
+			pipelined_file_writer writer(pFile, out_buf.data(), data_ofs);
+
+			if (params.m_pStats)
+				params.m_pStats->clear();
+
+			size_t size;
+			{
+				FPNG_STATS_ONLY(encode_stats_timer timer(params.m_pStats, &fpng_encode_stats::m_total_ns);)
+				size = encode_image_to_memory(pImage, w, h, num_chans, out_buf.data(), out_buf.size(), params, pipelined_file_writer::output_func, &writer);
+			}
+
+			status = writer.finish(size);
+		}
+
+		status = (fclose(pFile) != EOF) && status;
+
+		// Written in place, a failed file is removed instead of being left incomplete.
+		if ((!status) && (temp_file.is_direct()))
+			remove(pFilename);
+
+		return status && temp_file.commit();
+	}
+#endif
+
+#ifndef FPNG_NO_STDIO
+	bool fpng_encode_image_to_file(const char* pFilename, const void* pImage, uint32_t w, uint32_t h, uint32_t num_chans, uint32_t flags)
+	{
+		fpng_encode_params params;
+		params.m_flags = flags;
+
+		return fpng_encode_image_to_file(pFilename, pImage, w, h, num_chans, params);
+	}
+
+	bool fpng_encode_image_to_file(const char* pFilename, const void* pImage, uint32_t w, uint32_t h, uint32_t num_chans, const fpng_encode_params& params)
+	{
+#if !FPNG_NO_THREADING
+		if (params.m_flags & FPNG_ENCODE_PIPELINED_WRITE)
+			return encode_image_to_file_pipelined(pFilename, pImage, w, h, num_chans, params);
+#endif
+
+		temp_output_file temp_file(pFilename, (params.m_flags & FPNG_ENCODE_REPLACE_FILE) != 0);
+
+#if FPNG_MMAP_WRITE
+		// Encode straight into the file's pages: it's created at the worst case size, then truncated to the PNG's actual size.
+		const uint64_t max_size = fpng_get_max_encoded_size(w, h, num_chans, params.m_flags);
+		if (max_size)
+		{
+			mapped_file file;
+			if (file.create_for_writing(temp_file.get_filename(), max_size))
+			{
+				const size_t size = fpng_encode_image_to_memory(pImage, w, h, num_chans, file.get_ptr(), (size_t)max_size, params);
+				if (!file.close(size))
+					return false;
+
+				if (!size)
+				{
+					// Written in place, the file has already been truncated, so it's removed instead of being left empty.
+					if (temp_file.is_direct())
+						remove(pFilename);
+					return false;
+				}
+
+				return temp_file.commit();
+			}
+		}
+#endif
+
+		std::vector<uint8_t> out_buf;
+		if (!fpng_encode_image_to_memory(pImage, w, h, num_chans, out_buf, params))
+			return false;
+
+		FILE* pFile = nullptr;
+#ifdef _MSC_VER
+		fopen_s(&pFile, temp_file.get_filename(), "wb");
+#else
+		pFile = fopen(temp_file.get_filename(), "wb");
+#endif
+		if (!pFile)
+			return false;
+
+		if (fwrite(out_buf.data(), 1, out_buf.size(), pFile) != out_buf.size())
+		{
+			fclose(pFile);
+			return false;
+		}
+
+		if (fclose(pFile) == EOF)
+			return false;
+
+		return temp_file.commit();
+	}
+#endif
+
+	// Streaming compression
+
+	// Roughly how much compressed data is gathered before it's written as an IDAT chunk.
+	const uint32_t STREAM_IDAT_CHUNK_SIZE = 256 * 1024;
+
+	static const uint8_t s_iend_chunk[12] = { 0, 0, 0, 0, 'I', 'E', 'N', 'D', 0xAE, 0x42, 0x60, 0x82 };
+
+	fpng_encoder::fpng_encoder() :
+		m_pWrite(nullptr), m_pWrite_user_data(nullptr),
+		m_w(0), m_h(0), m_num_chans(0), m_cur_row(0),
+		m_bit_buf(0), m_bit_buf_size(0), m_adler32(FPNG_ADLER32_INIT),
+		m_buf_ofs(0), m_idat_crc32(FPNG_CRC32_INIT), m_idat_crc32_ofs(0)
+	{
+	}
+
+	bool fpng_encoder::fail()
+	{
+		m_pWrite = nullptr;
+		m_pWrite_user_data = nullptr;
+		return false;
+	}
+
+	bool fpng_encoder::write(const void* pData, size_t size)
+	{
+		if (!m_pWrite(pData, size, m_pWrite_user_data))
+			return fail();
+		return true;
+	}
+
+	// Writes all the whole bytes of compressed data to a new IDAT chunk. Any leftover bits stay in the bit buffer.
+	bool fpng_encoder::flush_idat()
+	{
+		if (!m_buf_ofs)
+			return true;
+
+		// Most of the chunk has already been folded into the CRC as it was compressed. A single row can be longer than FPNG_MAX_IDAT_CHUNK_SIZE though, 
+		// in which case the data is split into several chunks, each with its own CRC.
+		for (uint32_t ofs = 0; ofs < m_buf_ofs; )
+		{
+			const uint32_t len = minimum<uint32_t>(m_buf_ofs - ofs, FPNG_MAX_IDAT_CHUNK_SIZE);
+			const uint8_t prefix[8] = { (uint8_t)(len >> 24), (uint8_t)(len >> 16), (uint8_t)(len >> 8), (uint8_t)len, 'I', 'D', 'A', 'T' };
+
+			uint32_t c;
+			if (len == m_buf_ofs)
+			{
+				defl_output_crc32 idat_crc32(m_idat_crc32, m_idat_crc32_ofs);
+				idat_crc32.update(m_buf.data(), len);
+				c = idat_crc32.m_crc32;
+			}
+			else
+				c = fpng_crc32(m_buf.data() + ofs, len, fpng_crc32("IDAT", 4, FPNG_CRC32_INIT));
+
+			const uint8_t crc[4] = { (uint8_t)(c >> 24), (uint8_t)(c >> 16), (uint8_t)(c >> 8), (uint8_t)c };
+
+			if ((!write(prefix, sizeof(prefix))) || (!write(m_buf.data() + ofs, len)) || (!write(crc, sizeof(crc))))
+				return false;
+
+			ofs += len;
+		}
+
+		m_buf_ofs = 0;
+		m_idat_crc32 = fpng_crc32("IDAT", 4, FPNG_CRC32_INIT);
+		m_idat_crc32_ofs = 0;
+		return true;
+	}
+
+	bool fpng_encoder::begin(uint32_t w, uint32_t h, uint32_t num_chans, fpng_write_func pWrite, void* pWrite_user_data)
+	{
+		fail();
+
+		if (!endian_check())
+		{
+			assert(0);
+			return false;
+		}
+
+		// The image is compressed a batch of rows at a time, so unlike fpng_encode_image_to_memory() there's no limit on its total size.
+		if ((!pWrite) || (w < 1) || (h < 1) || (w > FPNG_MAX_SUPPORTED_DIM) || (h > FPNG_MAX_SUPPORTED_DIM) || ((num_chans != 3) && (num_chans != 4)))
+		{
+			assert(0);
+			return false;
+		}
+
+		m_pWrite = pWrite;
+		m_pWrite_user_data = pWrite_user_data;
+		m_w = w;
+		m_h = h;
+		m_num_chans = num_chans;
+		m_cur_row = 0;
+		m_adler32 = FPNG_ADLER32_INIT;
+		m_idat_crc32 = fpng_crc32("IDAT", 4, FPNG_CRC32_INIT);
+		m_idat_crc32_ofs = 0;
+		
+		const uint32_t bpl = 1 + w * num_chans;
+		m_prev_row.resize(bpl - 1);
+		m_row_buf.resize(bpl + 8);
+
+		m_buf.resize(STREAM_IDAT_CHUNK_SIZE);
+		
+		// Write the PNG header, minus the IDAT chunk. The file is a single Deflate block, so it gets the single block fdEC chunk.
+		uint8_t hdr[PNG_SIG_IHDR_SIZE + sizeof(s_fdec_chunk_single_block) + PNG_IDAT_HEADER_SIZE];
+		const uint32_t hdr_size = write_png_header(hdr, w, h, num_chans, 0, s_fdec_chunk_single_block, sizeof(s_fdec_chunk_single_block));
+		if (!write(hdr, hdr_size - PNG_IDAT_HEADER_SIZE))
+			return false;
+
+		// zlib header and the precomputed dynamic block header
+		if (num_chans == 3)
+		{
+			m_buf_ofs = defl_write_prefix(g_dyn_huff_3, sizeof(g_dyn_huff_3), DEFL_ZLIB_STREAM, m_buf.data(), (uint32_t)m_buf.size());
+			m_bit_buf = DYN_HUFF_3_BITBUF;
+			m_bit_buf_size = DYN_HUFF_3_BITBUF_SIZE;
+		}
+		else
+		{
+			m_buf_ofs = defl_write_prefix(g_dyn_huff_4, sizeof(g_dyn_huff_4), DEFL_ZLIB_STREAM, m_buf.data(), (uint32_t)m_buf.size());
+			m_bit_buf = DYN_HUFF_4_BITBUF;
+			m_bit_buf_size = DYN_HUFF_4_BITBUF_SIZE;
+		}
+				
+		return true;
+	}
+
+	bool fpng_encoder::push_rows(const void* pRows, uint32_t num_rows, uint32_t pitch)
+	{
+		if (!m_pWrite)
+			return false;
+
+		const uint32_t src_bpl = m_w * m_num_chans;
+
+		if ((!pRows) || (pitch < src_bpl) || (num_rows > (m_h - m_cur_row)))
+		{
+			assert(0);
+			return fail();
+		}
+
+		// Every code in the one pass tables is at most 12 bits, so a row can't expand to more than 1.5 bytes per byte.
+		const uint32_t max_row_bytes = ((src_bpl + 1) * 3 + 1) / 2 + 8;
+		const uint32_t max_rows_per_batch = maximum<uint32_t>(1, STREAM_IDAT_CHUNK_SIZE / max_row_bytes);
+
+		const uint8_t* pSrc_rows = static_cast<const uint8_t*>(pRows);
+
+		for (uint32_t row_index = 0; row_index < num_rows; )
+		{
+			const uint32_t num_batch_rows = minimum(max_rows_per_batch, num_rows - row_index);
+			
+			const size_t dst_size_needed = m_buf_ofs + (size_t)num_batch_rows * max_row_bytes + 16;
+			if (m_buf.size() < dst_size_needed)
+				m_buf.resize(dst_size_needed);
+
+			const uint8_t* pBatch = pSrc_rows + (size_t)row_index * pitch;
+			const uint8_t* pPrev_row = row_index ? (pBatch - pitch) : (m_cur_row ? m_prev_row.data() : nullptr);
+
+			defl_output_crc32 idat_crc32(m_idat_crc32, m_idat_crc32_ofs);
+
+			encode_row_reader batch_rows(encode_source(pBatch, pitch, m_w));
+
+			bool status;
+			if (m_num_chans == 3)
+				status = pixel_deflate_rows_3_one_pass(batch_rows, m_w, num_batch_rows, pPrev_row, m_row_buf.data(), m_buf.data(), m_buf_ofs, (uint32_t)m_buf.size(), m_bit_buf, m_bit_buf_size, m_adler32, g_dyn_huff_3_codes, &idat_crc32, false);
+			else
+				status = pixel_deflate_rows_4_one_pass(batch_rows, m_w, num_batch_rows, pPrev_row, m_row_buf.data(), m_buf.data(), m_buf_ofs, (uint32_t)m_buf.size(), m_bit_buf, m_bit_buf_size, m_adler32, g_dyn_huff_4_codes, &idat_crc32, false);
+
+			m_idat_crc32 = idat_crc32.m_crc32;
+			m_idat_crc32_ofs = idat_crc32.m_ofs;
+			
+			if (!status)
+			{
+				// Shouldn't happen, the buffer is always large enough.
+				assert(0);
+				return fail();
+			}
+
+			row_index += num_batch_rows;
+			m_cur_row += num_batch_rows;
+
+			if (m_buf_ofs >= STREAM_IDAT_CHUNK_SIZE)
+			{
+				if (!flush_idat())
+					return false;
+			}
+		}
+
+		// The next push's first row is Up filtered against the last row we've been given.
+		if (num_rows)
+			memcpy(m_prev_row.data(), pSrc_rows + (size_t)(num_rows - 1) * pitch, src_bpl);
+
+		return true;
+	}
+
+	bool fpng_encoder::finish()
+	{
+		if (!m_pWrite)
+			return false;
+
+		if (m_cur_row != m_h)
+		{
+			assert(0);
+			return fail();
+		}
+
+		if (m_buf.size() < (m_buf_ofs + 64))
+			m_buf.resize(m_buf_ofs + 64);
+
+		uint64_t bit_buf = m_bit_buf;
+		int bit_buf_size = m_bit_buf_size;
+
+		assert(bit_buf_size <= 7);
+
+		if (m_num_chans == 3)
+			PUT_BITS_CZ(g_dyn_huff_3_codes[256].m_code, g_dyn_huff_3_codes[256].m_code_size);
+		else
+			PUT_BITS_CZ(g_dyn_huff_4_codes[256].m_code, g_dyn_huff_4_codes[256].m_code_size);
+		
+		if (!defl_finish_block(m_buf.data(), m_buf_ofs, (uint32_t)m_buf.size(), bit_buf, bit_buf_size, DEFL_ZLIB_STREAM, m_adler32))
+		{
+			assert(0);
+			return fail();
+		}
+
+		if (!flush_idat())
+			return false;
+
+		if (!write(s_iend_chunk, sizeof(s_iend_chunk)))
+			return false;
+		
+		m_pWrite = nullptr;
+		m_pWrite_user_data = nullptr;
+		m_buf.clear();
+		m_buf.shrink_to_fit();
+
+		return true;
+	}
+
+	// Animated PNG compression
+
+#if FPNG_AVX2_SUPPORTED
+	// Returns the offset of the first byte in [0, n) where pA and pB differ, or n if they're the same. Compares 32 bytes at a time, like find_run_len_avx2().
+	static FPNG_AVX2_FUNC uint32_t find_first_diff_avx2(const uint8_t* pA, const uint8_t* pB, uint32_t n)
+	{
+		uint32_t ofs = 0;
+		for (; (ofs + 32) <= n; ofs += 32)
+		{
+			const uint32_t eq_mask = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(pA + ofs)), _mm256_loadu_si256((const __m256i*)(pB + ofs))));
+			if (eq_mask != 0xFFFFFFFF)
+			{
+#ifdef _MSC_VER
+				unsigned long first_diff;
+				_BitScanForward(&first_diff, ~eq_mask);
+				return ofs + first_diff;
+#else
+				return ofs + (uint32_t)__builtin_ctz(~eq_mask);
+#endif
+			}
+		}
+
+		for (; ofs < n; ofs++)
+			if (pA[ofs] != pB[ofs])
+				break;
+
+		return ofs;
+	}
+
+	// Returns one past the offset of the last byte in [0, n) where pA and pB differ, or 0 if they're the same. Compares 32 bytes at a time, from the end.
+	static FPNG_AVX2_FUNC uint32_t find_last_diff_avx2(const uint8_t* pA, const uint8_t* pB, uint32_t n)
+	{
+		for (; n >= 32; n -= 32)
+		{
+			const uint32_t eq_mask = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(pA + n - 32)), _mm256_loadu_si256((const __m256i*)(pB + n - 32))));
+			if (eq_mask != 0xFFFFFFFF)
+			{
+#ifdef _MSC_VER
+				unsigned long last_diff;
+				_BitScanReverse(&last_diff, ~eq_mask);
+				return n - 31 + last_diff;
+#else
+				return n - (uint32_t)__builtin_clz(~eq_mask);
+#endif
+			}
+		}
+
+		for (; n; n--)
+			if (pA[n - 1] != pB[n - 1])
+				break;
+
+		return n;
+	}
+#endif
+
+	static uint32_t find_first_diff(const uint8_t* pA, const uint8_t* pB, uint32_t n)
+	{
+#if FPNG_AVX2_SUPPORTED
+		if (g_cpu_info.can_use_avx2())
+			return find_first_diff_avx2(pA, pB, n);
+#endif
+
+		uint32_t ofs = 0;
+		while (((ofs + 8) <= n) && (memcmp(pA + ofs, pB + ofs, 8) == 0))
+			ofs += 8;
+
+		for (; ofs < n; ofs++)
+			if (pA[ofs] != pB[ofs])
+				break;
+
+		return ofs;
+	}
+
+	static uint32_t find_last_diff(const uint8_t* pA, const uint8_t* pB, uint32_t n)
+	{
+#if FPNG_AVX2_SUPPORTED
+		if (g_cpu_info.can_use_avx2())
+			return find_last_diff_avx2(pA, pB, n);
+#endif
+
+		while ((n >= 8) && (memcmp(pA + n - 8, pB + n - 8, 8) == 0))
+			n -= 8;
+
+		for (; n; n--)
+			if (pA[n - 1] != pB[n - 1])
+				break;
+
+		return n;
+	}
+
+	// Finds the bounding box [x0, x1) x [y0, y1) of the pixels that differ between two images with bpp bytes per pixel and the same pitch. Returns false if they're identical.
+	// Most rows of a screen capture don't change, so each row is first compared as a whole, and only the parts of a changed row outside of the box found so far are searched.
+	static bool find_dirty_rect(const uint8_t* pPrev, size_t prev_pitch, const uint8_t* pCur, size_t cur_pitch, uint32_t w, uint32_t h, uint32_t bpp, uint32_t& x0, uint32_t& y0, uint32_t& x1, uint32_t& y1)
+	{
+		const uint32_t bpl = w * bpp;
+
+		// The box's columns in bytes, [min_ofs, max_ofs)
+		uint32_t min_ofs = bpl, max_ofs = 0;
+		uint32_t first_row = UINT32_MAX, last_row = 0;
+
+		for (uint32_t y = 0; y < h; y++)
+		{
+			const uint8_t* pPrev_row = pPrev + y * prev_pitch;
+			const uint8_t* pCur_row = pCur + y * cur_pitch;
+
+			if (memcmp(pPrev_row, pCur_row, bpl) == 0)
+				continue;
+
+			if (first_row == UINT32_MAX)
+				first_row = y;
+			last_row = y;
+
+			if (min_ofs)
+				min_ofs = find_first_diff(pPrev_row, pCur_row, min_ofs);
+
+			if (max_ofs < bpl)
+				max_ofs += find_last_diff(pPrev_row + max_ofs, pCur_row + max_ofs, bpl - max_ofs);
+		}
+
+		if (first_row == UINT32_MAX)
+			return false;
+
+		x0 = min_ofs / bpp;
+		x1 = (max_ofs + bpp - 1) / bpp;
+		y0 = first_row;
+		y1 = last_row + 1;
+		return true;
+	}
+
+	// APNG fcTL dispose_op and blend_op values. Every frame is drawn over the previous one, replacing the pixels in its box.
+	enum { APNG_DISPOSE_OP_NONE = 0, APNG_BLEND_OP_SOURCE = 0 };
+
+	fpng_apng_encoder::fpng_apng_encoder() :
+		m_pWrite(nullptr), m_pWrite_user_data(nullptr),
+		m_w(0), m_h(0), m_num_chans(0), m_bpp(0), m_src_bpp(0), m_num_frames(0), m_cur_frame(0), m_seq_num(0)
+	{
+	}
+
+	bool fpng_apng_encoder::fail()
+	{
+		m_pWrite = nullptr;
+		m_pWrite_user_data = nullptr;
+		return false;
+	}
+
+	bool fpng_apng_encoder::write(const void* pData, size_t size)
+	{
+		if (!m_pWrite(pData, size, m_pWrite_user_data))
+			return fail();
+		return true;
+	}
+
+	// Writes one of the small APNG chunks (acTL or fcTL).
+	bool fpng_apng_encoder::write_chunk(const char* pType, const uint8_t* pData, uint32_t len)
+	{
+		uint8_t chunk[PNG_IDAT_HEADER_SIZE + 26 + 4];
+		assert(len <= 26);
+
+		write_be32(chunk, len);
+		memcpy(chunk + 4, pType, 4);
+		memcpy(chunk + 8, pData, len);
+		write_be32(chunk + 8 + len, fpng_crc32(chunk + 4, 4 + len, FPNG_CRC32_INIT));
+
+		return write(chunk, 12 + len);
+	}
+
+	// Writes the current frame's zlib stream, m_buf[0, zlib_len), as IDAT chunks (the first frame) or fdAT chunks (which start with a sequence number), splitting it into chunks 
+	// of at most FPNG_MAX_IDAT_CHUNK_SIZE bytes. crc32 is the CRC-32 of the first chunk's type, sequence number and the whole stream, folded in as it was compressed.
+	bool fpng_apng_encoder::write_frame_data(uint32_t zlib_len, uint32_t crc32)
+	{
+		const bool fdat = m_cur_frame != 0;
+		const uint32_t hdr_len = fdat ? 12 : 8;
+
+		for (uint32_t ofs = 0; ofs < zlib_len; )
+		{
+			const uint32_t len = minimum<uint32_t>(zlib_len - ofs, FPNG_MAX_IDAT_CHUNK_SIZE);
+
+			uint8_t hdr[12];
+			write_be32(hdr, len + hdr_len - 8);
+			memcpy(hdr + 4, fdat ? "fdAT" : "IDAT", 4);
+			write_be32(hdr + 8, m_seq_num);
+
+			if (fdat)
+				m_seq_num++;
+
+			const uint32_t c = (len == zlib_len) ? crc32 : fpng_crc32(m_buf.data() + ofs, len, fpng_crc32(hdr + 4, hdr_len - 4, FPNG_CRC32_INIT));
+
+			uint8_t crc[4];
+			write_be32(crc, c);
+
+			if ((!write(hdr, hdr_len)) || (!write(m_buf.data() + ofs, len)) || (!write(crc, sizeof(crc))))
+				return false;
+
+			ofs += len;
+		}
+
+		return true;
+	}
+
+	bool fpng_apng_encoder::begin(uint32_t w, uint32_t h, uint32_t num_chans, uint32_t num_frames, uint32_t num_plays, fpng_write_func pWrite, void* pWrite_user_data, const fpng_encode_params& params)
+	{
+		fail();
+
+		if (!endian_check())
+		{
+			assert(0);
+			return false;
+		}
+
+		// The APNG frame and play counts are PNG four byte integers, so they're limited to 2^31-1.
+		if ((!pWrite) || (w < 1) || (h < 1) || (w * (uint64_t)h > UINT32_MAX) || (w > FPNG_MAX_SUPPORTED_DIM) || (h > FPNG_MAX_SUPPORTED_DIM) || (num_chans < 1) || (num_chans > 4) ||
+			(num_frames < 1) || (num_frames > INT32_MAX) || (num_plays > INT32_MAX))
+		{
+			assert(0);
+			return false;
+		}
+
+		const uint32_t flags = get_encode_flags(params);
+		const bool samples16 = (flags & FPNG_ENCODE_16BIT) != 0;
+
+		uint32_t file_chans, src_bpp;
+		pixel_convert_func pConvert;
+		if ((!get_pixel_format<true>(params.m_src_format, num_chans, file_chans, src_bpp, pConvert)) || (file_chans != num_chans) || ((pConvert) && (samples16)))
+		{
+			assert(0);
+			return false;
+		}
+
+		// Frames are compared in memory, so they can have a row pitch but not row pointers or a row callback.
+		const size_t src_bpl = (size_t)w * (pConvert ? src_bpp : get_bytes_per_pixel(num_chans, flags));
+		if ((params.m_ppSrc_rows) || (params.m_pRead_row) || ((params.m_src_pitch) && (params.m_src_pitch < src_bpl)))
+		{
+			assert(0);
+			return false;
+		}
+
+		m_pWrite = pWrite;
+		m_pWrite_user_data = pWrite_user_data;
+		m_params = params;
+		m_w = w;
+		m_h = h;
+		m_num_chans = num_chans;
+		m_bpp = get_bytes_per_pixel(num_chans, flags);
+		m_src_bpp = pConvert ? src_bpp : m_bpp;
+		m_num_frames = num_frames;
+		m_cur_frame = 0;
+		m_seq_num = 0;
+
+		// Keep the scratch memory across frames, unless the caller has their own context.
+		if (!m_params.m_pContext)
+			m_params.m_pContext = &m_context;
+
+		if (m_params.m_pStats)
+			m_params.m_pStats->clear();
+
+		if (num_frames > 1)
+			m_prev_frame.resize((size_t)w * h * m_src_bpp);
+
+		// Write the PNG header, minus the IDAT chunk. The first frame's IDAT is compressed like any other fpng file, so it gets the single block fdEC chunk.
+		uint8_t hdr[PNG_SIG_IHDR_SIZE + sizeof(s_fdec_chunk_single_block) + PNG_IDAT_HEADER_SIZE];
+		const uint32_t hdr_size = write_png_header(hdr, w, h, num_chans, 0, s_fdec_chunk_single_block, sizeof(s_fdec_chunk_single_block), samples16 ? 16 : 8);
+		if (!write(hdr, hdr_size - PNG_IDAT_HEADER_SIZE))
+			return false;
+
+		uint8_t actl[8];
+		write_be32(actl, num_frames);
+		write_be32(actl + 4, num_plays);
+		return write_chunk("acTL", actl, sizeof(actl));
+	}
+
+	bool fpng_apng_encoder::add_frame(const void* pImage, uint16_t delay_num, uint16_t delay_den)
+	{
+		if (!m_pWrite)
+			return false;
+
+		if ((!pImage) || (m_cur_frame == m_num_frames))
+		{
+			assert(0);
+			return fail();
+		}
+
+		FPNG_STATS_ONLY(encode_stats_timer timer(m_params.m_pStats, &fpng_encode_stats::m_total_ns);)
+
+		// The previous frame is kept packed.
+		const uint8_t* pSrc = static_cast<const uint8_t*>(pImage);
+		const size_t prev_pitch = (size_t)m_w * m_src_bpp;
+		const size_t pitch = m_params.m_src_pitch ? m_params.m_src_pitch : prev_pitch;
+
+		// The first frame is the default image, which must cover the whole image. The others only cover the pixels that changed.
+		uint32_t x0 = 0, y0 = 0, x1 = m_w, y1 = m_h;
+		if ((m_cur_frame) && (!find_dirty_rect(m_prev_frame.data(), prev_pitch, pSrc, pitch, m_w, m_h, m_src_bpp, x0, y0, x1, y1)))
+		{
+			x1 = 1;
+			y1 = 1;
+		}
+
+		const uint32_t frame_w = x1 - x0, frame_h = y1 - y0;
+		const uint8_t* pFrame_src = pSrc + y0 * pitch + (size_t)x0 * m_src_bpp;
+
+		// Only the changed pixels need to be copied to keep the previous frame up to date.
+		if ((m_cur_frame + 1) < m_num_frames)
+		{
+			for (uint32_t y = y0; y < y1; y++)
+				memcpy(m_prev_frame.data() + y * prev_pitch + (size_t)x0 * m_src_bpp, pSrc + y * pitch + (size_t)x0 * m_src_bpp, (size_t)frame_w * m_src_bpp);
+		}
+
+		uint8_t fctl[26];
+		write_be32(fctl, m_seq_num++);
+		write_be32(fctl + 4, frame_w);
+		write_be32(fctl + 8, frame_h);
+		write_be32(fctl + 12, x0);
+		write_be32(fctl + 16, y0);
+		fctl[20] = (uint8_t)(delay_num >> 8);
+		fctl[21] = (uint8_t)delay_num;
+		fctl[22] = (uint8_t)(delay_den >> 8);
+		fctl[23] = (uint8_t)delay_den;
+		fctl[24] = APNG_DISPOSE_OP_NONE;
+		fctl[25] = APNG_BLEND_OP_SOURCE;
+		if (!write_chunk("fcTL", fctl, sizeof(fctl)))
+			return false;
+
+		const uint32_t flags = get_encode_flags(m_params);
+		const bool samples16 = (flags & FPNG_ENCODE_16BIT) != 0;
+		const uint32_t bpl = frame_w * m_bpp;
+
+		uint32_t file_chans, src_bpp;
+		pixel_convert_func pConvert;
+		get_pixel_format<true>(m_params.m_src_format, m_num_chans, file_chans, src_bpp, pConvert);
+
+		const encode_source src(pFrame_src, pitch, frame_w, pConvert);
+
+		// Like fpng_encode_image_to_memory(), the zlib stream is limited to a bit under 4GB.
+		const uint32_t zlib_buf_size = (uint32_t)minimum<uint64_t>(get_raw_zlib_size(frame_w, frame_h, m_bpp), MAX_ZLIB_BUF_SIZE);
+		if (m_buf.size() < zlib_buf_size)
+			m_buf.resize(zlib_buf_size);
+
+		// The chunk's CRC-32 starts with its type, and for fdAT its sequence number, then the zlib stream is folded in as it's written.
+		uint8_t prefix[8];
+		memcpy(prefix, m_cur_frame ? "fdAT" : "IDAT", 4);
+		write_be32(prefix + 4, m_seq_num);
+		const uint32_t prefix_crc32 = fpng_crc32(prefix, m_cur_frame ? 8 : 4, FPNG_CRC32_INIT);
+		defl_output_crc32 data_crc32(prefix_crc32);
+
+		encode_scratch& scratch = m_params.m_pContext->get_scratch()->m_single;
+		scratch.m_pStats = m_params.m_pStats;
+
+		uint32_t zlib_size = 0;
+		if ((flags & FPNG_FORCE_UNCOMPRESSED) == 0)
+			zlib_size = pixel_deflate(scratch, src, frame_w, frame_h, m_num_chans, flags, get_sampled_tables(m_params), m_buf.data(), (uint32_t)minimum<uint64_t>(zlib_buf_size, ((uint64_t)(bpl + 1) * frame_h + 7) & ~7ULL), DEFL_ZLIB_STREAM, nullptr, &data_crc32);
+
+		if (!zlib_size)
+		{
+			// Fall back to uncompressed blocks, filter 0.
+			if (get_raw_zlib_size(frame_w, frame_h, m_bpp) > zlib_buf_size)
+				return fail();
+
+			data_crc32 = defl_output_crc32(prefix_crc32);
+
+#if FPNG_STATS
+			if ((flags & FPNG_FORCE_UNCOMPRESSED) == 0)
+				record_raw_fallback(m_params.m_pStats);
+			else
+				record_stats_table(m_params.m_pStats, FPNG_STATS_TABLE_RAW);
+#endif
+
+			encode_row_reader src_rows(src, scratch.m_src_rows, bpl);
+			zlib_size = write_raw_block(src_rows, frame_w, frame_h, m_bpp, m_buf.data(), zlib_buf_size, DEFL_ZLIB_STREAM, nullptr, &data_crc32, samples16, m_params.m_pStats);
+			if (!zlib_size)
+			{
+				assert(0);
+				return fail();
+			}
+		}
+
+		assert(data_crc32.m_ofs == zlib_size);
+
+		if (!write_frame_data(zlib_size, data_crc32.m_crc32))
+			return false;
+
+		m_cur_frame++;
+		return true;
+	}
+
+	bool fpng_apng_encoder::finish()
+	{
+		if (!m_pWrite)
+			return false;
+
+		if (m_cur_frame != m_num_frames)
+		{
+			assert(0);
+			return fail();
+		}
+
+		if (!write(s_iend_chunk, sizeof(s_iend_chunk)))
+			return false;
+
+		m_pWrite = nullptr;
+		m_pWrite_user_data = nullptr;
+		m_buf.clear();
+		m_buf.shrink_to_fit();
+		m_prev_frame.clear();
+		m_prev_frame.shrink_to_fit();
+
+		return true;
+	}
+
+	// Decompression
+
+	const uint32_t FPNG_DECODER_TABLE_BITS = 12;
+	const uint32_t FPNG_DECODER_TABLE_SIZE = 1 << FPNG_DECODER_TABLE_BITS;
+
+	static bool build_decoder_table(uint32_t num_syms, uint8_t* pCode_sizes, uint32_t* pTable)
+	{
+		uint32_t num_codes[16];
+
+		memset(num_codes, 0, sizeof(num_codes));
+		for (uint32_t i = 0; i < num_syms; i++)
+		{
+			assert(pCode_sizes[i] <= FPNG_DECODER_TABLE_SIZE);
+			num_codes[pCode_sizes[i]]++;
+		}
+
+		uint32_t next_code[17];
+		next_code[0] = next_code[1] = 0;
+		uint32_t total = 0;
+		for (uint32_t i = 1; i <= 15; i++)
+			next_code[i + 1] = (uint32_t)(total = ((total + ((uint32_t)num_codes[i])) << 1));
+
+		if (total != 0x10000)
+		{
+			uint32_t j = 0;
+
+			for (uint32_t i = 15; i != 0; i--)
+				if ((j += num_codes[i]) > 1)
+					return false;
+			
+			if (j != 1)
+				return false;
+		}
+
+		uint32_t rev_codes[DEFL_MAX_HUFF_SYMBOLS];
+
+		for (uint32_t i = 0; i < num_syms; i++)
+			rev_codes[i] = next_code[pCode_sizes[i]]++;
+
+		memset(pTable, 0, sizeof(uint32_t) * FPNG_DECODER_TABLE_SIZE);
+
+		for (uint32_t i = 0; i < num_syms; i++)
+		{
+			const uint32_t code_size = pCode_sizes[i];
+			if (!code_size)
+				continue;
+
+			uint32_t old_code = rev_codes[i], new_code = 0;
+			for (uint32_t j = code_size; j != 0; j--)
+			{
+				new_code = (new_code << 1) | (old_code & 1);
+				old_code >>= 1;
+			}
+
+			uint32_t j = 1 << code_size;
+
+			while (new_code < FPNG_DECODER_TABLE_SIZE)
+			{
+				pTable[new_code] = i | (code_size << 9);
+				new_code += j;
+			}
+		}
+
+		return true;
+	}
+
+	static const uint16_t g_run_len3_to_4[259] = 
+	{
+		0,
+		0, 0, 4, 0, 0, 8, 0, 0, 12, 0, 0, 16, 0, 0, 20, 0, 0, 24, 0, 0, 28, 0, 0,
+		32, 0, 0, 36, 0, 0, 40, 0, 0, 44, 0, 0, 48, 0, 0, 52, 0, 0, 56, 0, 0,
+		60, 0, 0, 64, 0, 0, 68, 0, 0, 72, 0, 0, 76, 0, 0, 80, 0, 0, 84, 0, 0,
+		88, 0, 0, 92, 0, 0, 96, 0, 0, 100, 0, 0, 104, 0, 0, 108, 0, 0, 112, 0, 0,
+		116, 0, 0, 120, 0, 0, 124, 0, 0, 128, 0, 0, 132, 0, 0, 136, 0, 0, 140, 0, 0,
+		144, 0, 0, 148, 0, 0, 152, 0, 0, 156, 0, 0, 160, 0, 0, 164, 0, 0, 168, 0, 0,
+		172, 0, 0, 176, 0, 0, 180, 0, 0, 184, 0, 0, 188, 0, 0, 192, 0, 0, 196, 0, 0,
+		200, 0, 0, 204, 0, 0, 208, 0, 0, 212, 0, 0, 216, 0, 0, 220, 0, 0, 224, 0, 0,
+		228, 0, 0, 232, 0, 0, 236, 0, 0, 240, 0, 0, 244, 0, 0, 248, 0, 0, 252, 0, 0,
+		256, 0, 0, 260, 0, 0, 264, 0, 0, 268, 0, 0, 272, 0, 0, 276, 0, 0, 280, 0, 0,
+		284, 0, 0, 288, 0, 0, 292, 0, 0, 296, 0, 0, 300, 0, 0, 304, 0, 0, 308, 0, 0,
+		312, 0, 0, 316, 0, 0, 320, 0, 0, 324, 0, 0, 328, 0, 0, 332, 0, 0, 336, 0, 0,
+		340, 0, 0, 
+		344,
+	};
+
+	static const int s_length_extra[] = { 0,0,0,0, 0,0,0,0, 1,1,1,1, 2,2,2,2, 3,3,3,3, 4,4,4,4, 5,5,5,5, 0,    0,0 };
+	static const int s_length_range[] = { 3,4,5,6, 7,8,9,10, 11,13,15,17, 19,23,27,31, 35,43,51,59, 67,83,99,115, 131,163,195,227, 258,    0,0 };
+
+#define ENSURE_32BITS() do { \
+	if (bit_buf_size < 32) { \
+		if ((src_ofs + 4) > src_len) return false; \
+		bit_buf |= ((uint64_t)READ_LE32(pSrc + src_ofs)) << bit_buf_size; \
+		src_ofs += 4; bit_buf_size += 32; } \
+	} while(0)
+
+#define GET_BITS(b, ll) do { \
+	uint32_t l = ll; assert(l && (l <= 32)); \
+	b = (uint32_t)(bit_buf & g_bitmasks[l]); \
+	bit_buf >>= l; \
+	bit_buf_size -= l; \
+	ENSURE_32BITS(); \
+	} while(0)
+
+#define SKIP_BITS(ll) do { \
+	uint32_t l = ll; assert(l <= 32); \
+	bit_buf >>= l; \
+	bit_buf_size -= l; \
+	ENSURE_32BITS(); \
+	} while(0)
+
+#define GET_BITS_NE(b, ll) do { \
+	uint32_t l = ll; assert(l && (l <= 32) && (bit_buf_size >= l)); \
+	b = (uint32_t)(bit_buf & g_bitmasks[l]); \
+	bit_buf >>= l; \
+	bit_buf_size -= l; \
+	} while(0)
+
+#define SKIP_BITS_NE(ll) do { \
+	uint32_t l = ll; assert(l <= 32 && (bit_buf_size >= l)); \
+	bit_buf >>= l; \
+	bit_buf_size -= l; \
+	} while(0)
+
+	// Per-thread decoder scratch memory: the Huffman decoder tables of the last block (and the code sizes they were built from), and the row buffers of the kernels.
+	struct decode_scratch
+	{
+		uint32_t m_lit_table[FPNG_DECODER_TABLE_SIZE], m_dist_table[FPNG_DECODER_TABLE_SIZE];
+
+		uint8_t m_code_sizes[DEFL_MAX_HUFF_SYMBOLS_0 + DEFL_MAX_HUFF_SYMBOLS_1];
+		uint32_t m_num_lit_codes, m_num_dist_codes, m_num_chans;
+		bool m_lz_matches;
+		bool m_tables_valid;
+
+		std::vector<uint8_t> m_rows, m_convert_rows;
+
+		// Where the decompressors add their timings and counts, or nullptr.
+		fpng_decode_stats* m_pStats;
+
+		decode_scratch() : m_tables_valid(false), m_pStats(nullptr) { }
+	};
+
+	// Reads the dynamic block's Huffman tables, and builds the literal (and if needed, distance) decoder tables in scratch. If the code sizes are the same as 
+	// the last block decoded with this scratch memory, which is usually the case for strips and for images written with the same preset, the tables are reused.
+	static bool prepare_dynamic_block(
+		const uint8_t* pSrc, size_t src_len, size_t& src_ofs,
+		uint32_t& bit_buf_size, uint64_t& bit_buf,
+		decode_scratch& scratch, uint32_t num_chans, bool& lz_matches)
+	{
+		static const uint8_t s_bit_length_order[] = { 16, 17, 18, 0, 8,  7,  9, 6, 10,  5, 11, 4, 12,  3, 13, 2, 14,  1, 15 };
+
+		FPNG_STATS_ONLY(decode_stats_timer timer(scratch.m_pStats, &fpng_decode_stats::m_table_build_ns);)
+
+		uint32_t num_lit_codes, num_dist_codes, num_clen_codes;
+
+		GET_BITS(num_lit_codes, 5);
+		num_lit_codes += 257;
+
+		GET_BITS(num_dist_codes, 5);
+		num_dist_codes += 1;
+		
+		uint32_t total_codes = num_lit_codes + num_dist_codes;
+		if (total_codes > (DEFL_MAX_HUFF_SYMBOLS_0 + DEFL_MAX_HUFF_SYMBOLS_1))
+			return false;
+
+		uint8_t code_sizes[DEFL_MAX_HUFF_SYMBOLS_0 + DEFL_MAX_HUFF_SYMBOLS_1];
+		memset(code_sizes, 0, sizeof(code_sizes));
+
+		GET_BITS(num_clen_codes, 4);
+		num_clen_codes += 4;
+
+		uint8_t clen_codesizes[DEFL_MAX_HUFF_SYMBOLS_2];
+		memset(clen_codesizes, 0, sizeof(clen_codesizes));
+
+		for (uint32_t i = 0; i < num_clen_codes; i++)
+		{
+			uint32_t len = 0;
+			GET_BITS(len, 3);
+			clen_codesizes[s_bit_length_order[i]] = (uint8_t)len;
+		}
+
+		uint32_t clen_table[FPNG_DECODER_TABLE_SIZE];
+		if (!build_decoder_table(DEFL_MAX_HUFF_SYMBOLS_2, clen_codesizes, clen_table))
+			return false;
+
+		uint32_t min_code_size = 15;
+
+		for (uint32_t cur_code = 0; cur_code < total_codes; )
+		{
+			uint32_t sym = clen_table[bit_buf & (FPNG_DECODER_TABLE_SIZE - 1)];
+			uint32_t sym_len = sym >> 9;
+			if (!sym_len)
+				return false;
+			SKIP_BITS(sym_len);
+			sym &= 511;
+						
+			if (sym <= 15)
+			{
+				// Can't be a fpng Huffman table
+				if (sym > FPNG_DECODER_TABLE_BITS)
+					return false;
+
+				if (sym)
+					min_code_size = minimum(min_code_size, sym);
+
+				code_sizes[cur_code++] = (uint8_t)sym;
+				continue;
+			}
+
+			uint32_t rep_len = 0, rep_code_size = 0;
+
+			switch (sym)
+			{
+			case 16:
+			{
+				GET_BITS(rep_len, 2);
+				rep_len += 3;
+				if (!cur_code)
+					return false;
+				rep_code_size = code_sizes[cur_code - 1];
+				break;
+			}
+			case 17:
+			{
+				GET_BITS(rep_len, 3);
+				rep_len += 3;
+				rep_code_size = 0;
+				break;
+			}
+			case 18:
+			{
+				GET_BITS(rep_len, 7);
+				rep_len += 11;
+				rep_code_size = 0;
+				break;
+			}
+			}
+
+			if ((cur_code + rep_len) > total_codes)
+				return false;
+
+			for (; rep_len; rep_len--)
+				code_sizes[cur_code++] = (uint8_t)rep_code_size;
+		}
+
+		if ((scratch.m_tables_valid) && (scratch.m_num_lit_codes == num_lit_codes) && (scratch.m_num_dist_codes == num_dist_codes) && (scratch.m_num_chans == num_chans) &&
+			(!memcmp(scratch.m_code_sizes, code_sizes, total_codes)))
+		{
+			FPNG_STATS_ONLY(if (scratch.m_pStats) scratch.m_pStats->m_num_tables_reused++;)
+
+			lz_matches = scratch.m_lz_matches;
+			return true;
+		}
+
+		scratch.m_tables_valid = false;
+
+		uint32_t* pLit_table = scratch.m_lit_table;
+		uint32_t* pDist_table = scratch.m_dist_table;
+
+		uint8_t lit_codesizes[DEFL_MAX_HUFF_SYMBOLS_0];
+
+		memcpy(lit_codesizes, code_sizes, num_lit_codes);
+		memset(lit_codesizes + num_lit_codes, 0, DEFL_MAX_HUFF_SYMBOLS_0 - num_lit_codes);
+
+		uint32_t total_valid_distcodes = 0, total_used_distcodes = 0;
+		for (uint32_t i = 0; i < num_dist_codes; i++)
+		{
+			total_valid_distcodes += (code_sizes[num_lit_codes + i] == 1);
+			total_used_distcodes += (code_sizes[num_lit_codes + i] != 0);
+		}
+		
+		// 1 or 2 because the first version of FPNG only issued 1 valid distance code, but that upset wuffs. So we let 1 or 2 through.
+		bool rle_only = (total_valid_distcodes >= 1) && (total_valid_distcodes <= 2) && (total_used_distcodes == total_valid_distcodes);
+
+		// A num_chans of 0 means the caller always wants the distance table.
+		if ((!num_chans) || (code_sizes[num_lit_codes + (num_chans - 1)] != 1))
+			rle_only = false;
+
+		if ((rle_only) && (total_valid_distcodes == 2))
+		{
+			// If there are two valid distance codes, make sure the first is 1 bit.
+			if (code_sizes[num_lit_codes + num_chans] != 1)
+				rle_only = false;
+		}
+
+		// Anything else must come from FPNG_ENCODE_LZ_MATCHES, which can use any distance.
+		lz_matches = !rle_only;
+		if (lz_matches)
+		{
+			uint8_t dist_codesizes[DEFL_MAX_HUFF_SYMBOLS_1];
+			memcpy(dist_codesizes, code_sizes + num_lit_codes, num_dist_codes);
+			memset(dist_codesizes + num_dist_codes, 0, DEFL_MAX_HUFF_SYMBOLS_1 - num_dist_codes);
+
+			if (!build_decoder_table(DEFL_MAX_HUFF_SYMBOLS_1, dist_codesizes, pDist_table))
+				return false;
+		}
+						
+		if (!build_decoder_table(num_lit_codes, lit_codesizes, pLit_table))
+			return false;
+
+		// Add next symbol to decoder table, when it fits
+		for (uint32_t i = 0; i < FPNG_DECODER_TABLE_SIZE; i++)
+		{
+			uint32_t sym = pLit_table[i] & 511;
+			if (sym >= 256)
+				continue;
+
+			uint32_t sym_bits = (pLit_table[i] >> 9) & 15;
+			if (!sym_bits)
+				continue;
+			assert(sym_bits <= FPNG_DECODER_TABLE_BITS);
+
+			uint32_t bits_left = FPNG_DECODER_TABLE_BITS - sym_bits;
+			if (bits_left < min_code_size)
+				continue;
+
+			uint32_t next_bits = i >> sym_bits;
+			uint32_t next_sym = pLit_table[next_bits] & 511;
+			uint32_t next_sym_bits = (pLit_table[next_bits] >> 9) & 15;
+			if ((!next_sym_bits) || (bits_left < next_sym_bits))
+				continue;
+
+			pLit_table[i] |= (next_sym << 16) | (next_sym_bits << (16 + 9));
+		}
+
+		memcpy(scratch.m_code_sizes, code_sizes, total_codes);
+		scratch.m_num_lit_codes = num_lit_codes;
+		scratch.m_num_dist_codes = num_dist_codes;
+		scratch.m_num_chans = num_chans;
+		scratch.m_lz_matches = lz_matches;
+		scratch.m_tables_valid = true;
+
+		FPNG_STATS_ONLY(if (scratch.m_pStats) scratch.m_pStats->m_num_tables_built++;)
+
+		return true;
+	}
+		
+	// Collects decoded rows into a band buffer and hands each complete band to the fpng_decode_memory_rows() callback.
+	// The buffer holds at least one more row than a band, so the row above the one being decoded is always intact when the next band starts.
+	// Rows before m_first_row are decoded (they're needed by the Up filter) but not passed to the callback, and decoding stops after row m_total_rows-1.
+	struct decode_row_sink
+	{
+		fpng_decode_rows_func m_pCallback;
+		void* m_pCallback_user_data;
+
+		uint8_t* m_pBuf;
+		uint8_t* m_pBuf_end;
+		uint8_t* m_pBand;
+		size_t m_bpl;
+		uint32_t m_rows_per_band, m_total_rows;
+		uint32_t m_cur_row, m_band_first_row;
+		uint32_t m_first_row;
+		bool m_stop_early; // true if m_total_rows is before the end of the image
+		bool m_aborted;
+		bool m_stopped; // set when decoding stopped after row m_total_rows-1 because of m_stop_early
+
+		// Called after each row is decoded, with the pointer just past it. Returns where the next row should go, or nullptr to stop decoding.
+		uint8_t* row_done(uint8_t* pNext_row)
+		{
+			if (m_cur_row >= m_total_rows)
+				return nullptr;
+
+			m_cur_row++;
+
+			const bool skipped = m_cur_row <= m_first_row;
+
+			if ((skipped) || ((m_cur_row - m_band_first_row) == m_rows_per_band) || (m_cur_row == m_total_rows))
+			{
+				if ((!skipped) && (!m_pCallback(m_pBand, m_band_first_row, m_cur_row - m_band_first_row, m_pCallback_user_data)))
+				{
+					m_aborted = true;
+					return nullptr;
+				}
+
+				if ((m_cur_row == m_total_rows) && (m_stop_early))
+				{
+					m_stopped = true;
+					return nullptr;
+				}
+
+				// The next band must fit, without overwriting the row just decoded.
+				if ((size_t)(m_pBuf_end - pNext_row) < m_rows_per_band * m_bpl)
+					pNext_row = ((pNext_row - m_bpl) == m_pBuf) ? (m_pBuf + m_bpl) : m_pBuf;
+
+				m_pBand = pNext_row;
+				m_band_first_row = m_cur_row;
+			}
+
+			return pNext_row;
+		}
+	};
+
+	// Sets up a sink which hands bands of rows_per_band rows, decoded into a buffer of buf_size bytes (see above), to pCallback. Rows before first_row are skipped, 
+	// and if stop_early is true decoding stops after row total_rows-1.
+	static void init_row_sink(decode_row_sink& sink, uint8_t* pBuf, size_t buf_size, size_t bpl, uint32_t rows_per_band, uint32_t start_row, uint32_t first_row, uint32_t total_rows, bool stop_early,
+		fpng_decode_rows_func pCallback, void* pCallback_user_data)
+	{
+		sink.m_pCallback = pCallback;
+		sink.m_pCallback_user_data = pCallback_user_data;
+		sink.m_pBuf = pBuf;
+		sink.m_pBuf_end = pBuf + buf_size;
+		sink.m_pBand = pBuf;
+		sink.m_bpl = bpl;
+		sink.m_rows_per_band = rows_per_band;
+		sink.m_total_rows = total_rows;
+		sink.m_cur_row = start_row;
+		sink.m_band_first_row = start_row;
+		sink.m_first_row = first_row;
+		sink.m_stop_early = stop_early;
+		sink.m_aborted = false;
+		sink.m_stopped = false;
+	}
+
+	// fpng_decode_params::m_dst_format: the decompressors unfilter each row against the one above it in their output, so the rows can't be converted where they're decoded.
+	// Instead they're decoded in the file's layout into a two row buffer (a sink with one row bands), and each row is converted as it's passed on: to its place in the output, 
+	// or to the sink of fpng_decode_memory_rows().
+	struct convert_rows_job
+	{
+		pixel_convert_func m_pConvert;
+		uint32_t m_w;
+		size_t m_src_bpl;
+		uint8_t* m_pNext_row;	// where the next converted row goes
+		size_t m_pitch;			// the distance between the converted rows, if m_pSink is nullptr
+		decode_row_sink* m_pSink;
+	};
+
+	static bool convert_rows_callback(const uint8_t* pRows, uint32_t first_row, uint32_t num_rows, void* pUser_data)
+	{
+		convert_rows_job& job = *static_cast<convert_rows_job*>(pUser_data);
+		(void)first_row;
+
+		for (uint32_t y = 0; y < num_rows; y++)
+		{
+			job.m_pConvert(pRows + y * job.m_src_bpl, job.m_pNext_row, job.m_w);
+
+			if (!job.m_pSink)
+				job.m_pNext_row += job.m_pitch;
+			else if (!(job.m_pNext_row = job.m_pSink->row_done(job.m_pNext_row + job.m_pSink->m_bpl)))
+				return false;
+		}
+
+		return true;
+	}
+
+	// Sets up decoding rows [start_row, total_rows) in the file's layout to a two row buffer in scratch, converting them with job (whose destination must be set by the caller).
+	// Returns where the first row should be decoded.
+	static uint8_t* init_convert_sink(decode_row_sink& sink, convert_rows_job& job, pixel_convert_func pConvert, uint32_t w, uint32_t src_bpl, uint32_t start_row, uint32_t first_row, uint32_t total_rows, bool stop_early, 
+		decode_scratch& scratch)
+	{
+		uint8_t* pBuf = get_scratch_buf(scratch.m_convert_rows, (size_t)src_bpl * 2);
+
+		job.m_pConvert = pConvert;
+		job.m_w = w;
+		job.m_src_bpl = src_bpl;
+
+		init_row_sink(sink, pBuf, (size_t)src_bpl * 2, src_bpl, 1, start_row, first_row, total_rows, stop_early, convert_rows_callback, &job);
+		return pBuf;
+	}
+
+	// Converts an unfiltered row of w pixels as stored in the file (file_chans channels, with big endian samples if bytes_per_sample is 2) to dst_chans channels:
+	// native endian samples (dst_bytes_per_sample bytes, keeping the high byte of 16-bit samples written as 8-bit), grayscale copied to R, G and B, and alpha added (opaque) or dropped.
+	typedef void (*raw_row_store_func)(const uint8_t* pRaw, uint8_t* pDst, uint32_t w);
+
+	template<uint32_t file_chans, uint32_t bytes_per_sample, uint32_t dst_chans, uint32_t dst_bytes_per_sample = bytes_per_sample>
+	static void store_raw_row(const uint8_t* pRaw, uint8_t* pDst, uint32_t w)
+	{
+		static_assert(dst_bytes_per_sample <= bytes_per_sample, "samples are never widened");
+
+		const uint32_t file_color_chans = (file_chans <= 2) ? 1 : 3, dst_color_chans = (dst_chans <= 2) ? 1 : 3;
+		const bool file_has_alpha = (file_chans == 2) || (file_chans == 4);
+
+		for (uint32_t x = 0; x < w; x++, pRaw += file_chans * bytes_per_sample, pDst += dst_chans * dst_bytes_per_sample)
+		{
+			for (uint32_t c = 0; c < dst_chans; c++)
+			{
+				uint32_t v;
+				if ((c < dst_color_chans) || (file_has_alpha))
+				{
+					const uint8_t* pSample = pRaw + ((c < dst_color_chans) ? minimum(c, file_color_chans - 1) : (file_chans - 1)) * bytes_per_sample;
+					v = (bytes_per_sample == 2) ? ((pSample[0] << 8) | pSample[1]) : pSample[0];
+				}
+				else
+					v = (bytes_per_sample == 2) ? 0xFFFF : 0xFF;
+
+				if (dst_bytes_per_sample == 2)
+				{
+					const uint16_t sample = (uint16_t)v;
+					memcpy(pDst + c * 2, &sample, 2);
+				}
+				else
+					pDst[c] = (uint8_t)(v >> ((bytes_per_sample - 1) * 8));
+			}
+		}
+	}
+
+	// Decodes the raw (stored) blocks from src_ofs to end_ofs, holding h rows using filter 0: either the whole zlib stream (src_ofs 2, up to its Adler-32), or a strip written as raw blocks.
+	// Like the pixel decompressors, only the last block of the final strip may be marked final.
+	// src_bpp and dst_bpp are the bytes per pixel in the file and in the output. Without pStore only 3 or 4 8-bit channels are supported, which are converted in place (adding an opaque alpha or dropping it).
+	// Otherwise each row is gathered and converted by pStore.
+	static bool fpng_pixel_zlib_raw_decompress(
+		const uint8_t* pSrc, size_t src_len, size_t src_ofs, size_t end_ofs, bool final_block,
+		uint8_t* pDst, uint32_t w, uint32_t h, uint32_t dst_pitch,
+		uint32_t src_bpp, uint32_t dst_bpp, decode_row_sink* pSink, uint32_t* pAdler32, decode_scratch& scratch, raw_row_store_func pStore = nullptr)
+	{
+		assert(pStore || (src_bpp == 3) || (src_bpp == 4));
+		assert(pStore || (dst_bpp == 3) || (dst_bpp == 4));
+		assert(end_ofs <= src_len);
+		(void)src_len;
+
+		const uint32_t src_bpl = w * src_bpp;
+
+		uint8_t* pRaw_row = pStore ? get_scratch_buf(scratch.m_rows, src_bpl) : nullptr;
+
+		// With a pitch, rows are dst_pitch bytes apart.
+		assert(dst_pitch >= w * dst_bpp);
+
+		uint8_t* pCur_scanline = pDst;
+		uint32_t y = 0;
+		uint32_t x_ofs = 0;
+		uint32_t raster_ofs = 0;
+		uint32_t comp_ofs = 0;
+
+		FPNG_STATS_ONLY(decode_stats_timer timer(scratch.m_pStats, &fpng_decode_stats::m_decode_ns);)
+
+		for (; ; )
+		{
+			// A strip which isn't the last one simply ends after its last block.
+			if ((!final_block) && (src_ofs == end_ofs))
+				break;
+
+			if ((src_ofs + 5) > end_ofs)
+				return false;
+
+			const bool bfinal = (pSrc[src_ofs] & 1) != 0;
+			const uint32_t btype = (pSrc[src_ofs] >> 1) & 3;
+			if ((btype != 0) || (bfinal && !final_block))
+				return false;
+
+			src_ofs++;
+
+			uint32_t len = pSrc[src_ofs + 0] | (pSrc[src_ofs + 1] << 8);
+			uint32_t nlen = pSrc[src_ofs + 2] | (pSrc[src_ofs + 3] << 8);
+			src_ofs += 4;
+
+			if (len != (~nlen & 0xFFFF))
+				return false;
+
+			if ((src_ofs + len) > end_ofs)
+				return false;
+
+			// The stored block's bytes are exactly the filtered rows, and are about to be read anyway.
+			if (pAdler32)
+			{
+				FPNG_STATS_ONLY(timer.lap(&fpng_decode_stats::m_decode_ns);)
+				*pAdler32 = fpng_adler32(pSrc + src_ofs, len, *pAdler32);
+				FPNG_STATS_ONLY(timer.lap(&fpng_decode_stats::m_checksum_ns);)
+			}
+
+			// Raw blocks are a relatively uncommon case so this isn't well optimized.
+			// Supports 3->4 and 4->3 byte/pixel conversion.
+			for (uint32_t i = 0; i < len; i++)
+			{
+				uint32_t c = pSrc[src_ofs + i];
+
+				if (!raster_ofs)
+				{
+					// Check filter type, and that there's another row to decode
+					if ((c != 0) || (y == h))
+						return false;
+
+					assert(!comp_ofs);
+				}
+				else if (pStore)
+					pRaw_row[raster_ofs - 1] = (uint8_t)c;
+				else
+				{
+					if (comp_ofs < dst_bpp)
+						pCur_scanline[x_ofs++] = (uint8_t)c;
+
+					if (++comp_ofs == src_bpp)
+					{
+						if (dst_bpp > src_bpp)
+							pCur_scanline[x_ofs++] = (uint8_t)0xFF;
+
+						comp_ofs = 0;
+					}
+				}
+
+				if (++raster_ofs == (src_bpl + 1))
+				{
+					assert(!comp_ofs);
+					raster_ofs = 0;
+					x_ofs = 0;
+
+					if (pStore)
+						pStore(pRaw_row, pCur_scanline, w);
+
+					pCur_scanline += dst_pitch;
+					y++;
+
+					if (pSink)
+					{
+						pCur_scanline = pSink->row_done(pCur_scanline);
+						if (!pCur_scanline)
+							return false;
+					}
+				}
+			}
+
+			src_ofs += len;
+
+			if (bfinal)
+				break;
+		}
+
+		// The rows must end with the last block, and the final block must end where the zlib adler32 begins.
+		return (raster_ofs == 0) && (y == h) && (src_ofs == end_ofs);
+	}
+
+#if FPNG_X86_OR_X64_CPU && !FPNG_NO_SSE
+	// Loads/stores the first num_chans (1-8) bytes of a pixel as 16-bit lanes.
+	template<uint32_t num_chans>
+	static inline __m128i load_pixel_sse41(const uint8_t* p)
+	{
+		uint64_t v = 0;
+		memcpy(&v, p, num_chans);
+		return _mm_cvtepu8_epi16(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(&v)));
+	}
+
+	template<uint32_t num_chans>
+	static inline void store_pixel_sse41(uint8_t* p, __m128i v)
+	{
+		uint64_t u;
+		_mm_storel_epi64(reinterpret_cast<__m128i*>(&u), _mm_packus_epi16(v, v));
+		memcpy(p, &u, num_chans);
+	}
+#endif
+
+	// Undoes the Sub (1), Average (3) or Paeth (4) filter of a decoded row in place. The decompressors leave this until the row is decoded, because each pixel depends on the one to its left.
+	// The row's pixels are dst_comps bytes apart, and only their first num_chans bytes are unfiltered (so an added alpha stays 0xFF). pPrev_row can only be nullptr for Sub.
+	template<uint32_t dst_comps, uint32_t num_chans>
+	static void unfilter_row(uint32_t filter, uint8_t* pRow, const uint8_t* pPrev_row, uint32_t w)
+	{
+		assert((filter == 1) || (filter == 3) || (filter == 4));
+		assert(pPrev_row || (filter == 1));
+
+#if FPNG_X86_OR_X64_CPU && !FPNG_NO_SSE
+		if (g_cpu_info.can_use_sse41())
+		{
+			// One pixel at a time: a is the pixel to the left, b the one above, c the one above and to the left.
+			const __m128i byte_mask = _mm_set1_epi16(0xFF);
+			__m128i a = _mm_setzero_si128(), c = _mm_setzero_si128();
+
+			for (uint32_t x = 0; x < w; x++, pRow += dst_comps)
+			{
+				__m128i v = load_pixel_sse41<num_chans>(pRow);
+
+				if (filter == 1)
+					v = _mm_add_epi16(v, a);
+				else
+				{
+					const __m128i b = load_pixel_sse41<num_chans>(pPrev_row);
+					pPrev_row += dst_comps;
+
+					if (filter == 3)
+						v = _mm_add_epi16(v, _mm_srli_epi16(_mm_add_epi16(a, b), 1));
+					else
+						v = _mm_add_epi16(v, paeth_predictor_sse41(a, b, c));
+
+					c = b;
+				}
+
+				a = _mm_and_si128(v, byte_mask);
+				store_pixel_sse41<num_chans>(pRow, a);
+			}
+
+			return;
+		}
+#endif
+
+		for (uint32_t x = 0; x < w; x++, pRow += dst_comps)
+		{
+			for (uint32_t i = 0; i < num_chans; i++)
+			{
+				const uint32_t a = x ? (pRow - dst_comps)[i] : 0;
+
+				if (filter == 1)
+					pRow[i] = (uint8_t)(pRow[i] + a);
+				else if (filter == 3)
+					pRow[i] = (uint8_t)(pRow[i] + ((a + pPrev_row[i]) >> 1));
+				else
+					pRow[i] = (uint8_t)(pRow[i] + paeth_predictor(a, pPrev_row[i], x ? (pPrev_row - dst_comps)[i] : 0));
+			}
+
+			if (pPrev_row)
+				pPrev_row += dst_comps;
+		}
+	}
+
+	// Updates the zlib Adler32 with a decoded row, as it was in the zlib stream: its filter byte, then the row's bytes as decoded, or their differences from the pixels above if pPrev_row isn't nullptr (Up).
+	// Rows using the other filters must be passed in before they're unfiltered.
+	// The filtered row is rebuilt in pFiltered_row (1+w*file_comps bytes) while the decoded row is still in the cache. If alpha is being dropped (4->3), the decompressor must have already stored the alpha differences in it.
+	template<uint32_t file_comps, uint32_t dst_comps>
+	static uint32_t decoded_row_adler32(uint32_t filter, const uint8_t* pRow, const uint8_t* pPrev_row, uint32_t w, uint8_t* pFiltered_row, uint32_t adler)
+	{
+		pFiltered_row[0] = (uint8_t)filter;
+
+		uint8_t* pDst = pFiltered_row + 1;
+
+		if (file_comps == dst_comps)
+		{
+			const uint32_t n = w * file_comps;
+			if (pPrev_row)
+			{
+				for (uint32_t i = 0; i < n; i++)
+					pDst[i] = (uint8_t)(pRow[i] - pPrev_row[i]);
+			}
+			else
+				memcpy(pDst, pRow, n);
+		}
+		else
+		{
+			// Only the RGB bytes of each pixel were in the file, either because alpha was added (3->4) or dropped (4->3).
+			for (uint32_t x = 0; x < w; x++, pRow += dst_comps, pDst += file_comps)
+			{
+				if (pPrev_row)
+				{
+					pDst[0] = (uint8_t)(pRow[0] - pPrev_row[0]);
+					pDst[1] = (uint8_t)(pRow[1] - pPrev_row[1]);
+					pDst[2] = (uint8_t)(pRow[2] - pPrev_row[2]);
+					pPrev_row += dst_comps;
+				}
+				else
+				{
+					pDst[0] = pRow[0];
+					pDst[1] = pRow[1];
+					pDst[2] = pRow[2];
+				}
+			}
+		}
+
+		return fpng_adler32(pFiltered_row, 1 + w * file_comps, adler);
+	}
+
+	// Checks the end of a block decoded by the pixel decompressors: the EOB symbol, the sync flush after a non-final block, and that the block ends exactly at end_ofs.
+	static bool finish_pixel_block(const uint8_t* pSrc, size_t src_len, size_t src_ofs, size_t end_ofs, bool final_block, uint64_t bit_buf, uint32_t bit_buf_size, const uint32_t* pLit_table)
+	{
+		// The last symbol should be EOB
+		assert(bit_buf_size >= FPNG_DECODER_TABLE_BITS);
+		uint32_t lit0 = pLit_table[bit_buf & (FPNG_DECODER_TABLE_SIZE - 1)];
+		uint32_t lit0_len = (lit0 >> 9) & 15;
+		if (!lit0_len)
+			return false;
+		lit0 &= 511;
+		if (lit0 != 256)
+			return false;
+
+		bit_buf_size -= lit0_len;
+		bit_buf >>= lit0_len;
+
+		if (!final_block)
+		{
+			// The next block must be an empty stored block (a sync flush)
+			ENSURE_32BITS();
+			if (bit_buf & 7)
+				return false;
+			bit_buf_size -= 3;
+			bit_buf >>= 3;
+		}
+
+		uint32_t align_bits = bit_buf_size & 7;
+		bit_buf_size -= align_bits;
+		bit_buf >>= align_bits;
+
+		if (src_ofs < (bit_buf_size >> 3))
+			return false;
+		src_ofs -= (bit_buf_size >> 3);
+
+		if (!final_block)
+		{
+			if ((src_ofs + 4) > src_len)
+				return false;
+
+			// LEN=0, NLEN=0xFFFF
+			if (READ_LE32(pSrc + src_ofs) != 0xFFFF0000)
+				return false;
+			src_ofs += 4;
+		}
+
+		// We should be at the very end, because the bit buf reads ahead 32-bits (which contains the zlib adler32, or the next strip).
+		if (src_ofs != end_ofs)
+			return false;
+
+		return true;
+	}
+
+	static const int s_dist_base[] = { 1,2,3,4,5,7,9,13,17,25,33,49,65,97,129,193,257,385,513,769,1025,1537,2049,3073,4097,6145,8193,12289,16385,24577,    0,0 };
+	static const int s_dist_extra[] = { 0,0,0,0,1,1,2,2,3,3,4,4,5,5,6,6,7,7,8,8,9,9,10,10,11,11,12,12,13,13,    0,0 };
+
+	// Decodes a row's filter byte and pixels (bpl bytes in all) to pFiltered, as they were before compression. The row can contain literals, and matches at any distance within the row.
+	static bool decode_filtered_row(const uint8_t* pSrc, size_t src_len, size_t& src_ofs, uint64_t& bit_buf, uint32_t& bit_buf_size, 
+		const uint32_t* pLit_table, const uint32_t* pDist_table, uint8_t* pFiltered, uint32_t bpl)
+	{
+		uint32_t ofs = 0;
+		while (ofs < bpl)
+		{
+			assert(bit_buf_size >= FPNG_DECODER_TABLE_BITS);
+			uint32_t sym = pLit_table[bit_buf & (FPNG_DECODER_TABLE_SIZE - 1)];
+			uint32_t sym_len = (sym >> 9) & 15;
+			if (!sym_len)
+				return false;
+			SKIP_BITS(sym_len);
+			sym &= 511;
+
+			if (sym < 256)
+			{
+				pFiltered[ofs++] = (uint8_t)sym;
+				continue;
+			}
+
+			// Can't be EOB (we still have more pixels to decompress), and the filter byte must be a literal.
+			if ((sym == 256) || (sym > 285) || (!ofs))
+				return false;
+
+			uint32_t match_len = s_length_range[sym - 257];
+			if (s_length_extra[sym - 257])
+			{
+				uint32_t e;
+				GET_BITS(e, s_length_extra[sym - 257]);
+				match_len += e;
+			}
+
+			assert(bit_buf_size >= FPNG_DECODER_TABLE_BITS);
+			uint32_t dist_sym = pDist_table[bit_buf & (FPNG_DECODER_TABLE_SIZE - 1)];
+			uint32_t dist_sym_len = (dist_sym >> 9) & 15;
+			if (!dist_sym_len)
+				return false;
+			SKIP_BITS(dist_sym_len);
+			dist_sym &= 511;
+			if (dist_sym >= 30)
+				return false;
+
+			uint32_t dist = s_dist_base[dist_sym];
+			if (s_dist_extra[dist_sym])
+			{
+				uint32_t e;
+				GET_BITS(e, s_dist_extra[dist_sym]);
+				dist += e;
+			}
+
+			// Matches can't reach back to the filter byte or the previous rows, or run past the end of the row.
+			if ((dist >= ofs) || ((ofs + match_len) > bpl))
+				return false;
+
+			const uint8_t* pMatch = pFiltered + ofs - dist;
+			if (dist >= match_len)
+				memcpy(pFiltered + ofs, pMatch, match_len);
+			else
+			{
+				for (uint32_t i = 0; i < match_len; i++)
+					pFiltered[ofs + i] = pMatch[i];
+			}
+
+			ofs += match_len;
+		}
+
+		return true;
+	}
+
+	// Writes a row decoded by fpng_pixel_zlib_decompress_lz() into the image: adds back the pixels above for Up, converts from file_comps to dst_comps bytes per pixel 
+	// (adding an opaque alpha, or dropping alpha), then undoes the Sub, Average or Paeth filters.
+	template<uint32_t file_comps, uint32_t dst_comps>
+	static void store_lz_row(uint32_t filter, const uint8_t* pFiltered, uint8_t* pRow, const uint8_t* pPrev_row, uint32_t w)
+	{
+		const uint32_t num_chans = (file_comps < dst_comps) ? file_comps : dst_comps;
+
+		if (file_comps == dst_comps)
+		{
+			const uint32_t n = w * dst_comps;
+			if (filter == 2)
+			{
+				for (uint32_t i = 0; i < n; i++)
+					pRow[i] = (uint8_t)(pFiltered[i] + pPrev_row[i]);
+			}
+			else
+				memcpy(pRow, pFiltered, n);
+		}
+		else
+		{
+			uint8_t* pDst = pRow;
+			const uint8_t* pUp = (filter == 2) ? pPrev_row : nullptr;
+
+			for (uint32_t x = 0; x < w; x++, pFiltered += file_comps, pDst += dst_comps)
+			{
+				for (uint32_t i = 0; i < 3; i++)
+					pDst[i] = (uint8_t)(pFiltered[i] + (pUp ? pUp[i] : 0));
+
+				if (dst_comps == 4)
+					pDst[3] = 0xFF;
+
+				if (pUp)
+					pUp += dst_comps;
+			}
+		}
+
+		if ((filter == 1) || (filter >= 3))
+			unfilter_row<dst_comps, num_chans>(filter, pRow, pPrev_row, w);
+	}
+
+	// Decompresses a block written with FPNG_ENCODE_LZ_MATCHES, whose matches can use any distance within the current row. Called by fpng_pixel_zlib_decompress_3/4() 
+	// once prepare_dynamic_block() has read the Huffman tables, and otherwise works the same way. Each row is decoded into a copy of its filtered bytes first (which the matches
+	// copy from, and which is also exactly what the zlib adler32 covers), then written to the image.
+	template<uint32_t file_comps, uint32_t dst_comps, bool check_adler32>
+	static bool fpng_pixel_zlib_decompress_lz(
+		const uint8_t* pSrc, size_t src_len, size_t src_ofs, size_t end_ofs, bool final_block,
+		uint8_t* pDst, uint32_t w, uint32_t h, uint32_t dst_pitch, decode_row_sink* pSink, uint32_t* pAdler32,
+		uint64_t bit_buf, uint32_t bit_buf_size, const uint32_t* pLit_table, const uint32_t* pDist_table, decode_scratch& scratch)
+	{
+		const uint32_t bpl = 1 + w * file_comps;
+
+		uint8_t* pFiltered = get_scratch_buf(scratch.m_rows, bpl);
+
+		FPNG_STATS_ONLY(decode_stats_timer timer(scratch.m_pStats, &fpng_decode_stats::m_decode_ns);)
+
+		const uint8_t* pPrev_scanline = nullptr;
+		uint8_t* pCur_scanline = pDst;
+
+		for (uint32_t y = 0; y < h; y++)
+		{
+			if (!decode_filtered_row(pSrc, src_len, src_ofs, bit_buf, bit_buf_size, pLit_table, pDist_table, pFiltered, bpl))
+				return false;
+
+			// The first row of the image or strip can use None or Sub, and the other rows any filter.
+			const uint32_t filter = pFiltered[0];
+			if (filter > (y ? 4U : 1U))
+				return false;
+
+			if (check_adler32)
+			{
+				FPNG_STATS_ONLY(timer.lap(&fpng_decode_stats::m_decode_ns);)
+				*pAdler32 = fpng_adler32(pFiltered, bpl, *pAdler32);
+				FPNG_STATS_ONLY(timer.lap(&fpng_decode_stats::m_checksum_ns);)
+			}
+
+			store_lz_row<file_comps, dst_comps>(filter, pFiltered + 1, pCur_scanline, pPrev_scanline, w);
+
+			pPrev_scanline = pCur_scanline;
+			pCur_scanline += dst_pitch;
+
+			if (pSink)
+			{
+				pCur_scanline = pSink->row_done(pCur_scanline);
+				if (!pCur_scanline)
+					return false;
+			}
+
+		} // y
+
+		return finish_pixel_block(pSrc, src_len, src_ofs, end_ofs, final_block, bit_buf, bit_buf_size, pLit_table);
+	}
+
+	// Undoes the Sub, Average or Paeth filter of a row of pixels of bpp (1, 2, 4, 6 or 8) bytes in place.
+	static void unfilter_generic_row(uint32_t filter, uint8_t* pRow, const uint8_t* pPrev_row, uint32_t w, uint32_t bpp)
+	{
+		switch (bpp)
+		{
+		case 1: unfilter_row<1, 1>(filter, pRow, pPrev_row, w); break;
+		case 2: unfilter_row<2, 2>(filter, pRow, pPrev_row, w); break;
+		case 4: unfilter_row<4, 4>(filter, pRow, pPrev_row, w); break;
+		case 6: unfilter_row<6, 6>(filter, pRow, pPrev_row, w); break;
+		default: assert(bpp == 8); unfilter_row<8, 8>(filter, pRow, pPrev_row, w); break;
+		}
+	}
+
+	// Decompresses a block of grayscale, gray+alpha or 16-bit pixels (bpp bytes each), which are written by pixel_deflate_dyn_lz() with or without matches at other distances.
+	// Each row is decoded and unfiltered as it's stored in the file, then converted into the image by pStore. Otherwise works like fpng_pixel_zlib_decompress_3/4().
+	static bool pixel_zlib_decompress_generic(
+		const uint8_t* pSrc, size_t src_len, size_t src_ofs, size_t end_ofs, bool final_block,
+		uint8_t* pDst, uint32_t w, uint32_t h, uint32_t dst_pitch, decode_row_sink* pSink, uint32_t* pAdler32, decode_scratch& scratch, uint32_t bpp, raw_row_store_func pStore)
+	{
+		assert(src_len >= (end_ofs + 8));
+
+		if ((src_ofs + 4) > src_len)
+			return false;
+		uint64_t bit_buf = READ_LE32(pSrc + src_ofs);
+		src_ofs += 4;
+
+		uint32_t bit_buf_size = 32;
+
+		uint32_t bfinal, btype;
+		GET_BITS(bfinal, 1);
+		GET_BITS(btype, 2);
+
+		// Must be the expected block kind (final or not), and type=2 (dynamic)
+		if ((bfinal != (final_block ? 1U : 0U)) || (btype != 2))
+			return false;
+
+		bool lz_matches = false;
+		if (!prepare_dynamic_block(pSrc, src_len, src_ofs, bit_buf_size, bit_buf, scratch, 0, lz_matches))
+			return false;
+
+		const uint32_t* lit_table = scratch.m_lit_table;
+		const uint32_t* dist_table = scratch.m_dist_table;
+
+		const uint32_t bpl = 1 + w * bpp;
+
+		// The current and previous rows as they're stored in the file, including their filter bytes.
+		uint8_t* pRows = get_scratch_buf(scratch.m_rows, bpl * 2);
+		const uint8_t* pPrev_row = nullptr;
+		uint8_t* pCur_row = pRows;
+
+		uint8_t* pCur_scanline = pDst;
+
+		FPNG_STATS_ONLY(decode_stats_timer timer(scratch.m_pStats, &fpng_decode_stats::m_decode_ns);)
+
+		for (uint32_t y = 0; y < h; y++)
+		{
+			if (!decode_filtered_row(pSrc, src_len, src_ofs, bit_buf, bit_buf_size, lit_table, dist_table, pCur_row, bpl))
+				return false;
+
+			// The first row of the image or strip can use None or Sub, and the other rows any filter.
+			const uint32_t filter = pCur_row[0];
+			if (filter > (y ? 4U : 1U))
+				return false;
+
+			if (pAdler32)
+			{
+				FPNG_STATS_ONLY(timer.lap(&fpng_decode_stats::m_decode_ns);)
+				*pAdler32 = fpng_adler32(pCur_row, bpl, *pAdler32);
+				FPNG_STATS_ONLY(timer.lap(&fpng_decode_stats::m_checksum_ns);)
+			}
+
+			if (filter == 2)
+			{
+				for (uint32_t i = 1; i < bpl; i++)
+					pCur_row[i] = (uint8_t)(pCur_row[i] + pPrev_row[i]);
+			}
+			else if (filter)
+				unfilter_generic_row(filter, pCur_row + 1, pPrev_row ? (pPrev_row + 1) : nullptr, w, bpp);
+
+			pStore(pCur_row + 1, pCur_scanline, w);
+
+			pPrev_row = pCur_row;
+			pCur_row = pRows + ((y + 1) & 1) * bpl;
+
+			pCur_scanline += dst_pitch;
+
+			if (pSink)
+			{
+				pCur_scanline = pSink->row_done(pCur_scanline);
+				if (!pCur_scanline)
+					return false;
+			}
+		}
+
+		return finish_pixel_block(pSrc, src_len, src_ofs, end_ofs, final_block, bit_buf, bit_buf_size, lit_table);
+	}
+
+	template<uint32_t file_chans, uint32_t bytes_per_sample, uint32_t dst_chans, uint32_t dst_bytes_per_sample>
+	static bool fpng_pixel_zlib_decompress_generic(
+		const uint8_t* pSrc, size_t src_len, size_t src_ofs, size_t end_ofs, bool final_block,
+		uint8_t* pDst, uint32_t w, uint32_t h, uint32_t dst_pitch, decode_row_sink* pSink, uint32_t* pAdler32, decode_scratch& scratch)
+	{
+		return pixel_zlib_decompress_generic(pSrc, src_len, src_ofs, end_ofs, final_block, pDst, w, h, dst_pitch, pSink, pAdler32, scratch, 
+			file_chans * bytes_per_sample, store_raw_row<file_chans, bytes_per_sample, dst_chans, dst_bytes_per_sample>);
+	}
+
+	// Decompresses h rows, which must be coded as a single dynamic Deflate block starting at byte src_ofs (after the zlib header, or at the start of a strip).
+	// A non-final block must be followed by a sync flush which ends at end_ofs. The final block must end at end_ofs, where the zlib adler32 begins.
+	// Rows are written dst_pitch bytes apart. If pSink isn't nullptr, pDst is its next row, dst_pitch must be w*dst_comps, and each decoded row is passed to it.
+	// If check_adler32 is true, each decoded row is folded into *pAdler32.
+	template<uint32_t dst_comps, bool check_adler32>
+	static bool fpng_pixel_zlib_decompress_3(
+		const uint8_t* pSrc, size_t src_len, size_t src_ofs, size_t end_ofs, bool final_block,
+		uint8_t* pDst, uint32_t w, uint32_t h, uint32_t dst_pitch, decode_row_sink* pSink, uint32_t* pAdler32, decode_scratch& scratch)
+	{
+		assert(src_len >= (end_ofs + 8));
+		assert(check_adler32 == (pAdler32 != nullptr));
+
+		const uint32_t dst_bpl = w * dst_comps;
+		//const uint32_t dst_len = dst_bpl * h;
+
+		if ((src_ofs + 4) > src_len)
+			return false;
+		uint64_t bit_buf = READ_LE32(pSrc + src_ofs);
+		src_ofs += 4;
+
+		uint32_t bit_buf_size = 32;
+
+		uint32_t bfinal, btype;
+		GET_BITS(bfinal, 1);
+		GET_BITS(btype, 2);
+
+		// Must be the expected block kind (final or not), and type=2 (dynamic)
+		if ((bfinal != (final_block ? 1U : 0U)) || (btype != 2))
+			return false;
+		
+		bool lz_matches = false;
+		if (!prepare_dynamic_block(pSrc, src_len, src_ofs, bit_buf_size, bit_buf, scratch, 3, lz_matches))
+			return false;
+
+		const uint32_t* lit_table = scratch.m_lit_table;
+
+		if (lz_matches)
+			return fpng_pixel_zlib_decompress_lz<3, dst_comps, check_adler32>(pSrc, src_len, src_ofs, end_ofs, final_block, pDst, w, h, dst_pitch, pSink, pAdler32, bit_buf, bit_buf_size, lit_table, scratch.m_dist_table, scratch);
+
+		uint8_t* pFiltered_row = check_adler32 ? get_scratch_buf(scratch.m_rows, 1 + w * 3) : nullptr;
+
+		FPNG_STATS_ONLY(decode_stats_timer timer(scratch.m_pStats, &fpng_decode_stats::m_decode_ns);)
+
+		const uint8_t* pPrev_scanline = nullptr;
+		uint8_t* pCur_scanline = pDst;
+
+		for (uint32_t y = 0; y < h; y++)
+		{
+			// At start of PNG scanline, so read the filter literal
+			assert(bit_buf_size >= FPNG_DECODER_TABLE_BITS);
+			uint32_t filter = lit_table[bit_buf & (FPNG_DECODER_TABLE_SIZE - 1)];
+			uint32_t filter_len = (filter >> 9) & 15;
+			if (!filter_len)
+				return false;
+			SKIP_BITS(filter_len);
+			filter &= 511;
+
+			// The first row of the image or strip can use None or Sub, and the other rows any filter (FPNG_ENCODE_ADAPTIVE_FILTERS). 
+			// Up is undone as the pixels are decoded, and Sub/Average/Paeth once the whole row is decoded.
+			if (filter > (y ? 4U : 1U))
+				return false;
+
+			const uint8_t* pUp_scanline = (filter == 2) ? pPrev_scanline : nullptr;
+
+			uint32_t x_ofs = 0;
+			uint8_t prev_delta_r = 0, prev_delta_g = 0, prev_delta_b = 0;
+			do
+			{
+				assert(bit_buf_size >= FPNG_DECODER_TABLE_BITS);
+				uint32_t lit0_tab = lit_table[bit_buf & (FPNG_DECODER_TABLE_SIZE - 1)];
+				
+				uint32_t lit0 = lit0_tab;
+				uint32_t lit0_len = (lit0_tab >> 9) & 15;
+				if (!lit0_len)
+					return false;
+				SKIP_BITS(lit0_len);
+
+				if (lit0 & 256)
+				{
+					lit0 &= 511;
+
+					// Can't be EOB - we still have more pixels to decompress.
+					if (lit0 == 256)
+						return false;
+
+					// Must be an RLE match against the previous pixel.
+					uint32_t run_len = s_length_range[lit0 - 257];
+					if (lit0 >= 265)
+					{
+						uint32_t e;
+						GET_BITS_NE(e, s_length_extra[lit0 - 257]);
+
+						run_len += e;
+					}
+					
+					// Skip match distance - it's always the same (3)
+					SKIP_BITS_NE(1);
+
+					// Matches must always be a multiple of 3/4 bytes
+					assert((run_len % 3) == 0);
+																				
+					if (dst_comps == 4)
+					{
+						const uint32_t x_ofs_end = x_ofs + g_run_len3_to_4[run_len];
+						
+						// Check for valid run lengths
+						if (x_ofs == x_ofs_end)
+							return false;
+
+						// Matches cannot cross scanlines.
+						if (x_ofs_end > dst_bpl)
+							return false;
+
+						if (pUp_scanline)
+						{
+							if ((prev_delta_r | prev_delta_g | prev_delta_b) == 0)
+							{
+								memcpy(pCur_scanline + x_ofs, pUp_scanline + x_ofs, x_ofs_end - x_ofs);
+								x_ofs = x_ofs_end;
+							}
+							else
+							{
+								do
+								{
+									pCur_scanline[x_ofs] = (uint8_t)(pUp_scanline[x_ofs] + prev_delta_r);
+									pCur_scanline[x_ofs + 1] = (uint8_t)(pUp_scanline[x_ofs + 1] + prev_delta_g);
+									pCur_scanline[x_ofs + 2] = (uint8_t)(pUp_scanline[x_ofs + 2] + prev_delta_b);
+									pCur_scanline[x_ofs + 3] = 0xFF;
+									x_ofs += 4;
+								} while (x_ofs < x_ofs_end);
+							}
+						}
+						else
+						{
+							do
+							{
+								pCur_scanline[x_ofs] = prev_delta_r;
+								pCur_scanline[x_ofs + 1] = prev_delta_g;
+								pCur_scanline[x_ofs + 2] = prev_delta_b;
+								pCur_scanline[x_ofs + 3] = 0xFF;
+								x_ofs += 4;
+							} while (x_ofs < x_ofs_end);
+						}
+					}
+					else
+					{
+						// Check for valid run lengths
+						if (!g_run_len3_to_4[run_len])
+							return false;
+
+						const uint32_t x_ofs_end = x_ofs + run_len;
+
+						// Matches cannot cross scanlines.
+						if (x_ofs_end > dst_bpl)
+							return false;
+
+						if (pUp_scanline)
+						{
+							if ((prev_delta_r | prev_delta_g | prev_delta_b) == 0)
+							{
+								memcpy(pCur_scanline + x_ofs, pUp_scanline + x_ofs, run_len);
+								x_ofs = x_ofs_end;
+							}
+							else
+							{
+								do
+								{
+									pCur_scanline[x_ofs] = (uint8_t)(pUp_scanline[x_ofs] + prev_delta_r);
+									pCur_scanline[x_ofs + 1] = (uint8_t)(pUp_scanline[x_ofs + 1] + prev_delta_g);
+									pCur_scanline[x_ofs + 2] = (uint8_t)(pUp_scanline[x_ofs + 2] + prev_delta_b);
+									x_ofs += 3;
+								} while (x_ofs < x_ofs_end);
+							}
+						}
+						else
+						{
+							do
+							{
+								pCur_scanline[x_ofs] = prev_delta_r;
+								pCur_scanline[x_ofs + 1] = prev_delta_g;
+								pCur_scanline[x_ofs + 2] = prev_delta_b;
+								x_ofs += 3;
+							} while (x_ofs < x_ofs_end);
+						}
+					}
+				}
+				else
+				{
+					uint32_t lit1, lit2;
+
+					uint32_t lit1_spec_len = (lit0_tab >> (16 + 9));
+					uint32_t lit2_len;
+					if (lit1_spec_len)
+					{
+						lit1 = (lit0_tab >> 16) & 511;
+						SKIP_BITS_NE(lit1_spec_len);
+
+						assert(bit_buf_size >= FPNG_DECODER_TABLE_BITS);
+						lit2 = lit_table[bit_buf & (FPNG_DECODER_TABLE_SIZE - 1)];
+						lit2_len = (lit2 >> 9) & 15;
+						if (!lit2_len)
+							return false;
+					}
+					else
+					{
+						assert(bit_buf_size >= FPNG_DECODER_TABLE_BITS);
+						lit1 = lit_table[bit_buf & (FPNG_DECODER_TABLE_SIZE - 1)];
+						uint32_t lit1_len = (lit1 >> 9) & 15;
+						if (!lit1_len)
+							return false;
+						SKIP_BITS_NE(lit1_len);
+
+						lit2_len = (lit1 >> (16 + 9));
+						if (lit2_len)
+							lit2 = lit1 >> 16;
+						else
+						{
+							assert(bit_buf_size >= FPNG_DECODER_TABLE_BITS);
+							lit2 = lit_table[bit_buf & (FPNG_DECODER_TABLE_SIZE - 1)];
+							lit2_len = (lit2 >> 9) & 15;
+							if (!lit2_len)
+								return false;
+						}
+					}
+
+					SKIP_BITS(lit2_len);
+					
+					// Check for matches
+					if ((lit1 | lit2) & 256)
+						return false;
+
+					if (dst_comps == 4)
+					{
+						if (pUp_scanline)
+						{
+							pCur_scanline[x_ofs] = (uint8_t)(pUp_scanline[x_ofs] + lit0);
+							pCur_scanline[x_ofs + 1] = (uint8_t)(pUp_scanline[x_ofs + 1] + lit1);
+							pCur_scanline[x_ofs + 2] = (uint8_t)(pUp_scanline[x_ofs + 2] + lit2);
+							pCur_scanline[x_ofs + 3] = 0xFF;
+						}
+						else
+						{
+							pCur_scanline[x_ofs] = (uint8_t)lit0;
+							pCur_scanline[x_ofs + 1] = (uint8_t)lit1;
+							pCur_scanline[x_ofs + 2] = (uint8_t)lit2;
+							pCur_scanline[x_ofs + 3] = 0xFF;
+						}
+						x_ofs += 4;
+					}
+					else
+					{
+						if (pUp_scanline)
+						{
+							pCur_scanline[x_ofs] = (uint8_t)(pUp_scanline[x_ofs] + lit0);
+							pCur_scanline[x_ofs + 1] = (uint8_t)(pUp_scanline[x_ofs + 1] + lit1);
+							pCur_scanline[x_ofs + 2] = (uint8_t)(pUp_scanline[x_ofs + 2] + lit2);
+						}
+						else
+						{
+							pCur_scanline[x_ofs] = (uint8_t)lit0;
+							pCur_scanline[x_ofs + 1] = (uint8_t)lit1;
+							pCur_scanline[x_ofs + 2] = (uint8_t)lit2;
+						}
+						x_ofs += 3;
+					}
+
+					prev_delta_r = (uint8_t)lit0;
+					prev_delta_g = (uint8_t)lit1;
+					prev_delta_b = (uint8_t)lit2;
+										
+					// See if we can decode one more pixel.
+					uint32_t spec_next_len0_len = lit2 >> (16 + 9);
+					if ((spec_next_len0_len) && (x_ofs < dst_bpl))
+					{
+						lit0 = (lit2 >> 16) & 511;
+						if (lit0 < 256)
+						{
+							SKIP_BITS_NE(spec_next_len0_len);
+
+							assert(bit_buf_size >= FPNG_DECODER_TABLE_BITS);
+							lit1 = lit_table[bit_buf & (FPNG_DECODER_TABLE_SIZE - 1)];
+							uint32_t lit1_len = (lit1 >> 9) & 15;
+							if (!lit1_len)
+								return false;
+							SKIP_BITS(lit1_len);
+
+							lit2_len = (lit1 >> (16 + 9));
+							if (lit2_len)
+								lit2 = lit1 >> 16;
+							else
+							{
+								assert(bit_buf_size >= FPNG_DECODER_TABLE_BITS);
+								lit2 = lit_table[bit_buf & (FPNG_DECODER_TABLE_SIZE - 1)];
+								lit2_len = (lit2 >> 9) & 15;
+								if (!lit2_len)
+									return false;
+							}
+
+							SKIP_BITS_NE(lit2_len);
+
+							// Check for matches
+							if ((lit1 | lit2) & 256)
+								return false;
+					
+							if (dst_comps == 4)
+							{
+								if (pUp_scanline)
+								{
+									pCur_scanline[x_ofs] = (uint8_t)(pUp_scanline[x_ofs] + lit0);
+									pCur_scanline[x_ofs + 1] = (uint8_t)(pUp_scanline[x_ofs + 1] + lit1);
+									pCur_scanline[x_ofs + 2] = (uint8_t)(pUp_scanline[x_ofs + 2] + lit2);
+									pCur_scanline[x_ofs + 3] = 0xFF;
+								}
+								else
+								{
+									pCur_scanline[x_ofs] = (uint8_t)lit0;
+									pCur_scanline[x_ofs + 1] = (uint8_t)lit1;
+									pCur_scanline[x_ofs + 2] = (uint8_t)lit2;
+									pCur_scanline[x_ofs + 3] = 0xFF;
+								}
+								x_ofs += 4;
+							}
+							else
+							{
+								if (pUp_scanline)
+								{
+									pCur_scanline[x_ofs] = (uint8_t)(pUp_scanline[x_ofs] + lit0);
+									pCur_scanline[x_ofs + 1] = (uint8_t)(pUp_scanline[x_ofs + 1] + lit1);
+									pCur_scanline[x_ofs + 2] = (uint8_t)(pUp_scanline[x_ofs + 2] + lit2);
+								}
+								else
+								{
+									pCur_scanline[x_ofs] = (uint8_t)lit0;
+									pCur_scanline[x_ofs + 1] = (uint8_t)lit1;
+									pCur_scanline[x_ofs + 2] = (uint8_t)lit2;
+								}
+								x_ofs += 3;
+							}
+
+							prev_delta_r = (uint8_t)lit0;
+							prev_delta_g = (uint8_t)lit1;
+							prev_delta_b = (uint8_t)lit2;
+																				
+						} // if (lit0 < 256)
+
+					} // if ((spec_next_len0_len) && (x_ofs < bpl))
+				}
+
+			} while (x_ofs < dst_bpl);
+
+			if (check_adler32)
+			{
+				FPNG_STATS_ONLY(timer.lap(&fpng_decode_stats::m_decode_ns);)
+				*pAdler32 = decoded_row_adler32<3, dst_comps>(filter, pCur_scanline, pUp_scanline, w, pFiltered_row, *pAdler32);
+				FPNG_STATS_ONLY(timer.lap(&fpng_decode_stats::m_checksum_ns);)
+			}
+
+			if ((filter == 1) || (filter >= 3))
+				unfilter_row<dst_comps, 3>(filter, pCur_scanline, pPrev_scanline, w);
+
+			pPrev_scanline = pCur_scanline;
+			pCur_scanline += dst_pitch;
+
+			if (pSink)
+			{
+				pCur_scanline = pSink->row_done(pCur_scanline);
+				if (!pCur_scanline)
+					return false;
+			}
+
+		} // y
+
+		return finish_pixel_block(pSrc, src_len, src_ofs, end_ofs, final_block, bit_buf, bit_buf_size, lit_table);
+	}
+
+	// Decompresses h rows, which must be coded as a single dynamic Deflate block starting at byte src_ofs (after the zlib header, or at the start of a strip).
+	// A non-final block must be followed by a sync flush which ends at end_ofs. The final block must end at end_ofs, where the zlib adler32 begins.
+	// Rows are written dst_pitch bytes apart. If pSink isn't nullptr, pDst is its next row, dst_pitch must be w*dst_comps, and each decoded row is passed to it.
+	// If check_adler32 is true, each decoded row is folded into *pAdler32.
+	template<uint32_t dst_comps, bool check_adler32>
+	static bool fpng_pixel_zlib_decompress_4(
+		const uint8_t* pSrc, size_t src_len, size_t src_ofs, size_t end_ofs, bool final_block,
+		uint8_t* pDst, uint32_t w, uint32_t h, uint32_t dst_pitch, decode_row_sink* pSink, uint32_t* pAdler32, decode_scratch& scratch)
+	{
+		assert(src_len >= (end_ofs + 8));
+		assert(check_adler32 == (pAdler32 != nullptr));
+
+		const uint32_t dst_bpl = w * dst_comps;
+		//const uint32_t dst_len = dst_bpl * h;
+
+		if ((src_ofs + 4) > src_len)
+			return false;
+		uint64_t bit_buf = READ_LE32(pSrc + src_ofs);
+		src_ofs += 4;
+
+		uint32_t bit_buf_size = 32;
+
+		uint32_t bfinal, btype;
+		GET_BITS(bfinal, 1);
+		GET_BITS(btype, 2);
+
+		// Must be the expected block kind (final or not), and type=2 (dynamic)
+		if ((bfinal != (final_block ? 1U : 0U)) || (btype != 2))
+			return false;
+
+		bool lz_matches = false;
+		if (!prepare_dynamic_block(pSrc, src_len, src_ofs, bit_buf_size, bit_buf, scratch, 4, lz_matches))
+			return false;
+
+		const uint32_t* lit_table = scratch.m_lit_table;
+
+		if (lz_matches)
+			return fpng_pixel_zlib_decompress_lz<4, dst_comps, check_adler32>(pSrc, src_len, src_ofs, end_ofs, final_block, pDst, w, h, dst_pitch, pSink, pAdler32, bit_buf, bit_buf_size, lit_table, scratch.m_dist_table, scratch);
+
+		uint8_t* pFiltered_row = check_adler32 ? get_scratch_buf(scratch.m_rows, 1 + w * 4) : nullptr;
+
+		FPNG_STATS_ONLY(decode_stats_timer timer(scratch.m_pStats, &fpng_decode_stats::m_decode_ns);)
+
+		const uint8_t* pPrev_scanline = nullptr;
+		uint8_t* pCur_scanline = pDst;
+
+		for (uint32_t y = 0; y < h; y++)
+		{
+			// At start of PNG scanline, so read the filter literal
+			assert(bit_buf_size >= FPNG_DECODER_TABLE_BITS);
+			uint32_t filter = lit_table[bit_buf & (FPNG_DECODER_TABLE_SIZE - 1)];
+			uint32_t filter_len = (filter >> 9) & 15;
+			if (!filter_len)
+				return false;
+			SKIP_BITS(filter_len);
+			filter &= 511;
+
+			// The first row of the image or strip can use None or Sub, and the other rows any filter (FPNG_ENCODE_ADAPTIVE_FILTERS). 
+			// Up is undone as the pixels are decoded, and Sub/Average/Paeth once the whole row is decoded.
+			if (filter > (y ? 4U : 1U))
+				return false;
+
+			const uint8_t* pUp_scanline = (filter == 2) ? pPrev_scanline : nullptr;
+
+			uint32_t x_ofs = 0;
+			uint8_t prev_delta_r = 0, prev_delta_g = 0, prev_delta_b = 0, prev_delta_a = 0;
+			do
+			{
+				assert(bit_buf_size >= FPNG_DECODER_TABLE_BITS);
+				uint32_t lit0_tab = lit_table[bit_buf & (FPNG_DECODER_TABLE_SIZE - 1)];
+
+				uint32_t lit0 = lit0_tab;
+				uint32_t lit0_len = (lit0_tab >> 9) & 15;
+				if (!lit0_len)
+					return false;
+				SKIP_BITS(lit0_len);
+
+				if (lit0 & 256)
+				{
+					lit0 &= 511;
+
+					// Can't be EOB - we still have more pixels to decompress.
+					if (lit0 == 256)
+						return false;
+
+					// Must be an RLE match against the previous pixel.
+					uint32_t run_len = s_length_range[lit0 - 257];
 					if (lit0 >= 265)
 					{
 						uint32_t e;
 						GET_BITS_NE(e, s_length_extra[lit0 - 257]);
 
-						run_len += e;
-					}
+						run_len += e;
+					}
+
+					// Skip match distance - it's always the same (4)
+					SKIP_BITS_NE(1);
+
+					// Matches must always be a multiple of 3/4 bytes
+					if (run_len & 3)
+						return false;
+										
+					if (dst_comps == 3)
+					{
+						const uint32_t run_len3 = (run_len >> 2) * 3;
+						const uint32_t x_ofs_end = x_ofs + run_len3;
+
+						// Matches cannot cross scanlines.
+						if (x_ofs_end > dst_bpl)
+							return false;
+
+						// The alpha is dropped, so remember its differences for the Adler32.
+						if (check_adler32)
+						{
+							for (uint32_t i = x_ofs / 3; i < x_ofs_end / 3; i++)
+								pFiltered_row[1 + i * 4 + 3] = prev_delta_a;
+						}
+
+						if (pUp_scanline)
+						{
+							if ((prev_delta_r | prev_delta_g | prev_delta_b | prev_delta_a) == 0)
+							{
+								memcpy(pCur_scanline + x_ofs, pUp_scanline + x_ofs, run_len3);
+								x_ofs = x_ofs_end;
+							}
+							else
+							{
+								do
+								{
+									pCur_scanline[x_ofs] = (uint8_t)(pUp_scanline[x_ofs] + prev_delta_r);
+									pCur_scanline[x_ofs + 1] = (uint8_t)(pUp_scanline[x_ofs + 1] + prev_delta_g);
+									pCur_scanline[x_ofs + 2] = (uint8_t)(pUp_scanline[x_ofs + 2] + prev_delta_b);
+									x_ofs += 3;
+								} while (x_ofs < x_ofs_end);
+							}
+						}
+						else
+						{
+							do
+							{
+								pCur_scanline[x_ofs] = prev_delta_r;
+								pCur_scanline[x_ofs + 1] = prev_delta_g;
+								pCur_scanline[x_ofs + 2] = prev_delta_b;
+								x_ofs += 3;
+							} while (x_ofs < x_ofs_end);
+						}
+					}
+					else
+					{
+						const uint32_t x_ofs_end = x_ofs + run_len;
+
+						// Matches cannot cross scanlines.
+						if (x_ofs_end > dst_bpl)
+							return false;
+
+						if (pUp_scanline)
+						{
+							if ((prev_delta_r | prev_delta_g | prev_delta_b | prev_delta_a) == 0)
+							{
+								memcpy(pCur_scanline + x_ofs, pUp_scanline + x_ofs, run_len);
+								x_ofs = x_ofs_end;
+							}
+							else
+							{
+								do
+								{
+									pCur_scanline[x_ofs] = (uint8_t)(pUp_scanline[x_ofs] + prev_delta_r);
+									pCur_scanline[x_ofs + 1] = (uint8_t)(pUp_scanline[x_ofs + 1] + prev_delta_g);
+									pCur_scanline[x_ofs + 2] = (uint8_t)(pUp_scanline[x_ofs + 2] + prev_delta_b);
+									pCur_scanline[x_ofs + 3] = (uint8_t)(pUp_scanline[x_ofs + 3] + prev_delta_a);
+									x_ofs += 4;
+								} while (x_ofs < x_ofs_end);
+							}
+						}
+						else
+						{
+							do
+							{
+								pCur_scanline[x_ofs] = prev_delta_r;
+								pCur_scanline[x_ofs + 1] = prev_delta_g;
+								pCur_scanline[x_ofs + 2] = prev_delta_b;
+								pCur_scanline[x_ofs + 3] = prev_delta_a;
+								x_ofs += 4;
+							} while (x_ofs < x_ofs_end);
+						}
+					}
+				}
+				else
+				{
+					uint32_t lit1, lit2;
+
+					uint32_t lit1_spec_len = (lit0_tab >> (16 + 9));
+					uint32_t lit2_len;
+					if (lit1_spec_len)
+					{
+						lit1 = (lit0_tab >> 16) & 511;
+						SKIP_BITS_NE(lit1_spec_len);
+
+						assert(bit_buf_size >= FPNG_DECODER_TABLE_BITS);
+						lit2 = lit_table[bit_buf & (FPNG_DECODER_TABLE_SIZE - 1)];
+						lit2_len = (lit2 >> 9) & 15;
+						if (!lit2_len)
+							return false;
+					}
+					else
+					{
+						assert(bit_buf_size >= FPNG_DECODER_TABLE_BITS);
+						lit1 = lit_table[bit_buf & (FPNG_DECODER_TABLE_SIZE - 1)];
+						uint32_t lit1_len = (lit1 >> 9) & 15;
+						if (!lit1_len)
+							return false;
+						SKIP_BITS_NE(lit1_len);
+
+						lit2_len = (lit1 >> (16 + 9));
+						if (lit2_len)
+							lit2 = lit1 >> 16;
+						else
+						{
+							assert(bit_buf_size >= FPNG_DECODER_TABLE_BITS);
+							lit2 = lit_table[bit_buf & (FPNG_DECODER_TABLE_SIZE - 1)];
+							lit2_len = (lit2 >> 9) & 15;
+							if (!lit2_len)
+								return false;
+						}
+					}
+
+					uint32_t lit3;
+					uint32_t lit3_len = lit2 >> (16 + 9);
+					
+					if (lit3_len)
+					{
+						lit3 = (lit2 >> 16);
+						SKIP_BITS(lit2_len + lit3_len);
+					}
+					else
+					{
+						SKIP_BITS(lit2_len);
+
+						assert(bit_buf_size >= FPNG_DECODER_TABLE_BITS);
+						lit3 = lit_table[bit_buf & (FPNG_DECODER_TABLE_SIZE - 1)];
+						lit3_len = (lit3 >> 9) & 15;
+						if (!lit3_len)
+							return false;
+
+						SKIP_BITS_NE(lit3_len);
+					}
+										
+					// Check for matches
+					if ((lit1 | lit2 | lit3) & 256)
+						return false;
+
+					if (dst_comps == 3)
+					{
+						if (pUp_scanline)
+						{
+							pCur_scanline[x_ofs] = (uint8_t)(pUp_scanline[x_ofs] + lit0);
+							pCur_scanline[x_ofs + 1] = (uint8_t)(pUp_scanline[x_ofs + 1] + lit1);
+							pCur_scanline[x_ofs + 2] = (uint8_t)(pUp_scanline[x_ofs + 2] + lit2);
+						}
+						else
+						{
+							pCur_scanline[x_ofs] = (uint8_t)lit0;
+							pCur_scanline[x_ofs + 1] = (uint8_t)lit1;
+							pCur_scanline[x_ofs + 2] = (uint8_t)lit2;
+						}
+
+						if (check_adler32)
+							pFiltered_row[1 + (x_ofs / 3) * 4 + 3] = (uint8_t)lit3;
+
+						x_ofs += 3;
+					}
+					else
+					{
+						if (pUp_scanline)
+						{
+							pCur_scanline[x_ofs] = (uint8_t)(pUp_scanline[x_ofs] + lit0);
+							pCur_scanline[x_ofs + 1] = (uint8_t)(pUp_scanline[x_ofs + 1] + lit1);
+							pCur_scanline[x_ofs + 2] = (uint8_t)(pUp_scanline[x_ofs + 2] + lit2);
+							pCur_scanline[x_ofs + 3] = (uint8_t)(pUp_scanline[x_ofs + 3] + lit3);
+						}
+						else
+						{
+							pCur_scanline[x_ofs] = (uint8_t)lit0;
+							pCur_scanline[x_ofs + 1] = (uint8_t)lit1;
+							pCur_scanline[x_ofs + 2] = (uint8_t)lit2;
+							pCur_scanline[x_ofs + 3] = (uint8_t)lit3;
+						}
+						
+						x_ofs += 4;
+					}
+
+					prev_delta_r = (uint8_t)lit0;
+					prev_delta_g = (uint8_t)lit1;
+					prev_delta_b = (uint8_t)lit2;
+					prev_delta_a = (uint8_t)lit3;
+				}
+
+			} while (x_ofs < dst_bpl);
+
+			if (check_adler32)
+			{
+				FPNG_STATS_ONLY(timer.lap(&fpng_decode_stats::m_decode_ns);)
+				*pAdler32 = decoded_row_adler32<4, dst_comps>(filter, pCur_scanline, pUp_scanline, w, pFiltered_row, *pAdler32);
+				FPNG_STATS_ONLY(timer.lap(&fpng_decode_stats::m_checksum_ns);)
+			}
+
+			if ((filter == 1) || (filter >= 3))
+				unfilter_row<dst_comps, (dst_comps < 4) ? dst_comps : 4>(filter, pCur_scanline, pPrev_scanline, w);
+
+			pPrev_scanline = pCur_scanline;
+			pCur_scanline += dst_pitch;
+
+			if (pSink)
+			{
+				pCur_scanline = pSink->row_done(pCur_scanline);
+				if (!pCur_scanline)
+					return false;
+			}
+		} // y
+
+		return finish_pixel_block(pSrc, src_len, src_ofs, end_ofs, final_block, bit_buf, bit_buf_size, lit_table);
+	}
+
+#pragma pack(push)
+#pragma pack(1)
+	struct png_chunk_prefix
+	{
+		uint32_t m_length;
+		uint8_t m_type[4];
+	};
+	struct png_ihdr
+	{
+		png_chunk_prefix m_prefix;
+		uint32_t m_width;
+		uint32_t m_height;
+		uint8_t m_bitdepth;
+		uint8_t m_color_type;
+		uint8_t m_comp_method;
+		uint8_t m_filter_method;
+		uint8_t m_interlace_method;
+		uint32_t m_crc32;
+	};
+	const uint32_t IHDR_EXPECTED_LENGTH = 13;
+	struct png_iend
+	{
+		png_chunk_prefix m_prefix;
+		uint32_t m_crc32;
+	};
+#pragma pack(pop)
+
+	struct fpng_file_info
+	{
+		// File offset of the first IDAT chunk, the number of IDAT chunks (which must be consecutive), and the total size of their data.
+		size_t m_idat_ofs, m_total_idat_len;
+		uint32_t m_num_idats;
+
+		// The fdEC chunk's strip index, if any.
+		const uint8_t* m_pStrip_index;
+		uint32_t m_num_strips;
+
+		// 8 or 16
+		uint32_t m_bits_per_channel;
+	};
+
+	// Checks the contents of an fdEC chunk, and reads its strip index (if any) into info. Returns false if the chunk isn't one of ours.
+	static bool parse_fdec_chunk(const uint8_t* pChunk_data, uint32_t chunk_len, uint32_t height, fpng_file_info& info)
+	{
+		// Make sure it's big enough and check its contents.
+		if (chunk_len < 5)
+			return false;
+
+		// Check fdEC chunk sig
+		if ((pChunk_data[0] != 82) || (pChunk_data[1] != 36) || (pChunk_data[2] != 147) || (pChunk_data[3] != 227))
+			return false;
+
+		// Check fdEC version
+		if (pChunk_data[4] == FPNG_FDEC_VERSION_SINGLE_BLOCK)
+			return chunk_len == 5;
+		
+		if (pChunk_data[4] != FPNG_FDEC_VERSION)
+			return false;
+
+		// Strip index - the entries themselves are checked against the IDAT chunk before decoding.
+		if (chunk_len < 9)
+			return false;
+
+		info.m_num_strips = READ_BE32(pChunk_data + 5);
+		if ((!info.m_num_strips) || (info.m_num_strips > height) || (chunk_len != (9 + info.m_num_strips * FPNG_FDEC_STRIP_ENTRY_SIZE)))
+			return false;
+
+		info.m_pStrip_index = pChunk_data + 9;
+		return true;
+	}
+
+	// decode_flags controls which chunk CRC32's are checked, see FPNG_DECODE_CHECK_IDAT_CRC32 etc.
+	// If pPng_info isn't nullptr (for fpng_decode_any()), files which can't be fpng's are still scanned to the end and all their chunks checked (including the IDAT chunks, unless the flags skip CRC32's), 
+	// so the general purpose decoder doesn't have to. FPNG_DECODE_NOT_FPNG is then only returned after the whole file was scanned.
+	static int fpng_get_info_internal(const void* pImage, size_t image_size, uint32_t& width, uint32_t& height, uint32_t& channels_in_file, fpng_file_info &info, uint32_t decode_flags, fpng_decode_stats* pStats = nullptr, 
+		fpng_png_info* pPng_info = nullptr)
+	{
+		(void)pStats;
+
+		static const uint8_t s_png_sig[8] = { 137, 80, 78, 71, 13, 10, 26, 10 };
+
+		if (!endian_check())
+		{
+			assert(0);
+			return false;
+		}
+				
+		width = 0;
+		height = 0;
+		channels_in_file = 0;
+		memset(&info, 0, sizeof(info));
+		if (pPng_info)
+			memset(pPng_info, 0, sizeof(*pPng_info));
+				
+		// Ensure the file has at least a minimum possible size
+		if (image_size < (sizeof(s_png_sig) + sizeof(png_ihdr) + sizeof(png_chunk_prefix) + 1 + sizeof(uint32_t) + sizeof(png_iend)))
+			return FPNG_DECODE_FAILED_NOT_PNG;
+
+		if (memcmp(pImage, s_png_sig, 8) != 0)
+			return FPNG_DECODE_FAILED_NOT_PNG;
+
+		const uint8_t* pImage_u8 = static_cast<const uint8_t*>(pImage) + 8;
+
+		const png_ihdr& ihdr = *reinterpret_cast<const png_ihdr*>(pImage_u8);
+		pImage_u8 += sizeof(png_ihdr);
+
+		if (READ_BE32(&ihdr.m_prefix.m_length) != IHDR_EXPECTED_LENGTH)
+			return FPNG_DECODE_FAILED_NOT_PNG;
+
+		const bool check_crc32 = (decode_flags & (FPNG_DECODE_SKIP_CRC32 | FPNG_DECODE_SKIP_ALL_CHECKS)) == 0;
+		const bool check_idat_crc32 = check_crc32 && ((decode_flags & FPNG_DECODE_CHECK_IDAT_CRC32) != 0);
+
+		if ((check_crc32) && (fpng_crc32(ihdr.m_prefix.m_type, 4 + IHDR_EXPECTED_LENGTH, FPNG_CRC32_INIT) != READ_BE32(&ihdr.m_crc32)))
+			return FPNG_DECODE_FAILED_HEADER_CRC32;
+
+		width = READ_BE32(&ihdr.m_width);
+		height = READ_BE32(&ihdr.m_height);
+				
+		if (!width || !height || (width > FPNG_MAX_SUPPORTED_DIM) || (height > FPNG_MAX_SUPPORTED_DIM))
+			return FPNG_DECODE_FAILED_INVALID_DIMENSIONS;
+
+		// On 32-bit systems, don't even try to decode huge images.
+		uint64_t total_pixels = (uint64_t)width * height;
+		if ((sizeof(size_t) == sizeof(uint32_t)) && (total_pixels > (1 << 30)))
+			return FPNG_DECODE_FAILED_DIMENSIONS_TOO_LARGE;
+
+		if (pPng_info)
+		{
+			pPng_info->m_width = width;
+			pPng_info->m_height = height;
+			pPng_info->m_bit_depth = ihdr.m_bitdepth;
+			pPng_info->m_color_type = ihdr.m_color_type;
+			pPng_info->m_interlace_method = ihdr.m_interlace_method;
+		}
+
+		// Cleared as soon as something rules out fpng. Without pPng_info that's the end of the scan.
+		bool is_fpng = true;
+
+		if ((ihdr.m_comp_method) || (ihdr.m_filter_method) || (ihdr.m_interlace_method) || ((ihdr.m_bitdepth != 8) && (ihdr.m_bitdepth != 16)))
+		{
+			if (!pPng_info)
+				return FPNG_DECODE_NOT_FPNG;
+			is_fpng = false;
+		}
+
+		if (ihdr.m_color_type == 0)
+			channels_in_file = 1;
+		else if (ihdr.m_color_type == 4)
+			channels_in_file = 2;
+		else if (ihdr.m_color_type == 2)
+			channels_in_file = 3;
+		else if (ihdr.m_color_type == 6)
+			channels_in_file = 4;
+
+		info.m_bits_per_channel = ihdr.m_bitdepth;
+
+		if (!channels_in_file)
+		{
+			if (!pPng_info)
+				return FPNG_DECODE_NOT_FPNG;
+			is_fpng = false;
+		}
+
+		// Scan all the chunks. Look for one run of IDAT's, IEND, and our custom fdEC chunk that indicates the file was compressed by us. Skip any ancillary chunks.
+		bool found_fdec_chunk = false, prev_chunk_was_idat = false, found_trns_chunk = false;
+
+		// Cleared if an IDAT chunk's CRC32 wasn't checked.
+		bool all_chunks_checked = true;
+		
+		for (; ; )
+		{
+			const size_t src_ofs = pImage_u8 - static_cast<const uint8_t*>(pImage);
+			if (src_ofs >= image_size)
+				return FPNG_DECODE_FAILED_CHUNK_PARSING;
+
+			const size_t bytes_remaining = image_size - src_ofs;
+			if (bytes_remaining < sizeof(uint32_t) * 3)
+				return FPNG_DECODE_FAILED_CHUNK_PARSING;
+
+			const png_chunk_prefix* pChunk = reinterpret_cast<const png_chunk_prefix*>(pImage_u8);
+
+			const uint32_t chunk_len = READ_BE32(&pChunk->m_length);
+			if ((src_ofs + sizeof(uint32_t) * 2 + (uint64_t)chunk_len + sizeof(uint32_t)) > image_size)
+				return FPNG_DECODE_FAILED_CHUNK_PARSING;
+
+			for (uint32_t i = 0; i < 4; i++)
+			{
+				const uint8_t c = pChunk->m_type[i];
+				const bool is_upper = (c >= 65) && (c <= 90), is_lower = (c >= 97) && (c <= 122);
+				if ((!is_upper) && (!is_lower))
+					return FPNG_DECODE_FAILED_CHUNK_PARSING;
+			}
+
+			const uint32_t expected_crc32 = READ_BE32(pImage_u8 + sizeof(uint32_t) * 2 + chunk_len);
+
+			char chunk_type[5] = { (char)pChunk->m_type[0], (char)pChunk->m_type[1], (char)pChunk->m_type[2], (char)pChunk->m_type[3], 0 };
+			const bool is_idat = strcmp(chunk_type, "IDAT") == 0;
+
+			// If the IDAT's weren't consecutive, or we didn't find the fdEC chunk, then it's not FPNG.
+			if ((is_idat) && (((info.m_idat_ofs) && (!prev_chunk_was_idat)) || (!found_fdec_chunk)))
+			{
+				if (!pPng_info)
+					return FPNG_DECODE_NOT_FPNG;
+				is_fpng = false;
+			}
+
+#if !FPNG_DISABLE_DECODE_CRC32_CHECKS
+			// The IDAT chunks of files going to the general purpose decoder are checked here too, so it can skip them.
+			const bool check_chunk_crc32 = is_idat ? (check_idat_crc32 || (check_crc32 && !is_fpng)) : check_crc32;
+			if (check_chunk_crc32)
+			{
+				FPNG_STATS_ONLY(decode_stats_timer timer(is_idat ? pStats : nullptr, &fpng_decode_stats::m_checksum_ns);)
+
+				uint32_t actual_crc32 = fpng_crc32(pImage_u8 + sizeof(uint32_t), sizeof(uint32_t) + chunk_len, FPNG_CRC32_INIT);
+				if (actual_crc32 != expected_crc32)
+					return is_idat ? FPNG_DECODE_FAILED_CHECKSUM : FPNG_DECODE_FAILED_HEADER_CRC32;
+			}
+			else if (is_idat)
+				all_chunks_checked = false;
+#else
+			(void)check_idat_crc32;
+			all_chunks_checked = false;
+#endif
+
+			const uint8_t* pChunk_data = pImage_u8 + sizeof(uint32_t) * 2;
+
+			if (strcmp(chunk_type, "IEND") == 0)
+				break;
+			else if (is_idat)
+			{
+				if (is_fpng)
+				{
+					if (!info.m_idat_ofs)
+						info.m_idat_ofs = src_ofs;
+
+					info.m_num_idats++;
+					info.m_total_idat_len += chunk_len;
+				}
+			}
+			else if (strcmp(chunk_type, "fdEC") == 0)
+			{
+				// We've got our fdEC chunk.
+				if ((is_fpng) && ((found_fdec_chunk) || (!parse_fdec_chunk(pChunk_data, chunk_len, height, info))))
+				{
+					if (!pPng_info)
+						return FPNG_DECODE_NOT_FPNG;
+					is_fpng = false;
+				}
+
+				found_fdec_chunk = true;
+			}
+			else
+			{
+				// Bail if it's a critical chunk - can't be FPNG
+				if ((chunk_type[0] & 32) == 0)
+				{
+					if (!pPng_info)
+						return FPNG_DECODE_NOT_FPNG;
+					is_fpng = false;
+				}
+				else if (strcmp(chunk_type, "tRNS") == 0)
+					found_trns_chunk = true;
+
+				// ancillary chunk - skip it
+			}
+
+			prev_chunk_was_idat = is_idat;
+
+			pImage_u8 += sizeof(png_chunk_prefix) + chunk_len + sizeof(uint32_t);
+		}
+
+		if (pPng_info)
+		{
+			switch (ihdr.m_color_type)
+			{
+			case 0: pPng_info->m_num_chans = found_trns_chunk ? 2 : 1; break;
+			case 2: case 3: pPng_info->m_num_chans = found_trns_chunk ? 4 : 3; break;
+			case 4: pPng_info->m_num_chans = 2; break;
+			case 6: pPng_info->m_num_chans = 4; break;
+			default: break;
+			}
+
+			pPng_info->m_chunks_checked = (!check_crc32) || (all_chunks_checked);
+		}
+
+		if ((!is_fpng) || (!found_fdec_chunk) || (!info.m_idat_ofs))
+			return FPNG_DECODE_NOT_FPNG;
+
+		// Sanity check the IDAT data's length
+		if (info.m_total_idat_len < 7)
+			return FPNG_DECODE_FAILED_INVALID_IDAT;
+		
+		return FPNG_DECODE_SUCCESS;
+	}
+
+	int fpng_get_info(const void* pImage, size_t image_size, uint32_t& width, uint32_t& height, uint32_t& channels_in_file)
+	{
+		fpng_file_info info;
+		return fpng_get_info_internal(pImage, image_size, width, height, channels_in_file, info, 0);
+	}
+
+	int fpng_get_info(const void* pImage, size_t image_size, uint32_t& width, uint32_t& height, uint32_t& channels_in_file, uint32_t& bits_per_channel)
+	{
+		fpng_file_info info;
+		int status = fpng_get_info_internal(pImage, image_size, width, height, channels_in_file, info, 0);
+		bits_per_channel = info.m_bits_per_channel;
+		return status;
+	}
+
+	typedef bool (*pixel_decompress_func)(const uint8_t* pSrc, size_t src_len, size_t src_ofs, size_t end_ofs, bool final_block, uint8_t* pDst, uint32_t w, uint32_t h, uint32_t dst_pitch, decode_row_sink* pSink, uint32_t* pAdler32, decode_scratch& scratch);
+
+	// Ensures the fdEC strip index is consistent with the image and the size of the IDAT chunk.
+	static bool check_strip_index(const uint8_t* pStrip_index, uint32_t num_strips, uint32_t height, size_t zlib_len)
+	{
+		uint32_t prev_ofs = 0, prev_row = 0;
+		for (uint32_t i = 0; i < num_strips; i++)
+		{
+			const uint8_t* pEntry = pStrip_index + i * FPNG_FDEC_STRIP_ENTRY_SIZE;
+			const uint32_t ofs = READ_BE32(pEntry), first_row = READ_BE32(pEntry + 4);
+
+			if ((pEntry[8] != FPNG_FDEC_STRIP_TABLE_DYNAMIC) && (pEntry[8] != FPNG_FDEC_STRIP_TABLE_STORED))
+				return false;
+
+			if (!i)
+			{
+				// The first strip immediately follows the zlib header
+				if ((ofs != 2) || (first_row != 0))
+					return false;
+			}
+			else if ((ofs <= prev_ofs) || (first_row <= prev_row))
+				return false;
+
+			if ((first_row >= height) || ((uint64_t)ofs + 4 >= zlib_len))
+				return false;
+
+			prev_ofs = ofs;
+			prev_row = first_row;
+		}
+
+		return true;
+	}
+
+	// Copies the data of a run of consecutive IDAT chunks (already validated by fpng_get_info_internal()) into buf.
+	static void gather_idat_chunks(const uint8_t* pFirst_chunk, const fpng_file_info& info, std::vector<uint8_t>& buf)
+	{
+		buf.resize(0);
+		buf.reserve(info.m_total_idat_len + 4);
+
+		const uint8_t* pChunk = pFirst_chunk;
+		for (uint32_t i = 0; i < info.m_num_idats; i++)
+		{
+			const uint32_t chunk_len = READ_BE32(pChunk);
+			vector_append(buf, pChunk + sizeof(uint32_t) * 2, chunk_len);
+			pChunk += sizeof(png_chunk_prefix) + chunk_len + sizeof(uint32_t);
+		}
+
+		buf.resize(buf.size() + 4);
+	}
+
+	struct decode_strips_job
+	{
+		const uint8_t* m_pSrc;
+		size_t m_src_len, m_zlib_len;
+		const uint8_t* m_pStrip_index;
+		uint32_t m_num_strips;
+		uint32_t m_w, m_h, m_dst_pitch;
+		uint8_t* m_pDst;
+		pixel_decompress_func m_pDecompress;
+		uint32_t m_src_bpp, m_dst_bpp; // for strips written as raw blocks
+		raw_row_store_func m_pRaw_store;
+		pixel_convert_func m_pConvert; // converts the decoded rows of m_dst_bpp bytes per pixel to fpng_decode_params::m_dst_format, or nullptr
+		uint8_t* m_pStatus;
+		uint32_t* m_pAdler32; // each strip's Adler32, or nullptr if it isn't being checked
+		decode_scratch* m_pScratch; // each strip's scratch memory
+	};
+
+	static void decode_strip_task(uint32_t strip_index, void* pData)
+	{
+		const decode_strips_job& job = *static_cast<const decode_strips_job*>(pData);
+
+		const uint8_t* pEntry = job.m_pStrip_index + strip_index * FPNG_FDEC_STRIP_ENTRY_SIZE;
+		const bool last_strip = (strip_index == (job.m_num_strips - 1));
+
+		const uint32_t ofs = READ_BE32(pEntry), first_row = READ_BE32(pEntry + 4);
+		const size_t end_ofs = last_strip ? (job.m_zlib_len - 4) : READ_BE32(pEntry + FPNG_FDEC_STRIP_ENTRY_SIZE);
+		const uint32_t end_row = last_strip ? job.m_h : READ_BE32(pEntry + FPNG_FDEC_STRIP_ENTRY_SIZE + 4);
+
+		uint8_t* pStrip_dst = job.m_pDst + (size_t)first_row * job.m_dst_pitch;
+		uint32_t* pAdler32 = job.m_pAdler32 ? &job.m_pAdler32[strip_index] : nullptr;
+		decode_scratch& scratch = job.m_pScratch[strip_index];
+
+		uint32_t dst_pitch = job.m_dst_pitch;
+		decode_row_sink convert_sink;
+		convert_rows_job convert_job;
+		decode_row_sink* pSink = nullptr;
+		if (job.m_pConvert)
+		{
+			dst_pitch = job.m_w * job.m_dst_bpp;
+			convert_job.m_pNext_row = pStrip_dst;
+			convert_job.m_pitch = job.m_dst_pitch;
+			convert_job.m_pSink = nullptr;
+			pStrip_dst = init_convert_sink(convert_sink, convert_job, job.m_pConvert, job.m_w, dst_pitch, 0, 0, end_row - first_row, false, scratch);
+			pSink = &convert_sink;
+		}
+
+		if (pEntry[8] == FPNG_FDEC_STRIP_TABLE_STORED)
+			job.m_pStatus[strip_index] = fpng_pixel_zlib_raw_decompress(job.m_pSrc, job.m_src_len, ofs, end_ofs, last_strip,
+				pStrip_dst, job.m_w, end_row - first_row, dst_pitch, job.m_src_bpp, job.m_dst_bpp, pSink, pAdler32, scratch, job.m_pRaw_store);
+		else
+			job.m_pStatus[strip_index] = job.m_pDecompress(job.m_pSrc, job.m_src_len, ofs, end_ofs, last_strip,
+				pStrip_dst, job.m_w, end_row - first_row, dst_pitch, pSink, pAdler32, scratch);
+	}
+
+	struct fpng_decode_context::scratch
+	{
+		decode_scratch m_single;
+		std::vector<decode_scratch> m_strips;
+		std::vector<uint8_t> m_idat_buf, m_band_buf, m_strip_status;
+		std::vector<uint32_t> m_strip_adler32;
+	};
+
+	fpng_decode_context::fpng_decode_context() : m_pScratch(nullptr)
+	{
+	}
+
+	fpng_decode_context::~fpng_decode_context()
+	{
+		delete m_pScratch;
+	}
+
+	void fpng_decode_context::clear()
+	{
+		delete m_pScratch;
+		m_pScratch = nullptr;
+	}
+
+	fpng_decode_context::scratch* fpng_decode_context::get_scratch()
+	{
+		if (!m_pScratch)
+			m_pScratch = new scratch;
+		return m_pScratch;
+	}
+
+	// The parsed, validated IDAT data of a file, ready to be decompressed.
+	struct decode_setup
+	{
+		const uint8_t* m_pIDAT_data;
+		size_t m_src_len, m_idat_len;
+		const uint8_t* m_pStrip_index;
+		uint32_t m_num_strips;
+		pixel_decompress_func m_pDecompress;
+		bool m_check_adler32;
+		std::vector<uint8_t> m_idat_buf;
+
+		// The caller's fpng_decode_context scratch memory, or nullptr.
+		fpng_decode_context::scratch* m_pContext_scratch;
+
+		// 1 or 2. Files with 16 bits per channel, or without 3 or 4 channels, are decoded by fpng_pixel_zlib_decompress_generic(), and their raw blocks converted by m_pRaw_store.
+		uint32_t m_bytes_per_sample;
+
+		// The bytes per sample of the output: 2 for 16-bit files decoded with FPNG_DECODE_16BIT, otherwise 1.
+		uint32_t m_dst_bytes_per_sample;
+		raw_row_store_func m_pRaw_store;
+
+		// The number of channels the decompressors write, and the function converting them to fpng_decode_params::m_dst_format (nullptr if it's FPNG_PIXEL_FORMAT_DEFAULT).
+		uint32_t m_decode_chans;
+		pixel_convert_func m_pConvert;
+
+		// The Adler32 at the end of the zlib stream.
+		uint32_t get_expected_adler32() const { return READ_BE32(m_pIDAT_data + m_idat_len - 4); }
+	};
 
-					// Skip match distance - it's always the same (4)
-					SKIP_BITS_NE(1);
+	template<uint32_t file_chans, uint32_t bytes_per_sample, uint32_t dst_bytes_per_sample>
+	static void select_generic_funcs(uint32_t dst_chans, decode_setup& setup)
+	{
+		switch (dst_chans)
+		{
+		case 1: setup.m_pDecompress = fpng_pixel_zlib_decompress_generic<file_chans, bytes_per_sample, 1, dst_bytes_per_sample>; setup.m_pRaw_store = store_raw_row<file_chans, bytes_per_sample, 1, dst_bytes_per_sample>; break;
+		case 2: setup.m_pDecompress = fpng_pixel_zlib_decompress_generic<file_chans, bytes_per_sample, 2, dst_bytes_per_sample>; setup.m_pRaw_store = store_raw_row<file_chans, bytes_per_sample, 2, dst_bytes_per_sample>; break;
+		case 3: setup.m_pDecompress = fpng_pixel_zlib_decompress_generic<file_chans, bytes_per_sample, 3, dst_bytes_per_sample>; setup.m_pRaw_store = store_raw_row<file_chans, bytes_per_sample, 3, dst_bytes_per_sample>; break;
+		default: setup.m_pDecompress = fpng_pixel_zlib_decompress_generic<file_chans, bytes_per_sample, 4, dst_bytes_per_sample>; setup.m_pRaw_store = store_raw_row<file_chans, bytes_per_sample, 4, dst_bytes_per_sample>; break;
+		}
+	}
 
-					// Matches must always be a multiple of 3/4 bytes
-					if (run_len & 3)
-						return false;
-										
-					if (dst_comps == 3)
-					{
-						const uint32_t run_len3 = (run_len >> 2) * 3;
-						const uint32_t x_ofs_end = x_ofs + run_len3;
+	template<uint32_t file_chans>
+	static void select_generic_funcs_16(uint32_t dst_chans, uint32_t dst_bytes_per_sample, decode_setup& setup)
+	{
+		if (dst_bytes_per_sample == 2)
+			select_generic_funcs<file_chans, 2, 2>(dst_chans, setup);
+		else
+			select_generic_funcs<file_chans, 2, 1>(dst_chans, setup);
+	}
 
-						// Matches cannot cross scanlines.
-						if (x_ofs_end > dst_bpl)
-							return false;
+	// Prepares the IDAT data of a file already scanned by fpng_get_info_internal().
+	static int setup_decode_scanned(const void* pImage, size_t image_size, const fpng_file_info& info, uint32_t height, uint32_t channels_in_file, uint32_t desired_channels, const fpng_decode_params& params, decode_setup& setup)
+	{
+		const uint32_t decode_flags = params.m_flags;
+		setup.m_pContext_scratch = params.m_pContext ? params.m_pContext->get_scratch() : nullptr;
 
-						if (pPrev_scanline)
-						{
-							if ((prev_delta_r | prev_delta_g | prev_delta_b | prev_delta_a) == 0)
-							{
-								memcpy(pCur_scanline + x_ofs, pPrev_scanline + x_ofs, run_len3);
-								x_ofs = x_ofs_end;
-							}
-							else
-							{
-								do
-								{
-									pCur_scanline[x_ofs] = (uint8_t)(pPrev_scanline[x_ofs] + prev_delta_r);
-									pCur_scanline[x_ofs + 1] = (uint8_t)(pPrev_scanline[x_ofs + 1] + prev_delta_g);
-									pCur_scanline[x_ofs + 2] = (uint8_t)(pPrev_scanline[x_ofs + 2] + prev_delta_b);
-									x_ofs += 3;
-								} while (x_ofs < x_ofs_end);
-							}
-						}
-						else
-						{
-							do
-							{
-								pCur_scanline[x_ofs] = prev_delta_r;
-								pCur_scanline[x_ofs + 1] = prev_delta_g;
-								pCur_scanline[x_ofs + 2] = prev_delta_b;
-								x_ofs += 3;
-							} while (x_ofs < x_ofs_end);
-						}
-					}
-					else
-					{
-						const uint32_t x_ofs_end = x_ofs + run_len;
+		setup.m_idat_len = info.m_total_idat_len;
+		setup.m_num_strips = info.m_num_strips;
+		setup.m_pStrip_index = info.m_pStrip_index;
 
-						// Matches cannot cross scanlines.
-						if (x_ofs_end > dst_bpl)
-							return false;
+		setup.m_pIDAT_data = static_cast<const uint8_t*>(pImage) + info.m_idat_ofs + sizeof(uint32_t) * 2;
+		setup.m_src_len = image_size - (info.m_idat_ofs + sizeof(uint32_t) * 2);
 
-						if (pPrev_scanline)
-						{
-							if ((prev_delta_r | prev_delta_g | prev_delta_b | prev_delta_a) == 0)
-							{
-								memcpy(pCur_scanline + x_ofs, pPrev_scanline + x_ofs, run_len);
-								x_ofs = x_ofs_end;
-							}
-							else
-							{
-								do
-								{
-									pCur_scanline[x_ofs] = (uint8_t)(pPrev_scanline[x_ofs] + prev_delta_r);
-									pCur_scanline[x_ofs + 1] = (uint8_t)(pPrev_scanline[x_ofs + 1] + prev_delta_g);
-									pCur_scanline[x_ofs + 2] = (uint8_t)(pPrev_scanline[x_ofs + 2] + prev_delta_b);
-									pCur_scanline[x_ofs + 3] = (uint8_t)(pPrev_scanline[x_ofs + 3] + prev_delta_a);
-									x_ofs += 4;
-								} while (x_ofs < x_ofs_end);
-							}
-						}
-						else
-						{
-							do
-							{
-								pCur_scanline[x_ofs] = prev_delta_r;
-								pCur_scanline[x_ofs + 1] = prev_delta_g;
-								pCur_scanline[x_ofs + 2] = prev_delta_b;
-								pCur_scanline[x_ofs + 3] = prev_delta_a;
-								x_ofs += 4;
-							} while (x_ofs < x_ofs_end);
-						}
-					}
-				}
+		if (info.m_num_idats > 1)
+		{
+			// Gather the data of all the IDAT chunks into a single buffer, followed by 4 padding bytes because the bit reader reads ahead.
+			std::vector<uint8_t>& idat_buf = setup.m_pContext_scratch ? setup.m_pContext_scratch->m_idat_buf : setup.m_idat_buf;
+			gather_idat_chunks(static_cast<const uint8_t*>(pImage) + info.m_idat_ofs, info, idat_buf);
+			setup.m_pIDAT_data = idat_buf.data();
+			setup.m_src_len = idat_buf.size();
+		}
+
+		// check zlib header
+		if ((setup.m_pIDAT_data[0] != 0x78) || (setup.m_pIDAT_data[1] != 0x01))
+			return FPNG_DECODE_NOT_FPNG;
+
+		if ((setup.m_num_strips) && (!check_strip_index(setup.m_pStrip_index, setup.m_num_strips, height, setup.m_idat_len)))
+			return FPNG_DECODE_NOT_FPNG;
+
+		setup.m_check_adler32 = (decode_flags & FPNG_DECODE_CHECK_ADLER32) && ((decode_flags & FPNG_DECODE_SKIP_ALL_CHECKS) == 0);
+
+		// 16-bit samples are only returned if they're asked for.
+		setup.m_bytes_per_sample = info.m_bits_per_channel / 8;
+		setup.m_dst_bytes_per_sample = (decode_flags & FPNG_DECODE_16BIT) ? setup.m_bytes_per_sample : 1;
+
+		// Other pixel formats are decoded to 8-bit RGB or RGBA, and converted a row at a time.
+		uint32_t dst_bpp;
+		if ((!get_pixel_format<false>(params.m_dst_format, desired_channels, setup.m_decode_chans, dst_bpp, setup.m_pConvert)) || (dst_bpp != desired_channels) || ((setup.m_pConvert) && (setup.m_dst_bytes_per_sample != 1)))
+			return FPNG_DECODE_INVALID_ARG;
+
+		desired_channels = setup.m_decode_chans;
+
+		// Only grayscale and gray+alpha files can be decoded to 1 or 2 channels.
+		if ((desired_channels < 3) && (channels_in_file > 2))
+			return FPNG_DECODE_INVALID_ARG;
+
+		setup.m_pRaw_store = nullptr;
+
+		if ((setup.m_bytes_per_sample == 2) || (channels_in_file < 3))
+		{
+			if (setup.m_bytes_per_sample == 1)
+			{
+				if (channels_in_file == 1)
+					select_generic_funcs<1, 1, 1>(desired_channels, setup);
 				else
+					select_generic_funcs<2, 1, 1>(desired_channels, setup);
+			}
+			else
+			{
+				switch (channels_in_file)
 				{
-					uint32_t lit1, lit2;
+				case 1: select_generic_funcs_16<1>(desired_channels, setup.m_dst_bytes_per_sample, setup); break;
+				case 2: select_generic_funcs_16<2>(desired_channels, setup.m_dst_bytes_per_sample, setup); break;
+				case 3: select_generic_funcs_16<3>(desired_channels, setup.m_dst_bytes_per_sample, setup); break;
+				default: select_generic_funcs_16<4>(desired_channels, setup.m_dst_bytes_per_sample, setup); break;
+				}
+			}
+		}
+		else if (setup.m_check_adler32)
+		{
+			if (desired_channels == 3)
+				setup.m_pDecompress = (channels_in_file == 3) ? fpng_pixel_zlib_decompress_3<3, true> : fpng_pixel_zlib_decompress_4<3, true>;
+			else
+				setup.m_pDecompress = (channels_in_file == 3) ? fpng_pixel_zlib_decompress_3<4, true> : fpng_pixel_zlib_decompress_4<4, true>;
+		}
+		else
+		{
+			if (desired_channels == 3)
+				setup.m_pDecompress = (channels_in_file == 3) ? fpng_pixel_zlib_decompress_3<3, false> : fpng_pixel_zlib_decompress_4<3, false>;
+			else
+				setup.m_pDecompress = (channels_in_file == 3) ? fpng_pixel_zlib_decompress_3<4, false> : fpng_pixel_zlib_decompress_4<4, false>;
+		}
 
-					uint32_t lit1_spec_len = (lit0_tab >> (16 + 9));
-					uint32_t lit2_len;
-					if (lit1_spec_len)
-					{
-						lit1 = (lit0_tab >> 16) & 511;
-						SKIP_BITS_NE(lit1_spec_len);
+		return FPNG_DECODE_SUCCESS;
+	}
 
-						assert(bit_buf_size >= FPNG_DECODER_TABLE_BITS);
-						lit2 = lit_table[bit_buf & (FPNG_DECODER_TABLE_SIZE - 1)];
-						lit2_len = (lit2 >> 9) & 15;
-						if (!lit2_len)
-							return false;
-					}
-					else
-					{
-						assert(bit_buf_size >= FPNG_DECODER_TABLE_BITS);
-						lit1 = lit_table[bit_buf & (FPNG_DECODER_TABLE_SIZE - 1)];
-						uint32_t lit1_len = (lit1 >> 9) & 15;
-						if (!lit1_len)
-							return false;
-						SKIP_BITS_NE(lit1_len);
+	static int setup_decode(const void* pImage, size_t image_size, uint32_t& width, uint32_t& height, uint32_t& channels_in_file, uint32_t desired_channels, const fpng_decode_params& params, decode_setup& setup)
+	{
+		fpng_file_info info;
+		int status = fpng_get_info_internal(pImage, image_size, width, height, channels_in_file, info, params.m_flags, params.m_pStats);
+		if (status)
+			return status;
 
-						lit2_len = (lit1 >> (16 + 9));
-						if (lit2_len)
-							lit2 = lit1 >> 16;
-						else
-						{
-							assert(bit_buf_size >= FPNG_DECODER_TABLE_BITS);
-							lit2 = lit_table[bit_buf & (FPNG_DECODER_TABLE_SIZE - 1)];
-							lit2_len = (lit2 >> 9) & 15;
-							if (!lit2_len)
-								return false;
-						}
-					}
+		return setup_decode_scanned(pImage, image_size, info, height, channels_in_file, desired_channels, params, setup);
+	}
 
-					uint32_t lit3;
-					uint32_t lit3_len = lit2 >> (16 + 9);
-					
-					if (lit3_len)
-					{
-						lit3 = (lit2 >> 16);
-						SKIP_BITS(lit2_len + lit3_len);
-					}
-					else
-					{
-						SKIP_BITS(lit2_len);
+	// Decompresses the image data prepared by setup_decode() to pDst, with rows dst_pitch bytes apart.
+	// Returns FPNG_DECODE_SUCCESS, FPNG_DECODE_NOT_FPNG if the compressed data isn't valid, or FPNG_DECODE_FAILED_CHECKSUM.
+	static int decode_image(const decode_setup& setup, uint32_t width, uint32_t height, uint32_t channels_in_file, uint8_t* pDst, uint32_t dst_pitch, const fpng_decode_params& params)
+	{
+		const uint32_t src_bpp = channels_in_file * setup.m_bytes_per_sample, decode_bpp = setup.m_decode_chans * setup.m_dst_bytes_per_sample;
 
-						assert(bit_buf_size >= FPNG_DECODER_TABLE_BITS);
-						lit3 = lit_table[bit_buf & (FPNG_DECODER_TABLE_SIZE - 1)];
-						lit3_len = (lit3 >> 9) & 15;
-						if (!lit3_len)
-							return false;
+		const uint32_t num_strips = setup.m_num_strips;
 
-						SKIP_BITS_NE(lit3_len);
-					}
-										
-					// Check for matches
-					if ((lit1 | lit2 | lit3) & 256)
-						return false;
+		uint32_t adler32 = FPNG_ADLER32_INIT;
 
-					if (dst_comps == 3)
-					{
-						if (pPrev_scanline)
-						{
-							pCur_scanline[x_ofs] = (uint8_t)(pPrev_scanline[x_ofs] + lit0);
-							pCur_scanline[x_ofs + 1] = (uint8_t)(pPrev_scanline[x_ofs + 1] + lit1);
-							pCur_scanline[x_ofs + 2] = (uint8_t)(pPrev_scanline[x_ofs + 2] + lit2);
-						}
-						else
-						{
-							pCur_scanline[x_ofs] = (uint8_t)lit0;
-							pCur_scanline[x_ofs + 1] = (uint8_t)lit1;
-							pCur_scanline[x_ofs + 2] = (uint8_t)lit2;
-						}
+		fpng_decode_context::scratch* pContext_scratch = setup.m_pContext_scratch;
 
-						x_ofs += 3;
-					}
-					else
-					{
-						if (pPrev_scanline)
-						{
-							pCur_scanline[x_ofs] = (uint8_t)(pPrev_scanline[x_ofs] + lit0);
-							pCur_scanline[x_ofs + 1] = (uint8_t)(pPrev_scanline[x_ofs + 1] + lit1);
-							pCur_scanline[x_ofs + 2] = (uint8_t)(pPrev_scanline[x_ofs + 2] + lit2);
-							pCur_scanline[x_ofs + 3] = (uint8_t)(pPrev_scanline[x_ofs + 3] + lit3);
-						}
-						else
-						{
-							pCur_scanline[x_ofs] = (uint8_t)lit0;
-							pCur_scanline[x_ofs + 1] = (uint8_t)lit1;
-							pCur_scanline[x_ofs + 2] = (uint8_t)lit2;
-							pCur_scanline[x_ofs + 3] = (uint8_t)lit3;
-						}
-						
-						x_ofs += 4;
-					}
+		if (num_strips)
+		{
+			// Each strip gets its own scratch memory, which is kept by the context if there is one.
+			std::vector<uint8_t> local_strip_status;
+			std::vector<uint32_t> local_strip_adler32;
+			std::vector<decode_scratch> local_strip_scratch;
+
+			std::vector<uint8_t>& strip_status = pContext_scratch ? pContext_scratch->m_strip_status : local_strip_status;
+			std::vector<uint32_t>& strip_adler32 = pContext_scratch ? pContext_scratch->m_strip_adler32 : local_strip_adler32;
+			std::vector<decode_scratch>& strip_scratch = pContext_scratch ? pContext_scratch->m_strips : local_strip_scratch;
+
+			strip_status.resize(num_strips);
+			strip_adler32.assign(setup.m_check_adler32 ? num_strips : 0, FPNG_ADLER32_INIT);
+			if (strip_scratch.size() < num_strips)
+				strip_scratch.resize(num_strips);
+
+			decode_strips_job job;
+			job.m_pSrc = setup.m_pIDAT_data;
+			job.m_src_len = setup.m_src_len;
+			job.m_zlib_len = setup.m_idat_len;
+			job.m_pStrip_index = setup.m_pStrip_index;
+			job.m_num_strips = num_strips;
+			job.m_w = width;
+			job.m_h = height;
+			job.m_dst_pitch = dst_pitch;
+			job.m_pDst = pDst;
+			job.m_pDecompress = setup.m_pDecompress;
+			job.m_src_bpp = src_bpp;
+			job.m_dst_bpp = decode_bpp;
+			job.m_pRaw_store = setup.m_pRaw_store;
+			job.m_pConvert = setup.m_pConvert;
+			job.m_pStatus = strip_status.data();
+			job.m_pAdler32 = setup.m_check_adler32 ? strip_adler32.data() : nullptr;
+			job.m_pScratch = strip_scratch.data();
+
+#if FPNG_STATS
+			std::vector<fpng_decode_stats> strip_stats(params.m_pStats ? num_strips : 0);
+			for (uint32_t i = 0; i < num_strips; i++)
+				strip_scratch[i].m_pStats = params.m_pStats ? &strip_stats[i] : nullptr;
+#endif
 
-					prev_delta_r = (uint8_t)lit0;
-					prev_delta_g = (uint8_t)lit1;
-					prev_delta_b = (uint8_t)lit2;
-					prev_delta_a = (uint8_t)lit3;
+			dispatch_tasks(num_strips, params.m_num_threads, decode_strip_task, &job, params.m_pDispatch, params.m_pDispatch_user_data);
+
+#if FPNG_STATS
+			for (uint32_t i = 0; i < strip_stats.size(); i++)
+				add_decode_stats(*params.m_pStats, strip_stats[i]);
+#endif
+
+			for (uint32_t i = 0; i < num_strips; i++)
+				if (!strip_status[i])
+					return FPNG_DECODE_NOT_FPNG;
+
+			if (setup.m_check_adler32)
+			{
+				FPNG_STATS_ONLY(decode_stats_timer timer(params.m_pStats, &fpng_decode_stats::m_checksum_ns);)
+
+				// The strips were checksummed independently, so combine them in order.
+				const uint64_t filtered_bpl = (uint64_t)width * channels_in_file * setup.m_bytes_per_sample + 1;
+				for (uint32_t i = 0; i < num_strips; i++)
+				{
+					const uint32_t first_row = READ_BE32(setup.m_pStrip_index + i * FPNG_FDEC_STRIP_ENTRY_SIZE + 4);
+					const uint32_t end_row = (i == (num_strips - 1)) ? height : READ_BE32(setup.m_pStrip_index + (i + 1) * FPNG_FDEC_STRIP_ENTRY_SIZE + 4);
+					adler32 = i ? fpng_adler32_combine(adler32, strip_adler32[i], filtered_bpl * (end_row - first_row)) : strip_adler32[i];
 				}
+			}
+		}
+		else
+		{
+			decode_scratch local_scratch;
+			decode_scratch& scratch = pContext_scratch ? pContext_scratch->m_single : local_scratch;
+			scratch.m_pStats = params.m_pStats;
+
+			decode_row_sink convert_sink;
+			convert_rows_job convert_job;
+			decode_row_sink* pSink = nullptr;
+			if (setup.m_pConvert)
+			{
+				convert_job.m_pNext_row = pDst;
+				convert_job.m_pitch = dst_pitch;
+				convert_job.m_pSink = nullptr;
+				dst_pitch = width * decode_bpp;
+				pDst = init_convert_sink(convert_sink, convert_job, setup.m_pConvert, width, dst_pitch, 0, 0, height, false, scratch);
+				pSink = &convert_sink;
+			}
+
+			if ((setup.m_pIDAT_data[2] & 6) == 0)
+			{
+				if (!fpng_pixel_zlib_raw_decompress(setup.m_pIDAT_data, setup.m_src_len, 2, setup.m_idat_len - 4, true, pDst, width, height, dst_pitch, 
+					src_bpp, decode_bpp, pSink, setup.m_check_adler32 ? &adler32 : nullptr, scratch, setup.m_pRaw_store))
+					return FPNG_DECODE_NOT_FPNG;
+			}
+			else if (!setup.m_pDecompress(setup.m_pIDAT_data, setup.m_src_len, 2, setup.m_idat_len - 4, true, pDst, width, height, dst_pitch, pSink, setup.m_check_adler32 ? &adler32 : nullptr, scratch))
+				return FPNG_DECODE_NOT_FPNG;
+		}
+
+		if ((setup.m_check_adler32) && (adler32 != setup.get_expected_adler32()))
+			return FPNG_DECODE_FAILED_CHECKSUM;
+
+		return FPNG_DECODE_SUCCESS;
+	}
+
+	int fpng_decode_memory(const void *pImage, size_t image_size, std::vector<uint8_t> &out, uint32_t& width, uint32_t& height, uint32_t &channels_in_file, uint32_t desired_channels)
+	{
+		return fpng_decode_memory(pImage, image_size, out, width, height, channels_in_file, desired_channels, fpng_decode_params());
+	}
+
+	int fpng_decode_memory(const void *pImage, size_t image_size, std::vector<uint8_t> &out, uint32_t& width, uint32_t& height, uint32_t &channels_in_file, uint32_t desired_channels, const fpng_decode_params& params)
+	{
+		if (params.m_pStats)
+			params.m_pStats->clear();
+
+		FPNG_STATS_ONLY(decode_stats_timer timer(params.m_pStats, &fpng_decode_stats::m_total_ns);)
+
+		out.resize(0);
+		width = 0;
+		height = 0;
+		channels_in_file = 0;
+
+		if ((!pImage) || (!image_size) || (desired_channels < 1) || (desired_channels > 4))
+		{
+			assert(0);
+			return FPNG_DECODE_INVALID_ARG;
+		}
+
+		decode_setup setup;
+		int status = setup_decode(pImage, image_size, width, height, channels_in_file, desired_channels, params, setup);
+		if (status)
+			return status;
+				
+		const uint64_t mem_needed = (uint64_t)width * height * desired_channels * setup.m_dst_bytes_per_sample;
+
+		// On 32-bit systems do a quick sanity check before we try to resize the output buffer.
+		if ((sizeof(size_t) == sizeof(uint32_t)) && (mem_needed >= 0x80000000))
+			return FPNG_DECODE_FAILED_DIMENSIONS_TOO_LARGE;
+
+		out.resize(mem_needed);
+		
+		// If something went wrong, either the file data was corrupted, or it doesn't conform to one of our zlib/Deflate constraints.
+		// The conservative thing to do is indicate it wasn't written by us (FPNG_DECODE_NOT_FPNG), and let the general purpose PNG decoder handle it.
+		return decode_image(setup, width, height, channels_in_file, out.data(), width * desired_channels * setup.m_dst_bytes_per_sample, params);
+	}
 
-			} while (x_ofs < dst_bpl);
+	int fpng_decode_memory(const void* pImage, size_t image_size, void* pDst, size_t dst_buf_size, uint32_t dst_pitch, uint32_t& width, uint32_t& height, uint32_t& channels_in_file, uint32_t desired_channels, const fpng_decode_params& params)
+	{
+		if (params.m_pStats)
+			params.m_pStats->clear();
 
-			pPrev_scanline = pCur_scanline;
-			pCur_scanline += dst_bpl;
-		} // y
+		FPNG_STATS_ONLY(decode_stats_timer timer(params.m_pStats, &fpng_decode_stats::m_total_ns);)
 
-		// The last symbol should be EOB
-		assert(bit_buf_size >= FPNG_DECODER_TABLE_BITS);
-		uint32_t lit0 = lit_table[bit_buf & (FPNG_DECODER_TABLE_SIZE - 1)];
-		uint32_t lit0_len = (lit0 >> 9) & 15;
-		if (!lit0_len)
-			return false;
-		lit0 &= 511;
-		if (lit0 != 256)
-			return false;
+		width = 0;
+		height = 0;
+		channels_in_file = 0;
 
-		bit_buf_size -= lit0_len;
-		bit_buf >>= lit0_len;
+		if ((!pImage) || (!image_size) || (!pDst) || (desired_channels < 1) || (desired_channels > 4))
+		{
+			assert(0);
+			return FPNG_DECODE_INVALID_ARG;
+		}
 
-		uint32_t align_bits = bit_buf_size & 7;
-		bit_buf_size -= align_bits;
-		bit_buf >>= align_bits;
+		decode_setup setup;
+		int status = setup_decode(pImage, image_size, width, height, channels_in_file, desired_channels, params, setup);
+		if (status)
+			return status;
 
-		if (src_ofs < (bit_buf_size >> 3))
-			return false;
-		src_ofs -= (bit_buf_size >> 3);
+		const uint32_t dst_bpl = width * desired_channels * setup.m_dst_bytes_per_sample;
+		if (!dst_pitch)
+			dst_pitch = dst_bpl;
 
-		// We should be at the very end, because the bit buf reads ahead 32-bits (which contains the zlib adler32).
-		if ((src_ofs + 4) != zlib_len)
-			return false;
+		// The caller's buffer must be large enough. The last row doesn't need to be padded out to the full pitch.
+		if ((dst_pitch < dst_bpl) || (((uint64_t)(height - 1) * dst_pitch + dst_bpl) > dst_buf_size))
+			return FPNG_DECODE_INVALID_ARG;
 
-		return true;
+		return decode_image(setup, width, height, channels_in_file, static_cast<uint8_t*>(pDst), dst_pitch, params);
 	}
 
-#pragma pack(push)
-#pragma pack(1)
-	struct png_chunk_prefix
-	{
-		uint32_t m_length;
-		uint8_t m_type[4];
-	};
-	struct png_ihdr
-	{
-		png_chunk_prefix m_prefix;
-		uint32_t m_width;
-		uint32_t m_height;
-		uint8_t m_bitdepth;
-		uint8_t m_color_type;
-		uint8_t m_comp_method;
-		uint8_t m_filter_method;
-		uint8_t m_interlace_method;
-		uint32_t m_crc32;
-	};
-	const uint32_t IHDR_EXPECTED_LENGTH = 13;
-	struct png_iend
+	// Decodes to pDst, or to *pOut (resized once the dimensions are known) if it isn't nullptr.
+	static int decode_any(const void* pImage, size_t image_size, std::vector<uint8_t>* pOut, void* pDst, size_t dst_buf_size, uint32_t dst_pitch, uint32_t& width, uint32_t& height, uint32_t& channels_in_file, uint32_t desired_channels,
+		fpng_fallback_decode_func pFallback, void* pFallback_user_data, const fpng_decode_params& params)
 	{
-		png_chunk_prefix m_prefix;
-		uint32_t m_crc32;
-	};
-#pragma pack(pop)
+		if (params.m_pStats)
+			params.m_pStats->clear();
 
-	static int fpng_get_info_internal(const void* pImage, uint32_t image_size, uint32_t& width, uint32_t& height, uint32_t& channels_in_file, uint32_t &idat_ofs, uint32_t &idat_len)
-	{
-		static const uint8_t s_png_sig[8] = { 137, 80, 78, 71, 13, 10, 26, 10 };
+		FPNG_STATS_ONLY(decode_stats_timer timer(params.m_pStats, &fpng_decode_stats::m_total_ns);)
 
-		if (!endian_check())
-		{
-			assert(0);
-			return false;
-		}
-				
 		width = 0;
 		height = 0;
 		channels_in_file = 0;
-		idat_ofs = 0, idat_len = 0;
-				
-		// Ensure the file has at least a minimum possible size
-		if (image_size < (sizeof(s_png_sig) + sizeof(png_ihdr) + sizeof(png_chunk_prefix) + 1 + sizeof(uint32_t) + sizeof(png_iend)))
-			return FPNG_DECODE_FAILED_NOT_PNG;
 
-		if (memcmp(pImage, s_png_sig, 8) != 0)
-			return FPNG_DECODE_FAILED_NOT_PNG;
+		if ((!pImage) || (!image_size) || ((!pDst) && (!pOut)) || (!pFallback) || (desired_channels < 1) || (desired_channels > 4))
+		{
+			assert(0);
+			return FPNG_DECODE_INVALID_ARG;
+		}
 
-		const uint8_t* pImage_u8 = static_cast<const uint8_t*>(pImage) + 8;
+		// The one chunk scan of the file, whether it's fpng's or not.
+		fpng_file_info info;
+		fpng_png_info png_info;
+		int status = fpng_get_info_internal(pImage, image_size, width, height, channels_in_file, info, params.m_flags, params.m_pStats, &png_info);
+		if ((status != FPNG_DECODE_SUCCESS) && (status != FPNG_DECODE_NOT_FPNG))
+			return status;
 
-		const png_ihdr& ihdr = *reinterpret_cast<const png_ihdr*>(pImage_u8);
-		pImage_u8 += sizeof(png_ihdr);
+		// fpng's decompressor ignores tRNS chunks, so the channel count must agree with the general purpose decoder's.
+		const bool use_fpng = (status == FPNG_DECODE_SUCCESS) && (info.m_bits_per_channel == 8) && (png_info.m_num_chans == channels_in_file) && ((desired_channels >= 3) || (channels_in_file <= 2));
+		channels_in_file = png_info.m_num_chans;
 
-		if (READ_BE32(&ihdr.m_prefix.m_length) != IHDR_EXPECTED_LENGTH)
-			return FPNG_DECODE_FAILED_NOT_PNG;
+		const uint32_t dst_bpl = width * desired_channels;
 
-		if (fpng_crc32(ihdr.m_prefix.m_type, 4 + IHDR_EXPECTED_LENGTH, FPNG_CRC32_INIT) != READ_BE32(&ihdr.m_crc32))
-			return FPNG_DECODE_FAILED_HEADER_CRC32;
+		if (pOut)
+		{
+			const uint64_t mem_needed = (uint64_t)dst_bpl * height;
 
-		width = READ_BE32(&ihdr.m_width);
-		height = READ_BE32(&ihdr.m_height);
-				
-		if (!width || !height || (width > FPNG_MAX_SUPPORTED_DIM) || (height > FPNG_MAX_SUPPORTED_DIM))
-			return FPNG_DECODE_FAILED_INVALID_DIMENSIONS;
+			// On 32-bit systems do a quick sanity check before we try to resize the output buffer.
+			if ((sizeof(size_t) == sizeof(uint32_t)) && (mem_needed >= 0x80000000))
+				return FPNG_DECODE_FAILED_DIMENSIONS_TOO_LARGE;
 
-		uint64_t total_pixels = (uint64_t)width * height;
-		if (total_pixels > (1 << 30))
-			return FPNG_DECODE_FAILED_INVALID_DIMENSIONS;
+			pOut->resize(mem_needed);
+			pDst = pOut->data();
+			dst_buf_size = pOut->size();
+			dst_pitch = dst_bpl;
+		}
+		else if (!dst_pitch)
+			dst_pitch = dst_bpl;
 
-		if ((ihdr.m_comp_method) || (ihdr.m_filter_method) || (ihdr.m_interlace_method) || (ihdr.m_bitdepth != 8))
-			return FPNG_DECODE_NOT_FPNG;
+		// The caller's buffer must be large enough. The last row doesn't need to be padded out to the full pitch.
+		if ((dst_pitch < dst_bpl) || (((uint64_t)(height - 1) * dst_pitch + dst_bpl) > dst_buf_size))
+			return FPNG_DECODE_INVALID_ARG;
 
-		if (ihdr.m_color_type == 2)
-			channels_in_file = 3;
-		else if (ihdr.m_color_type == 6)
-			channels_in_file = 4;
+		// The general purpose decoder writes RGB or RGBA, which is converted to the pixel format afterwards.
+		uint32_t decode_chans, dst_bpp;
+		pixel_convert_func pConvert;
+		if ((!get_pixel_format<false>(params.m_dst_format, desired_channels, decode_chans, dst_bpp, pConvert)) || (dst_bpp != desired_channels) || ((pConvert) && (png_info.m_bit_depth > 8)))
+			return FPNG_DECODE_INVALID_ARG;
 
-		if (!channels_in_file)
-			return FPNG_DECODE_NOT_FPNG;
+		if (use_fpng)
+		{
+			decode_setup setup;
+			status = setup_decode_scanned(pImage, image_size, info, height, channels_in_file, desired_channels, params, setup);
+			if (status == FPNG_DECODE_SUCCESS)
+				status = decode_image(setup, width, height, channels_in_file, static_cast<uint8_t*>(pDst), dst_pitch, params);
+
+			// Only a file that turned out not to follow fpng's constraints goes on to the general purpose decoder (png_info.m_chunks_checked tells it if the IDAT CRC32's still need checking).
+			if (status != FPNG_DECODE_NOT_FPNG)
+				return status;
+		}
 
-		// Scan all the chunks. Look for one IDAT, IEND, and our custom fdEC chunk that indicates the file was compressed by us. Skip any ancillary chunks.
-		bool found_fdec_chunk = false;
-		
-		for (; ; )
+		if (!pConvert)
 		{
-			const size_t src_ofs = pImage_u8 - static_cast<const uint8_t*>(pImage);
-			if (src_ofs >= image_size)
-				return FPNG_DECODE_FAILED_CHUNK_PARSING;
+			if (!pFallback(pImage, image_size, png_info, static_cast<uint8_t*>(pDst), dst_pitch, desired_channels, pFallback_user_data))
+				return FPNG_DECODE_FALLBACK_FAILED;
 
-			const uint32_t bytes_remaining = image_size - (uint32_t)src_ofs;
-			if (bytes_remaining < sizeof(uint32_t) * 3)
-				return FPNG_DECODE_FAILED_CHUNK_PARSING;
+			return FPNG_DECODE_SUCCESS;
+		}
 
-			const png_chunk_prefix* pChunk = reinterpret_cast<const png_chunk_prefix*>(pImage_u8);
+		// The general purpose decoder writes RGB or RGBA. That's converted in place if it's the same size, otherwise from a temporary copy.
+		std::vector<uint8_t> decoded;
+		uint8_t* pDecoded = static_cast<uint8_t*>(pDst);
+		uint32_t decoded_pitch = dst_pitch;
+		if (decode_chans != desired_channels)
+		{
+			decoded_pitch = width * decode_chans;
+			decoded.resize((size_t)decoded_pitch * height);
+			pDecoded = decoded.data();
+		}
 
-			const uint32_t chunk_len = READ_BE32(&pChunk->m_length);
-			if ((src_ofs + sizeof(uint32_t) * 2 + (uint64_t)chunk_len + sizeof(uint32_t)) > image_size)
-				return FPNG_DECODE_FAILED_CHUNK_PARSING;
+		if (!pFallback(pImage, image_size, png_info, pDecoded, decoded_pitch, decode_chans, pFallback_user_data))
+			return FPNG_DECODE_FALLBACK_FAILED;
 
-			for (uint32_t i = 0; i < 4; i++)
-			{
-				const uint8_t c = pChunk->m_type[i];
-				const bool is_upper = (c >= 65) && (c <= 90), is_lower = (c >= 97) && (c <= 122);
-				if ((!is_upper) && (!is_lower))
-					return FPNG_DECODE_FAILED_CHUNK_PARSING;
-			}
+		for (uint32_t y = 0; y < height; y++)
+			pConvert(pDecoded + (size_t)y * decoded_pitch, static_cast<uint8_t*>(pDst) + (size_t)y * dst_pitch, width);
 
-			const uint32_t expected_crc32 = READ_BE32(pImage_u8 + sizeof(uint32_t) * 2 + chunk_len);
+		return FPNG_DECODE_SUCCESS;
+	}
 
-			char chunk_type[5] = { (char)pChunk->m_type[0], (char)pChunk->m_type[1], (char)pChunk->m_type[2], (char)pChunk->m_type[3], 0 };
-			const bool is_idat = strcmp(chunk_type, "IDAT") == 0;
+	int fpng_decode_any(const void* pImage, size_t image_size, void* pDst, size_t dst_buf_size, uint32_t dst_pitch, uint32_t& width, uint32_t& height, uint32_t& channels_in_file, uint32_t desired_channels,
+		fpng_fallback_decode_func pFallback, void* pFallback_user_data, const fpng_decode_params& params)
+	{
+		return decode_any(pImage, image_size, nullptr, pDst, dst_buf_size, dst_pitch, width, height, channels_in_file, desired_channels, pFallback, pFallback_user_data, params);
+	}
 
-#if !FPNG_DISABLE_DECODE_CRC32_CHECKS
-			if (!is_idat)
-			{
-				uint32_t actual_crc32 = fpng_crc32(pImage_u8 + sizeof(uint32_t), sizeof(uint32_t) + chunk_len, FPNG_CRC32_INIT);
-				if (actual_crc32 != expected_crc32)
-					return FPNG_DECODE_FAILED_HEADER_CRC32;
-			}
-#endif
+	int fpng_decode_any(const void* pImage, size_t image_size, std::vector<uint8_t>& out, uint32_t& width, uint32_t& height, uint32_t& channels_in_file, uint32_t desired_channels,
+		fpng_fallback_decode_func pFallback, void* pFallback_user_data, const fpng_decode_params& params)
+	{
+		out.resize(0);
+		return decode_any(pImage, image_size, &out, nullptr, 0, 0, width, height, channels_in_file, desired_channels, pFallback, pFallback_user_data, params);
+	}
 
-			const uint8_t* pChunk_data = pImage_u8 + sizeof(uint32_t) * 2;
+	// Decodes rows [first_row, end_row) of the image prepared by setup_decode() into a band buffer, passing each band of rows_per_callback rows to pCallback. 
+	// Strips before the one holding first_row are skipped, and decoding stops after row end_row-1. The Adler32 can only be checked if the whole image is decoded.
+	static int decode_rows(const decode_setup& setup, uint32_t width, uint32_t height, uint32_t channels_in_file, uint32_t desired_channels, uint32_t first_row, uint32_t end_row,
+		uint32_t rows_per_callback, fpng_decode_rows_func pCallback, void* pCallback_user_data, const fpng_decode_params& params)
+	{
+		assert((first_row < end_row) && (end_row <= height));
 
-			if (strcmp(chunk_type, "IEND") == 0)
-				break;
-			else if (is_idat)
-			{
-				// If there were multiple IDAT's, or we didn't find the fdEC chunk, then it's not FPNG.
-				if ((idat_ofs) || (!found_fdec_chunk))
-					return FPNG_DECODE_NOT_FPNG;
+		const uint32_t src_bpp = channels_in_file * setup.m_bytes_per_sample, decode_bpp = setup.m_decode_chans * setup.m_dst_bytes_per_sample;
+		const uint32_t dst_bpl = width * desired_channels * setup.m_dst_bytes_per_sample;
+		const uint32_t rows_per_band = minimum(rows_per_callback, end_row - first_row);
+		
+		// The band buffer needs one more row than a band, see decode_row_sink.
+		const uint32_t buf_rows = rows_per_band + 1;
+		if ((uint64_t)buf_rows * dst_bpl > UINT32_MAX)
+			return FPNG_DECODE_FAILED_DIMENSIONS_TOO_LARGE;
 
-				idat_ofs = (uint32_t)src_ofs;
-				idat_len = chunk_len;
+		const size_t band_buf_size = (size_t)buf_rows * dst_bpl;
 
-				// Sanity check the IDAT chunk length
-				if (idat_len < 7)
-					return FPNG_DECODE_FAILED_INVALID_IDAT;
-			}
-			else if (strcmp(chunk_type, "fdEC") == 0)
-			{
-				if (found_fdec_chunk)
-					return FPNG_DECODE_NOT_FPNG;
+		std::vector<uint8_t> local_band_buf;
+		decode_scratch local_scratch;
+		decode_scratch& scratch = setup.m_pContext_scratch ? setup.m_pContext_scratch->m_single : local_scratch;
+		scratch.m_pStats = params.m_pStats;
+		uint8_t* pBand_buf = get_scratch_buf(setup.m_pContext_scratch ? setup.m_pContext_scratch->m_band_buf : local_band_buf, band_buf_size);
 
-				// We've got our fdEC chunk. Now make sure it's big enough and check its contents.
-				if (chunk_len != 5)
-					return FPNG_DECODE_NOT_FPNG;
+		// Skip the strips before the first needed row.
+		uint32_t first_strip = 0;
+		while (((first_strip + 1) < setup.m_num_strips) && (READ_BE32(setup.m_pStrip_index + (first_strip + 1) * FPNG_FDEC_STRIP_ENTRY_SIZE + 4) <= first_row))
+			first_strip++;
 
-				// Check fdEC chunk sig
-				if ((pChunk_data[0] != 82) || (pChunk_data[1] != 36) || (pChunk_data[2] != 147) || (pChunk_data[3] != 227))
-					return FPNG_DECODE_NOT_FPNG;
+		const uint32_t start_row = setup.m_num_strips ? READ_BE32(setup.m_pStrip_index + first_strip * FPNG_FDEC_STRIP_ENTRY_SIZE + 4) : 0;
 
-				// Check fdEC version
-				if (pChunk_data[4] != FPNG_FDEC_VERSION)
-					return FPNG_DECODE_NOT_FPNG;
+		decode_row_sink sink;
+		init_row_sink(sink, pBand_buf, band_buf_size, dst_bpl, rows_per_band, start_row, first_row, end_row, end_row < height, pCallback, pCallback_user_data);
 
-				found_fdec_chunk = true;
-			}
-			else
+		// With a pixel format, the rows are decoded into the converting sink, which passes the converted rows from first_row on to the band sink.
+		decode_row_sink convert_sink;
+		convert_rows_job convert_job;
+		decode_row_sink* pSink = &sink;
+		uint8_t* pFirst_row = pBand_buf;
+		if (setup.m_pConvert)
+		{
+			sink.m_cur_row = first_row;
+			sink.m_band_first_row = first_row;
+			convert_job.m_pNext_row = pBand_buf;
+			convert_job.m_pSink = &sink;
+			pFirst_row = init_convert_sink(convert_sink, convert_job, setup.m_pConvert, width, width * decode_bpp, start_row, first_row, end_row, end_row < height, scratch);
+			pSink = &convert_sink;
+		}
+		
+		// The strips are decoded in order, so their Adler32's don't need to be combined. The decompressors were picked to compute it, but it's ignored if only part of the image is decoded.
+		uint32_t adler32 = FPNG_ADLER32_INIT;
+		uint32_t* pAdler32 = setup.m_check_adler32 ? &adler32 : nullptr;
+		const bool check_adler32 = (pAdler32) && (!first_row) && (end_row == height);
+
+		bool decomp_status;
+		if (setup.m_num_strips)
+		{
+			// The strips are decoded in order, continuing where the previous strip left off in the band buffer.
+			decomp_status = true;
+			for (uint32_t i = first_strip; decomp_status && (i < setup.m_num_strips) && (pSink->m_cur_row < end_row); i++)
 			{
-				// Bail if it's a critical chunk - can't be FPNG
-				if ((chunk_type[0] & 32) == 0)
-					return FPNG_DECODE_NOT_FPNG;
+				const uint8_t* pEntry = setup.m_pStrip_index + i * FPNG_FDEC_STRIP_ENTRY_SIZE;
+				const bool last_strip = (i == (setup.m_num_strips - 1));
 
-				// ancillary chunk - skip it
-			}
+				const uint32_t ofs = READ_BE32(pEntry), strip_first_row = READ_BE32(pEntry + 4);
+				const size_t end_ofs = last_strip ? (setup.m_idat_len - 4) : READ_BE32(pEntry + FPNG_FDEC_STRIP_ENTRY_SIZE);
+				const uint32_t strip_end_row = last_strip ? height : READ_BE32(pEntry + FPNG_FDEC_STRIP_ENTRY_SIZE + 4);
 
-			pImage_u8 += sizeof(png_chunk_prefix) + chunk_len + sizeof(uint32_t);
+				assert(strip_first_row == pSink->m_cur_row);
+				
+				uint8_t* pNext_row = pSink->m_pBand + (size_t)(pSink->m_cur_row - pSink->m_band_first_row) * pSink->m_bpl;
+				if (pEntry[8] == FPNG_FDEC_STRIP_TABLE_STORED)
+					decomp_status = fpng_pixel_zlib_raw_decompress(setup.m_pIDAT_data, setup.m_src_len, ofs, end_ofs, last_strip, pNext_row, width, strip_end_row - strip_first_row, (uint32_t)pSink->m_bpl, 
+						src_bpp, decode_bpp, pSink, pAdler32, scratch, setup.m_pRaw_store);
+				else
+					decomp_status = setup.m_pDecompress(setup.m_pIDAT_data, setup.m_src_len, ofs, end_ofs, last_strip, pNext_row, width, strip_end_row - strip_first_row, (uint32_t)pSink->m_bpl, pSink, pAdler32, scratch);
+			}
 		}
+		else if ((setup.m_pIDAT_data[2] & 6) == 0)
+			decomp_status = fpng_pixel_zlib_raw_decompress(setup.m_pIDAT_data, setup.m_src_len, 2, setup.m_idat_len - 4, true, pFirst_row, width, height, (uint32_t)pSink->m_bpl, 
+				src_bpp, decode_bpp, pSink, pAdler32, scratch, setup.m_pRaw_store);
+		else
+			decomp_status = setup.m_pDecompress(setup.m_pIDAT_data, setup.m_src_len, 2, setup.m_idat_len - 4, true, pFirst_row, width, height, (uint32_t)pSink->m_bpl, pSink, pAdler32, scratch);
 
-		if ((!found_fdec_chunk) || (!idat_ofs))
+		if (sink.m_aborted)
+			return FPNG_DECODE_CALLBACK_ABORTED;
+
+		if ((!decomp_status) && (!sink.m_stopped))
 			return FPNG_DECODE_NOT_FPNG;
-		
+
+		if ((check_adler32) && (adler32 != setup.get_expected_adler32()))
+			return FPNG_DECODE_FAILED_CHECKSUM;
+
 		return FPNG_DECODE_SUCCESS;
 	}
 
-	int fpng_get_info(const void* pImage, uint32_t image_size, uint32_t& width, uint32_t& height, uint32_t& channels_in_file)
+	int fpng_decode_memory_rows(const void* pImage, size_t image_size, uint32_t rows_per_callback, fpng_decode_rows_func pCallback, void* pCallback_user_data, uint32_t& width, uint32_t& height, uint32_t& channels_in_file, uint32_t desired_channels,
+		const fpng_decode_params& params)
 	{
-		uint32_t idat_ofs = 0, idat_len = 0;
-		return fpng_get_info_internal(pImage, image_size, width, height, channels_in_file, idat_ofs, idat_len);
-	}
+		if (params.m_pStats)
+			params.m_pStats->clear();
+
+		FPNG_STATS_ONLY(decode_stats_timer timer(params.m_pStats, &fpng_decode_stats::m_total_ns);)
 
-	int fpng_decode_memory(const void *pImage, uint32_t image_size, std::vector<uint8_t> &out, uint32_t& width, uint32_t& height, uint32_t &channels_in_file, uint32_t desired_channels)
-	{
-		out.resize(0);
 		width = 0;
 		height = 0;
 		channels_in_file = 0;
 
-		if ((!pImage) || (!image_size) || ((desired_channels != 3) && (desired_channels != 4)))
+		if ((!pImage) || (!image_size) || (!rows_per_callback) || (!pCallback) || (desired_channels < 1) || (desired_channels > 4))
 		{
 			assert(0);
 			return FPNG_DECODE_INVALID_ARG;
 		}
 
-		uint32_t idat_ofs = 0, idat_len = 0;
-		int status = fpng_get_info_internal(pImage, image_size, width, height, channels_in_file, idat_ofs, idat_len);
+		decode_setup setup;
+		int status = setup_decode(pImage, image_size, width, height, channels_in_file, desired_channels, params, setup);
 		if (status)
 			return status;
-				
-		const uint64_t mem_needed = (uint64_t)width * height * desired_channels;
-		if (mem_needed > UINT32_MAX)
-			return FPNG_DECODE_FAILED_DIMENSIONS_TOO_LARGE;
 
-		// On 32-bit systems do a quick sanity check before we try to resize the output buffer.
-		if ((sizeof(size_t) == sizeof(uint32_t)) && (mem_needed >= 0x80000000))
-			return FPNG_DECODE_FAILED_DIMENSIONS_TOO_LARGE;
+		return decode_rows(setup, width, height, channels_in_file, desired_channels, 0, height, rows_per_callback, pCallback, pCallback_user_data, params);
+	}
 
-		out.resize(mem_needed);
+	// Box filters each band of decode_rows() rows (1 << shift rows, fewer at the end) into one row of the region's output.
+	struct downscale_job
+	{
+		uint8_t* m_pDst;
+		uint32_t m_dst_pitch;
+		uint32_t m_first_row, m_width, m_num_chans, m_bytes_per_sample, m_shift;
+		std::vector<uint32_t> m_sums; // the band's column sums, one per sample of a row
+	};
+
+	template<typename T, uint32_t num_chans>
+	static void downscale_band(downscale_job& job, const uint8_t* pRows, uint32_t first_row, uint32_t num_rows)
+	{
+		const uint32_t width = job.m_width, shift = job.m_shift, block_size = 1 << shift;
+		const uint32_t dst_width = (width + block_size - 1) >> shift;
+		const uint32_t full_blocks = width >> shift;
+		const size_t row_samples = (size_t)width * num_chans;
+		uint32_t* pSums = job.m_sums.data();
+
+		// Sum the band's rows into the accumulator row, which the compiler vectorizes, then sum each block's columns.
+		const T* pSrc = reinterpret_cast<const T*>(pRows);
+		for (size_t i = 0; i < row_samples; i++)
+			pSums[i] = pSrc[i];
+
+		for (uint32_t y = 1; y < num_rows; y++)
+		{
+			pSrc += row_samples;
+			for (size_t i = 0; i < row_samples; i++)
+				pSums[i] += pSrc[i];
+		}
+
+		T* pDst = reinterpret_cast<T*>(job.m_pDst + (size_t)((first_row - job.m_first_row) >> shift) * job.m_dst_pitch);
 		
-		const uint8_t* pIDAT_data = static_cast<const uint8_t*>(pImage) + idat_ofs + sizeof(uint32_t) * 2;
-		const uint32_t src_len = image_size - (idat_ofs + sizeof(uint32_t) * 2);
+		// Full blocks are divided with a shift. The last column and row of blocks can be partial.
+		const uint32_t n = block_size * num_rows;
+		const uint32_t total_shift = shift * 2, round = (1 << total_shift) >> 1;
 
-		bool decomp_status;
-		if (desired_channels == 3)
+		const uint32_t* pBlock_sums = pSums;
+		for (uint32_t bx = 0; bx < full_blocks; bx++, pDst += num_chans)
 		{
-			if (channels_in_file == 3)
-				decomp_status = fpng_pixel_zlib_decompress_3<3>(pIDAT_data, src_len, idat_len, out.data(), width, height);
-			else
-				decomp_status = fpng_pixel_zlib_decompress_4<3>(pIDAT_data, src_len, idat_len, out.data(), width, height);
+			uint32_t block_sums[num_chans];
+			for (uint32_t c = 0; c < num_chans; c++)
+				block_sums[c] = 0;
+
+			for (uint32_t i = 0; i < block_size; i++, pBlock_sums += num_chans)
+				for (uint32_t c = 0; c < num_chans; c++)
+					block_sums[c] += pBlock_sums[c];
+
+			for (uint32_t c = 0; c < num_chans; c++)
+				pDst[c] = (T)((num_rows == block_size) ? ((block_sums[c] + round) >> total_shift) : ((block_sums[c] + (n >> 1)) / n));
 		}
-		else
+
+		if (full_blocks < dst_width)
 		{
-			if (channels_in_file == 3)
-				decomp_status = fpng_pixel_zlib_decompress_3<4>(pIDAT_data, src_len, idat_len, out.data(), width, height);
-			else
-				decomp_status = fpng_pixel_zlib_decompress_4<4>(pIDAT_data, src_len, idat_len, out.data(), width, height);
+			const uint32_t partial_w = width - (full_blocks << shift), partial_n = partial_w * num_rows;
+			for (uint32_t c = 0; c < num_chans; c++)
+			{
+				uint32_t sum = 0;
+				for (uint32_t i = 0; i < partial_w; i++)
+					sum += pBlock_sums[i * num_chans + c];
+				pDst[c] = (T)((sum + (partial_n >> 1)) / partial_n);
+			}
+		}
+	}
+
+	template<typename T>
+	static void downscale_band(downscale_job& job, const uint8_t* pRows, uint32_t first_row, uint32_t num_rows)
+	{
+		switch (job.m_num_chans)
+		{
+		case 1: downscale_band<T, 1>(job, pRows, first_row, num_rows); break;
+		case 2: downscale_band<T, 2>(job, pRows, first_row, num_rows); break;
+		case 3: downscale_band<T, 3>(job, pRows, first_row, num_rows); break;
+		default: downscale_band<T, 4>(job, pRows, first_row, num_rows); break;
 		}
-		if (!decomp_status)
+	}
+
+	static bool downscale_rows_callback(const uint8_t* pRows, uint32_t first_row, uint32_t num_rows, void* pUser_data)
+	{
+		downscale_job& job = *static_cast<downscale_job*>(pUser_data);
+
+		if (!job.m_shift)
 		{
-			// Something went wrong. Either the file data was corrupted, or it doesn't conform to one of our zlib/Deflate constraints.
-			// The conservative thing to do is indicate it wasn't written by us, and let the general purpose PNG decoder handle it.
-			return FPNG_DECODE_NOT_FPNG;
+			const size_t bpl = (size_t)job.m_width * job.m_num_chans * job.m_bytes_per_sample;
+			for (uint32_t y = 0; y < num_rows; y++)
+				memcpy(job.m_pDst + (size_t)(first_row - job.m_first_row + y) * job.m_dst_pitch, pRows + y * bpl, bpl);
 		}
+		else if (job.m_bytes_per_sample == 2)
+			downscale_band<uint16_t>(job, pRows, first_row, num_rows);
+		else
+			downscale_band<uint8_t>(job, pRows, first_row, num_rows);
 
-		return FPNG_DECODE_SUCCESS;
+		return true;
+	}
+
+	int fpng_decode_memory_region(const void* pImage, size_t image_size, uint32_t first_row, uint32_t end_row, uint32_t scale_shift, void* pDst, size_t dst_buf_size, uint32_t dst_pitch, 
+		uint32_t& width, uint32_t& height, uint32_t& channels_in_file, uint32_t desired_channels, const fpng_decode_params& params)
+	{
+		if (params.m_pStats)
+			params.m_pStats->clear();
+
+		FPNG_STATS_ONLY(decode_stats_timer timer(params.m_pStats, &fpng_decode_stats::m_total_ns);)
+
+		width = 0;
+		height = 0;
+		channels_in_file = 0;
+
+		if ((!pImage) || (!image_size) || (!pDst) || (scale_shift > FPNG_DECODE_MAX_SCALE_SHIFT) || (desired_channels < 1) || (desired_channels > 4))
+		{
+			assert(0);
+			return FPNG_DECODE_INVALID_ARG;
+		}
+
+		decode_setup setup;
+		int status = setup_decode(pImage, image_size, width, height, channels_in_file, desired_channels, params, setup);
+		if (status)
+			return status;
+
+		end_row = minimum(end_row, height);
+		if (first_row >= end_row)
+			return FPNG_DECODE_INVALID_ARG;
+
+		const uint32_t dst_width = (width + (1 << scale_shift) - 1) >> scale_shift;
+		const uint32_t dst_height = (end_row - first_row + (1 << scale_shift) - 1) >> scale_shift;
+		const uint32_t dst_bpl = dst_width * desired_channels * setup.m_dst_bytes_per_sample;
+		if (!dst_pitch)
+			dst_pitch = dst_bpl;
+
+		// The caller's buffer must be large enough. The last row doesn't need to be padded out to the full pitch.
+		if ((dst_pitch < dst_bpl) || (((uint64_t)(dst_height - 1) * dst_pitch + dst_bpl) > dst_buf_size))
+			return FPNG_DECODE_INVALID_ARG;
+
+		downscale_job job;
+		job.m_pDst = static_cast<uint8_t*>(pDst);
+		job.m_dst_pitch = dst_pitch;
+		job.m_first_row = first_row;
+		job.m_width = width;
+		job.m_num_chans = desired_channels;
+		job.m_bytes_per_sample = setup.m_dst_bytes_per_sample;
+		job.m_shift = scale_shift;
+		job.m_sums.resize(scale_shift ? ((size_t)width * desired_channels) : 0);
+
+		// Each band is one output row. Unscaled regions are copied in larger bands.
+		const uint32_t rows_per_band = scale_shift ? (1 << scale_shift) : 16;
+
+		return decode_rows(setup, width, height, channels_in_file, desired_channels, first_row, end_row, rows_per_band, downscale_rows_callback, &job, params);
 	}
 
 #ifndef FPNG_NO_STDIO
 	int fpng_decode_file(const char* pFilename, std::vector<uint8_t>& out, uint32_t& width, uint32_t& height, uint32_t& channels_in_file, uint32_t desired_channels)
 	{
+		return fpng_decode_file(pFilename, out, width, height, channels_in_file, desired_channels, fpng_decode_params());
+	}
+
+	int fpng_decode_file(const char* pFilename, std::vector<uint8_t>& out, uint32_t& width, uint32_t& height, uint32_t& channels_in_file, uint32_t desired_channels, const fpng_decode_params& params)
+	{
+#if FPNG_MMAP_READ
+		// Decode straight from the mapped file, without reading it into a buffer first.
+		{
+			mapped_file file;
+			if (file.open_for_reading(pFilename))
+				return fpng_decode_memory(file.get_ptr(), (size_t)file.get_size(), out, width, height, channels_in_file, desired_channels, params);
+		}
+#endif
+
 		FILE* pFile = nullptr;
 
 #ifdef _MSC_VER
@@ -3170,12 +8858,18 @@ do_literals:
 			return FPNG_DECODE_FILE_SEEK_FAILED;
 		}
 
-		if ( (filesize < 0) || (filesize > UINT32_MAX) || ( (sizeof(size_t) == sizeof(uint32_t)) && (filesize > 0x70000000) ) )
+		if ( (filesize < 0) || ( (sizeof(size_t) == sizeof(uint32_t)) && (filesize > 0x70000000) ) )
 		{
 			fclose(pFile);
 			return FPNG_DECODE_FILE_TOO_LARGE;
 		}
 
+		if (!filesize)
+		{
+			fclose(pFile);
+			return FPNG_DECODE_FAILED_NOT_PNG;
+		}
+
 		std::vector<uint8_t> buf((size_t)filesize);
 		if (fread(buf.data(), 1, buf.size(), pFile) != buf.size())
 		{
@@ -3185,7 +8879,7 @@ do_literals:
 
 		fclose(pFile);
 
-		return fpng_decode_memory(buf.data(), (uint32_t)buf.size(), out, width, height, channels_in_file, desired_channels);
+		return fpng_decode_memory(buf.data(), buf.size(), out, width, height, channels_in_file, desired_channels, params);
 	}
 #endif
 
@@ -10,6 +10,16 @@
 	#define FPNG_TRAIN_HUFFMAN_TABLES (0)
 #endif
 
+#ifndef FPNG_STATS
+	// Set to 1 to compile in the hot path instrumentation which fills in fpng_encode_stats and fpng_decode_stats. When 0, the timers and counters are compiled away entirely.
+	#define FPNG_STATS (0)
+#endif
+
+#ifndef FPNG_MAX_IDAT_CHUNK_SIZE
+	// PNG chunks can't be longer than 2^31-1 bytes, so fpng_encode_image_to_memory() splits larger zlib streams into IDAT chunks of at most this many bytes.
+	#define FPNG_MAX_IDAT_CHUNK_SIZE (0x40000000)
+#endif
+
 namespace fpng
 {
 	// ---- Library initialization - call once to identify if the processor supports SSE.
@@ -22,14 +32,90 @@ namespace fpng
 	// fpng_init() must have been called first, or it'll assert and return false.
 	bool fpng_cpu_supports_sse41();
 
-	// Fast CRC-32 SSE4.1+pclmul or a scalar fallback (slice by 4)
+	// Returns true if the CPU and OS support AVX2, and it wasn't disabled by setting FPNG_NO_SSE=1 or FPNG_NO_AVX2=1. If so, wider AVX2 kernels are used at runtime.
+	// fpng_init() must have been called first, or it'll assert and return false.
+	bool fpng_cpu_supports_avx2();
+
+	// Fast CRC-32 AVX2+VPCLMULQDQ, SSE4.1+pclmul or a scalar fallback (slice by 4)
 	const uint32_t FPNG_CRC32_INIT = 0;
 	uint32_t fpng_crc32(const void* pData, size_t size, uint32_t prev_crc32 = FPNG_CRC32_INIT);
 
-	// Fast Adler32 SSE4.1 Adler-32 with a scalar fallback.
+	// Fast Adler32 AVX2 or SSE4.1 Adler-32 with a scalar fallback.
 	const uint32_t FPNG_ADLER32_INIT = 1;
 	uint32_t fpng_adler32(const void* pData, size_t size, uint32_t adler = FPNG_ADLER32_INIT);
 
+	// Combines the CRC-32's or Adler-32's of two adjacent buffers A and B into the checksum of A+B, given the length of B in bytes.
+	uint32_t fpng_crc32_combine(uint32_t crc32_a, uint32_t crc32_b, uint64_t len_b);
+	uint32_t fpng_adler32_combine(uint32_t adler32_a, uint32_t adler32_b, uint64_t len_b);
+
+	// ---- Multithreading
+
+	// A single task of a parallel job.
+	typedef void (*fpng_task_func)(uint32_t task_index, void* pTask_data);
+
+	// Optional hook to run fpng's parallel work on your own job system.
+	// It must call pTask(i, pTask_data) exactly once for every i in [0, num_tasks), in any order and on any threads, and only return once all the calls have completed.
+	typedef void (*fpng_dispatch_func)(uint32_t num_tasks, fpng_task_func pTask, void* pTask_data, void* pUser_data);
+
+	// Reads an image being encoded a row at a time: copies row y's w pixels (in fpng_encode_params::m_src_format's layout) to pDst. Rows can be read more than once and in any order, 
+	// and with strip-parallel encoding from several threads at once.
+	typedef void (*fpng_read_row_func)(uint32_t y, void* pDst, void* pUser_data);
+
+	// ---- Instrumentation
+
+	// The kind of Huffman table a Deflate block was coded with, see fpng_encode_stats::m_table_blocks.
+	enum
+	{
+		FPNG_STATS_TABLE_RAW = 0,	// raw (uncompressed) blocks
+		FPNG_STATS_TABLE_DYNAMIC,	// a custom table built from every symbol, in two passes
+		FPNG_STATS_TABLE_SAMPLED,	// a custom table built from a sample of the rows (FPNG_LEVEL_MEDIUM)
+		FPNG_STATS_TABLE_PRESET,	// FPNG_STATS_TABLE_PRESET + i: the single pass compressor's precomputed table i
+
+		FPNG_STATS_MAX_TABLES = FPNG_STATS_TABLE_PRESET + 8
+	};
+
+	// Filled in by fpng_encode_image_to_memory() if fpng_encode_params::m_pStats isn't nullptr. Unless fpng was compiled with FPNG_STATS=1, it's only cleared.
+	// Times are in nanoseconds. The stages are timed per row, so the timers themselves add a little overhead. With strip-parallel encoding everything is summed over the strips, 
+	// so the stage times are CPU time and can add up to more than m_total_ns.
+	struct fpng_encode_stats
+	{
+		uint64_t m_total_ns;		// the whole call
+		uint64_t m_analysis_ns;		// sampling rows to pick the Huffman table, or to detect noise that won't compress
+		uint64_t m_filter_ns;		// filtering the rows (and swapping 16-bit samples to big endian)
+		uint64_t m_adler32_ns;		// the zlib Adler-32 of the filtered rows
+		uint64_t m_entropy_ns;		// finding the runs and matches, building the Huffman tables and writing the codes (or copying the rows into raw blocks)
+		uint64_t m_crc32_ns;		// folding the output into the IDAT CRC-32
+
+		uint64_t m_num_literals;	// literal bytes coded, including the filter bytes
+		uint64_t m_num_matches;		// RLE (or LZ) matches coded
+		uint64_t m_match_bytes;		// total bytes covered by the matches
+
+		// true if the image, or at least one of its strips, didn't compress and was written as raw blocks instead.
+		bool m_raw_fallback;
+
+		// The number of Deflate blocks (1, or 1 per strip) coded with each FPNG_STATS_TABLE_* kind of table.
+		uint32_t m_table_blocks[FPNG_STATS_MAX_TABLES];
+
+		fpng_encode_stats() { clear(); }
+		void clear();
+	};
+
+	// Filled in by the fpng_decode_memory() functions if fpng_decode_params::m_pStats isn't nullptr (again, only with FPNG_STATS=1). Times are in nanoseconds, and summed over the strips of 
+	// strip-parallel files.
+	struct fpng_decode_stats
+	{
+		uint64_t m_total_ns;		// the whole call
+		uint64_t m_table_build_ns;	// reading the Huffman code lengths, and building (or reusing) the decoding tables
+		uint64_t m_decode_ns;		// the inner loop: decoding the Deflate data into rows and unfiltering them (including fpng_decode_memory_rows()' callbacks)
+		uint64_t m_checksum_ns;		// the IDAT CRC-32 and zlib Adler-32 checks requested by the decode flags
+
+		uint32_t m_num_tables_built;	// Deflate blocks whose decoding tables were built
+		uint32_t m_num_tables_reused;	// Deflate blocks which reused the previous block's tables (see fpng_decode_context)
+
+		fpng_decode_stats() { clear(); }
+		void clear();
+	};
+
 	// ---- Compression
 	enum
 	{
@@ -39,19 +125,273 @@ namespace fpng
 		
 		// Only use raw Deflate blocks (no compression at all). Intended for testing.
 		FPNG_FORCE_UNCOMPRESSED = 2,
+
+		// Picks the PNG filter of each row (Sub, Up, Average or Paeth) using a quick estimate, instead of always using Up. Usually gives smaller files on gradients and photos, but compression is slower.
+		// fpng_decode_memory() still decodes these files, but rows that don't use Up take a little longer. Not supported by fpng_encoder.
+		FPNG_ENCODE_ADAPTIVE_FILTERS = 4,
+
+		// Also looks for repeats at other distances within each row (with a small hash chain), instead of only runs of the previous pixel. Helps UI screenshots, text and tiled sprites
+		// the most, but compression is around 2x slower than FPNG_ENCODE_SLOWER, which it implies, and can be combined with the compression levels. The files can only be decoded by fpng_decode_memory() 
+		// from this version or later (older versions return FPNG_DECODE_NOT_FPNG, and callers fall back to a general PNG decoder). Not supported by fpng_encoder.
+		FPNG_ENCODE_LZ_MATCHES = 8,
+
+		// The image has 16 bits per channel: pImage holds native endian uint16_t samples, and the PNG file is written with a bit depth of 16.
+		// Images without 3 or 4 8-bit channels are always compressed in two passes (like FPNG_ENCODE_SLOWER), because the precomputed Huffman tables only cover those.
+		FPNG_ENCODE_16BIT = 16,
+
+		// fpng_encode_image_to_file() only: writes to a temporary file next to the destination, which is renamed over it once it's complete, so a failed encode leaves an existing 
+		// file untouched. Without it, the destination is written in place. Symlinks, hard linked files and special files are still written in place, and a replaced file keeps its 
+		// permissions. Needs permission to create files in the destination's directory.
+		FPNG_ENCODE_REPLACE_FILE = 32,
+
+		// fpng_encode_image_to_file() only: compresses into memory while a background thread writes the finished part of the zlib stream to the file, then writes the header 
+		// (with the IDAT length) and the IDAT CRC-32 last. Overlaps compression with I/O on file systems where writes are slow, like network shares (instead of mapping the file, whose pages
+		// are only written back after it's closed). Strip-parallel encodes still write the whole file at the end. Ignored if FPNG_NO_THREADING is 1.
+		FPNG_ENCODE_PIPELINED_WRITE = 64,
+	};
+
+	// Compression levels, for fpng_encode_params::m_level. Higher levels give smaller files, but compress more slowly.
+	enum
+	{
+		// Use m_flags' FPNG_ENCODE_SLOWER, FPNG_FORCE_UNCOMPRESSED and FPNG_ENCODE_ADAPTIVE_FILTERS bits (the default).
+		FPNG_LEVEL_FROM_FLAGS = -1,
+
+		// Uncompressed Deflate blocks, like FPNG_FORCE_UNCOMPRESSED.
+		FPNG_LEVEL_UNCOMPRESSED = 0,
+
+		// Single pass using the precomputed Huffman tables (the default with no flags).
+		FPNG_LEVEL_FASTEST = 1,
+
+		// Builds a custom Huffman table from a sample of 1 in 8 rows, then compresses in a single pass. Gets most of FPNG_ENCODE_SLOWER's gain at close to single pass speed.
+		FPNG_LEVEL_MEDIUM = 2,
+
+		// Two passes with a custom Huffman table, like FPNG_ENCODE_SLOWER.
+		FPNG_LEVEL_SLOWER = 3,
+
+		// Two passes with adaptive filters (FPNG_ENCODE_SLOWER | FPNG_ENCODE_ADAPTIVE_FILTERS).
+		FPNG_LEVEL_SLOWEST = 4,
+
+		FPNG_MAX_LEVEL = FPNG_LEVEL_SLOWEST
+	};
+
+	// Pixel layouts in memory, for fpng_encode_params::m_src_format and fpng_decode_params::m_dst_format. Images in other 8-bit layouts are converted a row at a time as they're
+	// compressed or decompressed, instead of in a separate pass over the whole image.
+	enum
+	{
+		// Grayscale, gray+alpha, RGB or RGBA (from num_chans or desired_channels), R (or gray) first in memory.
+		FPNG_PIXEL_FORMAT_DEFAULT = 0,
+
+		// 3 bytes per pixel, RGB in the file.
+		FPNG_PIXEL_FORMAT_BGR,
+
+		// 4 bytes per pixel, RGBA in the file.
+		FPNG_PIXEL_FORMAT_BGRA,
+		FPNG_PIXEL_FORMAT_ARGB,
+		FPNG_PIXEL_FORMAT_ABGR,
+
+		// 4 bytes per pixel, one of which (X) is unused: RGB in the file. X is ignored when encoding, and set to 255 when decoding.
+		FPNG_PIXEL_FORMAT_RGBX,
+		FPNG_PIXEL_FORMAT_BGRX,
+		FPNG_PIXEL_FORMAT_XRGB,
+		FPNG_PIXEL_FORMAT_XBGR,
+
+		// Can be OR'd into a format with alpha (including FPNG_PIXEL_FORMAT_DEFAULT with 4 channels): the colors in memory are premultiplied by alpha.
+		// PNG's colors aren't, so they're divided by alpha when encoding, and multiplied by it when decoding.
+		FPNG_PIXEL_FORMAT_PREMULTIPLIED = 0x100
 	};
 
 	// Fast PNG encoding. The resulting file can be decoded either using a standard PNG decoder or by the fpng_decode_memory() function below.
-	// pImage: pointer to RGB or RGBA image pixels, R first in memory, B/A last.
-	// w/h - image dimensions. Image's row pitch in bytes must is w*num_chans.
-	// num_chans must be 3 or 4. 
+	// pImage: pointer to grayscale, gray+alpha, RGB or RGBA image pixels, R (or gray) first in memory, B/A last.
+	// w/h - image dimensions. Image's row pitch in bytes must is w*num_chans (times 2 with FPNG_ENCODE_16BIT). See fpng_encode_params for padded rows, row pointers and row callbacks.
+	// num_chans must be 1 (grayscale), 2 (gray+alpha), 3 or 4. 
+	// Each dimension can be up to 2^24, and w*h up to 2^32-1 (the zlib stream must be a bit under 4GB). Use fpng_encoder for larger images. 
+	// zlib streams larger than FPNG_MAX_IDAT_CHUNK_SIZE (1GB) are split into several IDAT chunks.
 	bool fpng_encode_image_to_memory(const void* pImage, uint32_t w, uint32_t h, uint32_t num_chans, std::vector<uint8_t>& out_buf, uint32_t flags = 0);
 
+	// Scratch memory reused across fpng_encode_image_to_memory() calls that point fpng_encode_params::m_pContext at it. Its buffers only ever grow, so once it has encoded an image 
+	// at least as large, encoding to a caller supplied buffer doesn't allocate any memory (except for the std::threads of strip-parallel encoding without m_pDispatch).
+	// A context can't be used by two calls at once, so use one per thread.
+	class fpng_encode_context
+	{
+	public:
+		fpng_encode_context();
+		~fpng_encode_context();
+
+		// Frees the scratch memory.
+		void clear();
+
+		// Internal: returns the scratch memory, which is allocated on first use.
+		struct scratch;
+		scratch* get_scratch();
+
+	private:
+		scratch* m_pScratch;
+
+		fpng_encode_context(const fpng_encode_context&) = delete;
+		fpng_encode_context& operator=(const fpng_encode_context&) = delete;
+	};
+
+	// Extended encoding parameters.
+	struct fpng_encode_params
+	{
+		// FPNG_ENCODE_SLOWER, FPNG_FORCE_UNCOMPRESSED, FPNG_ENCODE_ADAPTIVE_FILTERS, FPNG_ENCODE_LZ_MATCHES, FPNG_ENCODE_16BIT
+		uint32_t m_flags;
+
+		// FPNG_LEVEL_FROM_FLAGS, or a compression level between FPNG_LEVEL_UNCOMPRESSED and FPNG_MAX_LEVEL (higher levels are clamped), which overrides m_flags' compression flags.
+		int m_level;
+
+		// Opt-in strip-parallel encoding. If m_num_threads > 1, the image is cut into up to m_num_threads horizontal strips (of at least FPNG_MIN_STRIP_ROWS rows).
+		// Each strip is filtered and Deflate-coded independently, and the strips are stitched together into a single standard zlib stream.
+		// The output is a little larger than single threaded encoding. fpng_decode_memory() can decode the strips in parallel (see fpng_decode_params).
+		uint32_t m_num_threads;
+
+		// If m_pDispatch is nullptr, fpng spins up (m_num_threads - 1) std::threads per call to help the caller's thread. Otherwise the strips are handed to m_pDispatch.
+		fpng_dispatch_func m_pDispatch;
+		void* m_pDispatch_user_data;
+
+		// Optional scratch memory to reuse, see fpng_encode_context. If nullptr, the scratch memory is allocated and freed by each call.
+		fpng_encode_context* m_pContext;
+
+		// Optional timings and counters of the call, see fpng_encode_stats.
+		fpng_encode_stats* m_pStats;
+
+		// The layout of pImage's pixels, a FPNG_PIXEL_FORMAT_* format (optionally with FPNG_PIXEL_FORMAT_PREMULTIPLIED). Unless it's FPNG_PIXEL_FORMAT_DEFAULT, num_chans must be the
+		// number of channels written to the file (3 for BGR and the X formats, 4 with alpha), the packed row pitch is w times the format's bytes per pixel, and FPNG_ENCODE_16BIT isn't supported.
+		uint32_t m_src_format;
+
+		// The number of bytes from the start of one of pImage's rows to the next (at least a row's size), for padded rows or a sub-rectangle of a larger image. 0 if the rows are packed.
+		size_t m_src_pitch;
+
+		// Optional pointers to the image's h rows, which can be anywhere in memory. If it isn't nullptr, pImage and m_src_pitch are ignored (pImage can be nullptr).
+		const void* const* m_ppSrc_rows;
+
+		// Optional callback which copies the image's rows into fpng's row buffers, e.g. from a tiled framebuffer. If it isn't nullptr, pImage, m_src_pitch and m_ppSrc_rows are ignored.
+		fpng_read_row_func m_pRead_row;
+		void* m_pRead_row_user_data;
+
+		fpng_encode_params() : m_flags(0), m_level(FPNG_LEVEL_FROM_FLAGS), m_num_threads(0), m_pDispatch(nullptr), m_pDispatch_user_data(nullptr), m_pContext(nullptr), m_pStats(nullptr), m_src_format(FPNG_PIXEL_FORMAT_DEFAULT),
+			m_src_pitch(0), m_ppSrc_rows(nullptr), m_pRead_row(nullptr), m_pRead_row_user_data(nullptr) { }
+	};
+
+	const uint32_t FPNG_MIN_STRIP_ROWS = 32;
+
+	bool fpng_encode_image_to_memory(const void* pImage, uint32_t w, uint32_t h, uint32_t num_chans, std::vector<uint8_t>& out_buf, const fpng_encode_params& params);
+
+	// Returns the largest possible size of a file written by fpng_encode_image_to_memory() (for any thread count, and any flags except FPNG_ENCODE_16BIT, which must be passed in flags), or 0 if the parameters are invalid.
+	uint64_t fpng_get_max_encoded_size(uint32_t w, uint32_t h, uint32_t num_chans, uint32_t flags = 0);
+
+	// Encodes to a caller supplied buffer, which is never cleared or zero-filled. Returns the size of the PNG file written to pDst_buf, or 0 on failure.
+	// Encoding can only fail because the buffer is too small if dst_buf_size is less than fpng_get_max_encoded_size().
+	size_t fpng_encode_image_to_memory(const void* pImage, uint32_t w, uint32_t h, uint32_t num_chans, void* pDst_buf, size_t dst_buf_size, const fpng_encode_params& params = fpng_encode_params());
+
 #ifndef FPNG_NO_STDIO
 	// Fast PNG encoding to the specified file.
 	bool fpng_encode_image_to_file(const char* pFilename, const void* pImage, uint32_t w, uint32_t h, uint32_t num_chans, uint32_t flags = 0);
+	bool fpng_encode_image_to_file(const char* pFilename, const void* pImage, uint32_t w, uint32_t h, uint32_t num_chans, const fpng_encode_params& params);
 #endif
 
+	// ---- Mip chains
+
+	// Encodes an image and all of its mip levels (down to 1x1), each into its own PNG file. out_files[0] is the image itself, and out_files[i] is level i.
+	// Each level is half the size of the one above it (rounded down, but at least 1), and each of its pixels is the rounded average of a 2x2 block of the level above.
+	// An odd last row or column is dropped.
+	// The levels are built from the image's rows as the image is compressed, so the image is only read once, and they're all compressed with the same scratch memory.
+	// The levels are in the file's layout whatever params.m_src_format is. With strip-parallel encoding (m_num_threads > 1) the image is read again afterwards to build them.
+	// m_pStats, if any, is summed over the levels. Returns false (with out_files empty) on failure.
+	bool fpng_encode_mip_chain(const void* pImage, uint32_t w, uint32_t h, uint32_t num_chans, std::vector<std::vector<uint8_t>>& out_files, const fpng_encode_params& params = fpng_encode_params());
+
+	// ---- Streaming compression
+
+	// Called with each piece of the output PNG file, in order. Return false to abort encoding.
+	typedef bool (*fpng_write_func)(const void* pData, size_t size, void* pUser_data);
+
+	// Compresses an image that's supplied a few rows at a time, so neither the full image nor the full PNG file ever needs to be in memory. 
+	// The PNG file is handed to the write callback as it's produced, split into multiple IDAT chunks. Only the single pass compressor (with the precomputed Huffman tables) is supported.
+	// There's no limit on w*h (each dimension can be up to 2^24), so this is the way to encode images too large for fpng_encode_image_to_memory().
+	// The output can be decoded by fpng_decode_memory().
+	// Call begin(), then push_rows() until all the image's rows have been pushed, then finish(). All methods return false on failure (including write callback failures), after which begin() must be called again.
+	class fpng_encoder
+	{
+	public:
+		fpng_encoder();
+
+		// num_chans must be 3 or 4. Writes the PNG header.
+		bool begin(uint32_t w, uint32_t h, uint32_t num_chans, fpng_write_func pWrite, void* pWrite_user_data);
+
+		// Compresses the next num_rows rows. pRows points to the first row, and each row begins pitch bytes after the previous one (pitch must be >= w*num_chans).
+		bool push_rows(const void* pRows, uint32_t num_rows, uint32_t pitch);
+
+		// Flushes the remaining compressed data and the IEND chunk. Fails if not all of the image's rows have been pushed.
+		bool finish();
+
+	private:
+		fpng_write_func m_pWrite;
+		void* m_pWrite_user_data;
+
+		uint32_t m_w, m_h, m_num_chans, m_cur_row;
+
+		uint64_t m_bit_buf;
+		int m_bit_buf_size;
+		uint32_t m_adler32;
+
+		std::vector<uint8_t> m_buf;
+		uint32_t m_buf_ofs;
+
+		// CRC-32 of the current IDAT chunk's type and m_buf[0, m_idat_crc32_ofs)
+		uint32_t m_idat_crc32, m_idat_crc32_ofs;
+
+		std::vector<uint8_t> m_prev_row, m_row_buf;
+
+		bool write(const void* pData, size_t size);
+		bool flush_idat();
+		bool fail();
+	};
+
+	// ---- Animated PNG (APNG) compression
+
+	// Compresses an animation a frame at a time. Every frame after the first is compared against the previous one, and only the bounding box of the pixels that changed
+	// is compressed (as an fdAT frame drawn over the previous one), so mostly static sequences like screen or UI captures are much smaller and faster to encode than full frames.
+	// The first frame is also the file's default image, which is what decoders without APNG support (including fpng_decode_memory()) return.
+	// The file is handed to the write callback as it's produced, one frame at a time. Frames are compressed like fpng_encode_image_to_memory() does, except that m_num_threads
+	// is ignored, m_ppSrc_rows and m_pRead_row aren't supported, and the scratch memory (see fpng_encode_context) is kept from one frame to the next. m_pStats, if any, is summed over the frames.
+	// Call begin(), then add_frame() num_frames times, then finish(). All methods return false on failure (including write callback failures), after which begin() must be called again.
+	class fpng_apng_encoder
+	{
+	public:
+		fpng_apng_encoder();
+
+		// w, h and num_chans work like they do for fpng_encode_image_to_memory(), including the w*h < 2^32 limit. num_plays is the number of times the animation is played,
+		// or 0 to loop forever. Writes the PNG header and the acTL chunk.
+		bool begin(uint32_t w, uint32_t h, uint32_t num_chans, uint32_t num_frames, uint32_t num_plays, fpng_write_func pWrite, void* pWrite_user_data, const fpng_encode_params& params = fpng_encode_params());
+
+		// pImage holds the whole frame, laid out like fpng_encode_image_to_memory()'s pImage. The frame is shown for delay_num/delay_den seconds (a delay_den of 0 means 1/100ths).
+		// A frame identical to the previous one is written as a 1x1 frame, since APNG frames can't be empty.
+		bool add_frame(const void* pImage, uint16_t delay_num, uint16_t delay_den);
+
+		// Writes the IEND chunk. Fails if fewer than num_frames frames have been added.
+		bool finish();
+
+	private:
+		fpng_write_func m_pWrite;
+		void* m_pWrite_user_data;
+
+		fpng_encode_params m_params;
+		fpng_encode_context m_context;
+
+		uint32_t m_w, m_h, m_num_chans, m_bpp, m_src_bpp, m_num_frames, m_cur_frame, m_seq_num;
+
+		// The previous frame, in pImage's layout.
+		std::vector<uint8_t> m_prev_frame;
+
+		// The current frame's zlib stream.
+		std::vector<uint8_t> m_buf;
+
+		bool write(const void* pData, size_t size);
+		bool write_chunk(const char* pType, const uint8_t* pData, uint32_t len);
+		bool write_frame_data(uint32_t zlib_len, uint32_t crc32);
+		bool fail();
+	};
+
 	// ---- Decompression
 		
 	enum
@@ -73,7 +413,38 @@ namespace fpng
 		FPNG_DECODE_FILE_OPEN_FAILED,
 		FPNG_DECODE_FILE_TOO_LARGE,
 		FPNG_DECODE_FILE_READ_FAILED,
-		FPNG_DECODE_FILE_SEEK_FAILED
+		FPNG_DECODE_FILE_SEEK_FAILED,
+
+		// fpng_decode_memory_rows() specific errors
+		FPNG_DECODE_CALLBACK_ABORTED,			// the row callback returned false
+
+		FPNG_DECODE_FAILED_CHECKSUM,			// the IDAT CRC32 or the zlib Adler32 check requested by the decode flags failed, file is corrupted
+
+		// fpng_decode_any() specific errors
+		FPNG_DECODE_FALLBACK_FAILED				// the general purpose decoder failed to decode a file not written by fpng
+	};
+
+	// fpng_decode_params flags, which mostly control how much of the file's checksums are verified.
+	// By default the CRC32 of every chunk except IDAT is checked, and the zlib Adler32 isn't. The Deflate data itself is always validated as it's decoded.
+	enum
+	{
+		// Also check the CRC32 of the IDAT chunks. This is a separate pass over the compressed data.
+		FPNG_DECODE_CHECK_IDAT_CRC32 = 1,
+
+		// Check the zlib Adler32 of the decompressed data. It's computed on each row right after it's decoded, not in another pass over the image.
+		FPNG_DECODE_CHECK_ADLER32 = 2,
+
+		// Check every checksum in the file. Recommended for files from untrusted sources.
+		FPNG_DECODE_STRICT = FPNG_DECODE_CHECK_IDAT_CRC32 | FPNG_DECODE_CHECK_ADLER32,
+
+		// Don't check any chunk CRC32's, including the header chunks' (like FPNG_DISABLE_DECODE_CRC32_CHECKS, but per call). The Adler32 is still checked if requested.
+		FPNG_DECODE_SKIP_CRC32 = 4,
+
+		// Don't check any checksums at all, regardless of the other flags. For data that's already protected some other way.
+		FPNG_DECODE_SKIP_ALL_CHECKS = 8,
+
+		// Decode files with 16 bits per channel to native endian uint16_t samples, so the output is twice as large. Without it they're decoded to 8 bits per channel (the high byte of each sample).
+		FPNG_DECODE_16BIT = 16
 	};
 
 	// Fast PNG decoding of files ONLY created by fpng_encode_image_to_memory() or fpng_encode_image_to_file().
@@ -81,36 +452,150 @@ namespace fpng
 	//
 	// fpng_get_info() parses the PNG header and iterates through all chunks to determine if it's a file written by FPNG, but does not decompress the actual image data so it's relatively fast.
 	// 
-	// pImage, image_size: Pointer to PNG image data and its size
+	// pImage, image_size: Pointer to PNG image data and its size, which can be larger than 4GB on 64-bit systems
 	// width, height: output image's dimensions
-	// channels_in_file: will be 3 or 4
+	// channels_in_file: will be 1 (grayscale), 2 (gray+alpha), 3 or 4
+	// bits_per_channel: will be 8 or 16
 	// 
 	// Returns FPNG_DECODE_SUCCESS on success, otherwise one of the failure codes above.
 	// If FPNG_DECODE_NOT_FPNG is returned, you must decompress the file with a general purpose PNG decoder.
 	// If another error occurs, the file is likely corrupted or invalid, but you can still try to decompress the file with another decoder (which will likely fail).
-	int fpng_get_info(const void* pImage, uint32_t image_size, uint32_t& width, uint32_t& height, uint32_t& channels_in_file);
+	int fpng_get_info(const void* pImage, size_t image_size, uint32_t& width, uint32_t& height, uint32_t& channels_in_file);
+	int fpng_get_info(const void* pImage, size_t image_size, uint32_t& width, uint32_t& height, uint32_t& channels_in_file, uint32_t& bits_per_channel);
 
-	// fpng_decode_memory() decompresses 24/32bpp PNG files ONLY encoded by this module.
+	// fpng_decode_memory() decompresses PNG files ONLY encoded by this module.
 	// If the image was written by FPNG, it will decompress the image data, otherwise it will return FPNG_DECODE_NOT_FPNG in which case you should fall back to a general purpose PNG decoder (lodepng, stb_image, libpng, etc.)
 	//
 	// pImage, image_size: Pointer to PNG image data and its size
-	// out: Output 24/32bpp image buffer
+	// out: Output image buffer, with desired_channels 8-bit channels per pixel (files with 16 bits per channel can be decoded to uint16_t channels with FPNG_DECODE_16BIT, see fpng_decode_params)
 	// width, height: output image's dimensions
-	// channels_in_file: will be 3 or 4
-	// desired_channels: must be 3 or 4 
+	// channels_in_file: will be 1 (grayscale), 2 (gray+alpha), 3 or 4
+	// desired_channels: must be 3 or 4, or 1-4 for grayscale and gray+alpha files
 	// 
-	// If the image is 24bpp and 32bpp is requested, the alpha values will be set to 0xFF. 
-	// If the image is 32bpp and 24bpp is requested, the alpha values will be discarded.
+	// If the image has no alpha and alpha is requested, the alpha values will be set to 0xFF (0xFFFF for 16-bit output). 
+	// If the image has alpha and no alpha is requested, the alpha values will be discarded. Grayscale is copied to R, G and B if they are requested.
 	// 
 	// Returns FPNG_DECODE_SUCCESS on success, otherwise one of the failure codes above.
 	// If FPNG_DECODE_NOT_FPNG is returned, you must decompress the file with a general purpose PNG decoder.
 	// If another error occurs, the file is likely corrupted or invalid, but you can still try to decompress the file with another decoder (which will likely fail).
-	int fpng_decode_memory(const void* pImage, uint32_t image_size, std::vector<uint8_t>& out, uint32_t& width, uint32_t& height, uint32_t& channels_in_file, uint32_t desired_channels);
+	int fpng_decode_memory(const void* pImage, size_t image_size, std::vector<uint8_t>& out, uint32_t& width, uint32_t& height, uint32_t& channels_in_file, uint32_t desired_channels);
+
+	// Scratch memory reused across decodes that point fpng_decode_params::m_pContext at it, like fpng_encode_context: once it has decoded an image at least as large, 
+	// decoding to a caller supplied buffer doesn't allocate any memory (except for the std::threads of parallel decoding without m_pDispatch).
+	// It also keeps the last Huffman decoding tables, which are only rebuilt when a file's Huffman codes differ from the previous file's (files written by the single pass compressor 
+	// share a few sets of codes). Use one per thread.
+	class fpng_decode_context
+	{
+	public:
+		fpng_decode_context();
+		~fpng_decode_context();
+
+		// Frees the scratch memory.
+		void clear();
+
+		// Internal: returns the scratch memory, which is allocated on first use.
+		struct scratch;
+		scratch* get_scratch();
+
+	private:
+		scratch* m_pScratch;
+
+		fpng_decode_context(const fpng_decode_context&) = delete;
+		fpng_decode_context& operator=(const fpng_decode_context&) = delete;
+	};
+
+	// Extended decoding parameters.
+	struct fpng_decode_params
+	{
+		// Files written using strip-parallel encoding contain an index of independently decodable strips. If m_num_threads > 1, the strips are decoded on up to m_num_threads threads.
+		// Single block files are always decoded on the caller's thread.
+		uint32_t m_num_threads;
+
+		// If m_pDispatch isn't nullptr, the strips are handed to m_pDispatch instead of fpng's own threads.
+		fpng_dispatch_func m_pDispatch;
+		void* m_pDispatch_user_data;
+
+		// Combination of the FPNG_DECODE_CHECK_IDAT_CRC32 etc. flags above.
+		uint32_t m_flags;
+
+		// Optional scratch memory to reuse, see fpng_decode_context.
+		fpng_decode_context* m_pContext;
+
+		// Optional timings and counters of the call, see fpng_decode_stats.
+		fpng_decode_stats* m_pStats;
+
+		// The layout of the decoded pixels, a FPNG_PIXEL_FORMAT_* format (optionally with FPNG_PIXEL_FORMAT_PREMULTIPLIED). Unless it's FPNG_PIXEL_FORMAT_DEFAULT, desired_channels must be
+		// the format's bytes per pixel (3 for BGR, otherwise 4), and FPNG_DECODE_16BIT returns FPNG_DECODE_INVALID_ARG for files with 16 bits per channel. Grayscale files are expanded to RGB, and formats without alpha drop it.
+		uint32_t m_dst_format;
+
+		fpng_decode_params() : m_num_threads(0), m_pDispatch(nullptr), m_pDispatch_user_data(nullptr), m_flags(0), m_pContext(nullptr), m_pStats(nullptr), m_dst_format(FPNG_PIXEL_FORMAT_DEFAULT) { }
+	};
+
+	int fpng_decode_memory(const void* pImage, size_t image_size, std::vector<uint8_t>& out, uint32_t& width, uint32_t& height, uint32_t& channels_in_file, uint32_t desired_channels, const fpng_decode_params& params);
+
+	// Decodes to a caller supplied buffer (call fpng_get_info() first to get the dimensions), with each row starting dst_pitch bytes after the previous one. A dst_pitch of 0 means width*desired_channels (times 2 for 16-bit output).
+	// The bytes between rows are left untouched. Returns FPNG_DECODE_INVALID_ARG if dst_pitch is smaller than a row, or if dst_buf_size is too small for the image (the last row doesn't need to be padded out to dst_pitch).
+	int fpng_decode_memory(const void* pImage, size_t image_size, void* pDst, size_t dst_buf_size, uint32_t dst_pitch, uint32_t& width, uint32_t& height, uint32_t& channels_in_file, uint32_t desired_channels, const fpng_decode_params& params = fpng_decode_params());
 
 #ifndef FPNG_NO_STDIO
 	int fpng_decode_file(const char* pFilename, std::vector<uint8_t>& out, uint32_t& width, uint32_t& height, uint32_t& channels_in_file, uint32_t desired_channels);
+	int fpng_decode_file(const char* pFilename, std::vector<uint8_t>& out, uint32_t& width, uint32_t& height, uint32_t& channels_in_file, uint32_t desired_channels, const fpng_decode_params& params);
 #endif
 
+	// Called with each band of decoded rows: num_rows rows of width*desired_channels bytes (or 16-bit samples, with FPNG_DECODE_16BIT) each (tightly packed), starting at image row first_row. 
+	// The rows are only valid until the callback returns. Return false to abort decoding.
+	typedef bool (*fpng_decode_rows_func)(const uint8_t* pRows, uint32_t first_row, uint32_t num_rows, void* pUser_data);
+
+	// fpng_decode_memory_rows() is like fpng_decode_memory(), except the image is decoded into a small band buffer of rows_per_callback rows, which is passed to pCallback each time it fills up (the final band may be shorter).
+	// The full decoded image is never in memory. Strip-parallel files are decoded in order on the caller's thread.
+	// Errors in the compressed data can be detected after some rows were already passed to the callback. Returns FPNG_DECODE_CALLBACK_ABORTED if the callback returned false.
+	// Only params.m_flags, m_pContext and m_pStats are used. An Adler32 mismatch is only detected after all the rows were passed to the callback.
+	int fpng_decode_memory_rows(const void* pImage, size_t image_size, uint32_t rows_per_callback, fpng_decode_rows_func pCallback, void* pCallback_user_data, uint32_t& width, uint32_t& height, uint32_t& channels_in_file, uint32_t desired_channels, 
+		const fpng_decode_params& params = fpng_decode_params());
+
+	const uint32_t FPNG_DECODE_MAX_SCALE_SHIFT = 3;
+
+	// fpng_decode_memory_region() decodes rows [first_row, end_row) of the image (end_row is clamped to the height), box filtered down by 1 << scale_shift in both directions 
+	// (scale_shift 0 to FPNG_DECODE_MAX_SCALE_SHIFT: full size, 1/2, 1/4 or 1/8), to a caller supplied buffer (call fpng_get_info() first to get the dimensions).
+	// The output is (width + (1 << scale_shift) - 1) >> scale_shift pixels wide and (end_row - first_row + (1 << scale_shift) - 1) >> scale_shift rows high, with each row dst_pitch bytes after the 
+	// previous one (0 means tightly packed). The blocks start at first_row, and the blocks along the right and bottom edges average the pixels they have.
+	// Only a band of rows and one row of sums are kept, like fpng_decode_memory_rows(). Strips of files with a strip index before the one holding first_row are skipped, 
+	// and decoding stops after row end_row-1. The Adler32 (see FPNG_DECODE_CHECK_ADLER32) is only checked if the whole image is decoded.
+	// Only params.m_flags, m_pContext and m_pStats are used. width and height are the file's dimensions.
+	int fpng_decode_memory_region(const void* pImage, size_t image_size, uint32_t first_row, uint32_t end_row, uint32_t scale_shift, void* pDst, size_t dst_buf_size, uint32_t dst_pitch, 
+		uint32_t& width, uint32_t& height, uint32_t& channels_in_file, uint32_t desired_channels, const fpng_decode_params& params = fpng_decode_params());
+
+	// The header of any PNG file, from fpng_decode_any()'s chunk scan. It's passed to the general purpose decoder, so it doesn't need to parse the file again to size its output.
+	struct fpng_png_info
+	{
+		uint32_t m_width, m_height;
+
+		// The IHDR chunk's fields.
+		uint32_t m_bit_depth, m_color_type, m_interlace_method;
+
+		// The number of channels, from 1 to 4, factoring in tRNS transparency.
+		uint32_t m_num_chans;
+
+		// True if the scan already checked the CRC32 of every chunk, including the IDAT chunks (or params.m_flags asked to skip them), so the general purpose decoder doesn't need to.
+		bool m_chunks_checked;
+	};
+
+	// Decodes a PNG file that fpng can't into pDst, with width*desired_channels bytes per row and rows dst_pitch bytes apart. Returns false on any errors.
+	typedef bool (*fpng_fallback_decode_func)(const void* pImage, size_t image_size, const fpng_png_info& info, uint8_t* pDst, uint32_t dst_pitch, uint32_t desired_channels, void* pUser_data);
+
+	// fpng_decode_any() decodes any PNG file with a single chunk scan. Files written by fpng are decoded by fpng's decompressor. Everything else, including fpng files that turn out to break fpng's constraints
+	// after the scan (which would return FPNG_DECODE_NOT_FPNG), is passed to pFallback along with the scan's results and the same destination buffer (fpng_test.cpp wraps pv_png::load_png_to() from pvpngreader.cpp).
+	// Unlike fpng_decode_memory(), the output always has 8 bits per channel, and desired_channels can be 1 to 4 for any file. Files with 16 bits per channel, or written by fpng but with 3 or 4 channels 
+	// and decoded to 1 or 2 channels, go to pFallback.
+	// channels_in_file is the number of channels from 1 to 4, factoring in tRNS transparency (like pv_png::load_png()).
+	// width, height and channels_in_file are set even if FPNG_DECODE_INVALID_ARG is returned because dst_buf_size was too small, so the caller can grow its buffer.
+	// Returns FPNG_DECODE_FALLBACK_FAILED if pFallback returned false.
+	int fpng_decode_any(const void* pImage, size_t image_size, void* pDst, size_t dst_buf_size, uint32_t dst_pitch, uint32_t& width, uint32_t& height, uint32_t& channels_in_file, uint32_t desired_channels, 
+		fpng_fallback_decode_func pFallback, void* pFallback_user_data, const fpng_decode_params& params = fpng_decode_params());
+
+	int fpng_decode_any(const void* pImage, size_t image_size, std::vector<uint8_t>& out, uint32_t& width, uint32_t& height, uint32_t& channels_in_file, uint32_t desired_channels, 
+		fpng_fallback_decode_func pFallback, void* pFallback_user_data, const fpng_decode_params& params = fpng_decode_params());
+
 	// ---- Internal API used for Huffman table training purposes
 
 #if FPNG_TRAIN_HUFFMAN_TABLES
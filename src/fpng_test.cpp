@@ -4,11 +4,26 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <string.h>
+#include <math.h>
+#include <ctype.h>
+#include <atomic>
+#include <new>
+#include <string>
+#include <algorithm>
+#include <thread>
 
 #if defined(_WIN32)
 // For QueryPerformanceCounter/QueryPerformanceFrequency
 #define WIN32_LEAN_AND_MEAN
 #include <windows.h>
+#else
+// For listing the .png files in a directory
+#include <dirent.h>
+// For testing fpng_encode_image_to_file() with symlinks, file permissions and a file size limit
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <signal.h>
+#include <unistd.h>
 #endif
 
 #include "fpng.h"
@@ -32,6 +47,35 @@
 
 typedef std::vector<uint8_t> uint8_vec;
 
+// Set to 1 to count the heap allocations made through operator new, to check that reused encode/decode contexts don't allocate. Off by default, because replacing operator new
+// slows down every allocation in the program, including those of the codecs fpng is compared against.
+#ifndef FPNG_TEST_COUNT_ALLOCS
+#define FPNG_TEST_COUNT_ALLOCS (0)
+#endif
+
+#if FPNG_TEST_COUNT_ALLOCS
+static std::atomic<uint64_t> g_num_allocs;
+
+// Not inlined, so the compiler doesn't see malloc() paired with delete, or new paired with free() (-Wmismatched-new-delete).
+#ifdef _MSC_VER
+#define FPNG_TEST_NOINLINE __declspec(noinline)
+#else
+#define FPNG_TEST_NOINLINE __attribute__((noinline))
+#endif
+
+FPNG_TEST_NOINLINE void* operator new(size_t size)
+{
+	g_num_allocs++;
+	void* p = malloc(size ? size : 1);
+	if (!p)
+		throw std::bad_alloc();
+	return p;
+}
+
+FPNG_TEST_NOINLINE void operator delete(void* p) noexcept { free(p); }
+FPNG_TEST_NOINLINE void operator delete(void* p, size_t) noexcept { free(p); }
+#endif
+
 typedef uint64_t timer_ticks;
 
 template <typename S> static inline S maximum(S a, S b) { return (a > b) ? a : b; }
@@ -764,6 +808,52 @@ static void* wuffs_decode(void* pData, size_t data_len, uint32_t &width, uint32_
 }
 
 #if FPNG_TRAIN_HUFFMAN_TABLES
+// Prints a one pass Huffman table preset for fpng.cpp, trained on the given symbol frequencies.
+static bool print_huff_preset(uint64_t* pFreq, uint32_t num_chans, const char* pName)
+{
+	std::vector<uint8_t> dyn_prefix;
+	uint64_t bit_buf = 0;
+	int bit_buf_size = 0;
+	uint32_t codes[fpng::HUFF_COUNTS_SIZE];
+	uint8_t codesizes[fpng::HUFF_COUNTS_SIZE];
+
+	if (!fpng::create_dynamic_block_prefix(pFreq, num_chans, dyn_prefix, bit_buf, bit_buf_size, codes, codesizes))
+	{
+		fprintf(stderr, "fpng::create_dynamic_block_prefix() failed!\n");
+		return false;
+	}
+
+	std::string upper_name(pName);
+	for (char& c : upper_name)
+		c = (char)toupper((uint8_t)c);
+
+	printf("\n");
+	printf("static const uint8_t g_dyn_huff_%u_%s[] = {\n", num_chans, pName);
+	for (uint32_t i = 0; i < dyn_prefix.size(); i++)
+	{
+		printf("%u%c ", dyn_prefix[i], (i != (dyn_prefix.size() - 1)) ? ',' : ' ');
+		if ((i & 31) == 31)
+			printf("\n");
+	}
+	printf("};\n");
+	printf("const uint32_t DYN_HUFF_%u_%s_BITBUF = %u, DYN_HUFF_%u_%s_BITBUF_SIZE = %u;\n", num_chans, upper_name.c_str(), (uint32_t)bit_buf, num_chans, upper_name.c_str(), (uint32_t)bit_buf_size);
+
+	printf("static const defl_huff_code g_dyn_huff_%u_%s_codes[288] = {\n", num_chans, pName);
+	for (uint32_t i = 0; i < fpng::HUFF_COUNTS_SIZE; i++)
+	{
+		printf("{%u,%u}%c", codesizes[i], codes[i], (i != (fpng::HUFF_COUNTS_SIZE - 1)) ? ',' : ' ');
+		if ((i & 31) == 31)
+			printf("\n");
+	}
+	printf("};\n");
+
+	printf("\n// g_dyn_huff_%u_presets[] entry:\n", num_chans);
+	printf("{ g_dyn_huff_%u_%s, sizeof(g_dyn_huff_%u_%s), DYN_HUFF_%u_%s_BITBUF, DYN_HUFF_%u_%s_BITBUF_SIZE, g_dyn_huff_%u_%s_codes },\n",
+		num_chans, pName, num_chans, pName, num_chans, upper_name.c_str(), num_chans, upper_name.c_str(), num_chans, pName);
+
+	return true;
+}
+
 static int training_mode(const char* pFilename)
 {
 	if (pFilename[0] != '@')
@@ -888,76 +978,18 @@ static int training_mode(const char* pFilename)
 		return EXIT_FAILURE;
 	}
 
-	if (total_opaque_files)
-	{
-		std::vector<uint8_t> dyn_prefix;
-		uint64_t bit_buf = 0;
-		int bit_buf_size = 0;
-		uint32_t codes[fpng::HUFF_COUNTS_SIZE];
-		uint8_t codesizes[fpng::HUFF_COUNTS_SIZE];
-		
-		bool status = fpng::create_dynamic_block_prefix(opaque_freq, 3, dyn_prefix, bit_buf, bit_buf_size, codes, codesizes);
-		if (!status)
-		{
-			fprintf(stderr, "fpng::create_dynamic_block_prefix() failed!\n");
-			return EXIT_FAILURE;
-		}
-
-		printf("\n");
-		printf("static const uint8_t g_dyn_huff_3[] = {\n");
-		for (uint32_t i = 0; i < dyn_prefix.size(); i++) 
-		{ 
-			printf("%u%c ", dyn_prefix[i], (i != (dyn_prefix.size() - 1)) ? ',' : ' '); 
-			if ((i & 31) == 31) 
-				printf("\n"); 
-		}
-		printf("};\n");
-		printf("const uint32_t DYN_HUFF_3_BITBUF = %u, DYN_HUFF_3_BITBUF_SIZE = %u;\n", (uint32_t)bit_buf, (uint32_t)bit_buf_size);
-
-		printf("static const struct { uint8_t m_code_size; uint16_t m_code; } g_dyn_huff_3_codes[288] = {\n");
-		for (uint32_t i = 0; i < fpng::HUFF_COUNTS_SIZE; i++)
-		{
-			printf("{%u,%u}%c", codesizes[i], codes[i], (i != (fpng::HUFF_COUNTS_SIZE - 1)) ? ',' : ' ');
-			if ((i & 31) == 31)
-				printf("\n");
-		}
-		printf("};\n");
-	}
-
-	if (total_alpha_files)
-	{
-		std::vector<uint8_t> dyn_prefix;
-		uint64_t bit_buf = 0;
-		int bit_buf_size = 0;
-		uint32_t codes[fpng::HUFF_COUNTS_SIZE];
-		uint8_t codesizes[fpng::HUFF_COUNTS_SIZE];
-		bool status = fpng::create_dynamic_block_prefix(alpha_freq, 4, dyn_prefix, bit_buf, bit_buf_size, codes, codesizes);
-		if (!status)
-		{
-			fprintf(stderr, "fpng::create_dynamic_block_prefix() failed!\n");
-			return EXIT_FAILURE;
-		}
+	// Name the tables after the listing file, e.g. @screenshots.txt -> g_dyn_huff_3_screenshots.
+	std::string preset_name(pFilename + 1);
+	if (preset_name.find_last_of("/\\") != std::string::npos)
+		preset_name = preset_name.substr(preset_name.find_last_of("/\\") + 1);
+	if (preset_name.find_last_of('.') != std::string::npos)
+		preset_name = preset_name.substr(0, preset_name.find_last_of('.'));
 
-		printf("\n");
-		printf("static const uint8_t g_dyn_huff_4[] = {\n");
-		for (uint32_t i = 0; i < dyn_prefix.size(); i++)
-		{
-			printf("%u%c ", dyn_prefix[i], (i != (dyn_prefix.size() - 1)) ? ',' : ' ');
-			if ((i & 31) == 31)
-				printf("\n");
-		}
-		printf("};\n");
-		printf("const uint32_t DYN_HUFF_4_BITBUF = %u, DYN_HUFF_4_BITBUF_SIZE = %u;\n", (uint32_t)bit_buf, (uint32_t)bit_buf_size);
+	if ((total_opaque_files) && (!print_huff_preset(opaque_freq, 3, preset_name.c_str())))
+		return EXIT_FAILURE;
 
-		printf("static const struct { uint8_t m_code_size; uint16_t m_code; } g_dyn_huff_4_codes[288] = {\n");
-		for (uint32_t i = 0; i < fpng::HUFF_COUNTS_SIZE; i++)
-		{
-			printf("{%u,%u}%c", codesizes[i], codes[i], (i != (fpng::HUFF_COUNTS_SIZE - 1)) ? ',' : ' ');
-			if ((i & 31) == 31)
-				printf("\n");
-		}
-		printf("};\n");
-	}
+	if ((total_alpha_files) && (!print_huff_preset(alpha_freq, 4, preset_name.c_str())))
+		return EXIT_FAILURE;
 
 	return EXIT_SUCCESS;
 }
@@ -972,157 +1004,2742 @@ static int training_mode(const char* pFilename)
 }
 #endif
 
-int main(int arg_c, char **arg_v)
+// Benchmark mode (-b)
+
+// A corpus image, with the fpng and QOI files the decoders are timed on.
+struct bench_image
 {
-	fpng::fpng_init();
-	
-	if (arg_c < 2)
-	{
-		printf("Usage: fpng_test [filename.png] <alpha_filename.png>\n");
-		printf("Loads image and compresses it with fpng, lodepng, stb_image_write and QOI. Wrotes fpng.png, lodepng.png, stbi.png, and qoi.qoi.\n");
-		printf("Also decompresses the FPNG compressed file with several decompressors (lodepng, stb_image and fpng) and validates the decompressed data against the original source image.\n");
-		printf("\nOptions:\n");
-		printf("-s: 2 pass compression\n");
-		printf("-u: Use uncompressed Deflate blocks\n");
-		printf("-c: Write comma seperated values to stdout\n");
-		printf("-e: Fuzz encoder/decoder by randomly modifying an input image's pixels\n");
-		printf("-f: Decompress specified PNG image using FPNG, then exit\n");
-		printf("-a: Swizzle input image's green to alpha, for testing 32bpp correlation alpha\n");
-		printf("-t: Train Huffman tables on @filelist.txt (must compile with FPNG_TRAIN_HUFFMAN_TABLES=1)\n");
-		return EXIT_FAILURE;
-	}
+	std::string m_filename;
+	uint32_t m_w, m_h, m_chans;
+	uint8_vec m_pixels; // m_chans per pixel
+	uint8_vec m_fpng_file, m_qoi_file;
+};
 
-	const char* pFilename = nullptr;
-	const char* pAlpha_filename = nullptr;
-	bool csv_flag = false;
-	bool slower_encoding = false;
-	bool force_uncompressed = false;
-	bool fuzz_encoder = false;
-	bool fuzz_encoder2 = false;
-	bool fuzz_decoder = false;
-	bool swizzle_green_to_alpha = false;
-	bool training_mode_flag = false;
+// Encodes or decodes img once. pBuf is scratch memory owned by the calling thread, reused across calls.
+typedef bool (*bench_func)(const bench_image& img, uint8_vec& buf);
 
-	for (int i = 1; i < arg_c; i++)
-	{
-		const char* pArg = arg_v[i];
-		if (pArg[0] == '-')
-		{
-			if (pArg[1] == 'u')
-			{
-				force_uncompressed = true;
-			}
-			else if (pArg[1] == 's')
-			{
-				slower_encoding = true;
-			}
-			else if (pArg[1] == 'c')
-			{
-				csv_flag = true;
-			}
-			else if (pArg[1] == 'e')
-			{
-				fuzz_encoder = true;
-			}
-			else if (pArg[1] == 'E')
-			{
-				fuzz_encoder2 = true;
-			}
-			else if (pArg[1] == 'f')
-			{
-				fuzz_decoder = true;
-			}
-			else if (pArg[1] == 'a')
-			{
-				swizzle_green_to_alpha = true;
-			}
-			else if (pArg[1] == 't')
-			{
-				training_mode_flag = true;
-			}
-			else
-			{
-				fprintf(stderr, "Unrecognized option: %s\n", pArg);
-				return EXIT_FAILURE;
-			}
-		}
-		else
-		{
-			if ((pFilename) && (pAlpha_filename))
-			{
-				fprintf(stderr, "Too many filenames\n");
-				return EXIT_FAILURE;
-			}
-			
-			if (pFilename)
-				pAlpha_filename = pArg;
-			else
-				pFilename = pArg;
-		}
-	}
+static bool bench_fpng_encode(const bench_image& img, uint8_vec& buf) { return fpng::fpng_encode_image_to_memory(img.m_pixels.data(), img.m_w, img.m_h, img.m_chans, buf); }
+static bool bench_fpng_2pass_encode(const bench_image& img, uint8_vec& buf) { return fpng::fpng_encode_image_to_memory(img.m_pixels.data(), img.m_w, img.m_h, img.m_chans, buf, fpng::FPNG_ENCODE_SLOWER); }
 
-	uint32_t fpng_flags = 0;
-	if (slower_encoding)
-		fpng_flags |= fpng::FPNG_ENCODE_SLOWER;
-	if (force_uncompressed)
-		fpng_flags |= fpng::FPNG_FORCE_UNCOMPRESSED;
+static bool bench_lodepng_encode(const bench_image& img, uint8_vec& buf)
+{
+	buf.resize(0);
+	return lodepng::encode(buf, img.m_pixels.data(), img.m_w, img.m_h, (img.m_chans == 4) ? LCT_RGBA : LCT_RGB, 8) == 0;
+}
 
-	if (fuzz_encoder2)
-		return fuzz_test_encoder2(fpng_flags);
+static bool bench_stbi_encode(const bench_image& img, uint8_vec& buf)
+{
+	buf.resize(0);
+	return stbi_write_png_to_func(write_func_stbi, &buf, img.m_w, img.m_h, img.m_chans, img.m_pixels.data(), img.m_w * img.m_chans) != 0;
+}
 
-	if (training_mode_flag)
-		return training_mode(pFilename);
+static bool bench_qoi_encode(const bench_image& img, uint8_vec& buf)
+{
+	(void)buf;
+
+	qoi_desc desc;
+	desc.channels = (unsigned char)img.m_chans;
+	desc.width = img.m_w;
+	desc.height = img.m_h;
+	desc.colorspace = QOI_SRGB;
+
+	int len = 0;
+	void* p = qoi_encode(img.m_pixels.data(), &desc, &len);
+	free(p);
+	return p != nullptr;
+}
 
-	if (!csv_flag)
+static bool bench_fpng_decode(const bench_image& img, uint8_vec& buf)
+{
+	uint32_t w, h, chans;
+	return fpng::fpng_decode_memory(img.m_fpng_file.data(), (uint32_t)img.m_fpng_file.size(), buf, w, h, chans, img.m_chans) == fpng::FPNG_DECODE_SUCCESS;
+}
+
+static bool bench_lodepng_decode(const bench_image& img, uint8_vec& buf)
+{
+	(void)buf;
+
+	uint32_t w, h;
+	uint8_t* p = nullptr;
+	unsigned error = lodepng_decode_memory(&p, &w, &h, img.m_fpng_file.data(), img.m_fpng_file.size(), (img.m_chans == 4) ? LCT_RGBA : LCT_RGB, 8);
+	free(p);
+	return error == 0;
+}
+
+static bool bench_stbi_decode(const bench_image& img, uint8_vec& buf)
+{
+	(void)buf;
+
+	int x, y, c;
+	void* p = stbi_load_from_memory(img.m_fpng_file.data(), (int)img.m_fpng_file.size(), &x, &y, &c, img.m_chans);
+	free(p);
+	return p != nullptr;
+}
+
+static bool bench_wuffs_decode(const bench_image& img, uint8_vec& buf)
+{
+	(void)buf;
+
+	uint32_t w, h;
+	void* p = wuffs_decode((void*)img.m_fpng_file.data(), img.m_fpng_file.size(), w, h);
+	free(p);
+	return p != nullptr;
+}
+
+static bool bench_pvpng_decode(const bench_image& img, uint8_vec& buf)
+{
+	(void)buf;
+
+	uint32_t w, h, chans;
+	void* p = pv_png::load_png(img.m_fpng_file.data(), img.m_fpng_file.size(), img.m_chans, w, h, chans);
+	free(p);
+	return p != nullptr;
+}
+
+static bool bench_qoi_decode(const bench_image& img, uint8_vec& buf)
+{
+	(void)buf;
+
+	qoi_desc desc;
+	void* p = qoi_decode(img.m_qoi_file.data(), (int)img.m_qoi_file.size(), &desc, img.m_chans);
+	free(p);
+	return p != nullptr;
+}
+
+struct bench_stage
+{
+	const char* m_pCodec;
+	const char* m_pStage;
+	bench_func m_pFunc;
+};
+
+static const bench_stage s_bench_stages[] =
+{
+	{ "fpng", "encode", bench_fpng_encode },
+	{ "fpng_2pass", "encode", bench_fpng_2pass_encode },
+	{ "lodepng", "encode", bench_lodepng_encode },
+	{ "stbi", "encode", bench_stbi_encode },
+	{ "qoi", "encode", bench_qoi_encode },
+	{ "fpng", "decode", bench_fpng_decode },
+	{ "lodepng", "decode", bench_lodepng_decode },
+	{ "stbi", "decode", bench_stbi_decode },
+	{ "wuffs", "decode", bench_wuffs_decode },
+	{ "pvpng", "decode", bench_pvpng_decode },
+	{ "qoi", "decode", bench_qoi_decode },
+};
+
+const uint32_t NUM_BENCH_STAGES = sizeof(s_bench_stages) / sizeof(s_bench_stages[0]);
+
+struct bench_result
+{
+	double m_median_ms, m_p95_ms, m_p99_ms;
+	double m_mpix_per_sec;
+	double m_mt_mpix_per_sec; // 0 if the throughput wasn't measured
+};
+
+// Nearest-rank percentile of sorted samples.
+static double get_percentile(const std::vector<double>& sorted, double p)
+{
+	size_t i = (size_t)ceil(p * sorted.size());
+	return sorted[minimum<size_t>(maximum<size_t>(i, 1), sorted.size()) - 1];
+}
+
+static bool ends_with_png(const std::string& s)
+{
+	if (s.size() < 4)
+		return false;
+
+	std::string ext(s.substr(s.size() - 4));
+	for (auto& c : ext)
+		c = (char)tolower(c);
+	return ext == ".png";
+}
+
+// Adds the .png files in a directory (not recursively) to filenames, sorted by name.
+static bool list_directory_pngs(const char* pPath, std::vector<std::string>& filenames)
+{
+	std::vector<std::string> found;
+
+#ifdef _WIN32
+	WIN32_FIND_DATAA find_data;
+	HANDLE hFind = FindFirstFileA((std::string(pPath) + "\\*").c_str(), &find_data);
+	if (hFind == INVALID_HANDLE_VALUE)
+		return false;
+
+	do
 	{
-		printf("SSE 4.1 supported: %u\n", fpng::fpng_cpu_supports_sse41());
+		if ((!(find_data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)) && (ends_with_png(find_data.cFileName)))
+			found.push_back(std::string(pPath) + "\\" + find_data.cFileName);
+	} while (FindNextFileA(hFind, &find_data));
 
-		printf("Filename: %s\n", pFilename);
-		if (pAlpha_filename)
-			printf("Alpha filename: %s\n", pFilename);
+	FindClose(hFind);
+#else
+	DIR* pDir = opendir(pPath);
+	if (!pDir)
+		return false;
+
+	while (struct dirent* pEntry = readdir(pDir))
+	{
+		if (ends_with_png(pEntry->d_name))
+			found.push_back(std::string(pPath) + "/" + pEntry->d_name);
 	}
 
-	uint8_vec source_file_data;
-	if (!read_file_to_vec(pFilename, source_file_data))
+	closedir(pDir);
+#endif
+
+	std::sort(found.begin(), found.end());
+	filenames.insert(filenames.end(), found.begin(), found.end());
+	return true;
+}
+
+static bool load_bench_image(const std::string& filename, bench_image& img)
+{
+	uint8_vec file_data;
+	if (!read_file_to_vec(filename.c_str(), file_data))
 	{
-		fprintf(stderr, "Failed reading source file data \"%s\"\n", pFilename);
-		return EXIT_FAILURE;
+		fprintf(stderr, "Failed reading source file data \"%s\"\n", filename.c_str());
+		return false;
 	}
 
-	if (fuzz_decoder)
+	uint8_t* pPixels32 = nullptr;
+	if (lodepng_decode_memory(&pPixels32, &img.m_w, &img.m_h, file_data.data(), file_data.size(), LCT_RGBA, 8) != 0)
 	{
-		std::vector<uint8_t> fpngd_decode_buffer;
-		uint32_t channels_in_file;
-		uint32_t decoded_width, decoded_height;
+		fprintf(stderr, "Failed unpacking source file \"%s\"\n", filename.c_str());
+		return false;
+	}
 
-		int res = fpng::fpng_decode_memory(source_file_data.data(), (uint32_t)source_file_data.size(), fpngd_decode_buffer, decoded_width, decoded_height, channels_in_file, 3);
-		if (res != 0)
-		{
-			fprintf(stderr, "fpng::fpng_decode() failed with error %i!\n", res);
-			return EXIT_FAILURE;
-		}
+	const size_t total_pixels = (size_t)img.m_w * img.m_h;
 
-		if (lodepng_encode_file("out.png", fpngd_decode_buffer.data(), decoded_width, decoded_height, (channels_in_file == 4) ? LCT_RGBA : LCT_RGB, 8) != 0)
+	img.m_chans = 3;
+	for (size_t i = 0; i < total_pixels; i++)
+	{
+		if (pPixels32[i * 4 + 3] < 255)
 		{
-			fprintf(stderr, "lodepng_encode_file() failed with error %i!\n", res);
-			return EXIT_FAILURE;
+			img.m_chans = 4;
+			break;
 		}
+	}
 
-		printf("Wrote out.png %ux%u %u\n", decoded_width, decoded_height, channels_in_file);
+	img.m_filename = filename;
+	img.m_pixels.resize(total_pixels * img.m_chans);
+	for (size_t i = 0; i < total_pixels; i++)
+		memcpy(&img.m_pixels[i * img.m_chans], pPixels32 + i * 4, img.m_chans);
+	free(pPixels32);
 
-		return EXIT_SUCCESS;
-	}
-		
-	uint32_t source_width = 0, source_height = 0;
-	uint8_t* pSource_image_buffer = nullptr;
-	unsigned error = lodepng_decode_memory(&pSource_image_buffer, &source_width, &source_height, source_file_data.data(), source_file_data.size(), LCT_RGBA, 8);
-	if (error != 0)
+	if (!fpng::fpng_encode_image_to_memory(img.m_pixels.data(), img.m_w, img.m_h, img.m_chans, img.m_fpng_file))
 	{
-		fprintf(stderr, "Failed unpacking source file \"%s\"\n", pFilename);
-		return EXIT_FAILURE;
+		fprintf(stderr, "fpng_encode_image_to_memory() failed on \"%s\"\n", filename.c_str());
+		return false;
 	}
 
-	if (pAlpha_filename)
+	qoi_desc desc;
+	desc.channels = (unsigned char)img.m_chans;
+	desc.width = img.m_w;
+	desc.height = img.m_h;
+	desc.colorspace = QOI_SRGB;
+
+	int qoi_len = 0;
+	void* pQOI_data = qoi_encode(img.m_pixels.data(), &desc, &qoi_len);
+	if (!pQOI_data)
+	{
+		fprintf(stderr, "qoi_encode() failed on \"%s\"\n", filename.c_str());
+		return false;
+	}
+	img.m_qoi_file.assign((const uint8_t*)pQOI_data, (const uint8_t*)pQOI_data + qoi_len);
+	free(pQOI_data);
+
+	return true;
+}
+
+// Writes s as a JSON string.
+static void write_json_string(FILE* pFile, const std::string& s)
+{
+	fputc('"', pFile);
+	for (char c : s)
+	{
+		if ((c == '"') || (c == '\\'))
+			fprintf(pFile, "\\%c", c);
+		else if ((uint8_t)c < 32)
+			fprintf(pFile, "\\u%04x", (uint8_t)c);
+		else
+			fputc(c, pFile);
+	}
+	fputc('"', pFile);
+}
+
+static bool write_bench_json(const char* pFilename, const std::vector<bench_image>& images, uint32_t iterations, uint32_t num_threads, const bench_result* pResults)
+{
+	FILE* pFile = fopen(pFilename, "w");
+	if (!pFile)
+	{
+		fprintf(stderr, "Failed creating file \"%s\"\n", pFilename);
+		return false;
+	}
+
+	fprintf(pFile, "{\n");
+	fprintf(pFile, "  \"sse41\": %s,\n  \"avx2\": %s,\n", fpng::fpng_cpu_supports_sse41() ? "true" : "false", fpng::fpng_cpu_supports_avx2() ? "true" : "false");
+	fprintf(pFile, "  \"iterations\": %u,\n  \"threads\": %u,\n", iterations, num_threads);
+
+	fprintf(pFile, "  \"images\": [\n");
+	for (size_t i = 0; i < images.size(); i++)
+	{
+		const bench_image& img = images[i];
+		fprintf(pFile, "    { \"filename\": ");
+		write_json_string(pFile, img.m_filename);
+		fprintf(pFile, ", \"width\": %u, \"height\": %u, \"channels\": %u, \"fpng_bytes\": %u, \"qoi_bytes\": %u }%s\n",
+			img.m_w, img.m_h, img.m_chans, (uint32_t)img.m_fpng_file.size(), (uint32_t)img.m_qoi_file.size(), (i + 1 < images.size()) ? "," : "");
+	}
+	fprintf(pFile, "  ],\n");
+
+	fprintf(pFile, "  \"results\": [\n");
+	for (uint32_t i = 0; i < NUM_BENCH_STAGES; i++)
+	{
+		const bench_result& r = pResults[i];
+		fprintf(pFile, "    { \"codec\": \"%s\", \"stage\": \"%s\", \"median_ms\": %.6f, \"p95_ms\": %.6f, \"p99_ms\": %.6f, \"mpix_per_sec\": %.3f",
+			s_bench_stages[i].m_pCodec, s_bench_stages[i].m_pStage, r.m_median_ms, r.m_p95_ms, r.m_p99_ms, r.m_mpix_per_sec);
+		if (num_threads > 1)
+			fprintf(pFile, ", \"mt_mpix_per_sec\": %.3f", r.m_mt_mpix_per_sec);
+		fprintf(pFile, " }%s\n", (i + 1 < NUM_BENCH_STAGES) ? "," : "");
+	}
+	fprintf(pFile, "  ]\n}\n");
+
+	return fclose(pFile) != EOF;
+}
+
+// Times each codec's encoder and decoder on a corpus: pPath is a .png file, a directory of .png files, or an @listing file. After a warm up run, each image is
+// encoded/decoded iterations times and every call is timed, giving median/p95/p99 latencies, and MP/sec over the whole corpus. If num_threads > 1, the
+// throughput with num_threads threads each encoding/decoding whole images is also measured. Results can also be written as JSON.
+static int benchmark_mode(const char* pPath, uint32_t iterations, uint32_t num_threads, const char* pJSON_filename)
+{
+	std::vector<std::string> filenames;
+	if (pPath[0] == '@')
+	{
+		if (!load_listing_file(pPath, filenames))
+			return EXIT_FAILURE;
+	}
+	else if (!list_directory_pngs(pPath, filenames))
+		filenames.push_back(pPath);
+
+	std::vector<bench_image> images(filenames.size());
+	double total_mpix = 0.0f;
+	for (size_t i = 0; i < filenames.size(); i++)
+	{
+		if (!load_bench_image(filenames[i], images[i]))
+			return EXIT_FAILURE;
+		total_mpix += (double)images[i].m_w * images[i].m_h / (1024.0f * 1024.0f);
+	}
+
+	if (images.empty())
+	{
+		fprintf(stderr, "No images to benchmark\n");
+		return EXIT_FAILURE;
+	}
+
+	printf("Benchmarking %u image(s), %4.3f MP, %u iterations\n", (uint32_t)images.size(), total_mpix, iterations);
+	printf("%-11s %-7s %12s %12s %12s %12s", "codec", "stage", "median ms", "p95 ms", "p99 ms", "MP/sec");
+	if (num_threads > 1)
+		printf(" %9s MP/sec", (std::to_string(num_threads) + " thread").c_str());
+	printf("\n");
+
+	bench_result results[NUM_BENCH_STAGES];
+	interval_timer tm;
+	uint8_vec buf;
+
+	for (uint32_t s = 0; s < NUM_BENCH_STAGES; s++)
+	{
+		const bench_stage& stage = s_bench_stages[s];
+		bench_result& r = results[s];
+
+		std::vector<double> times;
+		times.reserve(images.size() * iterations);
+		double total_secs = 0.0f;
+
+		for (const bench_image& img : images)
+		{
+			// Warm up
+			if (!stage.m_pFunc(img, buf))
+			{
+				fprintf(stderr, "%s %s failed on \"%s\"\n", stage.m_pCodec, stage.m_pStage, img.m_filename.c_str());
+				return EXIT_FAILURE;
+			}
+
+			for (uint32_t i = 0; i < iterations; i++)
+			{
+				tm.start();
+				stage.m_pFunc(img, buf);
+				const double secs = tm.get_elapsed_secs();
+
+				times.push_back(secs * 1000.0f);
+				total_secs += secs;
+			}
+		}
+
+		std::sort(times.begin(), times.end());
+		r.m_median_ms = get_percentile(times, .5f);
+		r.m_p95_ms = get_percentile(times, .95f);
+		r.m_p99_ms = get_percentile(times, .99f);
+		r.m_mpix_per_sec = total_secs ? (total_mpix * iterations / total_secs) : 0.0f;
+		r.m_mt_mpix_per_sec = 0.0f;
+
+		if (num_threads > 1)
+		{
+			// Each thread grabs the next image to process, until every image has been processed iterations times.
+			const uint32_t num_tasks = (uint32_t)images.size() * iterations;
+			std::atomic<uint32_t> next_task(0);
+
+			auto worker_func = [&]()
+			{
+				uint8_vec thread_buf;
+				uint32_t task_index;
+				while ((task_index = next_task.fetch_add(1)) < num_tasks)
+					stage.m_pFunc(images[task_index % images.size()], thread_buf);
+			};
+
+			tm.start();
+
+			std::vector<std::thread> threads;
+			for (uint32_t i = 0; i < num_threads; i++)
+				threads.emplace_back(worker_func);
+			for (auto& t : threads)
+				t.join();
+
+			const double secs = tm.get_elapsed_secs();
+			r.m_mt_mpix_per_sec = secs ? (total_mpix * iterations / secs) : 0.0f;
+		}
+
+		printf("%-11s %-7s %12.4f %12.4f %12.4f %12.3f", stage.m_pCodec, stage.m_pStage, r.m_median_ms, r.m_p95_ms, r.m_p99_ms, r.m_mpix_per_sec);
+		if (num_threads > 1)
+			printf(" %16.3f", r.m_mt_mpix_per_sec);
+		printf("\n");
+	}
+
+	if ((pJSON_filename) && (!write_bench_json(pJSON_filename, images, iterations, num_threads, results)))
+		return EXIT_FAILURE;
+
+	return EXIT_SUCCESS;
+}
+
+static bool stream_write_func(const void* pData, size_t size, void* pUser_data)
+{
+	std::vector<uint8_t>& buf = *static_cast<std::vector<uint8_t>*>(pUser_data);
+	buf.insert(buf.end(), static_cast<const uint8_t*>(pData), static_cast<const uint8_t*>(pData) + size);
+	return true;
+}
+
+static uint32_t read_be32(const uint8_t* p)
+{
+	return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static void append_be32(std::vector<uint8_t>& buf, uint32_t v)
+{
+	const uint8_t b[4] = { (uint8_t)(v >> 24), (uint8_t)(v >> 16), (uint8_t)(v >> 8), (uint8_t)v };
+	buf.insert(buf.end(), b, b + 4);
+}
+
+static void append_png_chunk(std::vector<uint8_t>& buf, const char* pType, const uint8_t* pData, size_t len)
+{
+	append_be32(buf, (uint32_t)len);
+	const size_t type_ofs = buf.size();
+	buf.insert(buf.end(), pType, pType + 4);
+	buf.insert(buf.end(), pData, pData + len);
+	append_be32(buf, lodepng_crc32(buf.data() + type_ofs, 4 + len));
+}
+
+// Returns a PNG file's zlib stream: the data of its IDAT chunks, concatenated.
+static std::vector<uint8_t> get_zlib_stream(const std::vector<uint8_t>& file_buf)
+{
+	std::vector<uint8_t> zlib_stream;
+	for (size_t ofs = 8; (ofs + 12) <= file_buf.size(); )
+	{
+		const uint32_t len = read_be32(&file_buf[ofs]);
+		if ((ofs + 12 + len) > file_buf.size())
+			break;
+
+		if (memcmp(&file_buf[ofs + 4], "IDAT", 4) == 0)
+			zlib_stream.insert(zlib_stream.end(), file_buf.begin() + ofs + 8, file_buf.begin() + ofs + 8 + len);
+
+		ofs += 12 + len;
+	}
+	return zlib_stream;
+}
+
+// Returns a copy of a PNG file with its IDAT chunks replaced by a single IDAT chunk holding zlib_stream, with a valid CRC.
+static std::vector<uint8_t> replace_zlib_stream(const std::vector<uint8_t>& file_buf, const std::vector<uint8_t>& zlib_stream)
+{
+	std::vector<uint8_t> new_file(file_buf.begin(), file_buf.begin() + 8);
+	bool wrote_idat = false;
+	for (size_t ofs = 8; (ofs + 12) <= file_buf.size(); )
+	{
+		const uint32_t len = read_be32(&file_buf[ofs]);
+		if ((ofs + 12 + len) > file_buf.size())
+			break;
+
+		if (memcmp(&file_buf[ofs + 4], "IDAT", 4) != 0)
+			new_file.insert(new_file.end(), file_buf.begin() + ofs, file_buf.begin() + ofs + 12 + len);
+		else if (!wrote_idat)
+		{
+			append_png_chunk(new_file, "IDAT", zlib_stream.data(), zlib_stream.size());
+			wrote_idat = true;
+		}
+
+		ofs += 12 + len;
+	}
+	return new_file;
+}
+
+struct decode_rows_state
+{
+	std::vector<uint8_t> m_image;
+	uint32_t m_bpl, m_next_row;
+	bool m_failed;
+};
+
+static bool decode_rows_func(const uint8_t* pRows, uint32_t first_row, uint32_t num_rows, void* pUser_data)
+{
+	decode_rows_state& state = *static_cast<decode_rows_state*>(pUser_data);
+
+	// Bands must arrive in order
+	if (first_row != state.m_next_row)
+	{
+		state.m_failed = true;
+		return false;
+	}
+
+	state.m_image.insert(state.m_image.end(), pRows, pRows + (size_t)num_rows * state.m_bpl);
+	state.m_next_row += num_rows;
+	return true;
+}
+
+// Decodes an FPNG file a band at a time using fpng_decode_memory_rows(), and compares it against the expected image.
+static bool verify_decode_rows(const std::vector<uint8_t>& file_buf, uint32_t rows_per_callback, uint32_t desired_channels, const void* pExpected, uint32_t expected_w, uint32_t expected_h, uint32_t decode_flags = 0)
+{
+	fpng::fpng_decode_params params;
+	params.m_flags = decode_flags;
+
+	decode_rows_state state;
+	state.m_bpl = expected_w * desired_channels;
+	state.m_next_row = 0;
+	state.m_failed = false;
+
+	uint32_t w, h, chans;
+	int res = fpng::fpng_decode_memory_rows(file_buf.data(), (uint32_t)file_buf.size(), rows_per_callback, decode_rows_func, &state, w, h, chans, desired_channels, params);
+	if (res != fpng::FPNG_DECODE_SUCCESS)
+	{
+		fprintf(stderr, "fpng::fpng_decode_memory_rows() failed with error %i!\n", res);
+		return false;
+	}
+
+	if ((state.m_failed) || (w != expected_w) || (h != expected_h) || (state.m_image.size() != (size_t)state.m_bpl * h) || (memcmp(state.m_image.data(), pExpected, state.m_image.size()) != 0))
+	{
+		fprintf(stderr, "FPNG row callback decode verification failed!\n");
+		return false;
+	}
+
+	return true;
+}
+
+// Decodes an FPNG file with all of its checksums checked, then checks that a corrupted zlib Adler32 is only detected when it's supposed to be.
+static bool verify_decode_checksums(const std::vector<uint8_t>& file_buf, const void* pExpected24, const void* pExpected32, uint32_t expected_w, uint32_t expected_h, uint32_t num_threads)
+{
+	fpng::fpng_decode_params params;
+	params.m_flags = fpng::FPNG_DECODE_STRICT;
+	params.m_num_threads = num_threads;
+
+	for (uint32_t desired_channels = 3; desired_channels <= 4; desired_channels++)
+	{
+		std::vector<uint8_t> decoded;
+		uint32_t w, h, chans;
+		int res = fpng::fpng_decode_memory(file_buf.data(), (uint32_t)file_buf.size(), decoded, w, h, chans, desired_channels, params);
+		if ((res != fpng::FPNG_DECODE_SUCCESS) || (w != expected_w) || (h != expected_h) ||
+			(memcmp(decoded.data(), (desired_channels == 3) ? pExpected24 : pExpected32, (size_t)w * h * desired_channels) != 0))
+		{
+			fprintf(stderr, "FPNG strict decode verification failed, error %i!\n", res);
+			return false;
+		}
+	}
+
+	if (!verify_decode_rows(file_buf, 5, 3, pExpected24, expected_w, expected_h, fpng::FPNG_DECODE_STRICT))
+		return false;
+
+	// The zlib Adler32 is just before the last IDAT's CRC and the IEND chunk.
+	std::vector<uint8_t> bad_file_buf(file_buf);
+	bad_file_buf[bad_file_buf.size() - 12 - 4 - 1] ^= 1;
+
+	const uint32_t flags_to_test[] = { 0, fpng::FPNG_DECODE_STRICT, fpng::FPNG_DECODE_CHECK_ADLER32 | fpng::FPNG_DECODE_SKIP_CRC32, fpng::FPNG_DECODE_STRICT | fpng::FPNG_DECODE_SKIP_ALL_CHECKS };
+	const int expected_results[] = { fpng::FPNG_DECODE_SUCCESS, fpng::FPNG_DECODE_FAILED_CHECKSUM, fpng::FPNG_DECODE_FAILED_CHECKSUM, fpng::FPNG_DECODE_SUCCESS };
+
+	for (uint32_t i = 0; i < sizeof(flags_to_test) / sizeof(flags_to_test[0]); i++)
+	{
+		params.m_flags = flags_to_test[i];
+
+		std::vector<uint8_t> decoded;
+		uint32_t w, h, chans;
+		int res = fpng::fpng_decode_memory(bad_file_buf.data(), (uint32_t)bad_file_buf.size(), decoded, w, h, chans, 4, params);
+		if (res != expected_results[i])
+		{
+			fprintf(stderr, "FPNG decode of a corrupted file with flags 0x%X returned %i, expected %i!\n", flags_to_test[i], res, expected_results[i]);
+			return false;
+		}
+	}
+
+	return true;
+}
+
+// Box filters rows [first_row, end_row) of a decoded image down by 1 << shift, the way fpng_decode_memory_region() should.
+template<typename T>
+static std::vector<uint8_t> downscale_reference(const std::vector<uint8_t>& decoded, uint32_t w, uint32_t num_chans, uint32_t first_row, uint32_t end_row, uint32_t shift)
+{
+	const uint32_t f = 1 << shift, dst_w = (w + f - 1) >> shift, dst_h = (end_row - first_row + f - 1) >> shift;
+	const T* pSrc = reinterpret_cast<const T*>(decoded.data());
+
+	std::vector<uint8_t> out((size_t)dst_w * dst_h * num_chans * sizeof(T));
+	T* pDst = reinterpret_cast<T*>(out.data());
+
+	for (uint32_t dy = 0; dy < dst_h; dy++)
+		for (uint32_t dx = 0; dx < dst_w; dx++)
+			for (uint32_t c = 0; c < num_chans; c++)
+			{
+				uint32_t sum = 0, n = 0;
+				for (uint32_t y = first_row + dy * f; y < minimum(first_row + (dy + 1) * f, end_row); y++)
+					for (uint32_t x = dx * f; x < minimum((dx + 1) * f, w); x++, n++)
+						sum += pSrc[((size_t)y * w + x) * num_chans + c];
+				*pDst++ = (T)((sum + n / 2) / n);
+			}
+
+	return out;
+}
+
+// Checks fpng_decode_memory_region() against box filtering fpng_decode_memory()'s output, on single block and strip files, and 8 and 16-bit files.
+static bool verify_decode_region(const uint8_t* pSource32, uint32_t w, uint32_t h)
+{
+	// The regions are fractions of the image, so any image size works. Those that come out empty on short images are skipped.
+	struct region { uint32_t m_first_row, m_end_row, m_shift; };
+	const region regions[] = { { 0, h, 0 }, { 0, h, 1 }, { 0, h, 3 }, { h / 9, h * 2 / 3, 2 }, { h - minimum(h, 5U), h, 1 }, { h / 3, h / 3 + 1, 0 }, { h / 2, UINT32_MAX, 3 }, { 1, h - 1, 2 } };
+
+	std::vector<uint16_t> gray16((size_t)w * h);
+	for (uint32_t i = 0; i < w * h; i++)
+		gray16[i] = (uint16_t)((pSource32[i * 4 + 1] << 8) | (i & 0xFF));
+
+	for (uint32_t file_index = 0; file_index < 4; file_index++)
+	{
+		const uint32_t num_chans = (file_index == 3) ? 1 : ((file_index == 2) ? 3 : 4);
+		const uint32_t bytes_per_sample = (file_index == 3) ? 2 : 1;
+		
+		std::vector<uint8_t> img;
+		if (file_index == 3)
+			img.assign((const uint8_t*)gray16.data(), (const uint8_t*)gray16.data() + gray16.size() * 2);
+		else
+		{
+			img.resize((size_t)w * h * num_chans);
+			for (uint32_t i = 0; i < w * h; i++)
+				memcpy(&img[(size_t)i * num_chans], pSource32 + i * 4, num_chans);
+		}
+
+		// Single block, strips, adaptive filters with strips, and 16-bit grayscale strips.
+		fpng::fpng_encode_params encode_params;
+		encode_params.m_num_threads = file_index ? 4 : 0;
+		encode_params.m_flags = (file_index == 2) ? fpng::FPNG_ENCODE_ADAPTIVE_FILTERS : ((file_index == 3) ? fpng::FPNG_ENCODE_16BIT : 0);
+
+		std::vector<uint8_t> file_buf;
+		if (!fpng::fpng_encode_image_to_memory(img.data(), w, h, num_chans, file_buf, encode_params))
+		{
+			fprintf(stderr, "fpng_encode_image_to_memory() failed!\n");
+			return false;
+		}
+
+		fpng::fpng_decode_params params;
+		params.m_flags = fpng::FPNG_DECODE_STRICT | fpng::FPNG_DECODE_16BIT;
+
+		std::vector<uint8_t> decoded;
+		uint32_t dw = 0, dh = 0, chans = 0;
+		if (fpng::fpng_decode_memory(file_buf.data(), file_buf.size(), decoded, dw, dh, chans, num_chans, params) != fpng::FPNG_DECODE_SUCCESS)
+		{
+			fprintf(stderr, "fpng_decode_memory() failed!\n");
+			return false;
+		}
+
+		for (const region& r : regions)
+		{
+			const uint32_t end_row = minimum(r.m_end_row, h);
+			if (r.m_first_row >= end_row)
+				continue;
+
+			const std::vector<uint8_t> expected = (bytes_per_sample == 2) ? downscale_reference<uint16_t>(decoded, w, num_chans, r.m_first_row, end_row, r.m_shift) :
+				downscale_reference<uint8_t>(decoded, w, num_chans, r.m_first_row, end_row, r.m_shift);
+
+			std::vector<uint8_t> out(expected.size());
+			int res = fpng::fpng_decode_memory_region(file_buf.data(), file_buf.size(), r.m_first_row, r.m_end_row, r.m_shift, out.data(), out.size(), 0, dw, dh, chans, num_chans, params);
+			if ((res != fpng::FPNG_DECODE_SUCCESS) || (dw != w) || (dh != h) || (out != expected))
+			{
+				fprintf(stderr, "fpng_decode_memory_region() verification failed on file %u, rows %u-%u, scale shift %u, error %i!\n", file_index, r.m_first_row, end_row, r.m_shift, res);
+				return false;
+			}
+		}
+
+		// Empty row ranges, or ones starting past the end of the image, are rejected.
+		const uint32_t empty_ranges[][2] = { { h / 2, h / 2 }, { h - 1, 0 }, { h, h + 1 }, { h, UINT32_MAX } };
+		for (const auto& range : empty_ranges)
+		{
+			std::vector<uint8_t> out((size_t)w * num_chans * bytes_per_sample);
+			int res = fpng::fpng_decode_memory_region(file_buf.data(), file_buf.size(), range[0], range[1], 0, out.data(), out.size(), 0, dw, dh, chans, num_chans, params);
+			if (res != fpng::FPNG_DECODE_INVALID_ARG)
+			{
+				fprintf(stderr, "fpng_decode_memory_region() didn't reject rows %u-%u on file %u, error %i!\n", range[0], range[1], file_index, res);
+				return false;
+			}
+		}
+	}
+
+	return true;
+}
+
+// Encodes a few synthetic images that the one pass compressor's Huffman table presets were made for (flat screenshots and sprites, noisy photos) and checks they decode.
+static bool verify_huff_presets()
+{
+	const uint32_t W = 193, H = 271;
+	mrand r(1);
+
+	for (uint32_t kind = 0; kind < 4; kind++)
+	{
+		const uint32_t num_chans = (kind & 1) ? 4 : 3;
+		const bool noisy = (kind >= 2);
+
+		std::vector<uint8_t> img(W * H * num_chans);
+		for (uint32_t y = 0; y < H; y++)
+		{
+			for (uint32_t x = 0; x < W; x++)
+			{
+				uint8_t* pPixel = &img[(y * W + x) * num_chans];
+				for (uint32_t c = 0; c < num_chans; c++)
+				{
+					if (noisy)
+						pPixel[c] = (uint8_t)minimum(maximum((int)(x + y * 2 + c * 40 + r.gaussian(0.0f, 6.0f)), 0), 255);
+					else
+						pPixel[c] = (uint8_t)((((x / 24) ^ (y / 16)) & 1) ? 240 : (c * 70));
+				}
+
+				// Sprite-like transparent border around an opaque middle
+				if ((num_chans == 4) && (!noisy) && ((x < 20) || (y < 10)))
+					memset(pPixel, 0, 4);
+			}
+		}
+
+		std::vector<uint8_t> file_buf;
+		if (!fpng::fpng_encode_image_to_memory(img.data(), W, H, num_chans, file_buf))
+		{
+			fprintf(stderr, "fpng_encode_image_to_memory() failed on a synthetic image!\n");
+			return false;
+		}
+
+		// The streaming encoder always uses the general purpose table (the first preset).
+		std::vector<uint8_t> default_file_buf;
+		fpng::fpng_encoder encoder;
+		if ((!encoder.begin(W, H, num_chans, stream_write_func, &default_file_buf)) || (!encoder.push_rows(img.data(), H, W * num_chans)) || (!encoder.finish()))
+		{
+			fprintf(stderr, "fpng_encoder failed on a synthetic image!\n");
+			return false;
+		}
+		
+		const std::vector<uint8_t> zlib_stream(get_zlib_stream(file_buf)), default_zlib_stream(get_zlib_stream(default_file_buf));
+		// The noisy images should stay with the general purpose table, which gives the same zlib stream. The flat ones should pick a trained table that beats it.
+		const bool selection_ok = noisy ? (zlib_stream == default_zlib_stream) : (zlib_stream.size() < default_zlib_stream.size());
+		if (!selection_ok)
+		{
+			fprintf(stderr, "Synthetic image %u picked the wrong Huffman table preset (%zu bytes, %zu with the general purpose table)!\n", kind, zlib_stream.size(), default_zlib_stream.size());
+			return false;
+		}
+
+		uint32_t lodepng_decoded_w = 0, lodepng_decoded_h = 0;
+		uint8_t* lodepng_decoded_buffer = nullptr;
+		int error = lodepng_decode_memory(&lodepng_decoded_buffer, &lodepng_decoded_w, &lodepng_decoded_h, file_buf.data(), file_buf.size(), (num_chans == 4) ? LCT_RGBA : LCT_RGB, 8);
+		if ((error) || (lodepng_decoded_w != W) || (lodepng_decoded_h != H) || (memcmp(lodepng_decoded_buffer, img.data(), img.size()) != 0))
+		{
+			fprintf(stderr, "FPNG synthetic image %u decode verification failed (using lodepng)!\n", kind);
+			return false;
+		}
+		free(lodepng_decoded_buffer);
+
+		fpng::fpng_decode_params params;
+		params.m_flags = fpng::FPNG_DECODE_STRICT;
+
+		std::vector<uint8_t> decoded;
+		uint32_t w, h, chans;
+		int res = fpng::fpng_decode_memory(file_buf.data(), (uint32_t)file_buf.size(), decoded, w, h, chans, num_chans, params);
+		if ((res != fpng::FPNG_DECODE_SUCCESS) || (memcmp(decoded.data(), img.data(), img.size()) != 0))
+		{
+			fprintf(stderr, "FPNG synthetic image %u decode verification failed (using FPNG), error %i!\n", kind, res);
+			return false;
+		}
+	}
+
+	return true;
+}
+
+// Encodes an image where each row repeats a short run of random pixels, which only LZ matching can find, and checks FPNG_ENCODE_LZ_MATCHES makes it much smaller.
+static bool verify_lz_repeats()
+{
+	const uint32_t W = 256, H = 64, PERIOD = 16, NUM_CHANS = 3;
+	mrand r(3);
+
+	std::vector<uint8_t> img(W * H * NUM_CHANS);
+	for (uint32_t y = 0; y < H; y++)
+	{
+		uint8_t pattern[PERIOD * NUM_CHANS];
+		for (uint32_t i = 0; i < PERIOD * NUM_CHANS; i++)
+			pattern[i] = (uint8_t)r.irand(0, 15);
+
+		for (uint32_t i = 0; i < W * NUM_CHANS; i++)
+			img[y * W * NUM_CHANS + i] = pattern[i % (PERIOD * NUM_CHANS)];
+	}
+
+	std::vector<uint8_t> file_bufs[2];
+	for (uint32_t lz = 0; lz < 2; lz++)
+	{
+		std::vector<uint8_t> decoded;
+		uint32_t dw, dh, chans;
+		if ((!fpng::fpng_encode_image_to_memory(img.data(), W, H, NUM_CHANS, file_bufs[lz], lz ? fpng::FPNG_ENCODE_LZ_MATCHES : 0)) ||
+			(fpng::fpng_decode_memory(file_bufs[lz].data(), file_bufs[lz].size(), decoded, dw, dh, chans, NUM_CHANS) != fpng::FPNG_DECODE_SUCCESS) || (decoded != img))
+		{
+			fprintf(stderr, "Encoding or decoding a repetitive image failed (LZ matches %u)!\n", lz);
+			return false;
+		}
+	}
+
+	if ((file_bufs[1].size() * 4) > file_bufs[0].size())
+	{
+		fprintf(stderr, "FPNG_ENCODE_LZ_MATCHES didn't find the repeats in an image (%zu bytes, %zu without it)!\n", file_bufs[1].size(), file_bufs[0].size());
+		return false;
+	}
+
+	return true;
+}
+
+// Encodes the source image with each optional compression flag, single threaded and strip-parallel, and checks the files decode with lodepng and FPNG.
+static bool verify_encode_flags(const void* pSource24, const void* pSource32, uint32_t w, uint32_t h, uint32_t source_chans, uint32_t fpng_flags, uint32_t num_encode_threads, bool csv_flag)
+{
+	struct encode_flag { uint32_t m_flag; const char* m_pName; };
+	static const encode_flag s_flags[] = 
+	{
+		{ fpng::FPNG_ENCODE_ADAPTIVE_FILTERS, "FPNG_ENCODE_ADAPTIVE_FILTERS" },
+		{ fpng::FPNG_ENCODE_LZ_MATCHES, "FPNG_ENCODE_LZ_MATCHES" },
+	};
+
+	for (const encode_flag& f : s_flags)
+	{
+		for (uint32_t pass = 0; pass < ((num_encode_threads > 1) ? 2U : 1U); pass++)
+		{
+			const uint32_t num_threads = pass ? num_encode_threads : 0;
+
+			fpng::fpng_encode_params encode_params;
+			encode_params.m_flags = fpng_flags | f.m_flag;
+			encode_params.m_num_threads = num_threads;
+
+			std::vector<uint8_t> file_buf;
+			if (!fpng::fpng_encode_image_to_memory((source_chans == 4) ? pSource32 : pSource24, w, h, source_chans, file_buf, encode_params))
+			{
+				fprintf(stderr, "fpng_encode_image_to_memory() failed with %s!\n", f.m_pName);
+				return false;
+			}
+
+			if (!csv_flag)
+				printf("%s: %u bytes, %u threads\n", f.m_pName, (uint32_t)file_buf.size(), num_threads);
+
+			uint32_t lodepng_decoded_w = 0, lodepng_decoded_h = 0;
+			uint8_t* lodepng_decoded_buffer = nullptr;
+			int error = lodepng_decode_memory(&lodepng_decoded_buffer, &lodepng_decoded_w, &lodepng_decoded_h, file_buf.data(), file_buf.size(), LCT_RGBA, 8);
+			if ((error) || (lodepng_decoded_w != w) || (lodepng_decoded_h != h) || (memcmp(lodepng_decoded_buffer, pSource32, (size_t)w * h * 4) != 0))
+			{
+				fprintf(stderr, "FPNG %s decode verification failed (using lodepng)!\n", f.m_pName);
+				return false;
+			}
+			free(lodepng_decoded_buffer);
+
+			if ((!verify_decode_checksums(file_buf, pSource24, pSource32, w, h, num_threads)) ||
+				(!verify_decode_rows(file_buf, 9, 4, pSource32, w, h)))
+				return false;
+		}
+
+		if ((f.m_flag == fpng::FPNG_ENCODE_LZ_MATCHES) && (!verify_lz_repeats()))
+			return false;
+	}
+
+	return true;
+}
+
+// Encodes grayscale, gray+alpha and 16-bit versions of the source image, and checks they decode with lodepng, and with FPNG to their own channels and to RGBA.
+static bool verify_pixel_formats(const uint8_t* pSource32, uint32_t w, uint32_t h, uint32_t num_threads)
+{
+	static const LodePNGColorType s_lodepng_color_types[] = { LCT_GREY, LCT_GREY_ALPHA, LCT_RGB, LCT_RGBA };
+	
+	const uint32_t total_pixels = w * h;
+
+	for (uint32_t num_chans = 1; num_chans <= 4; num_chans++)
+	{
+		for (uint32_t bytes_per_sample = 1; bytes_per_sample <= 2; bytes_per_sample++)
+		{
+			// 8-bit RGB/RGBA are tested everywhere else.
+			if ((num_chans >= 3) && (bytes_per_sample == 1))
+				continue;
+
+			// Gray is taken from green. The 16-bit samples get some low byte detail.
+			std::vector<uint16_t> samples(total_pixels * num_chans);
+			for (uint32_t i = 0; i < total_pixels; i++)
+			{
+				const uint8_t* pSrc = pSource32 + i * 4;
+				for (uint32_t c = 0; c < num_chans; c++)
+				{
+					const uint32_t v = pSrc[(num_chans <= 2) ? (c ? 3 : 1) : c];
+					samples[i * num_chans + c] = (uint16_t)((bytes_per_sample == 2) ? ((v << 8) | ((v * 7 + i) & 0xFF)) : v);
+				}
+			}
+
+			std::vector<uint8_t> img(samples.size() * bytes_per_sample);
+			if (bytes_per_sample == 2)
+				memcpy(img.data(), samples.data(), img.size());
+			else
+			{
+				for (size_t i = 0; i < samples.size(); i++)
+					img[i] = (uint8_t)samples[i];
+			}
+			
+			for (uint32_t lz = 0; lz < 2; lz++)
+			{
+				fpng::fpng_encode_params encode_params;
+				encode_params.m_flags = ((bytes_per_sample == 2) ? fpng::FPNG_ENCODE_16BIT : 0) | (lz ? fpng::FPNG_ENCODE_LZ_MATCHES : 0);
+				encode_params.m_num_threads = num_threads;
+
+				std::vector<uint8_t> file_buf;
+				if (!fpng::fpng_encode_image_to_memory(img.data(), w, h, num_chans, file_buf, encode_params))
+				{
+					fprintf(stderr, "fpng_encode_image_to_memory() failed on a %u channel, %u-bit image!\n", num_chans, bytes_per_sample * 8);
+					return false;
+				}
+
+				// lodepng returns 16-bit samples as big endian.
+				uint32_t lodepng_decoded_w = 0, lodepng_decoded_h = 0;
+				uint8_t* lodepng_decoded_buffer = nullptr;
+				int error = lodepng_decode_memory(&lodepng_decoded_buffer, &lodepng_decoded_w, &lodepng_decoded_h, file_buf.data(), file_buf.size(), s_lodepng_color_types[num_chans - 1], bytes_per_sample * 8);
+				bool matches = (!error) && (lodepng_decoded_w == w) && (lodepng_decoded_h == h);
+				for (size_t i = 0; matches && (i < samples.size()); i++)
+				{
+					const uint32_t v = (bytes_per_sample == 2) ? ((lodepng_decoded_buffer[i * 2] << 8) | lodepng_decoded_buffer[i * 2 + 1]) : lodepng_decoded_buffer[i];
+					matches = (v == samples[i]);
+				}
+				free(lodepng_decoded_buffer);
+
+				if (!matches)
+				{
+					fprintf(stderr, "FPNG %u channel, %u-bit image decode verification failed (using lodepng)!\n", num_chans, bytes_per_sample * 8);
+					return false;
+				}
+
+				uint32_t file_w, file_h, file_chans, file_bits;
+				if ((fpng::fpng_get_info(file_buf.data(), (uint32_t)file_buf.size(), file_w, file_h, file_chans, file_bits) != fpng::FPNG_DECODE_SUCCESS) || 
+					(file_chans != num_chans) || (file_bits != bytes_per_sample * 8))
+				{
+					fprintf(stderr, "fpng::fpng_get_info() failed on a %u channel, %u-bit image!\n", num_chans, bytes_per_sample * 8);
+					return false;
+				}
+
+				fpng::fpng_decode_params params;
+				params.m_flags = fpng::FPNG_DECODE_STRICT;
+				params.m_num_threads = num_threads;
+
+				// Without FPNG_DECODE_16BIT, 16-bit files are decoded to their high bytes.
+				std::vector<uint8_t> decoded;
+				int res = fpng::fpng_decode_memory(file_buf.data(), (uint32_t)file_buf.size(), decoded, file_w, file_h, file_chans, num_chans, params);
+				matches = (res == fpng::FPNG_DECODE_SUCCESS) && (decoded.size() == samples.size());
+				for (size_t i = 0; matches && (i < samples.size()); i++)
+					matches = (decoded[i] == (samples[i] >> ((bytes_per_sample - 1) * 8)));
+
+				if (!matches)
+				{
+					fprintf(stderr, "FPNG %u channel, %u-bit image 8-bit decode verification failed (using FPNG), error %i!\n", num_chans, bytes_per_sample * 8, res);
+					return false;
+				}
+
+				params.m_flags = fpng::FPNG_DECODE_STRICT | fpng::FPNG_DECODE_16BIT;
+
+				res = fpng::fpng_decode_memory(file_buf.data(), (uint32_t)file_buf.size(), decoded, file_w, file_h, file_chans, num_chans, params);
+				if ((res != fpng::FPNG_DECODE_SUCCESS) || (decoded != img))
+				{
+					fprintf(stderr, "FPNG %u channel, %u-bit image decode verification failed (using FPNG), error %i!\n", num_chans, bytes_per_sample * 8, res);
+					return false;
+				}
+
+				// Grayscale is copied to RGB, and a missing alpha is opaque.
+				res = fpng::fpng_decode_memory(file_buf.data(), (uint32_t)file_buf.size(), decoded, file_w, file_h, file_chans, 4, params);
+				matches = (res == fpng::FPNG_DECODE_SUCCESS);
+				for (uint32_t i = 0; matches && (i < total_pixels * 4); i++)
+				{
+					const uint32_t c = i & 3;
+					uint32_t expected;
+					if (c == 3)
+						expected = ((num_chans & 1) == 0) ? samples[(i >> 2) * num_chans + num_chans - 1] : ((bytes_per_sample == 2) ? 0xFFFF : 0xFF);
+					else
+						expected = samples[(i >> 2) * num_chans + ((num_chans <= 2) ? 0 : c)];
+
+					uint16_t v = decoded[i];
+					if (bytes_per_sample == 2)
+						memcpy(&v, &decoded[i * 2], 2);
+
+					matches = (v == expected);
+				}
+
+				if (!matches)
+				{
+					fprintf(stderr, "FPNG %u channel, %u-bit image RGBA decode verification failed (using FPNG), error %i!\n", num_chans, bytes_per_sample * 8, res);
+					return false;
+				}
+
+				if ((bytes_per_sample == 1) && (!verify_decode_rows(file_buf, 7, num_chans, img.data(), w, h, fpng::FPNG_DECODE_STRICT)))
+					return false;
+			}
+		}
+	}
+
+	return true;
+}
+
+// Runs the strip tasks on the calling thread, so the strip-parallel code paths can be checked for allocations without spawning threads.
+static void serial_dispatch(uint32_t num_tasks, fpng::fpng_task_func pTask, void* pTask_data, void* pUser_data)
+{
+	(void)pUser_data;
+	for (uint32_t i = 0; i < num_tasks; i++)
+		pTask(i, pTask_data);
+}
+
+// Checks that encoding and decoding with reused contexts gives the same results as without them, and (with FPNG_TEST_COUNT_ALLOCS=1) doesn't allocate once the contexts have warmed up.
+static bool verify_contexts(const uint8_t* pSource32, uint32_t w, uint32_t h)
+{
+	fpng::fpng_encode_context encode_context;
+	fpng::fpng_decode_context decode_context;
+
+	for (uint32_t num_chans = 1; num_chans <= 4; num_chans++)
+	{
+		std::vector<uint8_t> img((size_t)w * h * num_chans);
+		for (uint32_t i = 0; i < w * h; i++)
+			for (uint32_t c = 0; c < num_chans; c++)
+				img[i * num_chans + c] = pSource32[i * 4 + ((num_chans <= 2) ? (c ? 3 : 1) : c)];
+
+		for (int level = fpng::FPNG_LEVEL_FASTEST; level <= fpng::FPNG_MAX_LEVEL; level++)
+		{
+			for (uint32_t num_strips = 1; num_strips <= 4; num_strips += 3)
+			{
+				fpng::fpng_encode_params encode_params;
+				encode_params.m_level = level;
+				encode_params.m_num_threads = num_strips;
+				encode_params.m_pDispatch = serial_dispatch;
+
+				std::vector<uint8_t> expected_file;
+				if (!fpng::fpng_encode_image_to_memory(img.data(), w, h, num_chans, expected_file, encode_params))
+				{
+					fprintf(stderr, "fpng_encode_image_to_memory() failed!\n");
+					return false;
+				}
+
+				std::vector<uint8_t> file_buf((size_t)fpng::fpng_get_max_encoded_size(w, h, num_chans, 0));
+				std::vector<uint8_t> decoded(img.size());
+
+				encode_params.m_pContext = &encode_context;
+
+				fpng::fpng_decode_params decode_params;
+				decode_params.m_flags = fpng::FPNG_DECODE_CHECK_ADLER32;
+				decode_params.m_num_threads = num_strips;
+				decode_params.m_pDispatch = serial_dispatch;
+				decode_params.m_pContext = &decode_context;
+
+				// The first pass warms up the contexts.
+				for (uint32_t pass = 0; pass < 2; pass++)
+				{
+#if FPNG_TEST_COUNT_ALLOCS
+					const uint64_t start_allocs = g_num_allocs;
+#endif
+
+					const size_t file_size = fpng::fpng_encode_image_to_memory(img.data(), w, h, num_chans, file_buf.data(), file_buf.size(), encode_params);
+
+					uint32_t file_w, file_h, file_chans;
+					int res = fpng::fpng_decode_memory(file_buf.data(), (uint32_t)file_size, decoded.data(), decoded.size(), 0, file_w, file_h, file_chans, num_chans, decode_params);
+
+#if FPNG_TEST_COUNT_ALLOCS
+					const uint64_t num_allocs = g_num_allocs - start_allocs;
+#endif
+
+					if ((file_size != expected_file.size()) || (memcmp(file_buf.data(), expected_file.data(), file_size) != 0))
+					{
+						fprintf(stderr, "Encoding with a context gave different results, level %i, %u channels, %u strips!\n", level, num_chans, num_strips);
+						return false;
+					}
+
+					if ((res != fpng::FPNG_DECODE_SUCCESS) || (decoded != img))
+					{
+						fprintf(stderr, "Decoding with a context failed, error %i, level %i, %u channels, %u strips!\n", res, level, num_chans, num_strips);
+						return false;
+					}
+
+#if FPNG_TEST_COUNT_ALLOCS
+					if ((pass) && (num_allocs))
+					{
+						fprintf(stderr, "Encoding and decoding with warmed up contexts made %u allocations, level %i, %u channels, %u strips!\n", (uint32_t)num_allocs, level, num_chans, num_strips);
+						return false;
+					}
+#endif
+				}
+			}
+		}
+	}
+
+	return true;
+}
+
+// Encodes synthetic images which are partly or entirely random noise, single threaded and strip-parallel. The noisy strips should be written as raw blocks
+// while the rest of the image is still compressed, and the files must decode with lodepng, and with FPNG both at once and a band at a time.
+// With FPNG_STATS=1, the literals and matches must cover every filtered byte, and each Deflate block must be counted once. Otherwise the stats are only cleared.
+static bool verify_stats(const uint8_t* pSource32, uint32_t w, uint32_t h)
+{
+	const int levels[] = { fpng::FPNG_LEVEL_FASTEST, fpng::FPNG_LEVEL_MEDIUM, fpng::FPNG_LEVEL_SLOWER };
+
+	for (uint32_t num_chans = 3; num_chans <= 4; num_chans++)
+	{
+		std::vector<uint8_t> img(w * h * num_chans);
+		for (uint32_t i = 0; i < w * h; i++)
+			memcpy(&img[i * num_chans], pSource32 + i * 4, num_chans);
+
+		for (uint32_t l = 0; l < sizeof(levels) / sizeof(levels[0]); l++)
+		{
+			for (uint32_t num_threads = 0; num_threads <= 4; num_threads += 4)
+			{
+				fpng::fpng_encode_stats stats;
+				stats.m_num_literals = 1;
+
+				fpng::fpng_encode_params params;
+				params.m_level = levels[l];
+				params.m_num_threads = num_threads;
+				params.m_pStats = &stats;
+
+				std::vector<uint8_t> file_buf;
+				if (!fpng::fpng_encode_image_to_memory(img.data(), w, h, num_chans, file_buf, params))
+				{
+					fprintf(stderr, "fpng_encode_image_to_memory() with stats failed!\n");
+					return false;
+				}
+
+				uint32_t total_blocks = 0;
+				for (uint32_t i = 0; i < fpng::FPNG_STATS_MAX_TABLES; i++)
+					total_blocks += stats.m_table_blocks[i];
+
+#if FPNG_STATS
+				const uint32_t num_strips = (num_threads > 1) ? std::max<uint32_t>(std::min<uint32_t>(num_threads, h / fpng::FPNG_MIN_STRIP_ROWS), 1) : 1;
+				const uint64_t filtered_size = (uint64_t)(w * num_chans + 1) * h;
+				if ((!stats.m_total_ns) || (stats.m_raw_fallback) || (total_blocks != num_strips) || (stats.m_num_literals + stats.m_match_bytes != filtered_size))
+#else
+				if ((stats.m_total_ns) || (stats.m_num_literals) || (total_blocks))
+#endif
+				{
+					fprintf(stderr, "FPNG encode stats are wrong (level %i, %u channels, %u threads)!\n", levels[l], num_chans, num_threads);
+					return false;
+				}
+
+				fpng::fpng_decode_stats decode_stats;
+				decode_stats.m_num_tables_built = 1;
+
+				fpng::fpng_decode_params decode_params;
+				decode_params.m_flags = fpng::FPNG_DECODE_STRICT;
+				decode_params.m_num_threads = num_threads;
+				decode_params.m_pStats = &decode_stats;
+
+				std::vector<uint8_t> decoded;
+				uint32_t dw, dh, chans;
+				if ((fpng::fpng_decode_memory(file_buf.data(), (uint32_t)file_buf.size(), decoded, dw, dh, chans, num_chans, decode_params) != fpng::FPNG_DECODE_SUCCESS) || (decoded != img))
+				{
+					fprintf(stderr, "FPNG decode with stats failed!\n");
+					return false;
+				}
+
+#if FPNG_STATS
+				if ((!decode_stats.m_total_ns) || (decode_stats.m_num_tables_built + decode_stats.m_num_tables_reused != num_strips))
+#else
+				if ((decode_stats.m_total_ns) || (decode_stats.m_num_tables_built))
+#endif
+				{
+					fprintf(stderr, "FPNG decode stats are wrong (level %i, %u channels, %u threads)!\n", levels[l], num_chans, num_threads);
+					return false;
+				}
+			}
+		}
+	}
+
+	// Noise must be reported as a raw block fallback.
+	{
+		mrand r(3);
+		std::vector<uint8_t> img(w * h * 3);
+		for (auto& c : img)
+			c = (uint8_t)r.irand(0, 255);
+
+		fpng::fpng_encode_stats stats;
+		fpng::fpng_encode_params params;
+		params.m_pStats = &stats;
+
+		std::vector<uint8_t> file_buf;
+		if (!fpng::fpng_encode_image_to_memory(img.data(), w, h, 3, file_buf, params))
+		{
+			fprintf(stderr, "fpng_encode_image_to_memory() with stats failed on noise!\n");
+			return false;
+		}
+
+#if FPNG_STATS
+		if ((!stats.m_raw_fallback) || (stats.m_table_blocks[fpng::FPNG_STATS_TABLE_RAW] != 1))
+#else
+		if (stats.m_raw_fallback)
+#endif
+		{
+			fprintf(stderr, "FPNG encode stats didn't report the raw block fallback!\n");
+			return false;
+		}
+	}
+
+	return true;
+}
+
+// Returns the number of IDAT chunks in a PNG file, and the size of the largest.
+static uint32_t count_idat_chunks(const std::vector<uint8_t>& file_buf, uint32_t& max_idat_size)
+{
+	uint32_t num_idats = 0;
+	max_idat_size = 0;
+
+	for (size_t ofs = 8; ofs + 12 <= file_buf.size(); )
+	{
+		const uint32_t len = (file_buf[ofs] << 24) | (file_buf[ofs + 1] << 16) | (file_buf[ofs + 2] << 8) | file_buf[ofs + 3];
+		if (memcmp(&file_buf[ofs + 4], "IDAT", 4) == 0)
+		{
+			num_idats++;
+			max_idat_size = std::max(max_idat_size, len);
+		}
+		ofs += 12 + (size_t)len;
+	}
+
+	return num_idats;
+}
+
+// Images wider than 65535 pixels, with the in-memory, strip-parallel and streaming encoders. The fpng_test_small_idat build (FPNG_MAX_IDAT_CHUNK_SIZE=4096) also tests splitting the IDAT chunk.
+static bool verify_large_images()
+{
+	const uint32_t W = 70001, H = 64;
+	mrand r(5);
+
+	for (uint32_t num_chans = 3; num_chans <= 4; num_chans++)
+	{
+		std::vector<uint8_t> img((size_t)W * H * num_chans);
+		for (uint32_t y = 0; y < H; y++)
+			for (uint32_t x = 0; x < W; x++)
+				for (uint32_t c = 0; c < num_chans; c++)
+					img[((size_t)y * W + x) * num_chans + c] = (x & 1024) ? (uint8_t)r.irand(0, 255) : (uint8_t)((x >> 2) + y * c);
+
+		for (uint32_t mode = 0; mode < 3; mode++)
+		{
+			std::vector<uint8_t> file_buf;
+			if (mode < 2)
+			{
+				fpng::fpng_encode_params params;
+				params.m_num_threads = mode ? 4 : 0;
+
+				if (!fpng::fpng_encode_image_to_memory(img.data(), W, H, num_chans, file_buf, params))
+				{
+					fprintf(stderr, "fpng_encode_image_to_memory() failed on a %ux%u image!\n", W, H);
+					return false;
+				}
+			}
+			else
+			{
+				fpng::fpng_encoder encoder;
+				if ((!encoder.begin(W, H, num_chans, stream_write_func, &file_buf)) || (!encoder.push_rows(img.data(), H, W * num_chans)) || (!encoder.finish()))
+				{
+					fprintf(stderr, "fpng_encoder failed on a %ux%u image!\n", W, H);
+					return false;
+				}
+			}
+
+			uint32_t max_idat_size = 0;
+			const uint32_t num_idats = count_idat_chunks(file_buf, max_idat_size);
+			if ((!num_idats) || (max_idat_size > FPNG_MAX_IDAT_CHUNK_SIZE))
+			{
+				fprintf(stderr, "FPNG wrote an IDAT chunk larger than FPNG_MAX_IDAT_CHUNK_SIZE (mode %u)!\n", mode);
+				return false;
+			}
+
+			uint32_t lodepng_decoded_w = 0, lodepng_decoded_h = 0;
+			uint8_t* lodepng_decoded_buffer = nullptr;
+			int error = lodepng_decode_memory(&lodepng_decoded_buffer, &lodepng_decoded_w, &lodepng_decoded_h, file_buf.data(), file_buf.size(), (num_chans == 4) ? LCT_RGBA : LCT_RGB, 8);
+			const bool lodepng_ok = (!error) && (lodepng_decoded_w == W) && (lodepng_decoded_h == H) && (memcmp(lodepng_decoded_buffer, img.data(), img.size()) == 0);
+			free(lodepng_decoded_buffer);
+
+			if (!lodepng_ok)
+			{
+				fprintf(stderr, "FPNG %ux%u image decode verification failed (using lodepng, mode %u)!\n", W, H, mode);
+				return false;
+			}
+
+			fpng::fpng_decode_params decode_params;
+			decode_params.m_flags = fpng::FPNG_DECODE_STRICT;
+			decode_params.m_num_threads = 4;
+
+			std::vector<uint8_t> decoded;
+			uint32_t w, h, chans;
+			int res = fpng::fpng_decode_memory(file_buf.data(), file_buf.size(), decoded, w, h, chans, num_chans, decode_params);
+			if ((res != fpng::FPNG_DECODE_SUCCESS) || (w != W) || (h != H) || (decoded != img))
+			{
+				fprintf(stderr, "FPNG %ux%u image decode verification failed (using FPNG, mode %u), error %i!\n", W, H, mode, res);
+				return false;
+			}
+		}
+	}
+
+	return true;
+}
+
+static bool verify_file_io(const uint8_t* pSource32, uint32_t w, uint32_t h)
+{
+	const char* pFilename = "__fpng_file_io.png";
+
+	// The noisy image takes the raw block fallback. The image with 7 bits of noise passes the incompressibility check, and only falls back to raw blocks after it's been compressed,
+	// so pipelined writes have to start over.
+	mrand r(4);
+	std::vector<uint8_t> noise(w * h * 4), noise7(w * h * 4);
+	for (auto& c : noise)
+		c = (uint8_t)r.irand(0, 255);
+	for (auto& c : noise7)
+		c = (uint8_t)r.irand(0, 127);
+
+	for (uint32_t kind = 0; kind < 6; kind++)
+	{
+		const uint32_t num_chans = (kind & 1) ? 4 : 3;
+		const uint8_t* pSrc = (kind >= 4) ? noise7.data() : ((kind >= 2) ? noise.data() : pSource32);
+
+		std::vector<uint8_t> img(w * h * num_chans);
+		for (uint32_t i = 0; i < w * h; i++)
+			memcpy(&img[i * num_chans], pSrc + i * 4, num_chans);
+
+		for (uint32_t test_index = 0; test_index < 6; test_index++)
+		{
+			// Single threaded and strip-parallel, each written by mapping the file, with pipelined writes, and pipelined with custom Huffman tables.
+			const uint32_t num_threads = (test_index & 1) ? 4 : 0;
+			const uint32_t pipelined = test_index >> 1;
+
+			fpng::fpng_encode_params params;
+			params.m_num_threads = num_threads;
+			if (pipelined)
+				params.m_flags = fpng::FPNG_ENCODE_PIPELINED_WRITE | ((pipelined == 2) ? fpng::FPNG_ENCODE_SLOWER : 0);
+
+			std::vector<uint8_t> expected;
+			if (!fpng::fpng_encode_image_to_memory(img.data(), w, h, num_chans, expected, params))
+			{
+				fprintf(stderr, "fpng_encode_image_to_memory() failed!\n");
+				return false;
+			}
+
+			// The file must be exactly the in-memory PNG, with nothing left over from sizing it for the worst case.
+			uint8_vec file_data;
+			if ((!fpng::fpng_encode_image_to_file(pFilename, img.data(), w, h, num_chans, params)) || (!read_file_to_vec(pFilename, file_data)) || (file_data != expected))
+			{
+				fprintf(stderr, "fpng_encode_image_to_file() wrote the wrong file (%u channels, %u threads, flags 0x%X)!\n", num_chans, num_threads, params.m_flags);
+				remove(pFilename);
+				return false;
+			}
+
+			fpng::fpng_decode_params decode_params;
+			decode_params.m_num_threads = num_threads;
+
+			std::vector<uint8_t> decoded;
+			uint32_t dw, dh, chans;
+			if ((fpng::fpng_decode_file(pFilename, decoded, dw, dh, chans, num_chans, decode_params) != fpng::FPNG_DECODE_SUCCESS) || (dw != w) || (dh != h) || (chans != num_chans) || (decoded != img))
+			{
+				fprintf(stderr, "fpng_decode_file() failed (%u channels, %u threads)!\n", num_chans, num_threads);
+				remove(pFilename);
+				return false;
+			}
+		}
+	}
+
+	// Overwriting a larger file must truncate it, and empty or missing files must fail cleanly.
+	{
+		std::vector<uint8_t> tiny(4 * 4 * 3, 128);
+		uint8_vec file_data;
+		if ((!fpng::fpng_encode_image_to_file(pFilename, tiny.data(), 4, 4, 3)) || (!read_file_to_vec(pFilename, file_data)) || (file_data.size() > 256))
+		{
+			fprintf(stderr, "fpng_encode_image_to_file() didn't truncate the file!\n");
+			remove(pFilename);
+			return false;
+		}
+
+#ifndef _WIN32
+		// With FPNG_ENCODE_REPLACE_FILE a failed encode must leave the existing file alone, with and without pipelined writes. Writes past the file size limit fail (with EFBIG, once
+		// SIGXFSZ is ignored), so lowering it makes writing a noisy image fail.
+		{
+			const uint32_t BIG_DIM = 256;
+			std::vector<uint8_t> big(BIG_DIM * BIG_DIM * 3);
+			for (auto& c : big)
+				c = (uint8_t)r.irand(0, 255);
+
+			struct rlimit old_limit, limit;
+			getrlimit(RLIMIT_FSIZE, &old_limit);
+			limit = old_limit;
+			limit.rlim_cur = 4096;
+
+			void (*pOld_handler)(int) = signal(SIGXFSZ, SIG_IGN);
+			bool kept = (setrlimit(RLIMIT_FSIZE, &limit) == 0);
+
+			for (uint32_t pipelined = 0; (kept) && (pipelined < 2); pipelined++)
+			{
+				fpng::fpng_encode_params params;
+				params.m_flags = fpng::FPNG_ENCODE_REPLACE_FILE | (pipelined ? fpng::FPNG_ENCODE_PIPELINED_WRITE : 0);
+
+				uint8_vec kept_data;
+				kept = (!fpng::fpng_encode_image_to_file(pFilename, big.data(), BIG_DIM, BIG_DIM, 3, params)) && (read_file_to_vec(pFilename, kept_data)) && (kept_data == file_data);
+			}
+
+			setrlimit(RLIMIT_FSIZE, &old_limit);
+			signal(SIGXFSZ, pOld_handler);
+
+			if (!kept)
+			{
+				fprintf(stderr, "fpng_encode_image_to_file() didn't fail, or changed the existing file!\n");
+				remove(pFilename);
+				return false;
+			}
+		}
+
+		// A replaced file must keep its permissions, and a symlink must be written through instead of being replaced.
+		{
+			const char* pLink_filename = "__fpng_file_io_link.png";
+
+			fpng::fpng_encode_params params;
+			params.m_flags = fpng::FPNG_ENCODE_REPLACE_FILE;
+
+			struct stat st;
+			const bool mode_kept = (chmod(pFilename, 0600) == 0) && (fpng::fpng_encode_image_to_file(pFilename, tiny.data(), 4, 4, 3, params)) && (stat(pFilename, &st) == 0) && ((st.st_mode & 0777) == 0600);
+
+			std::vector<uint8_t> gray(4 * 4 * 3, 64), expected;
+			uint8_vec link_data;
+			const bool link_kept = (symlink(pFilename, pLink_filename) == 0) && (fpng::fpng_encode_image_to_file(pLink_filename, gray.data(), 4, 4, 3, params)) && (lstat(pLink_filename, &st) == 0) && (S_ISLNK(st.st_mode)) &&
+				(fpng::fpng_encode_image_to_memory(gray.data(), 4, 4, 3, expected)) && (read_file_to_vec(pFilename, link_data)) && (link_data == expected);
+			remove(pLink_filename);
+
+			if ((!mode_kept) || (!link_kept))
+			{
+				fprintf(stderr, "fpng_encode_image_to_file() didn't keep the file's permissions (%u) or its symlink (%u)!\n", mode_kept, link_kept);
+				remove(pFilename);
+				return false;
+			}
+		}
+#endif
+
+		const bool wrote_empty = write_data_to_file_internal(pFilename, "", 0);
+
+		std::vector<uint8_t> decoded;
+		uint32_t dw, dh, chans;
+		const int empty_status = fpng::fpng_decode_file(pFilename, decoded, dw, dh, chans, 3);
+		remove(pFilename);
+
+		if ((!wrote_empty) || (empty_status != fpng::FPNG_DECODE_FAILED_NOT_PNG) || (fpng::fpng_decode_file(pFilename, decoded, dw, dh, chans, 3) != fpng::FPNG_DECODE_FILE_OPEN_FAILED))
+		{
+			fprintf(stderr, "fpng_decode_file() didn't fail on an empty or missing file!\n");
+			return false;
+		}
+	}
+
+	return true;
+}
+
+// pvpngreader undoes the Sub, Average and Paeth filters of 3 and 4 byte/pixel rows with SIMD kernels, so check it on files written by lodepng using each filter on every row.
+static bool verify_pvpng_filters()
+{
+	const uint32_t W = 101, H = 37;
+	mrand r(3);
+
+	for (uint32_t num_chans = 3; num_chans <= 4; num_chans++)
+	{
+		// Flat areas (where the Paeth predictor ties), gradients and noise.
+		std::vector<uint8_t> img(W * H * num_chans);
+		for (uint32_t y = 0; y < H; y++)
+			for (uint32_t x = 0; x < W; x++)
+				for (uint32_t c = 0; c < num_chans; c++)
+				{
+					uint8_t v = (uint8_t)(x * 3 + y * 5 + c * 40);
+					if ((x / 16 + y / 8) % 3 == 1)
+						v = (uint8_t)(c * 60);
+					else if ((x / 16 + y / 8) % 3 == 2)
+						v = (uint8_t)r.irand(0, 255);
+					img[(y * W + x) * num_chans + c] = v;
+				}
+
+		for (uint32_t filter = LFS_ZERO; filter <= LFS_FOUR; filter++)
+		{
+			lodepng::State state;
+			state.encoder.auto_convert = 0;
+			state.encoder.filter_strategy = (LodePNGFilterStrategy)filter;
+			state.info_raw.colortype = (num_chans == 4) ? LCT_RGBA : LCT_RGB;
+			state.info_raw.bitdepth = 8;
+			state.info_png.color.colortype = state.info_raw.colortype;
+			state.info_png.color.bitdepth = 8;
+
+			std::vector<uint8_t> file_buf;
+			if (lodepng::encode(file_buf, img.data(), W, H, state) != 0)
+			{
+				fprintf(stderr, "lodepng::encode() failed with filter %u!\n", filter);
+				return false;
+			}
+
+			uint32_t w = 0, h = 0, chans = 0;
+			void* pDecoded = pv_png::load_png(file_buf.data(), file_buf.size(), num_chans, w, h, chans);
+			const bool matches = pDecoded && (w == W) && (h == H) && (chans == num_chans) && (memcmp(pDecoded, img.data(), img.size()) == 0);
+			free(pDecoded);
+
+			if (!matches)
+			{
+				fprintf(stderr, "pvpng decode verification failed with filter %u, %u channels!\n", filter, num_chans);
+				return false;
+			}
+		}
+	}
+
+	return true;
+}
+
+// pvpngreader inflates the whole IDAT stream at once, so check it against lodepng on stored, fixed and dynamic Huffman blocks, interlaced files, and other pixel formats.
+static bool verify_pvpng_inflate()
+{
+	const uint32_t W = 93, H = 71;
+	mrand r(4);
+
+	// Grey with alpha, so the conversions below are lossless. Runs of flat pixels give the encoder matches, the rest are literals.
+	std::vector<uint8_t> img(W * H * 4);
+	for (uint32_t y = 0; y < H; y++)
+		for (uint32_t x = 0; x < W; x++)
+		{
+			uint8_t* p = &img[(y * W + x) * 4];
+			const uint8_t v = ((x / 8 + y / 4) & 1) ? (uint8_t)r.irand(0, 255) : (uint8_t)(y * 3);
+			p[0] = p[1] = p[2] = v;
+			p[3] = (uint8_t)(x * 2 + y);
+		}
+
+	struct png_format { LodePNGColorType m_color_type; uint32_t m_bit_depth; };
+	static const png_format s_formats[] = { { LCT_RGB, 8 }, { LCT_RGBA, 8 }, { LCT_GREY_ALPHA, 8 }, { LCT_RGBA, 16 } };
+
+	for (const png_format& fmt : s_formats)
+	{
+		for (uint32_t btype = 0; btype <= 2; btype++)
+		{
+			for (uint32_t interlace = 0; interlace <= 1; interlace++)
+			{
+				lodepng::State state;
+				state.encoder.auto_convert = 0;
+				state.encoder.zlibsettings.btype = btype;
+				state.encoder.filter_strategy = LFS_MINSUM;
+				state.info_raw.colortype = LCT_RGBA;
+				state.info_raw.bitdepth = 8;
+				state.info_png.color.colortype = fmt.m_color_type;
+				state.info_png.color.bitdepth = fmt.m_bit_depth;
+				state.info_png.interlace_method = interlace;
+
+				std::vector<uint8_t> file_buf;
+				if (lodepng::encode(file_buf, img.data(), W, H, state) != 0)
+				{
+					fprintf(stderr, "lodepng::encode() failed!\n");
+					return false;
+				}
+
+				std::vector<uint8_t> expected;
+				uint32_t ew = 0, eh = 0;
+				if (lodepng::decode(expected, ew, eh, file_buf, LCT_RGBA, 8) != 0)
+				{
+					fprintf(stderr, "lodepng::decode() failed!\n");
+					return false;
+				}
+
+				uint32_t w = 0, h = 0, chans = 0;
+				void* pDecoded = pv_png::load_png(file_buf.data(), file_buf.size(), 4, w, h, chans);
+				const bool matches = pDecoded && (w == W) && (h == H) && (memcmp(pDecoded, expected.data(), expected.size()) == 0);
+				free(pDecoded);
+
+				if (!matches)
+				{
+					fprintf(stderr, "pvpng decode verification failed with color type %u, bit depth %u, block type %u, interlace %u!\n", fmt.m_color_type, fmt.m_bit_depth, btype, interlace);
+					return false;
+				}
+
+				// A truncated IDAT stream must fail, not crash.
+				std::vector<uint8_t> truncated_buf(file_buf);
+				truncated_buf.resize(file_buf.size() / 2);
+				pDecoded = pv_png::load_png(truncated_buf.data(), truncated_buf.size(), 4, w, h, chans);
+				if (pDecoded)
+				{
+					free(pDecoded);
+					fprintf(stderr, "pvpng decoded a truncated file!\n");
+					return false;
+				}
+
+				// Files with a valid chunk structure and CRCs, but a truncated or corrupted zlib stream, get past the chunk parser to the inflater, which must reject them.
+				// The exception is corrupted Huffman coded data, which can decode to more than the image: pvpng stops once the image is full (like the line at a time
+				// path, it ignores extra data), so the Adler-32 isn't reached. Those only have to decode safely.
+				const std::vector<uint8_t> zlib_stream(get_zlib_stream(file_buf));
+				for (uint32_t damage = 0; damage < 5; damage++)
+				{
+					std::vector<uint8_t> damaged(zlib_stream);
+					switch (damage)
+					{
+					case 0: damaged.resize(damaged.size() / 2); break;					// cut off in the middle of the Deflate data
+					case 1: damaged.resize(damaged.size() - 4); break;					// missing Adler-32
+					case 2: damaged[damaged.size() / 2] ^= 0x55; break;				// corrupted Deflate data
+					case 3: damaged[2] |= 6; break;										// reserved block type 3
+					default: damaged.back() ^= 1; break;								// wrong Adler-32
+					}
+
+					const std::vector<uint8_t> damaged_file(replace_zlib_stream(file_buf, damaged));
+					pDecoded = pv_png::load_png(damaged_file.data(), damaged_file.size(), 4, w, h, chans);
+					if ((pDecoded) && (damage == 2) && (btype))
+						free(pDecoded);
+					else if (pDecoded)
+					{
+						free(pDecoded);
+						fprintf(stderr, "pvpng decoded a damaged zlib stream (damage %u, color type %u, bit depth %u, block type %u, interlace %u)!\n", damage, fmt.m_color_type, fmt.m_bit_depth, btype, interlace);
+						return false;
+					}
+				}
+			}
+		}
+	}
+
+	return true;
+}
+
+// fpng_decode_any()'s general purpose decoder: pvpngreader, which can skip the CRC32's checked by fpng's chunk scan. pUser_data counts the calls.
+static bool pvpng_fallback_decode(const void* pImage, size_t image_size, const fpng::fpng_png_info& info, uint8_t* pDst, uint32_t dst_pitch, uint32_t desired_channels, void* pUser_data)
+{
+	(*static_cast<uint32_t*>(pUser_data))++;
+
+	uint32_t w = 0, h = 0, chans = 0;
+	const size_t dst_buf_size = (size_t)(info.m_height - 1) * dst_pitch + info.m_width * desired_channels;
+	return pv_png::load_png_to(pImage, image_size, desired_channels, pDst, dst_buf_size, dst_pitch, w, h, chans, info.m_chunks_checked ? pv_png::LOAD_PNG_SKIP_CRC32 : 0);
+}
+
+// Decodes file_buf with fpng_decode_any() into a padded buffer and a vector, and compares them to pv_png::load_png()'s output.
+static bool verify_decode_any_file(const std::vector<uint8_t>& file_buf, uint32_t desired_channels, uint32_t expected_fallback_calls)
+{
+	uint32_t ew = 0, eh = 0, echans = 0;
+	void* pExpected = pv_png::load_png(file_buf.data(), file_buf.size(), desired_channels, ew, eh, echans);
+	if (!pExpected)
+	{
+		fprintf(stderr, "pv_png::load_png() failed!\n");
+		return false;
+	}
+
+	const uint32_t bpl = ew * desired_channels, pitch = bpl + 5;
+	std::vector<uint8_t> padded((size_t)pitch * eh, 0xCD), out;
+
+	uint32_t fallback_calls = 0;
+	uint32_t w = 0, h = 0, chans = 0, vw = 0, vh = 0, vchans = 0;
+	int status = fpng::fpng_decode_any(file_buf.data(), file_buf.size(), padded.data(), padded.size(), pitch, w, h, chans, desired_channels, pvpng_fallback_decode, &fallback_calls);
+	int vstatus = fpng::fpng_decode_any(file_buf.data(), file_buf.size(), out, vw, vh, vchans, desired_channels, pvpng_fallback_decode, &fallback_calls);
+
+	bool matches = (status == fpng::FPNG_DECODE_SUCCESS) && (vstatus == fpng::FPNG_DECODE_SUCCESS) && (w == ew) && (h == eh) && (chans == echans) && (vw == ew) && (vh == eh) && (vchans == echans) &&
+		(fallback_calls == expected_fallback_calls * 2) && (memcmp(out.data(), pExpected, (size_t)bpl * eh) == 0);
+
+	for (uint32_t y = 0; matches && (y < eh); y++)
+		matches = (memcmp(&padded[(size_t)y * pitch], (const uint8_t*)pExpected + (size_t)y * bpl, bpl) == 0) && (padded[(size_t)y * pitch + bpl] == 0xCD);
+
+	free(pExpected);
+
+	if (!matches)
+	{
+		fprintf(stderr, "fpng_decode_any() verification failed with %u channels (status %i %i, %u fallback calls)!\n", desired_channels, status, vstatus, fallback_calls);
+		return false;
+	}
+
+	return true;
+}
+
+static bool verify_decode_any()
+{
+	const uint32_t W = 77, H = 45;
+	mrand r(5);
+
+	std::vector<uint8_t> img(W * H * 4);
+	for (uint32_t y = 0; y < H; y++)
+		for (uint32_t x = 0; x < W; x++)
+		{
+			uint8_t* p = &img[(y * W + x) * 4];
+			p[0] = (uint8_t)(x * 3);
+			p[1] = (uint8_t)(y * 5);
+			p[2] = (uint8_t)r.irand(0, 255);
+			p[3] = (uint8_t)((x + y) * 2);
+		}
+
+	// fpng's own files only use the fallback when decoded to 1 or 2 channels.
+	std::vector<uint8_t> fpng_file;
+	if (!fpng::fpng_encode_image_to_memory(img.data(), W, H, 4, fpng_file))
+	{
+		fprintf(stderr, "fpng_encode_image_to_memory() failed!\n");
+		return false;
+	}
+
+	for (uint32_t desired_channels = 1; desired_channels <= 4; desired_channels++)
+		if (!verify_decode_any_file(fpng_file, desired_channels, (desired_channels < 3) ? 1 : 0))
+			return false;
+
+	// Everything else goes to the fallback: palettized, interlaced and 16-bit files.
+	for (uint32_t i = 0; i < 3; i++)
+	{
+		lodepng::State state;
+		state.info_raw.colortype = LCT_RGBA;
+		state.info_raw.bitdepth = 8;
+
+		std::vector<uint8_t> pixels(img);
+		if (i == 0)
+		{
+			// Few enough colors for a palette.
+			for (size_t j = 0; j < pixels.size(); j++)
+				pixels[j] &= 0xC0;
+		}
+		else if (i == 1)
+			state.info_png.interlace_method = 1;
+		else
+		{
+			state.encoder.auto_convert = 0;
+			state.info_png.color.colortype = LCT_RGB;
+			state.info_png.color.bitdepth = 16;
+		}
+
+		std::vector<uint8_t> file_buf;
+		if (lodepng::encode(file_buf, pixels.data(), W, H, state) != 0)
+		{
+			fprintf(stderr, "lodepng::encode() failed!\n");
+			return false;
+		}
+
+		for (uint32_t desired_channels = 1; desired_channels <= 4; desired_channels++)
+			if (!verify_decode_any_file(file_buf, desired_channels, 1))
+				return false;
+
+		// The scan checks the IDAT CRC32's of files it hands to the fallback, so a corrupted one fails without calling it.
+		if (i == 1)
+		{
+			std::vector<uint8_t> corrupted_buf(file_buf);
+			corrupted_buf[corrupted_buf.size() - 20]++;
+
+			std::vector<uint8_t> out;
+			uint32_t fallback_calls = 0, w = 0, h = 0, chans = 0;
+			int status = fpng::fpng_decode_any(corrupted_buf.data(), corrupted_buf.size(), out, w, h, chans, 4, pvpng_fallback_decode, &fallback_calls);
+			if ((status != fpng::FPNG_DECODE_FAILED_CHECKSUM) || (fallback_calls))
+			{
+				fprintf(stderr, "fpng_decode_any() didn't detect a corrupted IDAT chunk!\n");
+				return false;
+			}
+		}
+	}
+
+	// A buffer that's too small is rejected, but the dimensions are returned.
+	uint8_t small_buf[16];
+	uint32_t fallback_calls = 0, w = 0, h = 0, chans = 0;
+	int status = fpng::fpng_decode_any(fpng_file.data(), fpng_file.size(), small_buf, sizeof(small_buf), 0, w, h, chans, 4, pvpng_fallback_decode, &fallback_calls);
+	if ((status != fpng::FPNG_DECODE_INVALID_ARG) || (w != W) || (h != H) || (chans != 4) || (fallback_calls))
+	{
+		fprintf(stderr, "fpng_decode_any() didn't reject a small buffer!\n");
+		return false;
+	}
+
+	return true;
+}
+
+// Encodes from and decodes to other pixel layouts: swizzled, with an unused byte, and premultiplied by alpha. The files must be identical to ones encoded from RGB/RGBA.
+static bool verify_memory_layouts(const uint8_t* pSource32, uint32_t w, uint32_t h)
+{
+	// The offsets of R, G, B and A (or the unused byte) in memory.
+	struct layout { uint32_t m_format, m_bpp, m_file_chans; uint32_t m_ofs[4]; };
+	static const layout s_layouts[] = 
+	{
+		{ fpng::FPNG_PIXEL_FORMAT_BGR, 3, 3, { 2, 1, 0, 0 } },
+		{ fpng::FPNG_PIXEL_FORMAT_BGRA, 4, 4, { 2, 1, 0, 3 } },
+		{ fpng::FPNG_PIXEL_FORMAT_ARGB, 4, 4, { 1, 2, 3, 0 } },
+		{ fpng::FPNG_PIXEL_FORMAT_ABGR, 4, 4, { 3, 2, 1, 0 } },
+		{ fpng::FPNG_PIXEL_FORMAT_RGBX, 4, 3, { 0, 1, 2, 3 } },
+		{ fpng::FPNG_PIXEL_FORMAT_BGRX, 4, 3, { 2, 1, 0, 3 } },
+		{ fpng::FPNG_PIXEL_FORMAT_XRGB, 4, 3, { 1, 2, 3, 0 } },
+		{ fpng::FPNG_PIXEL_FORMAT_XBGR, 4, 3, { 3, 2, 1, 0 } },
+		{ fpng::FPNG_PIXEL_FORMAT_DEFAULT | fpng::FPNG_PIXEL_FORMAT_PREMULTIPLIED, 4, 4, { 0, 1, 2, 3 } },
+		{ fpng::FPNG_PIXEL_FORMAT_BGRA | fpng::FPNG_PIXEL_FORMAT_PREMULTIPLIED, 4, 4, { 2, 1, 0, 3 } },
+	};
+
+	const size_t total_pixels = (size_t)w * h;
+
+	for (const layout& l : s_layouts)
+	{
+		const bool premultiplied = (l.m_format & fpng::FPNG_PIXEL_FORMAT_PREMULTIPLIED) != 0;
+
+		// The image in memory (with a gradient for alpha, and junk in unused bytes), the pixels the file should hold, and the image decoding should return.
+		// Premultiplied colors round trip exactly, and unused bytes are decoded as 255.
+		std::vector<uint8_t> mem(total_pixels * l.m_bpp), file_pixels(total_pixels * l.m_file_chans), expected(mem.size());
+		for (size_t i = 0; i < total_pixels; i++)
+		{
+			const uint8_t* pSrc = pSource32 + i * 4;
+			const uint32_t a = (uint32_t)((i % w) * 3 + (i / w)) & 0xFF;
+
+			uint8_t* pMem = &mem[i * l.m_bpp];
+			uint8_t* pFile = &file_pixels[i * l.m_file_chans];
+			for (uint32_t c = 0; c < 3; c++)
+			{
+				uint32_t v = pSrc[c];
+				if (premultiplied)
+				{
+					v = (v * a + 127) / 255;
+					pFile[c] = (uint8_t)(a ? minimum<uint32_t>(255, (v * 255 + a / 2) / a) : 0);
+				}
+				else
+					pFile[c] = (uint8_t)v;
+
+				pMem[l.m_ofs[c]] = (uint8_t)v;
+			}
+
+			if (l.m_bpp == 4)
+				pMem[l.m_ofs[3]] = (uint8_t)((l.m_file_chans == 4) ? a : (i * 13));
+			if (l.m_file_chans == 4)
+				pFile[3] = (uint8_t)a;
+
+			memcpy(&expected[i * l.m_bpp], pMem, l.m_bpp);
+			if ((l.m_bpp == 4) && (l.m_file_chans == 3))
+				expected[i * l.m_bpp + l.m_ofs[3]] = 255;
+		}
+
+		// Single pass, sampled tables with strips, two passes with adaptive filters, LZ matches, and raw blocks.
+		std::vector<uint8_t> file_bufs[5];
+		for (uint32_t config = 0; config < 5; config++)
+		{
+			fpng::fpng_encode_params params;
+			params.m_level = (config == 4) ? fpng::FPNG_LEVEL_UNCOMPRESSED : ((config == 1) ? fpng::FPNG_LEVEL_MEDIUM : ((config == 2) ? fpng::FPNG_LEVEL_SLOWEST : fpng::FPNG_LEVEL_FASTEST));
+			params.m_flags = (config == 3) ? fpng::FPNG_ENCODE_LZ_MATCHES : 0;
+			params.m_num_threads = (config & 1) ? 4 : 0;
+
+			std::vector<uint8_t> expected_file;
+			if (!fpng::fpng_encode_image_to_memory(file_pixels.data(), w, h, l.m_file_chans, expected_file, params))
+			{
+				fprintf(stderr, "fpng_encode_image_to_memory() failed!\n");
+				return false;
+			}
+
+			params.m_src_format = l.m_format;
+			if ((!fpng::fpng_encode_image_to_memory(mem.data(), w, h, l.m_file_chans, file_bufs[config], params)) || (file_bufs[config] != expected_file))
+			{
+				fprintf(stderr, "fpng_encode_image_to_memory() failed with pixel format 0x%X, config %u!\n", l.m_format, config);
+				return false;
+			}
+		}
+
+		// The general purpose decoder's output is converted too. lodepng mustn't pick a smaller color type, which it can for small images that happen to be gray.
+		lodepng::State state;
+		state.encoder.auto_convert = 0;
+		state.info_raw.colortype = state.info_png.color.colortype = (l.m_file_chans == 4) ? LCT_RGBA : LCT_RGB;
+		state.info_raw.bitdepth = state.info_png.color.bitdepth = 8;
+
+		std::vector<uint8_t> lodepng_file;
+		if (lodepng::encode(lodepng_file, file_pixels.data(), w, h, state) != 0)
+		{
+			fprintf(stderr, "lodepng::encode() failed!\n");
+			return false;
+		}
+
+		fpng::fpng_decode_params params;
+		params.m_dst_format = l.m_format;
+		params.m_num_threads = 4;
+
+		const uint32_t bpl = w * l.m_bpp, pitch = bpl + 3;
+
+		for (uint32_t file_index = 0; file_index < 4; file_index++)
+		{
+			// Single block, strips, strips written as raw blocks, and a file that isn't fpng's.
+			const std::vector<uint8_t>& file_buf = (file_index == 3) ? lodepng_file : file_bufs[file_index * 2];
+
+			std::vector<uint8_t> out, padded((size_t)pitch * h, 0xCD);
+			uint32_t dw = 0, dh = 0, chans = 0, fallback_calls = 0;
+			int res;
+			if (file_index == 3)
+			{
+				res = fpng::fpng_decode_any(file_buf.data(), file_buf.size(), out, dw, dh, chans, l.m_bpp, pvpng_fallback_decode, &fallback_calls, params);
+				if (res == fpng::FPNG_DECODE_SUCCESS)
+					res = fpng::fpng_decode_any(file_buf.data(), file_buf.size(), padded.data(), padded.size(), pitch, dw, dh, chans, l.m_bpp, pvpng_fallback_decode, &fallback_calls, params);
+			}
+			else
+			{
+				res = fpng::fpng_decode_memory(file_buf.data(), file_buf.size(), out, dw, dh, chans, l.m_bpp, params);
+				if (res == fpng::FPNG_DECODE_SUCCESS)
+					res = fpng::fpng_decode_memory(file_buf.data(), file_buf.size(), padded.data(), padded.size(), pitch, dw, dh, chans, l.m_bpp, params);
+			}
+
+			bool matches = (res == fpng::FPNG_DECODE_SUCCESS) && (dw == w) && (dh == h) && (chans == l.m_file_chans) && (out == expected);
+			for (uint32_t y = 0; matches && (y < h); y++)
+				matches = (memcmp(&padded[(size_t)y * pitch], &expected[(size_t)y * bpl], bpl) == 0) && (padded[(size_t)y * pitch + bpl] == 0xCD);
+
+			if (!matches)
+			{
+				fprintf(stderr, "Decoding file %u to pixel format 0x%X failed, error %i!\n", file_index, l.m_format, res);
+				return false;
+			}
+
+			if (file_index == 3)
+				continue;
+
+			decode_rows_state state;
+			state.m_bpl = bpl;
+			state.m_next_row = 0;
+			state.m_failed = false;
+
+			res = fpng::fpng_decode_memory_rows(file_buf.data(), file_buf.size(), 7, decode_rows_func, &state, dw, dh, chans, l.m_bpp, params);
+			if ((res != fpng::FPNG_DECODE_SUCCESS) || (state.m_failed) || (state.m_image != expected))
+			{
+				fprintf(stderr, "fpng_decode_memory_rows() to pixel format 0x%X failed on file %u, error %i!\n", l.m_format, file_index, res);
+				return false;
+			}
+
+			// A band away from both edges of the image, which is never empty.
+			const uint32_t first_row = h / 5, end_row = h - h / 20;
+			for (uint32_t shift = 0; shift <= 1; shift++)
+			{
+				const std::vector<uint8_t> expected_region = downscale_reference<uint8_t>(expected, w, l.m_bpp, first_row, end_row, shift);
+				std::vector<uint8_t> region(expected_region.size());
+
+				res = fpng::fpng_decode_memory_region(file_buf.data(), file_buf.size(), first_row, end_row, shift, region.data(), region.size(), 0, dw, dh, chans, l.m_bpp, params);
+				if ((res != fpng::FPNG_DECODE_SUCCESS) || (region != expected_region))
+				{
+					fprintf(stderr, "fpng_decode_memory_region() to pixel format 0x%X failed on file %u, error %i!\n", l.m_format, file_index, res);
+					return false;
+				}
+			}
+		}
+	}
+
+	// Formats must match the number of channels, and only formats with alpha can be premultiplied.
+	std::vector<uint8_t> file_buf, out;
+	if (!fpng::fpng_encode_image_to_memory(pSource32, w, h, 4, file_buf))
+	{
+		fprintf(stderr, "fpng_encode_image_to_memory() failed!\n");
+		return false;
+	}
+
+	fpng::fpng_decode_params params;
+	uint32_t dw, dh, chans;
+	
+	params.m_dst_format = fpng::FPNG_PIXEL_FORMAT_BGRA;
+	const int res0 = fpng::fpng_decode_memory(file_buf.data(), file_buf.size(), out, dw, dh, chans, 3, params);
+	
+	params.m_dst_format = fpng::FPNG_PIXEL_FORMAT_RGBX | fpng::FPNG_PIXEL_FORMAT_PREMULTIPLIED;
+	const int res1 = fpng::fpng_decode_memory(file_buf.data(), file_buf.size(), out, dw, dh, chans, 4, params);
+
+	if ((res0 != fpng::FPNG_DECODE_INVALID_ARG) || (res1 != fpng::FPNG_DECODE_INVALID_ARG))
+	{
+		fprintf(stderr, "fpng_decode_memory() didn't reject an invalid pixel format!\n");
+		return false;
+	}
+
+	// 16-bit files can be decoded to a pixel format as 8-bit samples, but not as 16-bit samples.
+	std::vector<uint16_t> img16((size_t)w * h * 4);
+	for (size_t i = 0; i < img16.size(); i++)
+		img16[i] = (uint16_t)((pSource32[i] << 8) | (i & 0xFF));
+
+	fpng::fpng_encode_params encode_params;
+	encode_params.m_flags = fpng::FPNG_ENCODE_16BIT;
+	if (!fpng::fpng_encode_image_to_memory(img16.data(), w, h, 4, file_buf, encode_params))
+	{
+		fprintf(stderr, "fpng_encode_image_to_memory() failed!\n");
+		return false;
+	}
+
+	params.m_dst_format = fpng::FPNG_PIXEL_FORMAT_BGRA;
+	const int res2 = fpng::fpng_decode_memory(file_buf.data(), file_buf.size(), out, dw, dh, chans, 4, params);
+	bool matches = (res2 == fpng::FPNG_DECODE_SUCCESS) && (out.size() == (size_t)w * h * 4);
+	for (uint32_t i = 0; matches && (i < w * h); i++)
+		matches = (out[i * 4 + 0] == pSource32[i * 4 + 2]) && (out[i * 4 + 1] == pSource32[i * 4 + 1]) && (out[i * 4 + 2] == pSource32[i * 4 + 0]) && (out[i * 4 + 3] == pSource32[i * 4 + 3]);
+	
+	params.m_flags = fpng::FPNG_DECODE_16BIT;
+	const int res3 = fpng::fpng_decode_memory(file_buf.data(), file_buf.size(), out, dw, dh, chans, 4, params);
+
+	if ((!matches) || (res3 != fpng::FPNG_DECODE_INVALID_ARG))
+	{
+		fprintf(stderr, "fpng_decode_memory() of a 16-bit file to a pixel format failed, error %i!\n", res2);
+		return false;
+	}
+
+	return true;
+}
+
+struct apng_frame_box { uint32_t m_x, m_y, m_w, m_h; };
+
+// Checks the chunks of an APNG file written by fpng_apng_encoder, then decodes each frame with lodepng (by wrapping its IDAT or fdAT data in a PNG file of its own), 
+// and draws it over the previous frames. The result must match each of the frames, and each frame must only cover its expected box.
+static bool verify_apng_file(const std::vector<uint8_t>& file_buf, uint32_t w, uint32_t h, uint32_t num_chans, const std::vector< std::vector<uint8_t> >& frames, const apng_frame_box* pBoxes)
+{
+	std::vector<uint8_t> canvas(frames[0].size()), frame_data;
+	uint32_t num_frames = 0, next_seq_num = 0;
+	apng_frame_box box = { 0, 0, 0, 0 };
+	bool has_actl = false;
+
+	for (size_t ofs = 8; ; )
+	{
+		if ((ofs + 12) > file_buf.size())
+			return false;
+
+		const uint32_t len = read_be32(&file_buf[ofs]);
+		const std::string type((const char*)&file_buf[ofs + 4], 4);
+		const uint8_t* pData = &file_buf[ofs + 8];
+		if (((ofs + 12 + len) > file_buf.size()) || (lodepng_crc32(&file_buf[ofs + 4], 4 + len) != read_be32(pData + len)))
+			return false;
+		ofs += 12 + len;
+
+		// A frame ends at the next fcTL chunk or at IEND.
+		if (((type == "fcTL") || (type == "IEND")) && (num_frames))
+		{
+			static const uint8_t s_color_type[] = { 0, 0, 4, 2, 6 };
+			const uint8_t ihdr[13] = { (uint8_t)(box.m_w >> 24), (uint8_t)(box.m_w >> 16), (uint8_t)(box.m_w >> 8), (uint8_t)box.m_w, 
+				(uint8_t)(box.m_h >> 24), (uint8_t)(box.m_h >> 16), (uint8_t)(box.m_h >> 8), (uint8_t)box.m_h, 8, s_color_type[num_chans], 0, 0, 0 };
+
+			std::vector<uint8_t> png = { 0x89, 0x50, 0x4e, 0x47, 0x0d, 0x0a, 0x1a, 0x0a };
+			append_png_chunk(png, "IHDR", ihdr, sizeof(ihdr));
+			append_png_chunk(png, "IDAT", frame_data.data(), frame_data.size());
+			append_png_chunk(png, "IEND", nullptr, 0);
+
+			uint8_t* pPixels = nullptr;
+			uint32_t dw = 0, dh = 0;
+			const bool decoded = lodepng_decode_memory(&pPixels, &dw, &dh, png.data(), png.size(), (num_chans == 3) ? LCT_RGB : LCT_RGBA, 8) == 0;
+			if (decoded)
+			{
+				for (uint32_t y = 0; y < box.m_h; y++)
+					memcpy(&canvas[((box.m_y + y) * w + box.m_x) * num_chans], pPixels + y * box.m_w * num_chans, box.m_w * num_chans);
+			}
+			free(pPixels);
+
+			const apng_frame_box& expected_box = pBoxes[num_frames - 1];
+			if ((!decoded) || (canvas != frames[num_frames - 1]) || (box.m_x != expected_box.m_x) || (box.m_y != expected_box.m_y) || (box.m_w != expected_box.m_w) || (box.m_h != expected_box.m_h))
+			{
+				fprintf(stderr, "APNG frame %u doesn't match!\n", num_frames - 1);
+				return false;
+			}
+
+			frame_data.clear();
+		}
+
+		if (type == "acTL")
+		{
+			if ((len != 8) || (read_be32(pData) != frames.size()) || (num_frames))
+				return false;
+			has_actl = true;
+		}
+		else if (type == "fcTL")
+		{
+			// Every frame replaces the pixels in its box, and leaves the rest of the canvas alone.
+			if ((len != 26) || (!has_actl) || (read_be32(pData) != next_seq_num++) || (pData[24] != 0) || (pData[25] != 0))
+				return false;
+
+			box.m_w = read_be32(pData + 4);
+			box.m_h = read_be32(pData + 8);
+			box.m_x = read_be32(pData + 12);
+			box.m_y = read_be32(pData + 16);
+			if ((num_frames == frames.size()) || (!box.m_w) || (!box.m_h) || ((box.m_x + box.m_w) > w) || ((box.m_y + box.m_h) > h))
+				return false;
+			
+			num_frames++;
+		}
+		else if (type == "IDAT")
+		{
+			if (num_frames != 1)
+				return false;
+			frame_data.insert(frame_data.end(), pData, pData + len);
+		}
+		else if (type == "fdAT")
+		{
+			if ((len < 4) || (num_frames < 2) || (read_be32(pData) != next_seq_num++))
+				return false;
+			frame_data.insert(frame_data.end(), pData + 4, pData + len);
+		}
+		else if (type == "IEND")
+			break;
+	}
+
+	return num_frames == frames.size();
+}
+
+static bool verify_apng(const uint8_t* pSource32, uint32_t w, uint32_t h)
+{
+	const size_t total_pixels = (size_t)w * h;
+
+	for (uint32_t num_chans = 3; num_chans <= 4; num_chans++)
+	{
+		// The frames: the image, a small rectangle changed, the same again, the first and last pixels changed, and one channel of one pixel changed.
+		std::vector< std::vector<uint8_t> > frames(5);
+		
+		frames[0].resize(total_pixels * num_chans);
+		for (size_t i = 0; i < total_pixels; i++)
+			memcpy(&frames[0][i * num_chans], pSource32 + i * 4, num_chans);
+
+		const apng_frame_box boxes[5] = { { 0, 0, w, h }, { w / 4, h / 3, maximum(w / 2, 1U), maximum(h / 5, 1U) }, { 0, 0, 1, 1 }, { 0, 0, w, h }, { w / 2, h / 2, 1, 1 } };
+
+		frames[1] = frames[0];
+		for (uint32_t y = 0; y < boxes[1].m_h; y++)
+			for (uint32_t x = 0; x < boxes[1].m_w * num_chans; x++)
+				frames[1][((boxes[1].m_y + y) * w + boxes[1].m_x) * num_chans + x] ^= 0x55;
+
+		frames[2] = frames[1];
+
+		frames[3] = frames[2];
+		frames[3][0] ^= 0xFF;
+		frames[3][total_pixels * num_chans - 1] ^= 0xFF;
+
+		frames[4] = frames[3];
+		frames[4][((size_t)(h / 2) * w + (w / 2)) * num_chans + num_chans - 1] ^= 1;
+
+		for (uint32_t config = 0; config < 4; config++)
+		{
+			fpng::fpng_encode_params params;
+			if (config == 1)
+				params.m_flags = fpng::FPNG_ENCODE_SLOWER;
+			else if (config == 2)
+				params.m_flags = fpng::FPNG_FORCE_UNCOMPRESSED;
+			else if (config == 3)
+				params.m_src_format = (num_chans == 3) ? fpng::FPNG_PIXEL_FORMAT_BGRX : fpng::FPNG_PIXEL_FORMAT_BGRA;
+
+			std::vector<uint8_t> file_buf;
+			fpng::fpng_apng_encoder encoder;
+			bool status = encoder.begin(w, h, num_chans, (uint32_t)frames.size(), 0, stream_write_func, &file_buf, params);
+
+			for (uint32_t frame_index = 0; (status) && (frame_index < frames.size()); frame_index++)
+			{
+				if (config == 3)
+				{
+					// Swap R and B, with junk (the same in every frame) in the unused byte.
+					std::vector<uint8_t> mem(total_pixels * 4);
+					for (size_t i = 0; i < total_pixels; i++)
+					{
+						const uint8_t* pSrc = &frames[frame_index][i * num_chans];
+						mem[i * 4 + 0] = pSrc[2];
+						mem[i * 4 + 1] = pSrc[1];
+						mem[i * 4 + 2] = pSrc[0];
+						mem[i * 4 + 3] = (num_chans == 4) ? pSrc[3] : (uint8_t)(i * 7);
+					}
+
+					status = encoder.add_frame(mem.data(), 1, 30);
+				}
+				else
+					status = encoder.add_frame(frames[frame_index].data(), 1, 30);
+			}
+
+			if ((!status) || (!encoder.finish()))
+			{
+				fprintf(stderr, "fpng_apng_encoder failed with %u channels, config %u!\n", num_chans, config);
+				return false;
+			}
+
+			if (!verify_apng_file(file_buf, w, h, num_chans, frames, boxes))
+			{
+				fprintf(stderr, "APNG file with %u channels, config %u is invalid!\n", num_chans, config);
+				return false;
+			}
+
+			// Decoders without APNG support return the first frame.
+			std::vector<uint8_t> decoded;
+			uint32_t dw, dh, chans;
+			const int res = fpng::fpng_decode_memory(file_buf.data(), file_buf.size(), decoded, dw, dh, chans, num_chans);
+			if ((res != fpng::FPNG_DECODE_SUCCESS) || (decoded != frames[0]))
+			{
+				fprintf(stderr, "fpng_decode_memory() failed on an APNG file with %u channels, config %u, error %i!\n", num_chans, config, res);
+				return false;
+			}
+		}
+	}
+
+	return true;
+}
+
+// An image stored as TILE_SIZE x TILE_SIZE tiles, each tile's pixels packed row by row, with the tiles in row major order.
+struct tiled_image
+{
+	enum { TILE_SIZE = 32 };
+
+	std::vector<uint8_t> m_tiles;
+	uint32_t m_w, m_h, m_bpp, m_tiles_x;
+
+	tiled_image(const uint8_t* pPixels, uint32_t w, uint32_t h, uint32_t bpp) : m_w(w), m_h(h), m_bpp(bpp), m_tiles_x((w + TILE_SIZE - 1) / TILE_SIZE)
+	{
+		m_tiles.resize((size_t)m_tiles_x * ((h + TILE_SIZE - 1) / TILE_SIZE) * TILE_SIZE * TILE_SIZE * bpp);
+		for (uint32_t y = 0; y < h; y++)
+			for (uint32_t x = 0; x < w; x++)
+				memcpy(pixel(x, y), pPixels + ((size_t)y * w + x) * bpp, bpp);
+	}
+
+	uint8_t* pixel(uint32_t x, uint32_t y)
+	{
+		const size_t tile_index = (size_t)(y / TILE_SIZE) * m_tiles_x + (x / TILE_SIZE);
+		return &m_tiles[((tile_index * TILE_SIZE + (y % TILE_SIZE)) * TILE_SIZE + (x % TILE_SIZE)) * m_bpp];
+	}
+
+	static void read_row(uint32_t y, void* pDst, void* pUser_data)
+	{
+		tiled_image& img = *static_cast<tiled_image*>(pUser_data);
+		for (uint32_t x = 0; x < img.m_w; x += TILE_SIZE)
+			memcpy(static_cast<uint8_t*>(pDst) + (size_t)x * img.m_bpp, img.pixel(x, y), (size_t)minimum<uint32_t>(TILE_SIZE, img.m_w - x) * img.m_bpp);
+	}
+};
+
+static bool verify_row_sources(const uint8_t* pSource32, uint32_t source_w, uint32_t source_h)
+{
+	// A sub-rectangle of the image, tall enough to be split into strips, leaving a column to its right for the shifted APNG frame below (unless the image is 1 pixel wide).
+	const uint32_t shift = (source_w > 1) ? 1 : 0;
+	const uint32_t X = minimum<uint32_t>(13, source_w / 4), Y = minimum<uint32_t>(7, source_h / 4);
+	const uint32_t W = minimum<uint32_t>(301, source_w - X - shift), H = minimum<uint32_t>(250, source_h - Y);
+
+	// RGB, RGBA from BGRA, and 16-bit gray+alpha.
+	struct row_test { uint32_t m_num_chans, m_format; bool m_samples16; };
+	const row_test s_tests[] =
+	{
+		{ 3, fpng::FPNG_PIXEL_FORMAT_DEFAULT, false },
+		{ 4, fpng::FPNG_PIXEL_FORMAT_BGRA, false },
+		{ 2, fpng::FPNG_PIXEL_FORMAT_DEFAULT, true },
+	};
+
+	for (const row_test& t : s_tests)
+	{
+		const uint32_t bpp = t.m_num_chans * (t.m_samples16 ? 2 : 1);
+
+		// The whole image in memory (so the sub-rectangle's rows are padded), and the packed sub-rectangle.
+		std::vector<uint8_t> atlas((size_t)source_w * source_h * bpp), packed((size_t)W * H * bpp);
+		for (size_t i = 0; i < (size_t)source_w * source_h; i++)
+			memcpy(&atlas[i * bpp], pSource32 + i * 4, bpp);
+		for (uint32_t y = 0; y < H; y++)
+			memcpy(&packed[(size_t)y * W * bpp], &atlas[((size_t)(Y + y) * source_w + X) * bpp], (size_t)W * bpp);
+
+		// The rows, bottom up in memory.
+		std::vector<uint8_t> flipped(packed.size());
+		std::vector<const void*> rows(H);
+		for (uint32_t y = 0; y < H; y++)
+		{
+			rows[y] = &flipped[(size_t)(H - 1 - y) * W * bpp];
+			memcpy(&flipped[(size_t)(H - 1 - y) * W * bpp], &packed[(size_t)y * W * bpp], (size_t)W * bpp);
+		}
+
+		tiled_image tiled(packed.data(), W, H, bpp);
+
+		// Single pass, sampled tables with strips, two passes with adaptive filters, LZ matches, and raw blocks.
+		for (uint32_t config = 0; config < 5; config++)
+		{
+			fpng::fpng_encode_params params;
+			params.m_level = (config == 4) ? fpng::FPNG_LEVEL_UNCOMPRESSED : ((config == 1) ? fpng::FPNG_LEVEL_MEDIUM : ((config == 2) ? fpng::FPNG_LEVEL_SLOWEST : fpng::FPNG_LEVEL_FASTEST));
+			params.m_flags = ((config == 3) ? fpng::FPNG_ENCODE_LZ_MATCHES : 0) | (t.m_samples16 ? fpng::FPNG_ENCODE_16BIT : 0);
+			params.m_num_threads = (config & 1) ? 4 : 0;
+			params.m_src_format = t.m_format;
+
+			std::vector<uint8_t> expected_file;
+			if (!fpng::fpng_encode_image_to_memory(packed.data(), W, H, t.m_num_chans, expected_file, params))
+			{
+				fprintf(stderr, "fpng_encode_image_to_memory() failed!\n");
+				return false;
+			}
+
+			// A row pitch, row pointers, and a row callback.
+			for (uint32_t source = 0; source < 3; source++)
+			{
+				fpng::fpng_encode_params source_params(params);
+				const void* pImage = nullptr;
+				if (source == 0)
+				{
+					pImage = &atlas[((size_t)Y * source_w + X) * bpp];
+					source_params.m_src_pitch = (size_t)source_w * bpp;
+				}
+				else if (source == 1)
+					source_params.m_ppSrc_rows = rows.data();
+				else
+				{
+					source_params.m_pRead_row = tiled_image::read_row;
+					source_params.m_pRead_row_user_data = &tiled;
+				}
+
+				std::vector<uint8_t> file_buf;
+				if ((!fpng::fpng_encode_image_to_memory(pImage, W, H, t.m_num_chans, file_buf, source_params)) || (file_buf != expected_file))
+				{
+					fprintf(stderr, "fpng_encode_image_to_memory() failed with row source %u, %u channels, config %u!\n", source, t.m_num_chans, config);
+					return false;
+				}
+			}
+		}
+
+		// The APNG encoder takes a row pitch. The second frame is the image shifted by shift pixels, so the frames have the same pitch but differ.
+		std::vector<uint8_t> files[2];
+		for (uint32_t padded = 0; padded < 2; padded++)
+		{
+			fpng::fpng_encode_params params;
+			params.m_flags = t.m_samples16 ? fpng::FPNG_ENCODE_16BIT : 0;
+			params.m_src_format = t.m_format;
+			params.m_src_pitch = padded ? ((size_t)source_w * bpp) : 0;
+
+			fpng::fpng_apng_encoder encoder;
+			bool status = encoder.begin(W, H, t.m_num_chans, 2, 0, stream_write_func, &files[padded], params);
+			for (uint32_t frame = 0; (status) && (frame < 2); frame++)
+			{
+				if (padded)
+					status = encoder.add_frame(&atlas[((size_t)Y * source_w + X + frame * shift) * bpp], 1, 30);
+				else
+				{
+					std::vector<uint8_t> frame_pixels((size_t)W * H * bpp);
+					for (uint32_t y = 0; y < H; y++)
+						memcpy(&frame_pixels[(size_t)y * W * bpp], &atlas[((size_t)(Y + y) * source_w + X + frame * shift) * bpp], (size_t)W * bpp);
+					status = encoder.add_frame(frame_pixels.data(), 1, 30);
+				}
+			}
+
+			if ((!status) || (!encoder.finish()))
+			{
+				fprintf(stderr, "fpng_apng_encoder failed with a row pitch!\n");
+				return false;
+			}
+		}
+
+		if (files[0] != files[1])
+		{
+			fprintf(stderr, "fpng_apng_encoder's output changed with a row pitch!\n");
+			return false;
+		}
+	}
+
+	return true;
+}
+
+// Returns the level below a mip level, averaging each 2x2 block of pixels (clamped to the level's edges). Samples are bytes, or native endian 16-bit if samples16 is true.
+static std::vector<uint8_t> make_mip_level(const std::vector<uint8_t>& pixels, uint32_t w, uint32_t h, uint32_t num_chans, bool samples16, uint32_t& next_w, uint32_t& next_h)
+{
+	next_w = maximum<uint32_t>(w >> 1, 1);
+	next_h = maximum<uint32_t>(h >> 1, 1);
+
+	const uint32_t sample_size = samples16 ? 2 : 1;
+	std::vector<uint8_t> next((size_t)next_w * next_h * num_chans * sample_size);
+
+	for (uint32_t y = 0; y < next_h; y++)
+	{
+		for (uint32_t x = 0; x < next_w; x++)
+		{
+			for (uint32_t c = 0; c < num_chans; c++)
+			{
+				uint32_t sum = 0;
+				for (uint32_t i = 0; i < 4; i++)
+				{
+					const size_t ofs = (((size_t)minimum(y * 2 + (i >> 1), h - 1) * w + minimum(x * 2 + (i & 1), w - 1)) * num_chans + c) * sample_size;
+					sum += samples16 ? *reinterpret_cast<const uint16_t*>(&pixels[ofs]) : pixels[ofs];
+				}
+
+				const size_t ofs = (((size_t)y * next_w + x) * num_chans + c) * sample_size;
+				if (samples16)
+					*reinterpret_cast<uint16_t*>(&next[ofs]) = (uint16_t)((sum + 2) >> 2);
+				else
+					next[ofs] = (uint8_t)((sum + 2) >> 2);
+			}
+		}
+	}
+
+	return next;
+}
+
+static bool verify_mip_chain(const uint8_t* pSource32, uint32_t source_w, uint32_t source_h)
+{
+	// RGB and RGBA (also from BGRA), 16-bit gray+alpha, and odd and thin crops of the image (clamped to its size).
+	struct mip_test { uint32_t m_w, m_h, m_num_chans, m_format; bool m_samples16; };
+	const mip_test s_tests[] =
+	{
+		{ source_w, source_h, 3, fpng::FPNG_PIXEL_FORMAT_DEFAULT, false },
+		{ source_w, source_h, 4, fpng::FPNG_PIXEL_FORMAT_DEFAULT, false },
+		{ source_w, source_h, 4, fpng::FPNG_PIXEL_FORMAT_BGRA, false },
+		{ source_w, source_h, 2, fpng::FPNG_PIXEL_FORMAT_DEFAULT, true },
+		{ minimum<uint32_t>(101, source_w), minimum<uint32_t>(67, source_h), 3, fpng::FPNG_PIXEL_FORMAT_DEFAULT, false },
+		{ 1, minimum<uint32_t>(75, source_h), 4, fpng::FPNG_PIXEL_FORMAT_DEFAULT, false },
+		{ minimum<uint32_t>(75, source_w), 1, 1, fpng::FPNG_PIXEL_FORMAT_DEFAULT, false },
+		{ 1, 1, 3, fpng::FPNG_PIXEL_FORMAT_DEFAULT, false },
+	};
+
+	for (const mip_test& t : s_tests)
+	{
+		const uint32_t sample_size = t.m_samples16 ? 2 : 1;
+		const size_t total_pixels = (size_t)t.m_w * t.m_h;
+
+		// The image in the file's layout, and in memory.
+		std::vector<uint8_t> pixels(total_pixels * t.m_num_chans * sample_size), mem(pixels.size());
+		for (uint32_t y = 0; y < t.m_h; y++)
+		{
+			for (uint32_t x = 0; x < t.m_w; x++)
+			{
+				const uint8_t* pSrc = pSource32 + ((size_t)y * source_w + x) * 4;
+				uint8_t* pDst = &pixels[((size_t)y * t.m_w + x) * t.m_num_chans * sample_size];
+
+				if (t.m_samples16)
+				{
+					for (uint32_t c = 0; c < t.m_num_chans; c++)
+						reinterpret_cast<uint16_t*>(pDst)[c] = (uint16_t)((pSrc[c * 2] << 8) | pSrc[c * 2 + 1]);
+				}
+				else
+					memcpy(pDst, pSrc, t.m_num_chans);
+			}
+		}
+
+		mem = pixels;
+		if (t.m_format == fpng::FPNG_PIXEL_FORMAT_BGRA)
+		{
+			for (size_t i = 0; i < total_pixels; i++)
+				std::swap(mem[i * 4 + 0], mem[i * 4 + 2]);
+		}
+
+		// Single pass, strip-parallel, two passes with adaptive filters, and raw blocks.
+		for (uint32_t config = 0; config < 4; config++)
+		{
+			fpng::fpng_encode_params params;
+			params.m_level = (config == 3) ? fpng::FPNG_LEVEL_UNCOMPRESSED : ((config == 2) ? fpng::FPNG_LEVEL_SLOWEST : fpng::FPNG_LEVEL_FASTEST);
+			params.m_flags = t.m_samples16 ? fpng::FPNG_ENCODE_16BIT : 0;
+			params.m_num_threads = (config == 1) ? 4 : 0;
+			params.m_src_format = t.m_format;
+
+			std::vector< std::vector<uint8_t> > files;
+			if (!fpng::fpng_encode_mip_chain(mem.data(), t.m_w, t.m_h, t.m_num_chans, files, params))
+			{
+				fprintf(stderr, "fpng_encode_mip_chain() failed on a %ux%u image with %u channels, config %u!\n", t.m_w, t.m_h, t.m_num_chans, config);
+				return false;
+			}
+
+			// Each level must be encoded exactly like fpng_encode_image_to_memory() encodes the level built by make_mip_level().
+			params.m_src_format = fpng::FPNG_PIXEL_FORMAT_DEFAULT;
+
+			std::vector<uint8_t> level = pixels;
+			uint32_t level_w = t.m_w, level_h = t.m_h;
+			for (uint32_t i = 0; ; i++)
+			{
+				std::vector<uint8_t> expected_file;
+				if ((i >= files.size()) || (!fpng::fpng_encode_image_to_memory(level.data(), level_w, level_h, t.m_num_chans, expected_file, params)) || (files[i] != expected_file))
+				{
+					fprintf(stderr, "fpng_encode_mip_chain() level %u of a %ux%u image with %u channels, config %u is wrong!\n", i, t.m_w, t.m_h, t.m_num_chans, config);
+					return false;
+				}
+
+				if ((level_w == 1) && (level_h == 1))
+				{
+					if (files.size() != (i + 1))
+					{
+						fprintf(stderr, "fpng_encode_mip_chain() returned too many levels!\n");
+						return false;
+					}
+					break;
+				}
+
+				level = make_mip_level(level, level_w, level_h, t.m_num_chans, t.m_samples16, level_w, level_h);
+			}
+		}
+	}
+
+	return true;
+}
+
+static bool verify_incompressible()
+{
+	const uint32_t W = 211, H = 256;
+	mrand r(2);
+
+	for (uint32_t kind = 0; kind < 4; kind++)
+	{
+		const uint32_t num_chans = (kind & 1) ? 4 : 3;
+		const bool all_noise = (kind >= 2);
+
+		// The bottom half (or all) of the image is noise, the rest is a smooth gradient.
+		std::vector<uint8_t> img(W * H * num_chans);
+		for (uint32_t y = 0; y < H; y++)
+			for (uint32_t x = 0; x < W; x++)
+				for (uint32_t c = 0; c < num_chans; c++)
+					img[(y * W + x) * num_chans + c] = (all_noise || (y >= H / 2)) ? (uint8_t)r.irand(0, 255) : (uint8_t)(x + y + c * 50);
+
+		const uint64_t raw_size = (uint64_t)(W * num_chans + 1) * H;
+
+		for (uint32_t num_threads = 0; num_threads <= 4; num_threads += 4)
+		{
+			fpng::fpng_encode_params params;
+			params.m_num_threads = num_threads;
+
+			std::vector<uint8_t> file_buf;
+			if (!fpng::fpng_encode_image_to_memory(img.data(), W, H, num_chans, file_buf, params))
+			{
+				fprintf(stderr, "fpng_encode_image_to_memory() failed on a noisy image!\n");
+				return false;
+			}
+
+			// With strips, only the noisy strips should have fallen back to raw blocks.
+			if ((num_threads) && (!all_noise) && (file_buf.size() > raw_size * 3 / 4))
+			{
+				fprintf(stderr, "FPNG strip-parallel encode of a half noisy image is too large (%u bytes)!\n", (uint32_t)file_buf.size());
+				return false;
+			}
+
+			uint32_t lodepng_decoded_w = 0, lodepng_decoded_h = 0;
+			uint8_t* lodepng_decoded_buffer = nullptr;
+			int error = lodepng_decode_memory(&lodepng_decoded_buffer, &lodepng_decoded_w, &lodepng_decoded_h, file_buf.data(), file_buf.size(), (num_chans == 4) ? LCT_RGBA : LCT_RGB, 8);
+			if ((error) || (lodepng_decoded_w != W) || (lodepng_decoded_h != H) || (memcmp(lodepng_decoded_buffer, img.data(), img.size()) != 0))
+			{
+				fprintf(stderr, "FPNG noisy image %u decode verification failed (using lodepng)!\n", kind);
+				return false;
+			}
+			free(lodepng_decoded_buffer);
+
+			fpng::fpng_decode_params decode_params;
+			decode_params.m_flags = fpng::FPNG_DECODE_STRICT;
+			decode_params.m_num_threads = num_threads;
+
+			std::vector<uint8_t> decoded;
+			uint32_t w, h, chans;
+			int res = fpng::fpng_decode_memory(file_buf.data(), (uint32_t)file_buf.size(), decoded, w, h, chans, num_chans, decode_params);
+			if ((res != fpng::FPNG_DECODE_SUCCESS) || (decoded != img))
+			{
+				fprintf(stderr, "FPNG noisy image %u decode verification failed (using FPNG), error %i!\n", kind, res);
+				return false;
+			}
+
+			if (!verify_decode_rows(file_buf, 7, num_chans, img.data(), W, H, fpng::FPNG_DECODE_STRICT))
+				return false;
+		}
+	}
+
+	// Each row repeats its own 128 pixel pattern of noise, so only LZ matches can compress it. The entropy estimate doesn't see them, and must not send it to raw blocks.
+	// (The pattern is long enough that the sampled rows reliably look incompressible.)
+	const uint32_t LZ_W = 1024, LZ_H = 256, PATTERN_PIXELS = 128;
+	std::vector<uint8_t> img(LZ_W * LZ_H * 3);
+	for (uint32_t y = 0; y < LZ_H; y++)
+	{
+		uint8_t* pRow = &img[y * LZ_W * 3];
+		for (uint32_t i = 0; i < PATTERN_PIXELS * 3; i++)
+			pRow[i] = (uint8_t)r.irand(0, 255);
+		for (uint32_t i = PATTERN_PIXELS * 3; i < LZ_W * 3; i++)
+			pRow[i] = pRow[i - PATTERN_PIXELS * 3];
+	}
+
+	const uint64_t raw_size = (uint64_t)(LZ_W * 3 + 1) * LZ_H;
+
+	for (uint32_t num_threads = 0; num_threads <= 4; num_threads += 4)
+	{
+		fpng::fpng_encode_params params;
+		params.m_flags = fpng::FPNG_ENCODE_LZ_MATCHES;
+		params.m_num_threads = num_threads;
+
+		std::vector<uint8_t> file_buf, decoded;
+		uint32_t w, h, chans;
+		if ((!fpng::fpng_encode_image_to_memory(img.data(), LZ_W, LZ_H, 3, file_buf, params)) ||
+			(fpng::fpng_decode_memory(file_buf.data(), file_buf.size(), decoded, w, h, chans, 3) != fpng::FPNG_DECODE_SUCCESS) || (decoded != img))
+		{
+			fprintf(stderr, "FPNG_ENCODE_LZ_MATCHES encode of a repeating noisy image failed!\n");
+			return false;
+		}
+
+		if (file_buf.size() > raw_size / 4)
+		{
+			fprintf(stderr, "FPNG_ENCODE_LZ_MATCHES encode of a repeating noisy image is too large (%u bytes, %u raw)!\n", (uint32_t)file_buf.size(), (uint32_t)raw_size);
+			return false;
+		}
+	}
+
+	return true;
+}
+
+int main(int arg_c, char **arg_v)
+{
+	fpng::fpng_init();
+	
+	if (arg_c < 2)
+	{
+		printf("Usage: fpng_test [filename.png] <alpha_filename.png>\n");
+		printf("Loads image and compresses it with fpng, lodepng, stb_image_write and QOI. Wrotes fpng.png, lodepng.png, stbi.png, and qoi.qoi.\n");
+		printf("Also decompresses the FPNG compressed file with several decompressors (lodepng, stb_image and fpng) and validates the decompressed data against the original source image.\n");
+		printf("\nOptions:\n");
+		printf("-s: 2 pass compression\n");
+		printf("-u: Use uncompressed Deflate blocks\n");
+		printf("-c: Write comma seperated values to stdout\n");
+		printf("-e: Fuzz encoder/decoder by randomly modifying an input image's pixels\n");
+		printf("-f: Decompress specified PNG image using FPNG, then exit\n");
+		printf("-a: Swizzle input image's green to alpha, for testing 32bpp correlation alpha\n");
+		printf("-t: Train Huffman tables on @filelist.txt (must compile with FPNG_TRAIN_HUFFMAN_TABLES=1)\n");
+		printf("-mX: Also test strip-parallel encoding using X threads, e.g. -m4\n");
+		printf("-lX: Compress using level X (0-4, see FPNG_LEVEL_*), instead of -s/-u\n");
+		printf("-bX: Benchmark the codecs on the image, a directory of .png files, or @filelist.txt, timing X iterations (default 10) of each image\n");
+		printf("-pX: With -b, also measure the throughput of X threads\n");
+		printf("-ofile.json: With -b, also write the results to a JSON file\n");
+		printf("-v: Also run the test suites, which check fpng's encoding and decoding features and take much longer than the benchmark and write test files to the current directory\n");
+		return EXIT_FAILURE;
+	}
+
+	const char* pFilename = nullptr;
+	const char* pAlpha_filename = nullptr;
+	bool csv_flag = false;
+	bool slower_encoding = false;
+	bool force_uncompressed = false;
+	int fpng_level = fpng::FPNG_LEVEL_FROM_FLAGS;
+	bool fuzz_encoder = false;
+	bool fuzz_encoder2 = false;
+	bool fuzz_decoder = false;
+	bool swizzle_green_to_alpha = false;
+	bool training_mode_flag = false;
+	uint32_t num_encode_threads = 0;
+	uint32_t bench_iterations = 0;
+	uint32_t bench_threads = 0;
+	const char* pBench_json_filename = nullptr;
+	bool run_test_suites = false;
+
+	for (int i = 1; i < arg_c; i++)
+	{
+		const char* pArg = arg_v[i];
+		if (pArg[0] == '-')
+		{
+			if (pArg[1] == 'u')
+			{
+				force_uncompressed = true;
+			}
+			else if (pArg[1] == 's')
+			{
+				slower_encoding = true;
+			}
+			else if (pArg[1] == 'c')
+			{
+				csv_flag = true;
+			}
+			else if (pArg[1] == 'e')
+			{
+				fuzz_encoder = true;
+			}
+			else if (pArg[1] == 'E')
+			{
+				fuzz_encoder2 = true;
+			}
+			else if (pArg[1] == 'f')
+			{
+				fuzz_decoder = true;
+			}
+			else if (pArg[1] == 'a')
+			{
+				swizzle_green_to_alpha = true;
+			}
+			else if (pArg[1] == 't')
+			{
+				training_mode_flag = true;
+			}
+			else if (pArg[1] == 'm')
+			{
+				num_encode_threads = atoi(pArg + 2);
+			}
+			else if (pArg[1] == 'l')
+			{
+				fpng_level = atoi(pArg + 2);
+			}
+			else if (pArg[1] == 'b')
+			{
+				bench_iterations = pArg[2] ? maximum(atoi(pArg + 2), 1) : 10;
+			}
+			else if (pArg[1] == 'p')
+			{
+				bench_threads = atoi(pArg + 2);
+			}
+			else if (pArg[1] == 'o')
+			{
+				pBench_json_filename = pArg + 2;
+			}
+			else if (pArg[1] == 'v')
+			{
+				run_test_suites = true;
+			}
+			else
+			{
+				fprintf(stderr, "Unrecognized option: %s\n", pArg);
+				return EXIT_FAILURE;
+			}
+		}
+		else
+		{
+			if ((pFilename) && (pAlpha_filename))
+			{
+				fprintf(stderr, "Too many filenames\n");
+				return EXIT_FAILURE;
+			}
+			
+			if (pFilename)
+				pAlpha_filename = pArg;
+			else
+				pFilename = pArg;
+		}
+	}
+
+	uint32_t fpng_flags = 0;
+	if (slower_encoding)
+		fpng_flags |= fpng::FPNG_ENCODE_SLOWER;
+	if (force_uncompressed)
+		fpng_flags |= fpng::FPNG_FORCE_UNCOMPRESSED;
+
+	if (fuzz_encoder2)
+		return fuzz_test_encoder2(fpng_flags);
+
+	if (training_mode_flag)
+		return training_mode(pFilename);
+
+	if ((bench_iterations) && (!pFilename))
+	{
+		fprintf(stderr, "No image, directory or listing file to benchmark\n");
+		return EXIT_FAILURE;
+	}
+
+	if (bench_iterations)
+		return benchmark_mode(pFilename, bench_iterations, bench_threads, pBench_json_filename);
+
+	if (!csv_flag)
+	{
+		printf("SSE 4.1 supported: %u\n", fpng::fpng_cpu_supports_sse41());
+		printf("AVX2 supported: %u\n", fpng::fpng_cpu_supports_avx2());
+
+		printf("Filename: %s\n", pFilename);
+		if (pAlpha_filename)
+			printf("Alpha filename: %s\n", pFilename);
+	}
+
+	uint8_vec source_file_data;
+	if (!read_file_to_vec(pFilename, source_file_data))
+	{
+		fprintf(stderr, "Failed reading source file data \"%s\"\n", pFilename);
+		return EXIT_FAILURE;
+	}
+
+	if (fuzz_decoder)
+	{
+		std::vector<uint8_t> fpngd_decode_buffer;
+		uint32_t channels_in_file;
+		uint32_t decoded_width, decoded_height;
+
+		int res = fpng::fpng_decode_memory(source_file_data.data(), (uint32_t)source_file_data.size(), fpngd_decode_buffer, decoded_width, decoded_height, channels_in_file, 3);
+		if (res != 0)
+		{
+			fprintf(stderr, "fpng::fpng_decode() failed with error %i!\n", res);
+			return EXIT_FAILURE;
+		}
+
+		if (lodepng_encode_file("out.png", fpngd_decode_buffer.data(), decoded_width, decoded_height, (channels_in_file == 4) ? LCT_RGBA : LCT_RGB, 8) != 0)
+		{
+			fprintf(stderr, "lodepng_encode_file() failed with error %i!\n", res);
+			return EXIT_FAILURE;
+		}
+
+		printf("Wrote out.png %ux%u %u\n", decoded_width, decoded_height, channels_in_file);
+
+		return EXIT_SUCCESS;
+	}
+		
+	uint32_t source_width = 0, source_height = 0;
+	uint8_t* pSource_image_buffer = nullptr;
+	unsigned error = lodepng_decode_memory(&pSource_image_buffer, &source_width, &source_height, source_file_data.data(), source_file_data.size(), LCT_RGBA, 8);
+	if (error != 0)
+	{
+		fprintf(stderr, "Failed unpacking source file \"%s\"\n", pFilename);
+		return EXIT_FAILURE;
+	}
+
+	if (pAlpha_filename)
 	{
 		uint32_t alpha_source_width = 0, alpha_source_height = 0;
 		uint8_t* pAlpha_source_image_buffer = nullptr;
@@ -1200,7 +3817,11 @@ int main(int arg_c, char **arg_v)
 	for (uint32_t i = 0; i < NUM_TIMES_TO_ENCODE; i++)
 	{
 		tm.start();
-		if (!fpng::fpng_encode_image_to_memory((source_chans == 3) ? (const void *)pSource_pixels24 : (const void*)pSource_pixels32, source_width, source_height, source_chans, fpng_file_buf, fpng_flags))
+		fpng::fpng_encode_params params;
+		params.m_flags = fpng_flags;
+		params.m_level = fpng_level;
+
+		if (!fpng::fpng_encode_image_to_memory((source_chans == 3) ? (const void *)pSource_pixels24 : (const void*)pSource_pixels32, source_width, source_height, source_chans, fpng_file_buf, params))
 		{
 			fprintf(stderr, "fpng_encode_image_to_memory() failed!\n");
 			return EXIT_FAILURE;
@@ -1230,6 +3851,146 @@ int main(int arg_c, char **arg_v)
 		}
 #endif
 	}
+
+	// Compress with FPNG using multiple strips, and verify the output using lodepng and stb_image.h
+	if (num_encode_threads > 1)
+	{
+		fpng::fpng_encode_params params;
+		params.m_flags = fpng_flags;
+		params.m_level = fpng_level;
+		params.m_num_threads = num_encode_threads;
+
+		std::vector<uint8_t> fpng_mt_file_buf;
+		double fpng_mt_best_time = 1e+9f;
+		for (uint32_t i = 0; i < NUM_TIMES_TO_ENCODE; i++)
+		{
+			tm.start();
+			if (!fpng::fpng_encode_image_to_memory((source_chans == 3) ? (const void*)pSource_pixels24 : (const void*)pSource_pixels32, source_width, source_height, source_chans, fpng_mt_file_buf, params))
+			{
+				fprintf(stderr, "fpng_encode_image_to_memory() failed!\n");
+				return EXIT_FAILURE;
+			}
+			fpng_mt_best_time = minimum(fpng_mt_best_time, tm.get_elapsed_secs());
+		}
+
+		if (!csv_flag)
+			printf("FPNG MT: %4.6f secs, %u bytes, %4.3f MB, %4.3f MP/sec, %u threads\n", fpng_mt_best_time, (uint32_t)fpng_mt_file_buf.size(), fpng_mt_file_buf.size() / (1024.0f * 1024.0f), total_source_pixels / (1024.0f * 1024.0f) / fpng_mt_best_time, num_encode_threads);
+
+		uint32_t lodepng_decoded_w = 0, lodepng_decoded_h = 0;
+		uint8_t* lodepng_decoded_buffer = nullptr;
+		error = lodepng_decode_memory(&lodepng_decoded_buffer, &lodepng_decoded_w, &lodepng_decoded_h, (uint8_t*)fpng_mt_file_buf.data(), fpng_mt_file_buf.size(), LCT_RGBA, 8);
+		if ((error != 0) || (lodepng_decoded_w != source_width) || (lodepng_decoded_h != source_height) || (memcmp(lodepng_decoded_buffer, pSource_pixels32, total_source_pixels * 4) != 0))
+		{
+			fprintf(stderr, "FPNG strip-parallel decode verification failed (using lodepng)!\n");
+			return EXIT_FAILURE;
+		}
+		free(lodepng_decoded_buffer);
+
+		int x, y, c;
+		void* p = stbi_load_from_memory(fpng_mt_file_buf.data(), (int)fpng_mt_file_buf.size(), &x, &y, &c, 4);
+		if ((!p) || (memcmp(p, pSource_pixels32, total_source_pixels * 4) != 0))
+		{
+			fprintf(stderr, "FPNG strip-parallel decode verification failed (using stb_image.h)!\n");
+			return EXIT_FAILURE;
+		}
+		free(p);
+
+		fpng::fpng_decode_params decode_params;
+		decode_params.m_num_threads = num_encode_threads;
+
+		std::vector<uint8_t> fpng_mt_decode_buffer;
+		uint32_t decoded_width, decoded_height, channels_in_file;
+		double fpng_mt_decode_time = 1e+9f;
+		for (uint32_t i = 0; i < NUM_TIMES_TO_DECODE; i++)
+		{
+			tm.start();
+			int res = fpng::fpng_decode_memory(fpng_mt_file_buf.data(), (uint32_t)fpng_mt_file_buf.size(), fpng_mt_decode_buffer, decoded_width, decoded_height, channels_in_file, 4, decode_params);
+			if (res != fpng::FPNG_DECODE_SUCCESS)
+			{
+				fprintf(stderr, "fpng::fpng_decode_memory() failed decoding the strip-parallel file with error %i!\n", res);
+				return EXIT_FAILURE;
+			}
+			fpng_mt_decode_time = minimum(fpng_mt_decode_time, tm.get_elapsed_secs());
+		}
+
+		if ((decoded_width != source_width) || (decoded_height != source_height) || (memcmp(fpng_mt_decode_buffer.data(), pSource_pixels32, total_source_pixels * 4) != 0))
+		{
+			fprintf(stderr, "FPNG strip-parallel decode verification failed (using FPNG)!\n");
+			return EXIT_FAILURE;
+		}
+
+		if (run_test_suites)
+		{
+			if (!verify_decode_rows(fpng_mt_file_buf, 13, 4, pSource_pixels32, source_width, source_height))
+				return EXIT_FAILURE;
+
+			if (!verify_decode_checksums(fpng_mt_file_buf, pSource_pixels24, pSource_pixels32, source_width, source_height, num_encode_threads))
+				return EXIT_FAILURE;
+		}
+
+		if (!csv_flag)
+			printf("FPNG MT decode: %4.6f secs, %4.3f MP/sec\n", fpng_mt_decode_time, total_source_pixels / (1024.0f * 1024.0f) / fpng_mt_decode_time);
+
+		if (!csv_flag)
+		{
+			if (!write_data_to_file("fpng_mt.png", fpng_mt_file_buf.data(), fpng_mt_file_buf.size()))
+			{
+				fprintf(stderr, "Failed writing to file fpng_mt.png\n");
+				return EXIT_FAILURE;
+			}
+		}
+	}
+	
+	// Compress with the streaming encoder, pushing the rows in small uneven groups, and verify the output using lodepng and FPNG
+	{
+		const uint8_t* pSrc = (source_chans == 3) ? (const uint8_t*)pSource_pixels24 : (const uint8_t*)pSource_pixels32;
+		const uint32_t src_pitch = source_width * source_chans;
+
+		std::vector<uint8_t> fpng_stream_file_buf;
+		fpng::fpng_encoder stream_encoder;
+		
+		tm.start();
+
+		bool status = stream_encoder.begin(source_width, source_height, source_chans, stream_write_func, &fpng_stream_file_buf);
+		for (uint32_t y = 0, n = 1; status && (y < source_height); n = (n % 13) + 1)
+		{
+			const uint32_t num_rows = minimum(n, source_height - y);
+			status = stream_encoder.push_rows(pSrc + (size_t)y * src_pitch, num_rows, src_pitch);
+			y += num_rows;
+		}
+		if (status)
+			status = stream_encoder.finish();
+
+		const double fpng_stream_time = tm.get_elapsed_secs();
+
+		if (!status)
+		{
+			fprintf(stderr, "fpng_encoder failed!\n");
+			return EXIT_FAILURE;
+		}
+
+		if (!csv_flag)
+			printf("FPNG stream: %4.6f secs, %u bytes, %4.3f MB, %4.3f MP/sec\n", fpng_stream_time, (uint32_t)fpng_stream_file_buf.size(), fpng_stream_file_buf.size() / (1024.0f * 1024.0f), total_source_pixels / (1024.0f * 1024.0f) / fpng_stream_time);
+
+		uint32_t lodepng_decoded_w = 0, lodepng_decoded_h = 0;
+		uint8_t* lodepng_decoded_buffer = nullptr;
+		error = lodepng_decode_memory(&lodepng_decoded_buffer, &lodepng_decoded_w, &lodepng_decoded_h, (uint8_t*)fpng_stream_file_buf.data(), fpng_stream_file_buf.size(), LCT_RGBA, 8);
+		if ((error != 0) || (lodepng_decoded_w != source_width) || (lodepng_decoded_h != source_height) || (memcmp(lodepng_decoded_buffer, pSource_pixels32, total_source_pixels * 4) != 0))
+		{
+			fprintf(stderr, "FPNG streaming decode verification failed (using lodepng)!\n");
+			return EXIT_FAILURE;
+		}
+		free(lodepng_decoded_buffer);
+
+		std::vector<uint8_t> fpng_stream_decode_buffer;
+		uint32_t decoded_width, decoded_height, channels_in_file;
+		int res = fpng::fpng_decode_memory(fpng_stream_file_buf.data(), (uint32_t)fpng_stream_file_buf.size(), fpng_stream_decode_buffer, decoded_width, decoded_height, channels_in_file, 4);
+		if ((res != fpng::FPNG_DECODE_SUCCESS) || (decoded_width != source_width) || (decoded_height != source_height) || (memcmp(fpng_stream_decode_buffer.data(), pSource_pixels32, total_source_pixels * 4) != 0))
+		{
+			fprintf(stderr, "FPNG streaming decode verification failed (using FPNG), error %i!\n", res);
+			return EXIT_FAILURE;
+		}
+	}
 	
 	double fpng_decode_time = 0.0f, lodepng_decode_time = 0.0f, stbi_decode_time = 0.0f, qoi_decode_time = 0.0f, wuffs_decode_time = 0.0f, pvpng_decode_time = 0.0f;
 
@@ -1326,6 +4087,159 @@ int main(int arg_c, char **arg_v)
 		}
 	}
 
+	// The test suites, which check fpng's features on the image and on synthetic images
+	if (run_test_suites)
+	{
+		// Test encoding to a caller supplied buffer, and decoding to a buffer with a row pitch
+		{
+			std::vector<uint8_t> fpng_span_buf((size_t)fpng::fpng_get_max_encoded_size(source_width, source_height, source_chans));
+
+			fpng::fpng_encode_params params;
+			params.m_flags = fpng_flags;
+			params.m_level = fpng_level;
+
+			const size_t fpng_span_size = fpng::fpng_encode_image_to_memory((source_chans == 3) ? (const void*)pSource_pixels24 : (const void*)pSource_pixels32, source_width, source_height, source_chans, fpng_span_buf.data(), fpng_span_buf.size(), params);
+			if ((fpng_span_size != fpng_file_buf.size()) || (memcmp(fpng_span_buf.data(), fpng_file_buf.data(), fpng_span_size) != 0))
+			{
+				fprintf(stderr, "FPNG encode to caller supplied buffer failed!\n");
+				return EXIT_FAILURE;
+			}
+
+			const uint32_t PAD_BYTES = 13, PAD_VALUE = 0xCD;
+			const uint32_t dst_pitch = source_width * 4 + PAD_BYTES;
+			std::vector<uint8_t> pitch_buf((size_t)dst_pitch * source_height, (uint8_t)PAD_VALUE);
+
+			uint32_t decoded_width, decoded_height, channels_in_file;
+			int res = fpng::fpng_decode_memory(fpng_file_buf.data(), (uint32_t)fpng_file_buf.size(), pitch_buf.data(), pitch_buf.size() - PAD_BYTES, dst_pitch, decoded_width, decoded_height, channels_in_file, 4);
+			if ((res != fpng::FPNG_DECODE_SUCCESS) || (decoded_width != source_width) || (decoded_height != source_height))
+			{
+				fprintf(stderr, "fpng::fpng_decode_memory() to a pitched buffer failed with error %i!\n", res);
+				return EXIT_FAILURE;
+			}
+
+			for (uint32_t y = 0; y < source_height; y++)
+			{
+				const uint8_t* pRow = pitch_buf.data() + (size_t)y * dst_pitch;
+				bool pad_ok = true;
+				for (uint32_t i = source_width * 4; i < dst_pitch; i++)
+					pad_ok = pad_ok && (pRow[i] == PAD_VALUE);
+
+				if ((!pad_ok) || (memcmp(pRow, (const uint8_t*)pSource_pixels32 + (size_t)y * source_width * 4, source_width * 4) != 0))
+				{
+					fprintf(stderr, "FPNG pitched decode verification failed!\n");
+					return EXIT_FAILURE;
+				}
+			}
+		}
+
+		// Test decoding a band of rows at a time
+		if ((!verify_decode_rows(fpng_file_buf, 1, 4, pSource_pixels32, source_width, source_height)) || 
+			(!verify_decode_rows(fpng_file_buf, 7, 3, pSource_pixels24, source_width, source_height)) ||
+			(!verify_decode_rows(fpng_file_buf, 64, 4, pSource_pixels32, source_width, source_height)))
+			return EXIT_FAILURE;
+
+		// Test the decoder's checksum flags
+		if (!verify_decode_checksums(fpng_file_buf, pSource_pixels24, pSource_pixels32, source_width, source_height, 0))
+			return EXIT_FAILURE;
+
+		// Test per-row adaptive filtering and in-row LZ matching, single threaded and strip-parallel
+		if (!verify_encode_flags(pSource_pixels24, pSource_pixels32, source_width, source_height, source_chans, fpng_flags, num_encode_threads, csv_flag))
+			return EXIT_FAILURE;
+
+		// Test each compression level
+		for (int level = fpng::FPNG_LEVEL_UNCOMPRESSED; level <= fpng::FPNG_MAX_LEVEL; level++)
+		{
+			fpng::fpng_encode_params encode_params;
+			encode_params.m_level = level;
+
+			std::vector<uint8_t> level_file_buf;
+			if (!fpng::fpng_encode_image_to_memory((source_chans == 4) ? (const void*)pSource_pixels32 : (const void*)pSource_pixels24, source_width, source_height, source_chans, level_file_buf, encode_params))
+			{
+				fprintf(stderr, "fpng_encode_image_to_memory() failed at level %i!\n", level);
+				return EXIT_FAILURE;
+			}
+
+			if (!csv_flag)
+				printf("FPNG level %i: %u bytes\n", level, (uint32_t)level_file_buf.size());
+
+			uint32_t lodepng_decoded_w = 0, lodepng_decoded_h = 0;
+			uint8_t* lodepng_decoded_buffer = nullptr;
+			int error = lodepng_decode_memory(&lodepng_decoded_buffer, &lodepng_decoded_w, &lodepng_decoded_h, level_file_buf.data(), level_file_buf.size(), LCT_RGBA, 8);
+			if ((error) || (lodepng_decoded_w != source_width) || (lodepng_decoded_h != source_height) || (memcmp(lodepng_decoded_buffer, pSource_pixels32, total_source_pixels * 4) != 0))
+			{
+				fprintf(stderr, "FPNG level %i decode verification failed (using lodepng)!\n", level);
+				return EXIT_FAILURE;
+			}
+			free(lodepng_decoded_buffer);
+
+			if (!verify_decode_checksums(level_file_buf, pSource_pixels24, pSource_pixels32, source_width, source_height, 0))
+				return EXIT_FAILURE;
+		}
+
+		// Test the one pass compressor's Huffman table presets
+		if (!verify_huff_presets())
+			return EXIT_FAILURE;
+
+		// Test grayscale, gray+alpha and 16-bit images, single threaded and strip-parallel
+		for (uint32_t pass = 0; pass < ((num_encode_threads > 1) ? 2U : 1U); pass++)
+		{
+			if (!verify_pixel_formats((const uint8_t*)pSource_pixels32, source_width, source_height, pass ? num_encode_threads : 0))
+				return EXIT_FAILURE;
+		}
+
+		// Test reusing encode and decode contexts
+		if (!verify_contexts((const uint8_t*)pSource_pixels32, source_width, source_height))
+			return EXIT_FAILURE;
+
+		// Test the raw block fallback of incompressible images and strips, and that it leaves images only LZ matches can compress alone
+		if (!verify_incompressible())
+			return EXIT_FAILURE;
+
+		// Test the encode and decode stats
+		if (!verify_stats((const uint8_t*)pSource_pixels32, source_width, source_height))
+			return EXIT_FAILURE;
+
+		// Test encoding to and decoding from files
+		if (!verify_file_io((const uint8_t*)pSource_pixels32, source_width, source_height))
+			return EXIT_FAILURE;
+
+		// Test images wider than 65535 pixels and IDAT chunk splitting
+		if (!verify_large_images())
+			return EXIT_FAILURE;
+
+		// Test pvpngreader's unfiltering
+		if (!verify_pvpng_filters())
+			return EXIT_FAILURE;
+
+		// Test pvpngreader's inflate
+		if (!verify_pvpng_inflate())
+			return EXIT_FAILURE;
+
+		// Test decoding any PNG file, with pvpngreader as the fallback
+		if (!verify_decode_any())
+			return EXIT_FAILURE;
+
+		// Test decoding row ranges and downscaling
+		if (!verify_decode_region((const uint8_t*)pSource_pixels32, source_width, source_height))
+			return EXIT_FAILURE;
+
+		// Test encoding from and decoding to other pixel layouts
+		if (!verify_memory_layouts((const uint8_t*)pSource_pixels32, source_width, source_height))
+			return EXIT_FAILURE;
+
+		// Test the APNG encoder's frames and dirty rectangles
+		if (!verify_apng((const uint8_t*)pSource_pixels32, source_width, source_height))
+			return EXIT_FAILURE;
+
+		// Test encoding all the mip levels of an image
+		if (!verify_mip_chain((const uint8_t*)pSource_pixels32, source_width, source_height))
+			return EXIT_FAILURE;
+
+		// Test encoding from a row pitch, row pointers and a row callback
+		if (!verify_row_sources((const uint8_t*)pSource_pixels32, source_width, source_height))
+			return EXIT_FAILURE;
+	}
+
 	// Verify FPNG's output data using lodepng
 	{
 		uint32_t lodepng_decoded_w = 0, lodepng_decoded_h = 0;
@@ -29,6 +29,40 @@
 #define PVPNG_IDAT_CRC_CHECKING (1)
 #define PVPNG_ADLER32_CHECKING (1)
 
+// Set to 0 to always inflate the IDAT data a line at a time with miniz, instead of inflating it all at once when the image fits in memory.
+#ifndef PVPNG_FAST_INFLATE
+	#define PVPNG_FAST_INFLATE (1)
+#endif
+
+// The Sub, Average and Paeth filters of 3 and 4 byte/pixel rows are undone with SSE 4.1 or NEON, using the same switches as fpng.cpp: 
+// set FPNG_NO_SSE or FPNG_NO_NEON to 1 to only use the scalar loops. SSE 4.1 is only used if the CPU supports it.
+#ifndef FPNG_NO_SSE
+	#define FPNG_NO_SSE (0)
+#endif
+
+#ifndef FPNG_NO_NEON
+	#define FPNG_NO_NEON (0)
+#endif
+
+#if (defined(_M_IX86) || defined(_M_X64) || defined(__i386__) || defined(__i386) || defined(__i486__) || defined(__i486) || defined(i386) || defined(__ia64__) || defined(__x86_64__)) && !FPNG_NO_SSE
+	#define PVPNG_SSE41_SUPPORTED (1)
+	#ifdef _MSC_VER
+		#include <intrin.h>
+	#else
+		#include <cpuid.h>
+	#endif
+	#include <smmintrin.h>		// SSE4.1
+#else
+	#define PVPNG_SSE41_SUPPORTED (0)
+#endif
+
+#if (defined(__aarch64__) || defined(_M_ARM64)) && !defined(__ARM_BIG_ENDIAN) && !FPNG_NO_NEON
+	#define PVPNG_NEON_SUPPORTED (1)
+	#include <arm_neon.h>
+#else
+	#define PVPNG_NEON_SUPPORTED (0)
+#endif
+
 namespace pv_png
 {
 
@@ -372,6 +406,8 @@ public:
 	}
 };
 
+struct infl_tables;
+
 // This low-level helper class handles the actual decoding of PNG files.
 class png_decoder
 {
@@ -422,6 +458,9 @@ public:
 
 	uint8_t m_end_of_idat_chunks;
 
+	// Set to skip the chunk CRC32 checks, if the caller already checked them.
+	bool m_skip_crc32;
+
 	void* m_pMalloc_blocks[PNG_MAX_ALLOC_BLOCKS];
 
 	uint32_t m_dec_bytes_per_pixel; // bytes per pixel decoded from the PNG file (minimum 1 for 1/2/4 bpp), factors in the PNG 8/16 bit/component bit depth, may be up to 8 bytes (2*4)
@@ -455,6 +494,14 @@ public:
 	uint32_t m_inflate_dst_buf_ofs;
 
 	int m_inflate_eof_flag;
+
+	// The whole image's filtered lines, if they were inflated at once by inflate_idat_data().
+	uint8_t* m_pInflated_buf;
+	size_t m_inflated_size;
+	size_t m_inflated_ofs;
+
+	// fast_inflate()'s Huffman decoding tables (about 550KB), allocated on first use.
+	infl_tables* m_pInfl_tables;
 		
 	uint8_t m_gamma_table[256];
 
@@ -500,6 +547,9 @@ public:
 	inline uint8_t paeth_predictor(int a, int b, int c);
 	void unpredict_paeth(uint8_t* lst, uint8_t* cur, uint32_t bytes, int bpp);
 	int adam7_pass_size(int size, int start, int step);
+	uint32_t get_src_bytes_per_line(uint32_t pixels);
+	uint64_t get_total_filtered_size();
+	int inflate_idat_data();
 	int decompress_line(uint32_t* bytes_decoded);
 	int find_iend_chunk();
 	void calc_gamma_table();
@@ -524,6 +574,12 @@ void png_decoder::uninitialize()
 	}
 
 	mz_inflateEnd(&m_inflator);
+
+	free(m_pInflated_buf);
+	m_pInflated_buf = nullptr;
+
+	free(m_pInfl_tables);
+	m_pInfl_tables = nullptr;
 }
 
 int png_decoder::terminate(int status)
@@ -608,6 +664,9 @@ int png_decoder::fetch_next_chunk_data(uint8_t* buf, int bytes)
 	bool check_crc32 = !is_idat;
 #endif
 
+	if (m_skip_crc32)
+		check_crc32 = false;
+
 	if (check_crc32)
 		m_chunk_crc32 = buminiz::mz_crc32(m_chunk_crc32, buf, bytes);
 
@@ -1044,9 +1103,196 @@ static int unpack_true_alpha_16(uint8_t* src, uint8_t* dst, int pixels, png_deco
 	return TRUE;
 }
 
+#if PVPNG_SSE41_SUPPORTED || PVPNG_NEON_SUPPORTED
+// Pixels are unfiltered one at a time, because each depends on the one to its left. 
+// Only the pixel's bpp bytes are read or written, so the kernels never touch the bytes past the end of the row.
+template<uint32_t bpp> static inline uint32_t load_pixel_bits(const uint8_t* p)
+{
+	// A 3 byte memcpy() into a zeroed dword goes through the stack, and the dword's load stalls on the partial stores.
+	if (bpp == 3)
+	{
+		uint16_t lo;
+		memcpy(&lo, p, sizeof(lo));
+		return lo | ((uint32_t)p[2] << 16);
+	}
+
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+#endif
+
+#if PVPNG_SSE41_SUPPORTED
+// Checks the same CPUID bits as fpng's cpu_info::can_use_sse41(). There's no init function, so it's only done once on first use.
+static bool detect_sse41()
+{
+	uint32_t ecx = 0, edx = 0;
+#ifdef _MSC_VER
+	int regs[4];
+	__cpuid(regs, 0);
+	if (regs[0] < 1)
+		return false;
+	__cpuid(regs, 1);
+	ecx = (uint32_t)regs[2];
+	edx = (uint32_t)regs[3];
+#else
+	uint32_t eax = 0, ebx = 0;
+	if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+		return false;
+#endif
+	const bool has_sse = (edx & (1 << 25)) != 0, has_sse2 = (edx & (1 << 26)) != 0;
+	const bool has_sse3 = (ecx & (1 << 0)) != 0, has_ssse3 = (ecx & (1 << 9)) != 0, has_sse41 = (ecx & (1 << 19)) != 0;
+	return has_sse && has_sse2 && has_sse3 && has_ssse3 && has_sse41;
+}
+
+static bool can_use_sse41()
+{
+	static const bool s_sse41 = detect_sse41();
+	return s_sse41;
+}
+
+template<uint32_t bpp> static inline __m128i load_pixel_sse41(const uint8_t* p)
+{
+	return _mm_cvtsi32_si128((int)load_pixel_bits<bpp>(p));
+}
+
+template<uint32_t bpp> static inline void store_pixel_sse41(uint8_t* p, __m128i v)
+{
+	const uint32_t u = (uint32_t)_mm_cvtsi128_si32(v);
+	memcpy(p, &u, bpp);
+}
+
+template<uint32_t bpp> static void unpredict_sub_sse41(uint8_t* cur, uint32_t bytes)
+{
+	__m128i a = _mm_setzero_si128();
+	for (uint32_t i = 0; i < bytes; i += bpp)
+	{
+		a = _mm_add_epi8(load_pixel_sse41<bpp>(cur + i), a);
+		store_pixel_sse41<bpp>(cur + i, a);
+	}
+}
+
+template<uint32_t bpp> static void unpredict_average_sse41(const uint8_t* lst, uint8_t* cur, uint32_t bytes)
+{
+	const __m128i one = _mm_set1_epi8(1);
+	__m128i a = _mm_setzero_si128();
+	for (uint32_t i = 0; i < bytes; i += bpp)
+	{
+		const __m128i b = load_pixel_sse41<bpp>(lst + i);
+		
+		// _mm_avg_epu8() rounds up, PNG's average rounds down.
+		const __m128i avg = _mm_sub_epi8(_mm_avg_epu8(a, b), _mm_and_si128(_mm_xor_si128(a, b), one));
+		a = _mm_add_epi8(load_pixel_sse41<bpp>(cur + i), avg);
+		store_pixel_sse41<bpp>(cur + i, a);
+	}
+}
+
+template<uint32_t bpp> static void unpredict_paeth_sse41(const uint8_t* lst, uint8_t* cur, uint32_t bytes)
+{
+	// a, b and c are kept as 16-bit lanes, so p=a+b-c can't overflow.
+	const __m128i z = _mm_setzero_si128();
+	__m128i a = z, c = z;
+	for (uint32_t i = 0; i < bytes; i += bpp)
+	{
+		const __m128i b = _mm_cvtepu8_epi16(load_pixel_sse41<bpp>(lst + i));
+
+		// pa=|p-a|=|b-c|, pb=|p-b|=|a-c|, pc=|p-c|=|(b-c)+(a-c)|
+		const __m128i b_minus_c = _mm_sub_epi16(b, c), a_minus_c = _mm_sub_epi16(a, c);
+		const __m128i pa = _mm_abs_epi16(b_minus_c), pb = _mm_abs_epi16(a_minus_c), pc = _mm_abs_epi16(_mm_add_epi16(b_minus_c, a_minus_c));
+		const __m128i smallest = _mm_min_epi16(pc, _mm_min_epi16(pa, pb));
+
+		// Ties go to a, then b, like paeth_predictor().
+		const __m128i pred = _mm_blendv_epi8(_mm_blendv_epi8(c, b, _mm_cmpeq_epi16(smallest, pb)), a, _mm_cmpeq_epi16(smallest, pa));
+
+		const __m128i v = _mm_add_epi8(load_pixel_sse41<bpp>(cur + i), _mm_packus_epi16(pred, z));
+		store_pixel_sse41<bpp>(cur + i, v);
+
+		a = _mm_cvtepu8_epi16(v);
+		c = b;
+	}
+}
+#endif
+
+#if PVPNG_NEON_SUPPORTED
+template<uint32_t bpp> static inline uint8x8_t load_pixel_neon(const uint8_t* p)
+{
+	return vcreate_u8(load_pixel_bits<bpp>(p));
+}
+
+template<uint32_t bpp> static inline void store_pixel_neon(uint8_t* p, uint8x8_t v)
+{
+	const uint32_t u = vget_lane_u32(vreinterpret_u32_u8(v), 0);
+	memcpy(p, &u, bpp);
+}
+
+template<uint32_t bpp> static void unpredict_sub_neon(uint8_t* cur, uint32_t bytes)
+{
+	uint8x8_t a = vdup_n_u8(0);
+	for (uint32_t i = 0; i < bytes; i += bpp)
+	{
+		a = vadd_u8(load_pixel_neon<bpp>(cur + i), a);
+		store_pixel_neon<bpp>(cur + i, a);
+	}
+}
+
+template<uint32_t bpp> static void unpredict_average_neon(const uint8_t* lst, uint8_t* cur, uint32_t bytes)
+{
+	uint8x8_t a = vdup_n_u8(0);
+	for (uint32_t i = 0; i < bytes; i += bpp)
+	{
+		// vhadd rounds down, like PNG's average.
+		a = vadd_u8(load_pixel_neon<bpp>(cur + i), vhadd_u8(a, load_pixel_neon<bpp>(lst + i)));
+		store_pixel_neon<bpp>(cur + i, a);
+	}
+}
+
+template<uint32_t bpp> static void unpredict_paeth_neon(const uint8_t* lst, uint8_t* cur, uint32_t bytes)
+{
+	uint8x8_t a = vdup_n_u8(0), c = vdup_n_u8(0);
+	for (uint32_t i = 0; i < bytes; i += bpp)
+	{
+		const uint8x8_t b = load_pixel_neon<bpp>(lst + i);
+
+		// pa=|b-c|, pb=|a-c|, pc=|(b-c)+(a-c)|, in 16-bit lanes.
+		const int16x8_t b_minus_c = vreinterpretq_s16_u16(vsubl_u8(b, c)), a_minus_c = vreinterpretq_s16_u16(vsubl_u8(a, c));
+		const int16x8_t pa = vabsq_s16(b_minus_c), pb = vabsq_s16(a_minus_c), pc = vabsq_s16(vaddq_s16(b_minus_c, a_minus_c));
+
+		// Ties go to a, then b, like paeth_predictor().
+		const uint8x8_t use_a = vmovn_u16(vandq_u16(vcleq_s16(pa, pb), vcleq_s16(pa, pc)));
+		const uint8x8_t use_b = vmovn_u16(vcleq_s16(pb, pc));
+		const uint8x8_t pred = vbsl_u8(use_a, a, vbsl_u8(use_b, b, c));
+
+		a = vadd_u8(load_pixel_neon<bpp>(cur + i), pred);
+		store_pixel_neon<bpp>(cur + i, a);
+		c = b;
+	}
+}
+#endif
+
 void png_decoder::unpredict_sub(uint8_t* lst, uint8_t* cur, uint32_t bytes, int bpp)
 {
 	(void)lst;
+
+#if PVPNG_SSE41_SUPPORTED
+	if (((bpp == 3) || (bpp == 4)) && can_use_sse41())
+	{
+		if (bpp == 3)
+			unpredict_sub_sse41<3>(cur, bytes);
+		else
+			unpredict_sub_sse41<4>(cur, bytes);
+		return;
+	}
+#elif PVPNG_NEON_SUPPORTED
+	if ((bpp == 3) || (bpp == 4))
+	{
+		if (bpp == 3)
+			unpredict_sub_neon<3>(cur, bytes);
+		else
+			unpredict_sub_neon<4>(cur, bytes);
+		return;
+	}
+#endif
+
 	if (bytes == (uint32_t)bpp)
 		return;
 
@@ -1069,6 +1315,26 @@ void png_decoder::unpredict_up(uint8_t* lst, uint8_t* cur, uint32_t bytes, int b
 
 void png_decoder::unpredict_average(uint8_t* lst, uint8_t* cur, uint32_t bytes, int bpp)
 {
+#if PVPNG_SSE41_SUPPORTED
+	if (((bpp == 3) || (bpp == 4)) && can_use_sse41())
+	{
+		if (bpp == 3)
+			unpredict_average_sse41<3>(lst, cur, bytes);
+		else
+			unpredict_average_sse41<4>(lst, cur, bytes);
+		return;
+	}
+#elif PVPNG_NEON_SUPPORTED
+	if ((bpp == 3) || (bpp == 4))
+	{
+		if (bpp == 3)
+			unpredict_average_neon<3>(lst, cur, bytes);
+		else
+			unpredict_average_neon<4>(lst, cur, bytes);
+		return;
+	}
+#endif
+
 	int i;
 
 	for (i = 0; i < bpp; i++)
@@ -1108,6 +1374,26 @@ inline uint8_t png_decoder::paeth_predictor(int a, int b, int c)
 
 void png_decoder::unpredict_paeth(uint8_t* lst, uint8_t* cur, uint32_t bytes, int bpp)
 {
+#if PVPNG_SSE41_SUPPORTED
+	if (((bpp == 3) || (bpp == 4)) && can_use_sse41())
+	{
+		if (bpp == 3)
+			unpredict_paeth_sse41<3>(lst, cur, bytes);
+		else
+			unpredict_paeth_sse41<4>(lst, cur, bytes);
+		return;
+	}
+#elif PVPNG_NEON_SUPPORTED
+	if ((bpp == 3) || (bpp == 4))
+	{
+		if (bpp == 3)
+			unpredict_paeth_neon<3>(lst, cur, bytes);
+		else
+			unpredict_paeth_neon<4>(lst, cur, bytes);
+		return;
+	}
+#endif
+
 	int i;
 
 	for (i = 0; i < bpp; i++)
@@ -1143,6 +1429,541 @@ void png_decoder::unpredict_paeth(uint8_t* lst, uint8_t* cur, uint32_t bytes, in
 	}
 }
 
+#if PVPNG_FAST_INFLATE
+// ---- Full-buffer inflate
+// Inflates a whole zlib stream into a buffer in one pass. Huffman codes are decoded with lookup tables: a primary table indexed by the next 
+// INFL_LIT_TABLE_BITS (or INFL_DIST_TABLE_BITS) bits, and a subtable for each prefix of the longer codes. Like fpng's decoder, a primary 
+// literal entry also holds the literal after it when both codes fit, so runs of literals are decoded two at a time.
+
+const uint32_t INFL_LIT_TABLE_BITS = 11;
+const uint32_t INFL_DIST_TABLE_BITS = 8;
+const uint32_t INFL_CLEN_TABLE_BITS = 7;
+const uint32_t INFL_MAX_CODE_SIZE = 15;
+const uint32_t INFL_MAX_LIT_SYMS = 288, INFL_MAX_DIST_SYMS = 32, INFL_MAX_CLEN_SYMS = 19;
+
+// The fast path needs room for two literal pairs and the longest match, plus the 8 byte copies' overrun.
+const uint32_t INFL_FAST_DST_MARGIN = 2 * 2 + 258 + 8;
+
+// Every distinct prefix of a code longer than the primary table gets a subtable covering the longest code.
+const uint32_t INFL_LIT_TABLE_SIZE = (1 << INFL_LIT_TABLE_BITS) + INFL_MAX_LIT_SYMS * (1 << (INFL_MAX_CODE_SIZE - INFL_LIT_TABLE_BITS));
+const uint32_t INFL_DIST_TABLE_SIZE = (1 << INFL_DIST_TABLE_BITS) + INFL_MAX_DIST_SYMS * (1 << (INFL_MAX_CODE_SIZE - INFL_DIST_TABLE_BITS));
+
+// Table entries: bits 0-4 are the code size, bits 5-7 the kind, bits 8-15 a literal or a base's number of extra bits, bits 16-31 a second literal, 
+// a length/distance base, or a subtable's offset. A zero entry is an invalid code.
+enum
+{
+	INFL_KIND_INVALID = 0,
+	INFL_KIND_LIT = 1,
+	INFL_KIND_LIT2 = 2,
+	INFL_KIND_BASE = 3,
+	INFL_KIND_EOB = 4,
+	INFL_KIND_SUB = 5
+};
+
+static inline uint32_t infl_entry(uint32_t kind, uint32_t a, uint32_t b) { return (kind << 5) | (a << 8) | (b << 16); }
+static inline uint32_t infl_code_size(uint32_t e) { return e & 31; }
+static inline uint32_t infl_kind(uint32_t e) { return (e >> 5) & 7; }
+
+static const uint16_t s_infl_len_base[29] = { 3,4,5,6,7,8,9,10,11,13,15,17,19,23,27,31,35,43,51,59,67,83,99,115,131,163,195,227,258 };
+static const uint8_t s_infl_len_extra[29] = { 0,0,0,0,0,0,0,0,1,1,1,1,2,2,2,2,3,3,3,3,4,4,4,4,5,5,5,5,0 };
+static const uint16_t s_infl_dist_base[30] = { 1,2,3,4,5,7,9,13,17,25,33,49,65,97,129,193,257,385,513,769,1025,1537,2049,3073,4097,6145,8193,12289,16385,24577 };
+static const uint8_t s_infl_dist_extra[30] = { 0,0,0,0,1,1,2,2,3,3,4,4,5,5,6,6,7,7,8,8,9,9,10,10,11,11,12,12,13,13 };
+
+static inline uint64_t infl_read_le64(const uint8_t* p)
+{
+#if defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_BIG_ENDIAN__)
+	uint64_t v = 0;
+	for (int i = 7; i >= 0; i--)
+		v = (v << 8) | p[i];
+	return v;
+#else
+	uint64_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+#endif
+}
+
+// Builds a decoding table from the code sizes of num_syms symbols. pSym_entries are the symbols' entries, without their code size.
+// Over-subscribed codes are rejected. Incomplete codes are allowed (a single distance code is legal), and their unused entries stay invalid.
+static bool infl_build_table(const uint8_t* pCode_sizes, uint32_t num_syms, const uint32_t* pSym_entries, uint32_t table_bits, uint32_t* pTable, uint32_t table_size, uint32_t& sub_bits)
+{
+	uint32_t num_codes[INFL_MAX_CODE_SIZE + 1];
+	memset(num_codes, 0, sizeof(num_codes));
+	for (uint32_t i = 0; i < num_syms; i++)
+		num_codes[pCode_sizes[i]]++;
+	num_codes[0] = 0;
+
+	uint32_t next_code[INFL_MAX_CODE_SIZE + 1];
+	uint32_t max_code_size = 0, code = 0;
+	int left = 1;
+	for (uint32_t i = 1; i <= INFL_MAX_CODE_SIZE; i++)
+	{
+		left = (left << 1) - (int)num_codes[i];
+		if (left < 0)
+			return false;
+
+		next_code[i] = code;
+		code = (code + num_codes[i]) << 1;
+
+		if (num_codes[i])
+			max_code_size = i;
+	}
+
+	sub_bits = (max_code_size > table_bits) ? (max_code_size - table_bits) : 0;
+
+	const uint32_t primary_size = 1 << table_bits;
+	memset(pTable, 0, sizeof(uint32_t) * primary_size);
+
+	uint32_t next_sub_ofs = primary_size;
+
+	for (uint32_t sym = 0; sym < num_syms; sym++)
+	{
+		const uint32_t code_size = pCode_sizes[sym];
+		if (!code_size)
+			continue;
+
+		// Deflate's codes are stored starting with their MSB, so the table is indexed by the reversed code.
+		uint32_t rev_code = 0;
+		for (uint32_t c = next_code[code_size]++, i = 0; i < code_size; i++, c >>= 1)
+			rev_code = (rev_code << 1) | (c & 1);
+
+		const uint32_t e = pSym_entries[sym] | code_size;
+
+		if (code_size <= table_bits)
+		{
+			for (uint32_t j = rev_code; j < primary_size; j += (1 << code_size))
+				pTable[j] = e;
+			continue;
+		}
+
+		uint32_t& prefix_e = pTable[rev_code & (primary_size - 1)];
+		if (infl_kind(prefix_e) != INFL_KIND_SUB)
+		{
+			if ((next_sub_ofs + (1 << sub_bits)) > table_size)
+				return false;
+
+			prefix_e = infl_entry(INFL_KIND_SUB, 0, next_sub_ofs) | table_bits;
+			memset(pTable + next_sub_ofs, 0, sizeof(uint32_t) << sub_bits);
+			next_sub_ofs += (1 << sub_bits);
+		}
+
+		uint32_t* pSub = pTable + (prefix_e >> 16);
+		for (uint32_t j = rev_code >> table_bits; j < (1U << sub_bits); j += (1 << (code_size - table_bits)))
+			pSub[j] = e;
+	}
+
+	return true;
+}
+
+struct infl_tables
+{
+	uint32_t m_lit[INFL_LIT_TABLE_SIZE];
+	uint32_t m_dist[INFL_DIST_TABLE_SIZE];
+	uint32_t m_lit_sub_bits, m_dist_sub_bits;
+};
+
+static bool infl_build_block_tables(const uint8_t* pLit_code_sizes, uint32_t num_lit_syms, const uint8_t* pDist_code_sizes, uint32_t num_dist_syms, infl_tables& tables)
+{
+	uint32_t lit_entries[INFL_MAX_LIT_SYMS], dist_entries[INFL_MAX_DIST_SYMS];
+
+	for (uint32_t i = 0; i < INFL_MAX_LIT_SYMS; i++)
+	{
+		if (i < 256)
+			lit_entries[i] = infl_entry(INFL_KIND_LIT, i, 0);
+		else if (i == 256)
+			lit_entries[i] = infl_entry(INFL_KIND_EOB, 0, 0);
+		else if (i < 286)
+			lit_entries[i] = infl_entry(INFL_KIND_BASE, s_infl_len_extra[i - 257], s_infl_len_base[i - 257]);
+		else
+			lit_entries[i] = INFL_KIND_INVALID;
+	}
+
+	for (uint32_t i = 0; i < INFL_MAX_DIST_SYMS; i++)
+		dist_entries[i] = (i < 30) ? infl_entry(INFL_KIND_BASE, s_infl_dist_extra[i], s_infl_dist_base[i]) : (uint32_t)INFL_KIND_INVALID;
+
+	if (!infl_build_table(pLit_code_sizes, num_lit_syms, lit_entries, INFL_LIT_TABLE_BITS, tables.m_lit, INFL_LIT_TABLE_SIZE, tables.m_lit_sub_bits))
+		return false;
+
+	if (!infl_build_table(pDist_code_sizes, num_dist_syms, dist_entries, INFL_DIST_TABLE_BITS, tables.m_dist, INFL_DIST_TABLE_SIZE, tables.m_dist_sub_bits))
+		return false;
+
+	// Pair up literals whose codes both fit in the primary table. The second literal is looked up in a copy, so it's always a single literal.
+	uint32_t primary[1 << INFL_LIT_TABLE_BITS];
+	memcpy(primary, tables.m_lit, sizeof(primary));
+
+	for (uint32_t i = 0; i < (1 << INFL_LIT_TABLE_BITS); i++)
+	{
+		const uint32_t e = primary[i];
+		if (infl_kind(e) != INFL_KIND_LIT)
+			continue;
+
+		const uint32_t code_size = infl_code_size(e);
+		const uint32_t next_e = primary[i >> code_size];
+		if ((infl_kind(next_e) != INFL_KIND_LIT) || ((code_size + infl_code_size(next_e)) > INFL_LIT_TABLE_BITS))
+			continue;
+
+		tables.m_lit[i] = infl_entry(INFL_KIND_LIT2, (e >> 8) & 0xFF, (next_e >> 8) & 0xFF) | (code_size + infl_code_size(next_e));
+	}
+
+	return true;
+}
+
+// The bit buffer is refilled to at least 56 bits, enough for a length and a distance with their extra bits. Near the end of the stream it's refilled
+// a byte at a time, and bit_buf_size goes negative if more bits were consumed than the stream has.
+#define INFL_REFILL() do { \
+	if (bit_buf_size < 0) return false; \
+	if ((src_ofs + 8) <= src_len) { \
+		bit_buf |= infl_read_le64(pSrc + src_ofs) << bit_buf_size; \
+		src_ofs += (63 - bit_buf_size) >> 3; \
+		bit_buf_size |= 56; } \
+	else { \
+		while ((bit_buf_size <= 56) && (src_ofs < src_len)) { \
+			bit_buf |= (uint64_t)pSrc[src_ofs++] << bit_buf_size; \
+			bit_buf_size += 8; } } \
+	} while (0)
+
+#define INFL_SKIP_BITS(n) do { const uint32_t l = n; bit_buf >>= l; bit_buf_size -= (int)l; } while (0)
+
+#define INFL_GET_BITS(b, n) do { const uint32_t num_bits = n; b = (uint32_t)bit_buf & ((1U << num_bits) - 1); INFL_SKIP_BITS(num_bits); } while (0)
+
+// Inflates the zlib stream in pSrc into pDst, returning false if it's invalid. dst_size is the expected size: if the stream decompresses to more than that,
+// decoding stops once pDst is full (like the streaming path, which ignores any data after the last line). out_size is the number of bytes written.
+// tables is scratch memory for the Huffman decoding tables, which are rebuilt for each block.
+static bool fast_inflate(const uint8_t* pSrc, size_t src_len, uint8_t* pDst, size_t dst_size, size_t& out_size, bool check_adler32, infl_tables& tables)
+{
+	out_size = 0;
+
+	if (src_len < 2)
+		return false;
+
+	// zlib header: deflate with a window of up to 32KB, no preset dictionary
+	const uint32_t cmf = pSrc[0], flg = pSrc[1];
+	if ((((cmf << 8) | flg) % 31) || ((cmf & 15) != 8) || ((cmf >> 4) > 7) || (flg & 32))
+		return false;
+
+	size_t src_ofs = 2, dst_ofs = 0;
+	uint64_t bit_buf = 0;
+	int bit_buf_size = 0;
+	bool final_block = false, dst_full = false;
+
+	while ((!final_block) && (!dst_full))
+	{
+		INFL_REFILL();
+
+		uint32_t block_type;
+		INFL_GET_BITS(final_block, 1);
+		INFL_GET_BITS(block_type, 2);
+
+		if (block_type == 0)
+		{
+			// Stored block: LEN and NLEN start at the next byte boundary, then the bit buffer's unread bytes are put back.
+			INFL_SKIP_BITS(bit_buf_size & 7);
+			INFL_REFILL();
+			if (bit_buf_size < 32)
+				return false;
+
+			uint32_t len, nlen;
+			INFL_GET_BITS(len, 16);
+			INFL_GET_BITS(nlen, 16);
+			if (len != (~nlen & 0xFFFF))
+				return false;
+
+			src_ofs -= bit_buf_size >> 3;
+			bit_buf = 0;
+			bit_buf_size = 0;
+
+			if ((src_len - src_ofs) < len)
+				return false;
+
+			size_t n = len;
+			if (n > (dst_size - dst_ofs))
+			{
+				n = dst_size - dst_ofs;
+				dst_full = true;
+			}
+
+			memcpy(pDst + dst_ofs, pSrc + src_ofs, n);
+			dst_ofs += n;
+			src_ofs += len;
+			continue;
+		}
+		
+		if (block_type == 1)
+		{
+			uint8_t code_sizes[INFL_MAX_LIT_SYMS + INFL_MAX_DIST_SYMS];
+			memset(code_sizes, 8, 144);
+			memset(code_sizes + 144, 9, 256 - 144);
+			memset(code_sizes + 256, 7, 280 - 256);
+			memset(code_sizes + 280, 8, INFL_MAX_LIT_SYMS - 280);
+			memset(code_sizes + INFL_MAX_LIT_SYMS, 5, INFL_MAX_DIST_SYMS);
+
+			if (!infl_build_block_tables(code_sizes, INFL_MAX_LIT_SYMS, code_sizes + INFL_MAX_LIT_SYMS, INFL_MAX_DIST_SYMS, tables))
+				return false;
+		}
+		else if (block_type == 2)
+		{
+			static const uint8_t s_clen_order[INFL_MAX_CLEN_SYMS] = { 16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
+
+			uint32_t num_lit_syms, num_dist_syms, num_clen_syms;
+			INFL_GET_BITS(num_lit_syms, 5);
+			INFL_GET_BITS(num_dist_syms, 5);
+			INFL_GET_BITS(num_clen_syms, 4);
+			num_lit_syms += 257;
+			num_dist_syms += 1;
+			num_clen_syms += 4;
+
+			uint8_t clen_code_sizes[INFL_MAX_CLEN_SYMS];
+			memset(clen_code_sizes, 0, sizeof(clen_code_sizes));
+
+			for (uint32_t i = 0; i < num_clen_syms; i++)
+			{
+				INFL_REFILL();
+				INFL_GET_BITS(clen_code_sizes[s_clen_order[i]], 3);
+			}
+
+			uint32_t clen_entries[INFL_MAX_CLEN_SYMS], clen_table[1 << INFL_CLEN_TABLE_BITS], clen_sub_bits;
+			for (uint32_t i = 0; i < INFL_MAX_CLEN_SYMS; i++)
+				clen_entries[i] = infl_entry(INFL_KIND_LIT, i, 0);
+
+			if (!infl_build_table(clen_code_sizes, INFL_MAX_CLEN_SYMS, clen_entries, INFL_CLEN_TABLE_BITS, clen_table, 1 << INFL_CLEN_TABLE_BITS, clen_sub_bits))
+				return false;
+
+			uint8_t code_sizes[INFL_MAX_LIT_SYMS + INFL_MAX_DIST_SYMS];
+			const uint32_t total_syms = num_lit_syms + num_dist_syms;
+
+			for (uint32_t cur_sym = 0; cur_sym < total_syms; )
+			{
+				INFL_REFILL();
+
+				const uint32_t e = clen_table[bit_buf & ((1 << INFL_CLEN_TABLE_BITS) - 1)];
+				if (infl_kind(e) != INFL_KIND_LIT)
+					return false;
+				INFL_SKIP_BITS(infl_code_size(e));
+
+				const uint32_t sym = (e >> 8) & 0xFF;
+				if (sym < 16)
+				{
+					code_sizes[cur_sym++] = (uint8_t)sym;
+					continue;
+				}
+
+				uint32_t rep_len, rep_code_size = 0;
+				if (sym == 16)
+				{
+					if (!cur_sym)
+						return false;
+					rep_code_size = code_sizes[cur_sym - 1];
+					INFL_GET_BITS(rep_len, 2);
+					rep_len += 3;
+				}
+				else if (sym == 17)
+				{
+					INFL_GET_BITS(rep_len, 3);
+					rep_len += 3;
+				}
+				else
+				{
+					INFL_GET_BITS(rep_len, 7);
+					rep_len += 11;
+				}
+
+				if ((cur_sym + rep_len) > total_syms)
+					return false;
+
+				memset(code_sizes + cur_sym, rep_code_size, rep_len);
+				cur_sym += rep_len;
+			}
+
+			if (!infl_build_block_tables(code_sizes, num_lit_syms, code_sizes + num_lit_syms, num_dist_syms, tables))
+				return false;
+		}
+		else
+			return false;
+
+		const uint32_t lit_sub_mask = (1 << tables.m_lit_sub_bits) - 1, dist_sub_mask = (1 << tables.m_dist_sub_bits) - 1;
+
+#define INFL_LOOKUP_LIT() do { \
+	e = tables.m_lit[bit_buf & ((1 << INFL_LIT_TABLE_BITS) - 1)]; \
+	if (infl_kind(e) == INFL_KIND_SUB) \
+		e = tables.m_lit[(e >> 16) + ((uint32_t)(bit_buf >> INFL_LIT_TABLE_BITS) & lit_sub_mask)]; \
+	kind = infl_kind(e); \
+	} while (0)
+
+		for (; ; )
+		{
+			uint32_t e, kind;
+
+			if (((src_len - src_ofs) >= 8) && ((dst_size - dst_ofs) >= INFL_FAST_DST_MARGIN))
+			{
+				// Fast path: refill without any checks, and write without checking for the end of pDst. 
+				bit_buf |= infl_read_le64(pSrc + src_ofs) << bit_buf_size;
+				src_ofs += (63 - bit_buf_size) >> 3;
+				bit_buf_size |= 56;
+
+				// The 56 bits hold at least three literal entries. Both bytes of an entry are always written (kind is its number of literals), 
+				// and the second is overwritten next if it's a single literal.
+				INFL_LOOKUP_LIT();
+				if ((kind - INFL_KIND_LIT) < 2)
+				{
+					INFL_SKIP_BITS(infl_code_size(e));
+					pDst[dst_ofs] = (uint8_t)(e >> 8);
+					pDst[dst_ofs + 1] = (uint8_t)(e >> 16);
+					dst_ofs += kind;
+
+					INFL_LOOKUP_LIT();
+					if ((kind - INFL_KIND_LIT) < 2)
+					{
+						INFL_SKIP_BITS(infl_code_size(e));
+						pDst[dst_ofs] = (uint8_t)(e >> 8);
+						pDst[dst_ofs + 1] = (uint8_t)(e >> 16);
+						dst_ofs += kind;
+
+						INFL_LOOKUP_LIT();
+						if ((kind - INFL_KIND_LIT) < 2)
+						{
+							INFL_SKIP_BITS(infl_code_size(e));
+							pDst[dst_ofs] = (uint8_t)(e >> 8);
+							pDst[dst_ofs + 1] = (uint8_t)(e >> 16);
+							dst_ofs += kind;
+							continue;
+						}
+					}
+
+					// A length code, its extra bits, and the distance code and extra bits can need 48 bits.
+					if ((kind == INFL_KIND_BASE) && (bit_buf_size < 48))
+						INFL_REFILL();
+				}
+			}
+			else
+			{
+				INFL_REFILL();
+				INFL_LOOKUP_LIT();
+
+				if (kind == INFL_KIND_LIT)
+				{
+					if (dst_ofs == dst_size)
+					{
+						dst_full = true;
+						break;
+					}
+
+					INFL_SKIP_BITS(infl_code_size(e));
+					pDst[dst_ofs++] = (uint8_t)(e >> 8);
+					continue;
+				}
+
+				if (kind == INFL_KIND_LIT2)
+				{
+					if ((dst_size - dst_ofs) < 2)
+					{
+						if (dst_ofs < dst_size)
+							pDst[dst_ofs++] = (uint8_t)(e >> 8);
+						dst_full = true;
+						break;
+					}
+
+					INFL_SKIP_BITS(infl_code_size(e));
+					pDst[dst_ofs] = (uint8_t)(e >> 8);
+					pDst[dst_ofs + 1] = (uint8_t)(e >> 16);
+					dst_ofs += 2;
+					continue;
+				}
+			}
+
+			INFL_SKIP_BITS(infl_code_size(e));
+
+			if (kind == INFL_KIND_EOB)
+				break;
+			
+			if (kind != INFL_KIND_BASE)
+				return false;
+
+			uint32_t len, dist, extra;
+			INFL_GET_BITS(extra, (e >> 8) & 0xFF);
+			len = (e >> 16) + extra;
+
+			e = tables.m_dist[bit_buf & ((1 << INFL_DIST_TABLE_BITS) - 1)];
+			if (infl_kind(e) == INFL_KIND_SUB)
+				e = tables.m_dist[(e >> 16) + ((uint32_t)(bit_buf >> INFL_DIST_TABLE_BITS) & dist_sub_mask)];
+			if (infl_kind(e) != INFL_KIND_BASE)
+				return false;
+
+			INFL_SKIP_BITS(infl_code_size(e));
+			INFL_GET_BITS(extra, (e >> 8) & 0xFF);
+			dist = (e >> 16) + extra;
+
+			if (bit_buf_size < 0)
+				return false;
+
+			if (dist > dst_ofs)
+				return false;
+
+			if (len > (dst_size - dst_ofs))
+			{
+				len = (uint32_t)(dst_size - dst_ofs);
+				dst_full = true;
+			}
+
+			uint8_t* pOut = pDst + dst_ofs;
+			const uint8_t* pFrom = pOut - dist;
+			uint8_t* pOut_end = pOut + len;
+			dst_ofs += len;
+
+			if ((dist >= 8) && ((dst_size - dst_ofs) >= 8))
+			{
+				// Copy 8 bytes at a time, which may write up to 7 bytes past the match. Those are overwritten by whatever comes next.
+				do
+				{
+					memcpy(pOut, pFrom, 8);
+					pOut += 8;
+					pFrom += 8;
+				} while (pOut < pOut_end);
+			}
+			else if (dist == 1)
+				memset(pOut, *pFrom, len);
+			else
+			{
+				// The match overlaps itself. Copy its repeating pattern in non-overlapping pieces, which double in size each time.
+				while (pOut != pOut_end)
+				{
+					const size_t n = minimum<size_t>(pOut - pFrom, pOut_end - pOut);
+					memcpy(pOut, pFrom, n);
+					pOut += n;
+				}
+			}
+
+			if (dst_full)
+				break;
+		}
+
+#undef INFL_LOOKUP_LIT
+	}
+
+	if (bit_buf_size < 0)
+		return false;
+
+	out_size = dst_ofs;
+
+	if ((check_adler32) && (final_block) && (!dst_full))
+	{
+		// The Adler-32 is big endian, at the next byte boundary.
+		src_ofs -= bit_buf_size >> 3;
+		if ((src_len - src_ofs) < 4)
+			return false;
+
+		const uint32_t adler32 = ((uint32_t)pSrc[src_ofs] << 24) | ((uint32_t)pSrc[src_ofs + 1] << 16) | ((uint32_t)pSrc[src_ofs + 2] << 8) | pSrc[src_ofs + 3];
+		if (adler32 != (uint32_t)buminiz::mz_adler32(MZ_ADLER32_INIT, pDst, dst_ofs))
+			return false;
+	}
+
+	return true;
+}
+
+#undef INFL_REFILL
+#undef INFL_SKIP_BITS
+#undef INFL_GET_BITS
+#endif // PVPNG_FAST_INFLATE
+
 int png_decoder::adam7_pass_size(int size, int start, int step)
 {
 	if (size > start)
@@ -1151,6 +1972,85 @@ int png_decoder::adam7_pass_size(int size, int start, int step)
 		return 0;
 }
 
+// The number of filtered bytes in a line of pixels, not counting the filter byte.
+uint32_t png_decoder::get_src_bytes_per_line(uint32_t pixels)
+{
+	if ((m_ihdr.m_color_type == PNG_COLOR_TYPE_GREYSCALE) || (m_ihdr.m_color_type == PNG_COLOR_TYPE_PALETTIZED))
+		return ((pixels * m_ihdr.m_bit_depth) + 7) / 8;
+
+	return pixels * m_dec_bytes_per_pixel;
+}
+
+// The size of the inflated IDAT data: every line of every (non-empty) pass with its filter byte.
+uint64_t png_decoder::get_total_filtered_size()
+{
+	if (m_ihdr.m_ilace_type == 0)
+		return (uint64_t)(get_src_bytes_per_line(m_ihdr.m_width) + 1) * m_ihdr.m_height;
+
+	static const uint8_t s_x_start[7] = { 0, 4, 0, 2, 0, 1, 0 }, s_x_step[7] = { 8, 8, 4, 4, 2, 2, 1 };
+	static const uint8_t s_y_start[7] = { 0, 0, 4, 0, 2, 0, 1 }, s_y_step[7] = { 8, 8, 8, 4, 4, 2, 2 };
+
+	uint64_t total = 0;
+	for (int pass = 0; pass < 7; pass++)
+	{
+		const int x_size = adam7_pass_size(m_ihdr.m_width, s_x_start[pass], s_x_step[pass]);
+		const int y_size = adam7_pass_size(m_ihdr.m_height, s_y_start[pass], s_y_step[pass]);
+		if ((x_size) && (y_size))
+			total += (uint64_t)(get_src_bytes_per_line(x_size) + 1) * y_size;
+	}
+
+	return total;
+}
+
+// Reads all of the IDAT chunks and inflates them with fast_inflate(), if the image's filtered lines fit in memory. 
+// Otherwise m_pInflated_buf stays nullptr, and decompress_line() inflates a line at a time with miniz.
+int png_decoder::inflate_idat_data()
+{
+#if PVPNG_FAST_INFLATE
+	const uint64_t total_size = get_total_filtered_size();
+	if ((sizeof(size_t) == sizeof(uint32_t)) && (total_size >= 0x7FFFFFFF))
+		return 0;
+
+	if (!m_pInfl_tables)
+	{
+		m_pInfl_tables = (infl_tables*)calloc(1, sizeof(infl_tables));
+		if (!m_pInfl_tables)
+			return 0;
+	}
+
+	m_pInflated_buf = (uint8_t*)malloc((size_t)maximum<uint64_t>(total_size, 1));
+	if (!m_pInflated_buf)
+		return 0;
+
+	std::vector<uint8_t> idat_buf;
+
+	for (; ; )
+	{
+		const size_t cur_size = idat_buf.size();
+		const uint32_t bytes_to_read = (uint32_t)minimum<size_t>(maximum<size_t>(cur_size, 65536), 0x10000000);
+
+		idat_buf.resize(cur_size + bytes_to_read);
+
+		uint32_t bytes_read = 0;
+		int res = unchunk_data(idat_buf.data() + cur_size, bytes_to_read, &bytes_read);
+		if (res < 0)
+			return res;
+
+		idat_buf.resize(cur_size + bytes_read);
+
+		if (res)
+			break;
+	}
+
+	if (!fast_inflate(idat_buf.data(), idat_buf.size(), m_pInflated_buf, (size_t)total_size, m_inflated_size, PVPNG_ADLER32_CHECKING != 0, *m_pInfl_tables))
+		return terminate(PNG_INVALID_DATA_STREAM);
+
+	m_inflated_ofs = 0;
+#endif
+
+	return 0;
+}
+
 // TRUE if no more data, negative on error, FALSE if OK
 int png_decoder::decompress_line(uint32_t* bytes_decoded)
 {
@@ -1159,6 +2059,21 @@ int png_decoder::decompress_line(uint32_t* bytes_decoded)
 
 	m_inflate_dst_buf_ofs = 0;
 
+#if PVPNG_FAST_INFLATE
+	if (m_pInflated_buf)
+	{
+		const uint32_t n = (uint32_t)minimum<size_t>(m_inflated_size - m_inflated_ofs, m_dec_bytes_per_line);
+		memcpy(m_pCur_line_buf, m_pInflated_buf + m_inflated_ofs, n);
+		m_inflated_ofs += n;
+
+		if (bytes_decoded)
+			*bytes_decoded = n;
+
+		// Like the end of the zlib stream below, TRUE if there's no more data.
+		return (m_inflated_ofs == m_inflated_size) ? TRUE : FALSE;
+	}
+#endif
+
 	for (; ; )
 	{
 		if (m_inflate_src_buf_ofs == PNG_INFLATE_SRC_BUF_SIZE)
@@ -1620,9 +2535,16 @@ int png_decoder::png_decode_start()
 
 	m_inflate_src_buf_ofs = PNG_INFLATE_SRC_BUF_SIZE;
 
-	int res = mz_inflateInit(&m_inflator);
-	if (res != 0)
-		return terminate(PNG_DECERROR);
+	status = inflate_idat_data();
+	if (status < 0)
+		return status;
+
+	if (!m_pInflated_buf)
+	{
+		int res = mz_inflateInit(&m_inflator);
+		if (res != 0)
+			return terminate(PNG_DECERROR);
+	}
 
 	if (m_ihdr.m_ilace_type == 1)
 	{
@@ -2110,6 +3032,7 @@ void png_decoder::clear()
 	clear_obj(m_chunk_name);
 
 	m_end_of_idat_chunks = 0;
+	m_skip_crc32 = false;
 
 	m_dec_bytes_per_pixel = 0;
 	m_dst_bytes_per_pixel = 0;
@@ -2142,6 +3065,12 @@ void png_decoder::clear()
 	m_inflate_dst_buf_ofs = 0;
 
 	m_inflate_eof_flag = FALSE;
+
+	m_pInflated_buf = nullptr;
+	m_inflated_size = 0;
+	m_inflated_ofs = 0;
+
+	m_pInfl_tables = nullptr;
 		
 	clear_obj(m_trns_value);
 
@@ -2249,56 +3178,48 @@ bool get_png_info(const void* pImage_buf, size_t buf_size, png_info &info)
 	return true;
 }
 
-void* load_png(const void* pImage_buf, size_t buf_size, uint32_t desired_chans, uint32_t& width, uint32_t& height, uint32_t& num_chans)
+// Scans the file's header chunks, and returns the number of channels (factoring in transparency), or 0 on any errors.
+static uint32_t scan_png(png_decoder& dec, png_readonly_memory_file& mf, const void* pImage_buf, size_t buf_size)
 {
-	width = 0;
-	height = 0;
-	num_chans = 0;
-		
 	if ((!pImage_buf) || (buf_size < MIN_PNG_SIZE))
 	{
 		assert(0);
-		return nullptr;
-	}
-
-	if (desired_chans > 4)
-	{
-		assert(0);
-		return nullptr;
+		return 0;
 	}
 
-	png_readonly_memory_file mf;
 	mf.init(pImage_buf, buf_size);
 
-	png_decoder dec;
-		
 	int status = dec.png_scan(&mf);
 	if ((status != 0) || (dec.m_img_supported_flag != TRUE))
-		return nullptr;
+		return 0;
 
-	uint32_t colortype = dec.m_ihdr.m_color_type;
-	switch (colortype)
+	switch (dec.m_ihdr.m_color_type)
 	{
 	case PNG_COLOR_TYPE_GREYSCALE:
-		num_chans = dec.m_trns_flag ? 2 : 1;
-		break;
+		return dec.m_trns_flag ? 2 : 1;
 	case PNG_COLOR_TYPE_GREYSCALE_ALPHA:
-		num_chans = 2;
-		break;
+		return 2;
 	case PNG_COLOR_TYPE_PALETTIZED:
 	case PNG_COLOR_TYPE_TRUECOLOR:
-		num_chans = dec.m_trns_flag ? 4 : 3;
-		break;
+		return dec.m_trns_flag ? 4 : 3;
 	case PNG_COLOR_TYPE_TRUECOLOR_ALPHA:
-		num_chans = 4;
-		break;
+		return 4;
 	default:
 		assert(0);
 		break;
 	}
 
-	if (!desired_chans)
-		desired_chans = num_chans;
+	return 0;
+}
+
+// Decodes the scanned image to pDst, converting it to desired_chans 8-bit channels, with rows pitch bytes apart.
+static bool decode_png_rows(png_decoder& dec, uint32_t desired_chans, uint8_t* pDst, size_t pitch)
+{
+	const uint32_t width = dec.m_ihdr.m_width;
+	const uint32_t height = dec.m_ihdr.m_height;
+	const uint32_t colortype = dec.m_ihdr.m_color_type;
+	const uint32_t bitdepth = dec.m_ihdr.m_bit_depth;
+	const uint32_t dst_bpl = width * desired_chans;
 
 #if 0
 	printf("lode_png: %ux%u bitdepth: %u colortype: %u trns: %u ilace: %u\n",
@@ -2310,36 +3231,15 @@ void* load_png(const void* pImage_buf, size_t buf_size, uint32_t desired_chans,
 		dec.m_ihdr.m_ilace_type);
 #endif
 
-	width = dec.m_ihdr.m_width;
-	height = dec.m_ihdr.m_height;
-	uint32_t bitdepth = dec.m_ihdr.m_bit_depth;
-	uint32_t pitch = width * desired_chans;
-
-	uint64_t total_size = (uint64_t)pitch * height;
-	if (total_size > 0x7FFFFFFFULL)
-		return nullptr;
-	
-	uint8_t* pBuf = (uint8_t*)malloc((size_t)total_size);
-	if (!pBuf)
-		return nullptr;
-	
 	if (dec.png_decode_start() != 0)
-	{
-		free(pBuf);
-		return nullptr;
-	}
-
-	uint8_t* pDst = pBuf;
+		return false;
 
 	for (uint32_t y = 0; y < height; y++, pDst += pitch)
 	{
 		uint8_t* pLine;
 		uint32_t line_bytes;
 		if (dec.png_decode((void**)&pLine, &line_bytes) != 0)
-		{
-			free(pBuf);
-			return nullptr;
-		}
+			return false;
 
 		// This conversion matrix handles converting RGB->Luma, converting grayscale samples to 8-bit samples, converting palettized images, and PNG transparency.
 		switch (colortype)
@@ -2361,7 +3261,7 @@ void* load_png(const void* pImage_buf, size_t buf_size, uint32_t desired_chans,
 				else if (bitdepth == 8)
 				{
 					assert(line_bytes == width);
-					memcpy(pDst, pLine, pitch);
+					memcpy(pDst, pLine, dst_bpl);
 				}
 				else
 				{
@@ -2476,9 +3376,9 @@ void* load_png(const void* pImage_buf, size_t buf_size, uint32_t desired_chans,
 					pDst[i] = dec.m_img_pal[pLine[i * 2 + 0] * 3];
 				break;
 			case 2:
-				assert(line_bytes == pitch);
+				assert(line_bytes == dst_bpl);
 				if (bitdepth >= 8)
-					memcpy(pDst, pLine, pitch);
+					memcpy(pDst, pLine, dst_bpl);
 				else
 				{
 					for (uint32_t i = 0; i < width; i++)
@@ -2613,7 +3513,7 @@ void* load_png(const void* pImage_buf, size_t buf_size, uint32_t desired_chans,
 				}
 				break;
 			case 4:
-				memcpy(pDst, pLine, pitch);
+				memcpy(pDst, pLine, dst_bpl);
 				break;
 			}
 
@@ -2626,9 +3526,86 @@ void* load_png(const void* pImage_buf, size_t buf_size, uint32_t desired_chans,
 
 	} // y
 
+	return true;
+}
+
+void* load_png(const void* pImage_buf, size_t buf_size, uint32_t desired_chans, uint32_t& width, uint32_t& height, uint32_t& num_chans)
+{
+	width = 0;
+	height = 0;
+	num_chans = 0;
+		
+	if (desired_chans > 4)
+	{
+		assert(0);
+		return nullptr;
+	}
+
+	png_readonly_memory_file mf;
+	png_decoder dec;
+		
+	num_chans = scan_png(dec, mf, pImage_buf, buf_size);
+	if (!num_chans)
+		return nullptr;
+
+	if (!desired_chans)
+		desired_chans = num_chans;
+
+	width = dec.m_ihdr.m_width;
+	height = dec.m_ihdr.m_height;
+	uint32_t pitch = width * desired_chans;
+
+	uint64_t total_size = (uint64_t)pitch * height;
+	if (total_size > 0x7FFFFFFFULL)
+		return nullptr;
+	
+	uint8_t* pBuf = (uint8_t*)malloc((size_t)total_size);
+	if (!pBuf)
+		return nullptr;
+	
+	if (!decode_png_rows(dec, desired_chans, pBuf, pitch))
+	{
+		free(pBuf);
+		return nullptr;
+	}
+
 	return pBuf;
 }
 
+bool load_png_to(const void* pImage_buf, size_t buf_size, uint32_t desired_chans, void* pDst, size_t dst_buf_size, uint32_t dst_pitch, uint32_t& width, uint32_t& height, uint32_t& num_chans, uint32_t flags)
+{
+	width = 0;
+	height = 0;
+	num_chans = 0;
+
+	if ((!pDst) || (desired_chans < 1) || (desired_chans > 4))
+	{
+		assert(0);
+		return false;
+	}
+
+	png_readonly_memory_file mf;
+	png_decoder dec;
+	dec.m_skip_crc32 = (flags & LOAD_PNG_SKIP_CRC32) != 0;
+
+	num_chans = scan_png(dec, mf, pImage_buf, buf_size);
+	if (!num_chans)
+		return false;
+
+	width = dec.m_ihdr.m_width;
+	height = dec.m_ihdr.m_height;
+
+	const uint64_t dst_bpl = (uint64_t)width * desired_chans;
+	if (!dst_pitch)
+		dst_pitch = (uint32_t)minimum<uint64_t>(dst_bpl, UINT32_MAX);
+
+	// The last row doesn't need to be padded out to the full pitch.
+	if ((dst_pitch < dst_bpl) || (((uint64_t)(height - 1) * dst_pitch + dst_bpl) > dst_buf_size))
+		return false;
+
+	return decode_png_rows(dec, desired_chans, static_cast<uint8_t*>(pDst), dst_pitch);
+}
+
 } // namespace pv_png
 
 /*
@@ -45,4 +45,16 @@ namespace pv_png
 	//
 	// Returns nullptr on any errors.
 	void* load_png(const void* pImage_buf, size_t buf_size, uint32_t desired_chans, uint32_t &width, uint32_t &height, uint32_t& num_chans);
+
+	// load_png_to() flags
+	enum
+	{
+		// Don't check the chunk CRC32's, because the caller already did (e.g. fpng::fpng_decode_any()'s chunk scan).
+		LOAD_PNG_SKIP_CRC32 = 1
+	};
+
+	// Like load_png(), but decodes to a caller supplied buffer, with rows dst_pitch bytes apart (0 means width*desired_chans). desired_chans must be 1 to 4.
+	// The bytes between rows are left untouched. The buffer must hold (height-1)*dst_pitch+width*desired_chans bytes.
+	// Returns false on any errors, including a buffer that's too small. width, height and num_chans are set as soon as the file's header was read.
+	bool load_png_to(const void* pImage_buf, size_t buf_size, uint32_t desired_chans, void* pDst, size_t dst_buf_size, uint32_t dst_pitch, uint32_t& width, uint32_t& height, uint32_t& num_chans, uint32_t flags = 0);
 }